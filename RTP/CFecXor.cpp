@@ -0,0 +1,198 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "CFecXor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FEC_XOR_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FEC_XOR_NEON 1
+#endif
+
+namespace fec {
+
+    // Folds [off, end) of every source into dst.
+    typedef void XorKernel(uint8_t* dst, const uint8_t* const* srcs, int count, int off, int end);
+    
+    static void xorScalar(uint8_t* dst, const uint8_t* const* srcs, int count, int off, int end)
+    {
+        for (; off + 8 <= end; off += 8) {
+            uint64_t a, b;
+            memcpy(&a, dst + off, 8);
+            for (int k = 0; k < count; k++) {
+                memcpy(&b, srcs[k] + off, 8);
+                a ^= b;
+            }
+            memcpy(dst + off, &a, 8);
+        }
+        for (; off < end; off++) {
+            uint8_t a = dst[off];
+            for (int k = 0; k < count; k++)
+                a ^= srcs[k][off];
+            dst[off] = a;
+        }
+    }
+
+#if FEC_XOR_X86
+
+#if defined(__i386__) && !defined(__SSE2__)
+    __attribute__((target("sse2")))
+#endif
+    static void xorSse2(uint8_t* dst, const uint8_t* const* srcs, int count, int off, int end)
+    {
+        // Four registers in flight per source, a packet is 64 bytes at a time.
+        for (; off + 64 <= end; off += 64) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(dst + off));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(dst + off + 16));
+            __m128i a2 = _mm_loadu_si128((const __m128i*)(dst + off + 32));
+            __m128i a3 = _mm_loadu_si128((const __m128i*)(dst + off + 48));
+            for (int k = 0; k < count; k++) {
+                const uint8_t* s = srcs[k] + off;
+                a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i*)s));
+                a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i*)(s + 16)));
+                a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i*)(s + 32)));
+                a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i*)(s + 48)));
+            }
+            _mm_storeu_si128((__m128i*)(dst + off), a0);
+            _mm_storeu_si128((__m128i*)(dst + off + 16), a1);
+            _mm_storeu_si128((__m128i*)(dst + off + 32), a2);
+            _mm_storeu_si128((__m128i*)(dst + off + 48), a3);
+        }
+        for (; off + 16 <= end; off += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(dst + off));
+            for (int k = 0; k < count; k++)
+                a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(srcs[k] + off)));
+            _mm_storeu_si128((__m128i*)(dst + off), a);
+        }
+        xorScalar(dst, srcs, count, off, end);
+    }
+    
+    __attribute__((target("avx2")))
+    static void xorAvx2(uint8_t* dst, const uint8_t* const* srcs, int count, int off, int end)
+    {
+        for (; off + 128 <= end; off += 128) {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*)(dst + off));
+            __m256i a1 = _mm256_loadu_si256((const __m256i*)(dst + off + 32));
+            __m256i a2 = _mm256_loadu_si256((const __m256i*)(dst + off + 64));
+            __m256i a3 = _mm256_loadu_si256((const __m256i*)(dst + off + 96));
+            for (int k = 0; k < count; k++) {
+                const uint8_t* s = srcs[k] + off;
+                a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i*)s));
+                a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i*)(s + 32)));
+                a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i*)(s + 64)));
+                a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i*)(s + 96)));
+            }
+            _mm256_storeu_si256((__m256i*)(dst + off), a0);
+            _mm256_storeu_si256((__m256i*)(dst + off + 32), a1);
+            _mm256_storeu_si256((__m256i*)(dst + off + 64), a2);
+            _mm256_storeu_si256((__m256i*)(dst + off + 96), a3);
+        }
+        for (; off + 32 <= end; off += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(dst + off));
+            for (int k = 0; k < count; k++)
+                a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i*)(srcs[k] + off)));
+            _mm256_storeu_si256((__m256i*)(dst + off), a);
+        }
+        xorSse2(dst, srcs, count, off, end);
+    }
+
+#elif FEC_XOR_NEON
+    
+    static void xorNeon(uint8_t* dst, const uint8_t* const* srcs, int count, int off, int end)
+    {
+        for (; off + 64 <= end; off += 64) {
+            uint8x16_t a0 = vld1q_u8(dst + off);
+            uint8x16_t a1 = vld1q_u8(dst + off + 16);
+            uint8x16_t a2 = vld1q_u8(dst + off + 32);
+            uint8x16_t a3 = vld1q_u8(dst + off + 48);
+            for (int k = 0; k < count; k++) {
+                const uint8_t* s = srcs[k] + off;
+                a0 = veorq_u8(a0, vld1q_u8(s));
+                a1 = veorq_u8(a1, vld1q_u8(s + 16));
+                a2 = veorq_u8(a2, vld1q_u8(s + 32));
+                a3 = veorq_u8(a3, vld1q_u8(s + 48));
+            }
+            vst1q_u8(dst + off, a0);
+            vst1q_u8(dst + off + 16, a1);
+            vst1q_u8(dst + off + 32, a2);
+            vst1q_u8(dst + off + 48, a3);
+        }
+        for (; off + 16 <= end; off += 16) {
+            uint8x16_t a = vld1q_u8(dst + off);
+            for (int k = 0; k < count; k++)
+                a = veorq_u8(a, vld1q_u8(srcs[k] + off));
+            vst1q_u8(dst + off, a);
+        }
+        xorScalar(dst, srcs, count, off, end);
+    }
+
+#endif
+    
+    struct XorDispatch {
+        XorKernel* kernel;
+        const char* name;
+        
+        XorDispatch()
+        {
+#if FEC_XOR_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                kernel = xorAvx2;
+                name = "avx2";
+                return;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                kernel = xorSse2;
+                name = "sse2";
+                return;
+            }
+#elif FEC_XOR_NEON
+            kernel = xorNeon;
+            name = "neon";
+            return;
+#endif
+            kernel = xorScalar;
+            name = "scalar";
+        }
+    };
+    
+    static const XorDispatch& dispatch()
+    {
+        static const XorDispatch sDispatch;
+        return sDispatch;
+    }
+    
+    void xorInto(uint8_t* dst, const uint8_t* src, int length)
+    {
+        if (length > 0)
+            dispatch().kernel(dst, &src, 1, 0, length);
+    }
+    
+    void xorInto(uint8_t* dst, const uint8_t* const* srcs, const int* lengths, int count)
+    {
+        if (count <= 0)
+            return;
+        
+        // All sources together over the length they share, then whatever
+        // the longer ones have past it one at a time.
+        int common = lengths[0];
+        for (int k = 1; k < count; k++)
+            common = std::min(common, lengths[k]);
+        
+        XorKernel* kernel = dispatch().kernel;
+        if (common > 0)
+            kernel(dst, srcs, count, 0, common);
+        for (int k = 0; k < count; k++) {
+            if (lengths[k] > common)
+                kernel(dst, srcs + k, 1, common, lengths[k]);
+        }
+    }
+    
+    const char* xorName()
+    {
+        return dispatch().name;
+    }
+}
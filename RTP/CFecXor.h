@@ -0,0 +1,24 @@
+#ifndef __FEC_XOR_H__
+#define __FEC_XOR_H__
+
+#include <cstdint>
+
+// XOR kernels behind the parity FEC. Several packets are folded into one
+// destination per pass, so the destination is loaded and stored once per
+// block rather than once per packet. The kernel (AVX2, SSE2, NEON or scalar)
+// is picked once at runtime from what the CPU supports.
+
+namespace fec {
+
+    // dst[i] ^= src[i] for i in [0, length).
+    void xorInto(uint8_t* dst, const uint8_t* src, int length);
+    
+    // dst ^= every srcs[k] over its own lengths[k], dst being at least as
+    // long as the longest of them.
+    void xorInto(uint8_t* dst, const uint8_t* const* srcs, const int* lengths, int count);
+    
+    // Name of the kernel in use, for logs and benchmarks.
+    const char* xorName();
+}
+
+#endif
@@ -0,0 +1,286 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "CGf256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GF_NEON 1
+#endif
+
+namespace gf {
+
+    // Log and antilog for mul() and inv(), and for every constant c the
+    // products of c with the 16 low nibbles and with the 16 high nibbles,
+    // which is what the kernels look up.
+    struct Tables {
+        uint8_t exp[512];
+        uint8_t log[256];
+        uint8_t nibbles[256][32];
+        
+        Tables()
+        {
+            unsigned x = 1;
+            for (int i = 0; i < 255; i++) {
+                exp[i] = exp[i + 255] = (uint8_t)x;
+                log[x] = (uint8_t)i;
+                x <<= 1;
+                if (x & 0x100)
+                    x ^= 0x11d;
+            }
+            exp[510] = exp[511] = exp[0];
+            log[0] = 0;
+            
+            for (int c = 0; c < 256; c++) {
+                for (int n = 0; n < 16; n++) {
+                    nibbles[c][n] = product(c, n);
+                    nibbles[c][16 + n] = product(c, n << 4);
+                }
+            }
+        }
+        
+        uint8_t product(int a, int b) const
+        {
+            if (a == 0 || b == 0)
+                return 0;
+            return exp[log[a] + log[b]];
+        }
+    };
+    
+    static const Tables& tables()
+    {
+        static const Tables sTables;
+        return sTables;
+    }
+    
+    uint8_t mul(uint8_t a, uint8_t b)
+    {
+        return tables().product(a, b);
+    }
+    
+    uint8_t inv(uint8_t a)
+    {
+        if (a == 0)
+            return 0;
+        return tables().exp[255 - tables().log[a]];
+    }
+    
+    // Folds coefs[k] * srcs[k] over [off, end) into dst.
+    typedef void MulKernel(uint8_t* dst, const uint8_t* const* srcs, const uint8_t* coefs, int count, int off, int end);
+    
+    static void mulScalar(uint8_t* dst, const uint8_t* const* srcs, const uint8_t* coefs, int count, int off, int end)
+    {
+        const Tables& t = tables();
+        for (; off < end; off++) {
+            uint8_t a = dst[off];
+            for (int k = 0; k < count; k++) {
+                const uint8_t* n = t.nibbles[coefs[k]];
+                uint8_t s = srcs[k][off];
+                a ^= n[s & 0x0f] ^ n[16 + (s >> 4)];
+            }
+            dst[off] = a;
+        }
+    }
+
+#if GF_X86
+    
+    __attribute__((target("ssse3")))
+    static void mulSsse3(uint8_t* dst, const uint8_t* const* srcs, const uint8_t* coefs, int count, int off, int end)
+    {
+        const Tables& t = tables();
+        const __m128i low = _mm_set1_epi8(0x0f);
+        
+        // Two registers in flight per source, so the tables of a coefficient
+        // are loaded once per 32 bytes.
+        for (; off + 32 <= end; off += 32) {
+            __m128i a0 = _mm_loadu_si128((const __m128i*)(dst + off));
+            __m128i a1 = _mm_loadu_si128((const __m128i*)(dst + off + 16));
+            for (int k = 0; k < count; k++) {
+                const uint8_t* n = t.nibbles[coefs[k]];
+                __m128i lo = _mm_loadu_si128((const __m128i*)n);
+                __m128i hi = _mm_loadu_si128((const __m128i*)(n + 16));
+                __m128i s0 = _mm_loadu_si128((const __m128i*)(srcs[k] + off));
+                __m128i s1 = _mm_loadu_si128((const __m128i*)(srcs[k] + off + 16));
+                a0 = _mm_xor_si128(a0, _mm_shuffle_epi8(lo, _mm_and_si128(s0, low)));
+                a0 = _mm_xor_si128(a0, _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s0, 4), low)));
+                a1 = _mm_xor_si128(a1, _mm_shuffle_epi8(lo, _mm_and_si128(s1, low)));
+                a1 = _mm_xor_si128(a1, _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s1, 4), low)));
+            }
+            _mm_storeu_si128((__m128i*)(dst + off), a0);
+            _mm_storeu_si128((__m128i*)(dst + off + 16), a1);
+        }
+        for (; off + 16 <= end; off += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(dst + off));
+            for (int k = 0; k < count; k++) {
+                const uint8_t* n = t.nibbles[coefs[k]];
+                __m128i s = _mm_loadu_si128((const __m128i*)(srcs[k] + off));
+                a = _mm_xor_si128(a, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)n), _mm_and_si128(s, low)));
+                a = _mm_xor_si128(a, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(n + 16)),
+                                                      _mm_and_si128(_mm_srli_epi64(s, 4), low)));
+            }
+            _mm_storeu_si128((__m128i*)(dst + off), a);
+        }
+        mulScalar(dst, srcs, coefs, count, off, end);
+    }
+    
+    __attribute__((target("avx2")))
+    static void mulAvx2(uint8_t* dst, const uint8_t* const* srcs, const uint8_t* coefs, int count, int off, int end)
+    {
+        const Tables& t = tables();
+        const __m256i low = _mm256_set1_epi8(0x0f);
+        
+        // PSHUFB looks up within each 128-bit lane, the tables go in both.
+        for (; off + 64 <= end; off += 64) {
+            __m256i a0 = _mm256_loadu_si256((const __m256i*)(dst + off));
+            __m256i a1 = _mm256_loadu_si256((const __m256i*)(dst + off + 32));
+            for (int k = 0; k < count; k++) {
+                const uint8_t* n = t.nibbles[coefs[k]];
+                __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)n));
+                __m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(n + 16)));
+                __m256i s0 = _mm256_loadu_si256((const __m256i*)(srcs[k] + off));
+                __m256i s1 = _mm256_loadu_si256((const __m256i*)(srcs[k] + off + 32));
+                a0 = _mm256_xor_si256(a0, _mm256_shuffle_epi8(lo, _mm256_and_si256(s0, low)));
+                a0 = _mm256_xor_si256(a0, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s0, 4), low)));
+                a1 = _mm256_xor_si256(a1, _mm256_shuffle_epi8(lo, _mm256_and_si256(s1, low)));
+                a1 = _mm256_xor_si256(a1, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s1, 4), low)));
+            }
+            _mm256_storeu_si256((__m256i*)(dst + off), a0);
+            _mm256_storeu_si256((__m256i*)(dst + off + 32), a1);
+        }
+        mulSsse3(dst, srcs, coefs, count, off, end);
+    }
+
+#elif GF_NEON
+    
+    static void mulNeon(uint8_t* dst, const uint8_t* const* srcs, const uint8_t* coefs, int count, int off, int end)
+    {
+        const Tables& t = tables();
+        const uint8x16_t low = vdupq_n_u8(0x0f);
+        
+        for (; off + 32 <= end; off += 32) {
+            uint8x16_t a0 = vld1q_u8(dst + off);
+            uint8x16_t a1 = vld1q_u8(dst + off + 16);
+            for (int k = 0; k < count; k++) {
+                const uint8_t* n = t.nibbles[coefs[k]];
+                uint8x16_t lo = vld1q_u8(n);
+                uint8x16_t hi = vld1q_u8(n + 16);
+                uint8x16_t s0 = vld1q_u8(srcs[k] + off);
+                uint8x16_t s1 = vld1q_u8(srcs[k] + off + 16);
+                a0 = veorq_u8(a0, vqtbl1q_u8(lo, vandq_u8(s0, low)));
+                a0 = veorq_u8(a0, vqtbl1q_u8(hi, vshrq_n_u8(s0, 4)));
+                a1 = veorq_u8(a1, vqtbl1q_u8(lo, vandq_u8(s1, low)));
+                a1 = veorq_u8(a1, vqtbl1q_u8(hi, vshrq_n_u8(s1, 4)));
+            }
+            vst1q_u8(dst + off, a0);
+            vst1q_u8(dst + off + 16, a1);
+        }
+        mulScalar(dst, srcs, coefs, count, off, end);
+    }
+
+#endif
+    
+    struct MulDispatch {
+        MulKernel* kernel;
+        const char* name;
+        
+        MulDispatch()
+        {
+#if GF_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                kernel = mulAvx2;
+                name = "avx2";
+                return;
+            }
+            if (__builtin_cpu_supports("ssse3")) {
+                kernel = mulSsse3;
+                name = "ssse3";
+                return;
+            }
+#elif GF_NEON
+            kernel = mulNeon;
+            name = "neon";
+            return;
+#endif
+            kernel = mulScalar;
+            name = "scalar";
+        }
+    };
+    
+    static const MulDispatch& dispatch()
+    {
+        static const MulDispatch sDispatch;
+        return sDispatch;
+    }
+    
+    void mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, int length)
+    {
+        if (length > 0 && c != 0)
+            dispatch().kernel(dst, &src, &c, 1, 0, length);
+    }
+    
+    void mulAdd(uint8_t* dst, const uint8_t* const* srcs, const int* lengths, const uint8_t* coefs, int count)
+    {
+        if (count <= 0)
+            return;
+        
+        // All sources together over the length they share, then whatever
+        // the longer ones have past it one at a time.
+        int common = lengths[0];
+        for (int k = 1; k < count; k++)
+            common = std::min(common, lengths[k]);
+        
+        MulKernel* kernel = dispatch().kernel;
+        if (common > 0)
+            kernel(dst, srcs, coefs, count, 0, common);
+        for (int k = 0; k < count; k++) {
+            if (lengths[k] > common)
+                kernel(dst, srcs + k, coefs + k, 1, common, lengths[k]);
+        }
+    }
+    
+    bool invert(uint8_t* matrix, int n)
+    {
+        // Gauss-Jordan on [matrix | identity].
+        std::vector<uint8_t> work(n * 2 * n, 0);
+        for (int r = 0; r < n; r++) {
+            memcpy(&work[r * 2 * n], matrix + r * n, n);
+            work[r * 2 * n + n + r] = 1;
+        }
+        
+        for (int c = 0; c < n; c++) {
+            int p = c;
+            while (p < n && work[p * 2 * n + c] == 0)
+                p++;
+            if (p == n)
+                return false;
+            if (p != c)
+                std::swap_ranges(&work[p * 2 * n], &work[p * 2 * n] + 2 * n, &work[c * 2 * n]);
+            
+            uint8_t* pivot = &work[c * 2 * n];
+            uint8_t scale = inv(pivot[c]);
+            for (int i = 0; i < 2 * n; i++)
+                pivot[i] = mul(pivot[i], scale);
+            
+            for (int r = 0; r < n; r++) {
+                uint8_t* row = &work[r * 2 * n];
+                if (r != c && row[c] != 0)
+                    mulAdd(row, pivot, row[c], 2 * n);
+            }
+        }
+        
+        for (int r = 0; r < n; r++)
+            memcpy(matrix + r * n, &work[r * 2 * n + n], n);
+        return true;
+    }
+    
+    const char* kernelName()
+    {
+        return dispatch().name;
+    }
+}
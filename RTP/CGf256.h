@@ -0,0 +1,32 @@
+#ifndef __GF256_H__
+#define __GF256_H__
+
+#include <cstdint>
+
+// Arithmetic in GF(2^8) over the polynomial x^8 + x^4 + x^3 + x^2 + 1
+// (0x11d), for the Reed-Solomon erasure code. Multiplying a block by a
+// constant looks up the low and high nibble of every byte in two 16-entry
+// tables, which is one PSHUFB (SSSE3/AVX2) or TBL (NEON) per nibble. The
+// kernel is picked once at runtime from what the CPU supports.
+
+namespace gf {
+
+    uint8_t mul(uint8_t a, uint8_t b);
+    uint8_t inv(uint8_t a);
+    
+    // dst[i] ^= c * src[i] for i in [0, length).
+    void mulAdd(uint8_t* dst, const uint8_t* src, uint8_t c, int length);
+    
+    // dst ^= sum of coefs[k] * srcs[k], each source over its own lengths[k],
+    // dst being at least as long as the longest of them. The destination is
+    // loaded and stored once per block for all the sources.
+    void mulAdd(uint8_t* dst, const uint8_t* const* srcs, const int* lengths, const uint8_t* coefs, int count);
+    
+    // Inverts the n x n row-major matrix in place. False when it is singular.
+    bool invert(uint8_t* matrix, int n);
+    
+    // Name of the kernel in use, for logs and benchmarks.
+    const char* kernelName();
+}
+
+#endif
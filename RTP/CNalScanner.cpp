@@ -0,0 +1,190 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "CNalScanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAL_SCANNER_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define NAL_SCANNER_NEON 1
+#endif
+
+namespace nalu {
+
+    typedef const uint8_t* ScanKernel(const uint8_t* p, const uint8_t* end);
+    
+    // Skips ahead by looking at the third byte first: anything above 1 there
+    // rules out a start code at any of the three positions (H.264 Annex B).
+    static const uint8_t* findStartCodeScalar(const uint8_t* p, const uint8_t* end)
+    {
+        while (end - p >= 3) {
+            if (p[2] > 1)
+                p += 3;
+            else if (p[1])
+                p += 2;
+            else if (p[0] || p[2] != 1)
+                p++;
+            else
+                return p;
+        }
+        return end;
+    }
+    
+#if NAL_SCANNER_X86
+    
+#if defined(__i386__) && !defined(__SSE2__)
+    __attribute__((target("sse2")))
+#endif
+    static const uint8_t* findStartCodeSse2(const uint8_t* p, const uint8_t* end)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one  = _mm_set1_epi8(1);
+        
+        // Byte i of the mask is set when p[i], p[i+1], p[i+2] are 00 00 01.
+        while (end - p >= 16 + 2) {
+            __m128i a = _mm_loadu_si128((const __m128i*)p);
+            __m128i b = _mm_loadu_si128((const __m128i*)(p + 1));
+            __m128i c = _mm_loadu_si128((const __m128i*)(p + 2));
+            
+            __m128i m = _mm_and_si128(_mm_cmpeq_epi8(c, one),
+                                      _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)));
+            int mask = _mm_movemask_epi8(m);
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 16;
+        }
+        return findStartCodeScalar(p, end);
+    }
+    
+    __attribute__((target("avx2")))
+    static const uint8_t* findStartCodeAvx2(const uint8_t* p, const uint8_t* end)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i one  = _mm256_set1_epi8(1);
+        
+        while (end - p >= 32 + 2) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)p);
+            __m256i b = _mm256_loadu_si256((const __m256i*)(p + 1));
+            __m256i c = _mm256_loadu_si256((const __m256i*)(p + 2));
+            
+            __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(c, one),
+                                         _mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(m);
+            if (mask)
+                return p + __builtin_ctz(mask);
+            p += 32;
+        }
+        return findStartCodeSse2(p, end);
+    }
+    
+#elif NAL_SCANNER_NEON
+    
+    static const uint8_t* findStartCodeNeon(const uint8_t* p, const uint8_t* end)
+    {
+        const uint8x16_t zero = vdupq_n_u8(0);
+        const uint8x16_t one  = vdupq_n_u8(1);
+        
+        while (end - p >= 16 + 2) {
+            uint8x16_t a = vld1q_u8(p);
+            uint8x16_t b = vld1q_u8(p + 1);
+            uint8x16_t c = vld1q_u8(p + 2);
+            
+            uint8x16_t m = vandq_u8(vceqq_u8(c, one), vandq_u8(vceqq_u8(a, zero), vceqq_u8(b, zero)));
+            
+            // Narrow every byte of the mask to a nibble, NEON has no movemask.
+            uint8x8_t n = vshrn_n_u16(vreinterpretq_u16_u8(m), 4);
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(n), 0);
+            if (mask)
+                return p + (__builtin_ctzll(mask) >> 2);
+            p += 16;
+        }
+        return findStartCodeScalar(p, end);
+    }
+    
+#endif
+    
+    struct ScanDispatch {
+        ScanKernel* kernel;
+        const char* name;
+        
+        ScanDispatch()
+        {
+#if NAL_SCANNER_X86
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) {
+                kernel = findStartCodeAvx2;
+                name = "avx2";
+                return;
+            }
+            if (__builtin_cpu_supports("sse2")) {
+                kernel = findStartCodeSse2;
+                name = "sse2";
+                return;
+            }
+#elif NAL_SCANNER_NEON
+            kernel = findStartCodeNeon;
+            name = "neon";
+            return;
+#endif
+            kernel = findStartCodeScalar;
+            name = "scalar";
+        }
+    };
+    
+    static ScanDispatch& dispatch()
+    {
+        static ScanDispatch sDispatch;
+        return sDispatch;
+    }
+    
+    const uint8_t* findStartCode3(const uint8_t* p, const uint8_t* end)
+    {
+        if (p >= end)
+            return end;
+        return dispatch().kernel(p, end);
+    }
+    
+    const uint8_t* findStartCode(const uint8_t* p, const uint8_t* end)
+    {
+        const uint8_t* out = findStartCode3(p, end);
+        if (p < out && out < end && !out[-1])
+            out--;
+        return out;
+    }
+    
+    const char* scannerName()
+    {
+        return dispatch().name;
+    }
+    
+    bool useScanner(const char* name)
+    {
+        ScanDispatch& d = dispatch();
+        if (strcmp(name, "scalar") == 0) {
+            d.kernel = findStartCodeScalar;
+            d.name = "scalar";
+            return true;
+        }
+#if NAL_SCANNER_X86
+        if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+            d.kernel = findStartCodeSse2;
+            d.name = "sse2";
+            return true;
+        }
+        if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+            d.kernel = findStartCodeAvx2;
+            d.name = "avx2";
+            return true;
+        }
+#elif NAL_SCANNER_NEON
+        if (strcmp(name, "neon") == 0) {
+            d.kernel = findStartCodeNeon;
+            d.name = "neon";
+            return true;
+        }
+#endif
+        return false;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef __NAL_SCANNER_H__
+#define __NAL_SCANNER_H__
+
+#include <cstdint>
+
+// Annex-B start code scanning shared by the packetizer and the decoders.
+// The kernel (AVX2, SSE2, NEON or scalar) is picked once at runtime from
+// what the CPU supports.
+
+namespace nalu {
+
+    // First 3 byte start code (00 00 01) in [p, end), or end if there is none.
+    const uint8_t* findStartCode3(const uint8_t* p, const uint8_t* end);
+    
+    // Same, but steps back onto the leading zero of a 4 byte start code
+    // (00 00 00 01), so the result is where the start code begins.
+    const uint8_t* findStartCode(const uint8_t* p, const uint8_t* end);
+    
+    inline uint8_t* findStartCode(uint8_t* p, uint8_t* end)
+    {
+        return (uint8_t*)findStartCode((const uint8_t*)p, (const uint8_t*)end);
+    }
+    
+    // Name of the kernel in use, for logs and benchmarks.
+    const char* scannerName();
+    
+    // Switches to the kernel of that name ("scalar", "sse2", "avx2", "neon")
+    // if the CPU has it, for benchmarks. Not while other threads scan.
+    bool useScanner(const char* name);
+}
+
+#endif
@@ -0,0 +1,606 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "CRtcp.h"
+
+// Name and subtype of the APP message acknowledging an MTU probe.
+static const uint32_t probeAckName = 0x4d545550;   // "MTUP"
+static const int probeAckSubtype = 0;
+
+static uint16_t load16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t load32(const uint8_t* p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void store16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void store32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+CRtcpWriter::CRtcpWriter(uint32_t senderSsrc)
+    : mSsrc(senderSsrc)
+    , mLength(0)
+{
+}
+
+uint8_t* CRtcpWriter::feedback(int type, int fmt, int fciLength, uint32_t mediaSsrc)
+{
+    int size = 12 + fciLength;
+    if (mLength + size > ::maxRtcpSize)
+        return NULL;
+    
+    // Common feedback header (RFC 4585, 6.1), length in words minus one.
+    uint8_t* p = mBuf + mLength;
+    p[0] = 0x80 | fmt;
+    p[1] = (uint8_t)type;
+    store16(p + 2, (uint16_t)(size / 4 - 1));
+    store32(p + 4, mSsrc);
+    store32(p + 8, mediaSsrc);
+    
+    mLength += size;
+    return p + 12;
+}
+
+bool CRtcpWriter::addPli(uint32_t mediaSsrc)
+{
+    return feedback(::rtcpPayloadSpecificFb, ::rtcpFmtPli, 0, mediaSsrc) != NULL;
+}
+
+bool CRtcpWriter::addFir(uint32_t mediaSsrc, uint8_t seqNr)
+{
+    // The media source goes in the FCI entry, the header field stays zero.
+    uint8_t* fci = feedback(::rtcpPayloadSpecificFb, ::rtcpFmtFir, 8, 0);
+    if (fci == NULL)
+        return false;
+    
+    store32(fci, mediaSsrc);
+    fci[4] = seqNr;
+    fci[5] = fci[6] = fci[7] = 0;
+    return true;
+}
+
+int CRtcpWriter::addNack(uint32_t mediaSsrc, const uint16_t* seqs, int count)
+{
+    // Count the entries first, the header carries the length.
+    int room = (::maxRtcpSize - mLength - 12) / 4;
+    int entries = 0;
+    int n = 0;
+    while (n < count && entries < room) {
+        uint16_t pid = seqs[n++];
+        while (n < count && (uint16_t)(seqs[n] - pid) >= 1 && (uint16_t)(seqs[n] - pid) <= 16)
+            n++;
+        entries++;
+    }
+    
+    uint8_t* fci = entries > 0 ? feedback(::rtcpTransportFb, ::rtcpFmtNack, 4 * entries, mediaSsrc) : NULL;
+    if (fci == NULL)
+        return 0;
+    
+    // Packet ID, then a bitmask of the 16 packets following it.
+    for (int i = 0; i < n; fci += 4) {
+        uint16_t pid = seqs[i++];
+        uint16_t blp = 0;
+        while (i < n && (uint16_t)(seqs[i] - pid) >= 1 && (uint16_t)(seqs[i] - pid) <= 16)
+            blp |= 1 << ((uint16_t)(seqs[i++] - pid) - 1);
+        store16(fci, pid);
+        store16(fci + 2, blp);
+    }
+    return n;
+}
+
+int CRtcpWriter::addTransportFeedback(uint32_t mediaSsrc, uint16_t baseSeq, uint8_t fbCount, const int64_t* arrivalsUs, int count)
+{
+    // Deltas run in 250 us ticks from the reference time, a multiple of
+    // 64 ms, and each from the arrival before it, so they do not drift.
+    int first = 0;
+    while (first < count && arrivalsUs[first] < 0)
+        first++;
+    int64_t reference = first < count ? arrivalsUs[first] / 64000 : 0;
+    int64_t tick = reference * 256;
+    
+    // Not received, a small delta in one byte, or a large or negative one
+    // in two.
+    mSymbols.clear();
+    mDeltas.clear();
+    for (int i = 0; i < count && i < 0xffff; i++) {
+        if (arrivalsUs[i] < 0) {
+            mSymbols.push_back(0);
+            continue;
+        }
+        int64_t t = (arrivalsUs[i] + 125) / 250;
+        int64_t delta = t - tick;
+        if (delta < -32768 || delta > 32767)
+            break;
+        mSymbols.push_back(delta >= 0 && delta <= 255 ? 1 : 2);
+        mDeltas.push_back((int)delta);
+        tick = t;
+    }
+    
+    // Chunks while they fit, a run of one symbol, or a vector of 14 one-bit
+    // or 7 two-bit symbols.
+    int room = ::maxRtcpSize - mLength - 12 - 8 - 3;
+    int n = (int)mSymbols.size();
+    int covered = 0;
+    int chunks = 0;
+    int deltaBytes = 0;
+    int deltaIndex = 0;
+    uint16_t chunkBuf[::maxRtcpSize / 2];
+    while (covered < n) {
+        int run = 1;
+        while (covered + run < n && run < 8191 && mSymbols[covered + run] == mSymbols[covered])
+            run++;
+        
+        int span, bits;
+        if (run >= 7 || covered + run == n) {
+            span = run;
+            bits = 0;
+        }
+        else {
+            span = std::min(14, n - covered);
+            bits = 1;
+            for (int i = 0; i < span; i++) {
+                if (mSymbols[covered + i] > 1)
+                    bits = 2;
+            }
+            if (bits == 2)
+                span = std::min(7, n - covered);
+        }
+        
+        int bytes = 0;
+        for (int i = 0; i < span; i++)
+            bytes += mSymbols[covered + i];
+        if (2 * (chunks + 1) + deltaBytes + bytes > room)
+            break;
+        
+        uint16_t chunk;
+        if (bits == 0) {
+            chunk = (uint16_t)((mSymbols[covered] << 13) | span);
+        }
+        else if (bits == 1) {
+            chunk = 0x8000;
+            for (int i = 0; i < span; i++)
+                chunk |= mSymbols[covered + i] << (13 - i);
+        }
+        else {
+            chunk = 0xc000;
+            for (int i = 0; i < span; i++)
+                chunk |= mSymbols[covered + i] << (12 - 2 * i);
+        }
+        chunkBuf[chunks++] = chunk;
+        deltaBytes += bytes;
+        covered += span;
+    }
+    if (covered == 0)
+        return 0;
+    
+    int fciLength = (8 + 2 * chunks + deltaBytes + 3) & ~3;
+    uint8_t* fci = feedback(::rtcpTransportFb, ::rtcpFmtTransportCc, fciLength, mediaSsrc);
+    if (fci == NULL)
+        return 0;
+    
+    store16(fci, baseSeq);
+    store16(fci + 2, (uint16_t)covered);
+    fci[4] = (uint8_t)(reference >> 16);
+    fci[5] = (uint8_t)(reference >> 8);
+    fci[6] = (uint8_t)reference;
+    fci[7] = fbCount;
+    
+    uint8_t* p = fci + 8;
+    for (int i = 0; i < chunks; i++, p += 2)
+        store16(p, chunkBuf[i]);
+    for (int i = 0; i < covered; i++) {
+        if (mSymbols[i] == 1) {
+            *p++ = (uint8_t)mDeltas[deltaIndex++];
+        }
+        else if (mSymbols[i] == 2) {
+            store16(p, (uint16_t)(int16_t)mDeltas[deltaIndex++]);
+            p += 2;
+        }
+    }
+    while (p < fci + fciLength)
+        *p++ = 0;
+    return covered;
+}
+
+uint8_t* CRtcpWriter::message(int type, int count, int bodyLength)
+{
+    int size = 4 + bodyLength;
+    if (mLength + size > ::maxRtcpSize)
+        return NULL;
+    
+    uint8_t* p = mBuf + mLength;
+    p[0] = (uint8_t)(0x80 | count);
+    p[1] = (uint8_t)type;
+    store16(p + 2, (uint16_t)(size / 4 - 1));
+    
+    mLength += size;
+    return p + 4;
+}
+
+void CRtcpWriter::reportBlocks(uint8_t* p, const CRtcpReportBlock* blocks, int count)
+{
+    for (int i = 0; i < count; i++, p += 24) {
+        const CRtcpReportBlock& b = blocks[i];
+        int32_t lost = std::min(std::max(b.cumulativeLost, -0x800000), 0x7fffff);
+        store32(p, b.ssrc);
+        store32(p + 4, ((uint32_t)b.fractionLost << 24) | ((uint32_t)lost & 0xffffff));
+        store32(p + 8, b.highestSeq);
+        store32(p + 12, b.jitter);
+        store32(p + 16, b.lsr);
+        store32(p + 20, b.dlsr);
+    }
+}
+
+bool CRtcpWriter::addSr(const CRtcpSenderInfo& info, const CRtcpReportBlock* blocks, int count)
+{
+    count = std::min(count, ::maxReportBlocks);
+    uint8_t* p = message(::rtcpSr, count, 24 + 24 * count);
+    if (p == NULL)
+        return false;
+    
+    store32(p, mSsrc);
+    store32(p + 4, (uint32_t)(info.ntp >> 32));
+    store32(p + 8, (uint32_t)info.ntp);
+    store32(p + 12, info.rtpTimestamp);
+    store32(p + 16, info.packetCount);
+    store32(p + 20, info.octetCount);
+    reportBlocks(p + 24, blocks, count);
+    return true;
+}
+
+bool CRtcpWriter::addRr(const CRtcpReportBlock* blocks, int count)
+{
+    count = std::min(count, ::maxReportBlocks);
+    uint8_t* p = message(::rtcpRr, count, 4 + 24 * count);
+    if (p == NULL)
+        return false;
+    
+    store32(p, mSsrc);
+    reportBlocks(p + 4, blocks, count);
+    return true;
+}
+
+bool CRtcpWriter::addSdes(const char* cname)
+{
+    // One chunk: SSRC, the CNAME item, then at least one null octet to end
+    // the item list and pad the chunk to a word.
+    int length = (int)std::min(strlen(cname), (size_t)255);
+    int chunk = (4 + 2 + length + 1 + 3) & ~3;
+    uint8_t* p = message(::rtcpSdes, 1, chunk);
+    if (p == NULL)
+        return false;
+    
+    memset(p, 0, chunk);
+    store32(p, mSsrc);
+    p[4] = 1;
+    p[5] = (uint8_t)length;
+    memcpy(p + 6, cname, length);
+    return true;
+}
+
+bool CRtcpWriter::addBye(const char* reason)
+{
+    int length = reason != NULL ? (int)std::min(strlen(reason), (size_t)255) : 0;
+    int body = reason != NULL ? (4 + 1 + length + 3) & ~3 : 4;
+    uint8_t* p = message(::rtcpBye, 1, body);
+    if (p == NULL)
+        return false;
+    
+    memset(p, 0, body);
+    store32(p, mSsrc);
+    if (reason != NULL) {
+        p[4] = (uint8_t)length;
+        memcpy(p + 5, reason, length);
+    }
+    return true;
+}
+
+bool CRtcpWriter::addProbeAck(uint32_t probeSsrc, uint16_t probeSeq)
+{
+    uint8_t* p = message(::rtcpApp, ::probeAckSubtype, 16);
+    if (p == NULL)
+        return false;
+    
+    store32(p, mSsrc);
+    store32(p + 4, ::probeAckName);
+    store32(p + 8, probeSsrc);
+    store16(p + 12, probeSeq);
+    store16(p + 14, 0);
+    return true;
+}
+
+CRtcpParser::CRtcpParser()
+    : mKeyFrameCallback(NULL)
+    , mKeyFrameRef(NULL)
+    , mNackCallback(NULL)
+    , mNackRef(NULL)
+    , mTransportFeedbackCallback(NULL)
+    , mTransportFeedbackRef(NULL)
+    , mReportCallback(NULL)
+    , mReportRef(NULL)
+    , mSdesCallback(NULL)
+    , mSdesRef(NULL)
+    , mByeCallback(NULL)
+    , mByeRef(NULL)
+    , mProbeAckCallback(NULL)
+    , mProbeAckRef(NULL)
+    , mReference(-1)
+{
+}
+
+bool CRtcpParser::isRtcp(const uint8_t* data, int length)
+{
+    // RTCP packet types 192-223 can not be mistaken for an RTP payload type
+    // with or without the marker bit, given dynamic types start at 96.
+    return length >= 8 && (data[0] & 0xc0) == 0x80 && data[1] >= 192 && data[1] <= 223;
+}
+
+void CRtcpParser::setKeyFrameCallback(CRtcpKeyFrameCallback* callback, void *callbackRefCon)
+{
+    mKeyFrameCallback = callback;
+    mKeyFrameRef = callbackRefCon;
+}
+
+void CRtcpParser::setNackCallback(CRtcpNackCallback* callback, void *callbackRefCon)
+{
+    mNackCallback = callback;
+    mNackRef = callbackRefCon;
+}
+
+void CRtcpParser::setTransportFeedbackCallback(CRtcpTransportFeedbackCallback* callback, void *callbackRefCon)
+{
+    mTransportFeedbackCallback = callback;
+    mTransportFeedbackRef = callbackRefCon;
+}
+
+void CRtcpParser::setReportCallback(CRtcpReportCallback* callback, void *callbackRefCon)
+{
+    mReportCallback = callback;
+    mReportRef = callbackRefCon;
+}
+
+void CRtcpParser::setSdesCallback(CRtcpSdesCallback* callback, void *callbackRefCon)
+{
+    mSdesCallback = callback;
+    mSdesRef = callbackRefCon;
+}
+
+void CRtcpParser::setByeCallback(CRtcpByeCallback* callback, void *callbackRefCon)
+{
+    mByeCallback = callback;
+    mByeRef = callbackRefCon;
+}
+
+void CRtcpParser::setProbeAckCallback(CRtcpProbeAckCallback* callback, void *callbackRefCon)
+{
+    mProbeAckCallback = callback;
+    mProbeAckRef = callbackRefCon;
+}
+
+bool CRtcpParser::parse(const uint8_t* data, int length)
+{
+    int off = 0;
+    while (off + 4 <= length) {
+        const uint8_t* p = data + off;
+        int size = 4 * (load16(p + 2) + 1);
+        if ((p[0] & 0xc0) != 0x80 || off + size > length)
+            return false;
+        
+        if (p[1] == ::rtcpPayloadSpecificFb)
+            parseFeedback(p[0] & 0x1f, p, size);
+        else if (p[1] == ::rtcpTransportFb && (p[0] & 0x1f) == ::rtcpFmtNack)
+            parseNack(p, size);
+        else if (p[1] == ::rtcpTransportFb && (p[0] & 0x1f) == ::rtcpFmtTransportCc)
+            parseTransportFeedback(p, size);
+        else if (p[1] == ::rtcpSr || p[1] == ::rtcpRr)
+            parseReport(p, size);
+        else if (p[1] == ::rtcpSdes)
+            parseSdes(p, size);
+        else if (p[1] == ::rtcpBye)
+            parseBye(p, size);
+        else if (p[1] == ::rtcpApp)
+            parseApp(p, size);
+        
+        off += size;
+    }
+    return off == length;
+}
+
+void CRtcpParser::parseFeedback(int fmt, const uint8_t* data, int length)
+{
+    if (length < 12 || mKeyFrameCallback == NULL)
+        return;
+    
+    uint32_t sender = load32(data + 4);
+    
+    if (fmt == ::rtcpFmtPli) {
+        mKeyFrameCallback(mKeyFrameRef, sender, load32(data + 8), false);
+    }
+    else if (fmt == ::rtcpFmtFir) {
+        for (int off = 12; off + 8 <= length; off += 8) {
+            uint32_t media = load32(data + off);
+            uint8_t seqNr = data[off + 4];
+            
+            size_t i = 0;
+            while (i < mFirSeqs.size() && mFirSeqs[i].ssrc != sender)
+                i++;
+            if (i < mFirSeqs.size() && mFirSeqs[i].seqNr == seqNr)
+                continue;
+            
+            if (i == mFirSeqs.size()) {
+                FirSeq s = { sender, seqNr };
+                mFirSeqs.push_back(s);
+            }
+            mFirSeqs[i].seqNr = seqNr;
+            mKeyFrameCallback(mKeyFrameRef, sender, media, true);
+        }
+    }
+}
+
+void CRtcpParser::parseNack(const uint8_t* data, int length)
+{
+    if (length < 12 || mNackCallback == NULL)
+        return;
+    
+    mNackSeqs.clear();
+    for (int off = 12; off + 4 <= length; off += 4) {
+        uint16_t pid = load16(data + off);
+        uint16_t blp = load16(data + off + 2);
+        
+        mNackSeqs.push_back(pid);
+        for (int bit = 0; bit < 16; bit++) {
+            if (blp & (1 << bit))
+                mNackSeqs.push_back((uint16_t)(pid + bit + 1));
+        }
+    }
+    
+    if (!mNackSeqs.empty())
+        mNackCallback(mNackRef, load32(data + 4), load32(data + 8), mNackSeqs.data(), (int)mNackSeqs.size());
+}
+
+void CRtcpParser::parseTransportFeedback(const uint8_t* data, int length)
+{
+    if (length < 20 || mTransportFeedbackCallback == NULL)
+        return;
+    
+    uint16_t base = load16(data + 12);
+    int count = load16(data + 14);
+    
+    // The reference time wraps after 12 days of 64 ms, unwrapped against
+    // the one before.
+    uint32_t wrapped = ((uint32_t)data[16] << 16) | ((uint32_t)data[17] << 8) | data[18];
+    if (mReference < 0)
+        mReference = wrapped;
+    else
+        mReference += (int32_t)((wrapped - (uint32_t)mReference) << 8) >> 8;
+    int64_t reference = mReference;
+    
+    mSymbols.clear();
+    int off = 20;
+    while ((int)mSymbols.size() < count) {
+        if (off + 2 > length)
+            return;
+        uint16_t chunk = load16(data + off);
+        off += 2;
+        
+        if ((chunk & 0x8000) == 0) {
+            int run = chunk & 0x1fff;
+            mSymbols.insert(mSymbols.end(), run, (uint8_t)((chunk >> 13) & 3));
+        }
+        else if ((chunk & 0x4000) == 0) {
+            for (int i = 0; i < 14; i++)
+                mSymbols.push_back((chunk >> (13 - i)) & 1);
+        }
+        else {
+            for (int i = 0; i < 7; i++)
+                mSymbols.push_back((chunk >> (12 - 2 * i)) & 3);
+        }
+    }
+    
+    mArrivals.resize(count);
+    int64_t tick = reference * 256;
+    for (int i = 0; i < count; i++) {
+        int symbol = mSymbols[i];
+        if (symbol == 0 || symbol == 3) {
+            mArrivals[i] = -1;
+            continue;
+        }
+        if (off + symbol > length)
+            return;
+        tick += symbol == 1 ? data[off] : (int16_t)load16(data + off);
+        off += symbol;
+        mArrivals[i] = tick * 250;
+    }
+    
+    mTransportFeedbackCallback(mTransportFeedbackRef, load32(data + 4), base, data[19], mArrivals.data(), count);
+}
+
+void CRtcpParser::parseReport(const uint8_t* data, int length)
+{
+    if (length < 8 || mReportCallback == NULL)
+        return;
+    
+    CRtcpSenderInfo info;
+    int off = 8;
+    if (data[1] == ::rtcpSr) {
+        if (length < 28)
+            return;
+        info.ntp = ((uint64_t)load32(data + 8) << 32) | load32(data + 12);
+        info.rtpTimestamp = load32(data + 16);
+        info.packetCount = load32(data + 20);
+        info.octetCount = load32(data + 24);
+        off = 28;
+    }
+    
+    CRtcpReportBlock blocks[::maxReportBlocks];
+    int count = std::min(data[0] & 0x1f, (length - off) / 24);
+    for (int i = 0; i < count; i++, off += 24) {
+        const uint8_t* p = data + off;
+        uint32_t lost = load32(p + 4);
+        blocks[i].ssrc = load32(p);
+        blocks[i].fractionLost = (uint8_t)(lost >> 24);
+        blocks[i].cumulativeLost = (int32_t)(lost << 8) >> 8;
+        blocks[i].highestSeq = load32(p + 8);
+        blocks[i].jitter = load32(p + 12);
+        blocks[i].lsr = load32(p + 16);
+        blocks[i].dlsr = load32(p + 20);
+    }
+    
+    mReportCallback(mReportRef, load32(data + 4), data[1] == ::rtcpSr ? &info : NULL, blocks, count);
+}
+
+void CRtcpParser::parseSdes(const uint8_t* data, int length)
+{
+    if (mSdesCallback == NULL)
+        return;
+    
+    // Chunks of an SSRC and items, each list ended by a null octet and
+    // padded to a word.
+    int off = 4;
+    for (int c = 0; c < (data[0] & 0x1f) && off + 4 <= length; c++) {
+        uint32_t ssrc = load32(data + off);
+        off += 4;
+        while (off < length && data[off] != 0) {
+            if (off + 2 > length || off + 2 + data[off + 1] > length)
+                return;
+            if (data[off] == 1)
+                mSdesCallback(mSdesRef, ssrc, (const char*)data + off + 2, data[off + 1]);
+            off += 2 + data[off + 1];
+        }
+        off = (off + 4) & ~3;
+    }
+}
+
+void CRtcpParser::parseBye(const uint8_t* data, int length)
+{
+    if (mByeCallback == NULL)
+        return;
+    
+    for (int i = 0; i < (data[0] & 0x1f) && 8 + 4 * i <= length; i++)
+        mByeCallback(mByeRef, load32(data + 4 + 4 * i));
+}
+
+void CRtcpParser::parseApp(const uint8_t* data, int length)
+{
+    // Other applications' messages go by unseen.
+    if (length < 20 || mProbeAckCallback == NULL || (data[0] & 0x1f) != ::probeAckSubtype ||
+        load32(data + 8) != ::probeAckName)
+        return;
+    
+    mProbeAckCallback(mProbeAckRef, load32(data + 4), load32(data + 12), load16(data + 16));
+}
@@ -0,0 +1,171 @@
+#ifndef __RTCP_H__
+#define __RTCP_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+// RTCP packets (RFC 3550, 6) sharing the transport with RTP, told apart by
+// the packet type byte (RFC 5761, 4). CRtcpWriter builds compound packets,
+// CRtcpParser walks them and calls back per message.
+
+const int maxRtcpSize = 1400;
+
+const int rtcpSr = 200;                // Sender report (RFC 3550, 6.4.1)
+const int rtcpRr = 201;                // Receiver report (RFC 3550, 6.4.2)
+const int rtcpSdes = 202;              // Source description (RFC 3550, 6.5)
+const int rtcpBye = 203;               // Goodbye (RFC 3550, 6.6)
+const int rtcpApp = 204;               // Application-defined (RFC 3550, 6.7)
+const int maxReportBlocks = 31;        // Reception reports in one SR or RR.
+const int rtcpTransportFb = 205;       // RTPFB (RFC 4585, 6.1)
+const int rtcpPayloadSpecificFb = 206; // PSFB (RFC 4585, 6.1)
+const int rtcpFmtNack = 1;             // Generic NACK (RFC 4585, 6.2.1)
+const int rtcpFmtTransportCc = 15;     // Transport-wide feedback (draft-holmer-rmcat-transport-wide-cc-extensions-01, 3.1)
+const int rtcpFmtPli = 1;              // Picture Loss Indication (RFC 4585, 6.3.1)
+const int rtcpFmtFir = 4;              // Full Intra Request (RFC 5104, 4.3.1)
+
+// Sender info of an SR, what the source sent up to the NTP time.
+struct CRtcpSenderInfo {
+    uint64_t ntp;             // 32.32 fixed point seconds since 1900
+    uint32_t rtpTimestamp;    // The same instant on the RTP clock
+    uint32_t packetCount;
+    uint32_t octetCount;      // Payload only
+};
+
+// One reception report of an SR or RR, on the source ssrc.
+struct CRtcpReportBlock {
+    uint32_t ssrc;
+    uint8_t fractionLost;     // Of 256, since the previous report
+    int32_t cumulativeLost;   // 24 bit signed on the wire
+    uint32_t highestSeq;      // Extended with the wrap count
+    uint32_t jitter;          // Interarrival jitter, RTP timestamp units
+    uint32_t lsr;             // Middle 32 bits of the last SR's NTP time
+    uint32_t dlsr;            // Since that SR, 1/65536 s
+};
+
+class CRtcpWriter {
+    
+public:
+    CRtcpWriter(uint32_t senderSsrc);
+    
+    void clear() { mLength = 0; }
+    
+    // Append one message to the compound packet. False when it does not fit.
+    bool addPli(uint32_t mediaSsrc);
+    bool addFir(uint32_t mediaSsrc, uint8_t seqNr);
+    // Packs seqs, in sequence order, into PID/BLP entries. Returns how many
+    // of them fit.
+    int addNack(uint32_t mediaSsrc, const uint16_t* seqs, int count);
+    // When the packets from transport-wide sequence number baseSeq on
+    // arrived, arrivalsUs[i] < 0 for one that did not. Returns how many of
+    // them fit, which stops short too at a gap over 8 s between arrivals.
+    int addTransportFeedback(uint32_t mediaSsrc, uint16_t baseSeq, uint8_t fbCount, const int64_t* arrivalsUs, int count);
+    // Reports, count at most maxReportBlocks. A compound packet starts with
+    // one of them (RFC 3550, 6.1).
+    bool addSr(const CRtcpSenderInfo& info, const CRtcpReportBlock* blocks, int count);
+    bool addRr(const CRtcpReportBlock* blocks, int count);
+    // The CNAME item, the one every compound packet carries.
+    bool addSdes(const char* cname);
+    bool addBye(const char* reason = NULL);
+    // An MTU probe (CRtpStream::setMtuProbing()) arrived. An APP message
+    // named "MTUP", with the probe's SSRC and sequence number.
+    bool addProbeAck(uint32_t probeSsrc, uint16_t probeSeq);
+    
+    const uint8_t* data() const { return mBuf; }
+    int length() const { return mLength; }
+    uint32_t ssrc() const { return mSsrc; }
+    
+private:
+    uint8_t* feedback(int type, int fmt, int fciLength, uint32_t mediaSsrc);
+    uint8_t* message(int type, int count, int bodyLength);
+    void reportBlocks(uint8_t* p, const CRtcpReportBlock* blocks, int count);
+    
+    uint32_t mSsrc;
+    uint8_t mBuf[::maxRtcpSize];
+    int mLength;
+    std::vector<uint8_t> mSymbols;
+    std::vector<int> mDeltas;
+};
+
+// A receiver asked for a decodable picture. fullIntra is set for a FIR,
+// which asks for an IDR outright, rather than a PLI.
+typedef void CRtcpKeyFrameCallback(void *callbackRefCon, uint32_t senderSsrc, uint32_t mediaSsrc, bool fullIntra);
+
+// A receiver misses the packets seqs of mediaSsrc.
+typedef void CRtcpNackCallback(void *callbackRefCon, uint32_t senderSsrc, uint32_t mediaSsrc, const uint16_t* seqs, int count);
+
+// Arrival times of the packets from transport-wide sequence number baseSeq
+// on, on the receiver's clock, -1 for one that did not arrive. fbCount counts
+// the feedback packets, a gap in it is feedback lost.
+typedef void CRtcpTransportFeedbackCallback(void *callbackRefCon, uint32_t senderSsrc, uint16_t baseSeq, uint8_t fbCount,
+                                            const int64_t* arrivalsUs, int count);
+
+// An SR or RR from senderSsrc. info is NULL for an RR.
+typedef void CRtcpReportCallback(void *callbackRefCon, uint32_t senderSsrc, const CRtcpSenderInfo* info,
+                                 const CRtcpReportBlock* blocks, int count);
+
+// The CNAME of ssrc, length bytes, not terminated.
+typedef void CRtcpSdesCallback(void *callbackRefCon, uint32_t ssrc, const char* cname, int length);
+
+// ssrc left the session.
+typedef void CRtcpByeCallback(void *callbackRefCon, uint32_t ssrc);
+
+// The MTU probe probeSeq of probeSsrc reached senderSsrc.
+typedef void CRtcpProbeAckCallback(void *callbackRefCon, uint32_t senderSsrc, uint32_t probeSsrc, uint16_t probeSeq);
+
+class CRtcpParser {
+    
+public:
+    CRtcpParser();
+    
+    static bool isRtcp(const uint8_t* data, int length);
+    
+    void setKeyFrameCallback(CRtcpKeyFrameCallback* callback, void *callbackRefCon);
+    void setNackCallback(CRtcpNackCallback* callback, void *callbackRefCon);
+    void setTransportFeedbackCallback(CRtcpTransportFeedbackCallback* callback, void *callbackRefCon);
+    void setReportCallback(CRtcpReportCallback* callback, void *callbackRefCon);
+    void setSdesCallback(CRtcpSdesCallback* callback, void *callbackRefCon);
+    void setByeCallback(CRtcpByeCallback* callback, void *callbackRefCon);
+    void setProbeAckCallback(CRtcpProbeAckCallback* callback, void *callbackRefCon);
+    
+    // Walks a compound packet. False if it is malformed, messages before the
+    // fault have been delivered.
+    bool parse(const uint8_t* data, int length);
+    
+private:
+    void parseFeedback(int fmt, const uint8_t* data, int length);
+    void parseNack(const uint8_t* data, int length);
+    void parseTransportFeedback(const uint8_t* data, int length);
+    void parseReport(const uint8_t* data, int length);
+    void parseSdes(const uint8_t* data, int length);
+    void parseBye(const uint8_t* data, int length);
+    void parseApp(const uint8_t* data, int length);
+    
+    CRtcpKeyFrameCallback* mKeyFrameCallback;
+    void *mKeyFrameRef;
+    CRtcpNackCallback* mNackCallback;
+    void *mNackRef;
+    CRtcpTransportFeedbackCallback* mTransportFeedbackCallback;
+    void *mTransportFeedbackRef;
+    CRtcpReportCallback* mReportCallback;
+    void *mReportRef;
+    CRtcpSdesCallback* mSdesCallback;
+    void *mSdesRef;
+    CRtcpByeCallback* mByeCallback;
+    void *mByeRef;
+    CRtcpProbeAckCallback* mProbeAckCallback;
+    void *mProbeAckRef;
+    std::vector<uint16_t> mNackSeqs;
+    std::vector<uint8_t> mSymbols;
+    std::vector<int64_t> mArrivals;
+    int64_t mReference;
+    
+    // Last FIR sequence number per requester, repeats are retransmissions.
+    struct FirSeq {
+        uint32_t ssrc;
+        uint8_t seqNr;
+    };
+    std::vector<FirSeq> mFirSeqs;
+};
+
+#endif
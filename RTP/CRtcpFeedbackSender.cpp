@@ -0,0 +1,155 @@
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <algorithm>
+#include "CRtcpFeedbackSender.h"
+
+static uint32_t randomSsrc()
+{
+    std::random_device rd;
+    return rd();
+}
+
+CRtcpFeedbackSender::CRtcpFeedbackSender(CRtpStreamOutCallback* callback, void *callbackRefCon)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mWriter(randomSsrc())
+    , mMinIntervalUs(::defaultKeyFrameRequestUs)
+    , mFirSeqNr(0)
+    , mSent(0)
+    , mNacked(0)
+    , mFeedbackSsrc(0)
+    , mLastSeq(-1)
+    , mNextSeq(-1)
+    , mFeedbackDueUs(0)
+    , mFeedbackIntervalUs(::defaultTransportFeedbackUs)
+    , mFbCount(0)
+{
+}
+
+bool CRtcpFeedbackSender::requestKeyFrame(uint32_t mediaSsrc, int64_t nowUs)
+{
+    size_t i = 0;
+    while (i < mPending.size() && mPending[i].ssrc != mediaSsrc)
+        i++;
+    
+    if (i == mPending.size()) {
+        Pending p = { mediaSsrc, 0, 0 };
+        mPending.push_back(p);
+    }
+    else if (nowUs - mPending[i].lastUs < mMinIntervalUs) {
+        return false;
+    }
+    
+    Pending& p = mPending[i];
+    mWriter.clear();
+    if (p.count < ::pliBeforeFir)
+        mWriter.addPli(mediaSsrc);
+    else
+        mWriter.addFir(mediaSsrc, mFirSeqNr++);
+    
+    p.lastUs = nowUs;
+    p.count++;
+    mSent++;
+    
+    mCallback(mCallbackRef, mWriter.data(), mWriter.length());
+    return true;
+}
+
+void CRtcpFeedbackSender::keyFrameReceived(uint32_t mediaSsrc)
+{
+    for (size_t i = 0; i < mPending.size(); i++) {
+        if (mPending[i].ssrc == mediaSsrc) {
+            mPending.erase(mPending.begin() + i);
+            break;
+        }
+    }
+}
+
+void CRtcpFeedbackSender::sendNack(uint32_t mediaSsrc, const uint16_t* seqs, int count)
+{
+    int done = 0;
+    while (done < count) {
+        mWriter.clear();
+        int n = mWriter.addNack(mediaSsrc, seqs + done, count - done);
+        if (n == 0)
+            break;
+        
+        mCallback(mCallbackRef, mWriter.data(), mWriter.length());
+        done += n;
+    }
+    mNacked += done;
+}
+
+void CRtcpFeedbackSender::probeArrived(uint32_t probeSsrc, uint16_t probeSeq)
+{
+    mWriter.clear();
+    if (mWriter.addProbeAck(probeSsrc, probeSeq))
+        mCallback(mCallbackRef, mWriter.data(), mWriter.length());
+}
+
+void CRtcpFeedbackSender::packetArrived(uint32_t mediaSsrc, uint16_t seq, int64_t nowUs)
+{
+    // Unwrapped from one cycle up, so packets from before the first stay
+    // positive.
+    int64_t unwrapped = seq + 0x10000;
+    if (mLastSeq >= 0) {
+        unwrapped = mLastSeq + (int16_t)(seq - (uint16_t)mLastSeq);
+        mLastSeq = std::max(mLastSeq, unwrapped);
+    }
+    else {
+        mLastSeq = unwrapped;
+    }
+    
+    // Reported as lost already.
+    if (mNextSeq >= 0 && unwrapped < mNextSeq)
+        return;
+    
+    if (mArrivals.empty())
+        mFeedbackDueUs = nowUs + mFeedbackIntervalUs;
+    Arrival a = { unwrapped, nowUs };
+    mArrivals.push_back(a);
+    mFeedbackSsrc = mediaSsrc;
+}
+
+int64_t CRtcpFeedbackSender::poll(int64_t nowUs)
+{
+    if (mArrivals.empty())
+        return -1;
+    if (nowUs >= mFeedbackDueUs)
+        sendTransportFeedback();
+    return mArrivals.empty() ? -1 : mFeedbackDueUs;
+}
+
+void CRtcpFeedbackSender::sendTransportFeedback()
+{
+    std::sort(mArrivals.begin(), mArrivals.end(), [](const Arrival& a, const Arrival& b) { return a.seq < b.seq; });
+    
+    // Everything from the last one reported on, the gaps as lost, unless
+    // that is more than a feedback could ever hold.
+    int64_t last = mArrivals.back().seq;
+    int64_t base = mNextSeq >= 0 ? mNextSeq : mArrivals.front().seq;
+    base = std::max(base, last - ::maxTransportFeedbackSpan + 1);
+    
+    mFeedbackUs.assign((size_t)(last - base + 1), -1);
+    for (size_t i = 0; i < mArrivals.size(); i++) {
+        if (mArrivals[i].seq >= base)
+            mFeedbackUs[(size_t)(mArrivals[i].seq - base)] = mArrivals[i].us;
+    }
+    mArrivals.clear();
+    
+    int count = (int)mFeedbackUs.size();
+    int done = 0;
+    while (done < count) {
+        mWriter.clear();
+        int n = mWriter.addTransportFeedback(mFeedbackSsrc, (uint16_t)(base + done), mFbCount,
+                                             mFeedbackUs.data() + done, count - done);
+        if (n == 0)
+            break;
+        
+        mCallback(mCallbackRef, mWriter.data(), mWriter.length());
+        mFbCount++;
+        done += n;
+    }
+    mNextSeq = last + 1;
+}
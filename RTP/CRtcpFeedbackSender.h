@@ -0,0 +1,97 @@
+#ifndef __RTCP_FEEDBACK_SENDER_H__
+#define __RTCP_FEEDBACK_SENDER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "CRtpStream.h"
+#include "CRtcp.h"
+
+// Receiver side feedback to the media senders.
+//
+// On loss it asks for a new picture with a PLI instead of waiting for the
+// next periodic IDR, and repeats at most once per interval until a keyframe
+// arrives. A sender that ignores the PLIs gets a FIR after a few.
+//
+// Generic NACKs ask for the retransmission of single packets.
+//
+// Transport-wide feedback tells the senders when each packet carrying a
+// transport-wide sequence number arrived, for their bandwidth estimate.
+//
+// MTU probes are acknowledged as they come, so the sender knows the size
+// got through.
+
+const int defaultKeyFrameRequestUs = 200000;
+const int pliBeforeFir = 3;
+const int defaultTransportFeedbackUs = 50000;
+const int maxTransportFeedbackSpan = 8192;  // Packets reported at once at most.
+
+class CRtcpFeedbackSender {
+    
+public:
+    // RTCP packets go out through the same kind of callback as RTP ones.
+    CRtcpFeedbackSender(CRtpStreamOutCallback* callback, void *callbackRefCon);
+    
+    // Roughly a round trip, so a request is repeated only once the keyframe
+    // it asked for should have been here.
+    void setMinInterval(int us) { mMinIntervalUs = us; }
+    
+    // Loss seen on mediaSsrc. True if a request went out.
+    bool requestKeyFrame(uint32_t mediaSsrc, int64_t nowUs);
+    
+    // A keyframe from mediaSsrc was decoded, the next loss asks anew.
+    void keyFrameReceived(uint32_t mediaSsrc);
+    
+    // Asks for the given packets again, in as few RTCP packets as fit.
+    void sendNack(uint32_t mediaSsrc, const uint16_t* seqs, int count);
+    
+    // The MTU probe probeSeq of probeSsrc arrived, see CRtpStream::isProbe().
+    void probeArrived(uint32_t probeSsrc, uint16_t probeSeq);
+    
+    // A packet stamped with transport-wide sequence number seq arrived.
+    void packetArrived(uint32_t mediaSsrc, uint16_t seq, int64_t nowUs);
+    
+    // Sends the arrivals since the last feedback once an interval has gone
+    // by. Returns when to call again, or -1 with none recorded.
+    int64_t poll(int64_t nowUs);
+    void setTransportFeedbackInterval(int us) { mFeedbackIntervalUs = us; }
+    
+    uint32_t ssrc() const { return mWriter.ssrc(); }
+    uint32_t requestsSent() const { return mSent; }
+    uint32_t nacksSent() const { return mNacked; }
+    
+private:
+    struct Pending {
+        uint32_t ssrc;
+        int64_t lastUs;
+        int count;
+    };
+    
+    struct Arrival {
+        int64_t seq;    // Unwrapped
+        int64_t us;
+    };
+    
+    void sendTransportFeedback();
+    
+    CRtpStreamOutCallback* mCallback;
+    void *mCallbackRef;
+    
+    CRtcpWriter mWriter;
+    std::vector<Pending> mPending;
+    int mMinIntervalUs;
+    uint8_t mFirSeqNr;
+    uint32_t mSent;
+    uint32_t mNacked;
+    
+    std::vector<Arrival> mArrivals;
+    std::vector<int64_t> mFeedbackUs;
+    uint32_t mFeedbackSsrc;
+    int64_t mLastSeq;       // Unwrapped, -1 before the first
+    int64_t mNextSeq;       // The first not reported yet
+    int64_t mFeedbackDueUs;
+    int mFeedbackIntervalUs;
+    uint8_t mFbCount;
+};
+
+#endif
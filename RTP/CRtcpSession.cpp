@@ -0,0 +1,435 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#include "CRtpHeader.h"
+#include "CRtcpSession.h"
+
+// RFC 3550, A.1
+static const int maxDropout = 3000;
+static const int maxMisorder = 100;
+static const int minSequential = 2;
+static const uint32_t rtpSeqMod = 1 << 16;
+
+static const uint64_t ntpEpochOffset = 2208988800u;  // 1900 to 1970, seconds
+
+CRtcpSession::CRtcpSession(uint32_t ssrc, CRtpStreamOutCallback* callback, void *callbackRefCon)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mByeCallback(NULL)
+    , mByeRef(NULL)
+    , mWriter(ssrc)
+    , mClockRate(::defaultRtpClockRate)
+    , mIntervalUs(::defaultRtcpIntervalUs)
+    , mNextUs(0)
+    , mNowUs(0)
+    , mWallSet(false)
+    , mWallOffsetUs(0)
+    , mRandom(ssrc)
+    , mPacketsSent(0)
+    , mOctetsSent(0)
+    , mLastTimestamp(0)
+    , mLastSentUs(0)
+    , mReports(0)
+{
+    memset(mSources, 0, sizeof(mSources));
+    for (int i = 0; i <= ::maxRtcpSources; i++) {
+        mSnapshots[i].version.store(0, std::memory_order_relaxed);
+        mSnapshots[i].used.store(0, std::memory_order_relaxed);
+    }
+    
+    // No user or host to name, a random CNAME for the session (RFC 7022).
+    snprintf(mCname, sizeof(mCname), "%08x%08x", ssrc, (uint32_t)std::random_device()());
+    
+    memset(&mLocal, 0, sizeof(mLocal));
+    mLocal.ssrc = ssrc;
+    mLocal.rttUs = -1;
+    
+    mParser.setReportCallback(reportIn, this);
+    mParser.setByeCallback(byeIn, this);
+}
+
+void CRtcpSession::setCname(const char* cname)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    snprintf(mCname, sizeof(mCname), "%s", cname);
+}
+
+void CRtcpSession::setByeCallback(CRtcpByeCallback* callback, void *callbackRefCon)
+{
+    mByeCallback = callback;
+    mByeRef = callbackRefCon;
+}
+
+uint64_t CRtcpSession::ntp(int64_t nowUs)
+{
+    // nowUs runs on a steady clock, tie it to the wall clock once.
+    if (!mWallSet) {
+        int64_t wallUs = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        mWallOffsetUs = wallUs - nowUs;
+        mWallSet = true;
+    }
+    
+    int64_t us = nowUs + mWallOffsetUs;
+    uint64_t seconds = (uint64_t)(us / 1000000) + ::ntpEpochOffset;
+    uint64_t fraction = ((uint64_t)(us % 1000000) << 32) / 1000000;
+    return (seconds << 32) | fraction;
+}
+
+void CRtcpSession::rtpSent(const uint8_t* data, int length, int64_t nowUs)
+{
+    CRtpHeader header;
+    if (!header.parse(data, length) || header.ssrc() != mLocal.ssrc)
+        return;
+    
+    std::lock_guard<std::mutex> guard(mSendLock);
+    mPacketsSent++;
+    mOctetsSent += header.payloadLength();
+    mLastTimestamp = header.timestamp();
+    mLastSentUs = nowUs;
+    
+    mLocal.sending = true;
+    mLocal.packets = mPacketsSent;
+    mLocal.octets = mOctetsSent;
+    mLocal.updatedUs = nowUs;
+    publish(::maxRtcpSources, &mLocal);
+}
+
+int CRtcpSession::find(uint32_t ssrc) const
+{
+    for (int i = 0; i < ::maxRtcpSources; i++) {
+        if (mSources[i].used && mSources[i].ssrc == ssrc)
+            return i;
+    }
+    return -1;
+}
+
+int CRtcpSession::add(uint32_t ssrc, int64_t nowUs)
+{
+    for (int i = 0; i < ::maxRtcpSources; i++) {
+        if (!mSources[i].used) {
+            Source& source = mSources[i];
+            memset(&source, 0, sizeof(source));
+            source.used = true;
+            source.ssrc = ssrc;
+            source.lastUs = nowUs;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void CRtcpSession::remove(int index)
+{
+    mSources[index].used = false;
+    mSnapshots[index].used.store(0, std::memory_order_release);
+}
+
+void CRtcpSession::initSeq(Source& source, uint16_t seq)
+{
+    source.baseSeq = seq;
+    source.maxSeq = seq;
+    source.badSeq = ::rtpSeqMod + 1;
+    source.cycles = 0;
+    source.received = 0;
+    source.receivedPrior = 0;
+    source.expectedPrior = 0;
+}
+
+bool CRtcpSession::updateSeq(Source& source, uint16_t seq)
+{
+    uint16_t delta = (uint16_t)(seq - source.maxSeq);
+    
+    // A new source counts once a few packets came in sequence.
+    if (source.probation > 0) {
+        if (seq == (uint16_t)(source.maxSeq + 1)) {
+            source.probation--;
+            source.maxSeq = seq;
+            if (source.probation == 0) {
+                initSeq(source, seq);
+                source.received++;
+                return true;
+            }
+        }
+        else {
+            source.probation = ::minSequential - 1;
+            source.maxSeq = seq;
+        }
+        return false;
+    }
+    
+    if (delta < ::maxDropout) {
+        if (seq < source.maxSeq)
+            source.cycles += ::rtpSeqMod;
+        source.maxSeq = seq;
+    }
+    else if (delta <= ::rtpSeqMod - ::maxMisorder) {
+        // A big jump, the source restarted if the next packet follows it.
+        if (seq != source.badSeq) {
+            source.badSeq = (seq + 1) & (::rtpSeqMod - 1);
+            return false;
+        }
+        initSeq(source, seq);
+    }
+    // Otherwise a duplicate or a late packet, counted as received.
+    
+    source.received++;
+    return true;
+}
+
+void CRtcpSession::rtpReceived(uint32_t ssrc, uint16_t seq, uint32_t timestamp, int payloadLength, int64_t nowUs)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    int index = find(ssrc);
+    if (index < 0 && (index = add(ssrc, nowUs)) < 0)
+        return;
+    
+    Source& source = mSources[index];
+    source.lastUs = nowUs;
+    if (!source.started) {
+        initSeq(source, seq);
+        source.maxSeq = (uint16_t)(seq - 1);
+        source.probation = ::minSequential;
+        source.started = true;
+    }
+    if (!updateSeq(source, seq))
+        return;
+    source.octets += payloadLength;
+    source.heard = true;
+    
+    // RFC 3550, A.8: the transit time of successive packets, on the RTP clock.
+    uint32_t arrival = (uint32_t)(nowUs * mClockRate / 1000000);
+    int32_t transit = (int32_t)(arrival - timestamp);
+    if (source.hasTransit) {
+        int32_t d = std::abs(transit - source.transit);
+        source.jitter += (d - source.jitter) / 16;
+    }
+    source.transit = transit;
+    source.hasTransit = true;
+    
+    publishSource(source, nowUs);
+}
+
+void CRtcpSession::publish(int index, const CRtcpStats* stats)
+{
+    uint32_t words[statsWords] = { 0 };
+    memcpy(words, stats, sizeof(*stats));
+    
+    // Odd while the words change, readers retry.
+    Snapshot& snapshot = mSnapshots[index];
+    uint32_t version = snapshot.version.load(std::memory_order_relaxed);
+    snapshot.version.store(version + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (int i = 0; i < statsWords; i++)
+        snapshot.words[i].store(words[i], std::memory_order_relaxed);
+    snapshot.version.store(version + 2, std::memory_order_release);
+    snapshot.used.store(1, std::memory_order_release);
+}
+
+void CRtcpSession::publishSource(const Source& source, int64_t nowUs)
+{
+    uint32_t extended = source.cycles + source.maxSeq;
+    int64_t expected = (int64_t)extended - source.baseSeq + 1;
+    
+    CRtcpStats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.ssrc = source.ssrc;
+    stats.sending = false;
+    stats.packets = source.received;
+    stats.octets = source.octets;
+    stats.cumulativeLost = (int32_t)(expected - source.received);
+    stats.fractionLost = source.fraction / 256.0f;
+    stats.jitterUs = (int)(source.jitter * 1000000 / mClockRate);
+    stats.rttUs = -1;
+    stats.updatedUs = nowUs;
+    publish((int)(&source - mSources), &stats);
+}
+
+bool CRtcpSession::stats(uint32_t ssrc, CRtcpStats* stats) const
+{
+    for (int i = 0; i <= ::maxRtcpSources; i++) {
+        const Snapshot& snapshot = mSnapshots[i];
+        if (snapshot.used.load(std::memory_order_acquire) == 0)
+            continue;
+        
+        uint32_t words[statsWords];
+        uint32_t before, after;
+        do {
+            before = snapshot.version.load(std::memory_order_acquire);
+            for (int w = 0; w < statsWords; w++)
+                words[w] = snapshot.words[w].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = snapshot.version.load(std::memory_order_relaxed);
+        } while ((before & 1) != 0 || before != after);
+        
+        CRtcpStats copy;
+        memcpy(&copy, words, sizeof(copy));
+        if (copy.ssrc == ssrc) {
+            *stats = copy;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CRtcpSession::reportIn(void *sessionRef, uint32_t senderSsrc, const CRtcpSenderInfo* info,
+                            const CRtcpReportBlock* blocks, int count)
+{
+    CRtcpSession* session = (CRtcpSession*)sessionRef;
+    int64_t nowUs = session->mNowUs;
+    
+    // Our next report on the sender echoes when its SR came.
+    if (info != NULL) {
+        int index = session->find(senderSsrc);
+        if (index < 0)
+            index = session->add(senderSsrc, nowUs);
+        if (index >= 0) {
+            Source& source = session->mSources[index];
+            source.lsr = (uint32_t)(info->ntp >> 16);
+            source.lsrUs = nowUs;
+            source.lastUs = nowUs;
+        }
+    }
+    
+    for (int i = 0; i < count; i++) {
+        const CRtcpReportBlock& block = blocks[i];
+        if (block.ssrc != session->mLocal.ssrc)
+            continue;
+        
+        // The round trip is now less the SR's time less what the receiver
+        // held it, all in 1/65536 s (RFC 3550, 6.4.1).
+        int rttUs = -1;
+        if (block.lsr != 0) {
+            uint32_t now = (uint32_t)(session->ntp(nowUs) >> 16);
+            int32_t rtt = (int32_t)(now - block.lsr - block.dlsr);
+            if (rtt >= 0)
+                rttUs = (int)((int64_t)rtt * 1000000 / 65536);
+        }
+        
+        std::lock_guard<std::mutex> guard(session->mSendLock);
+        CRtcpStats& local = session->mLocal;
+        local.cumulativeLost = block.cumulativeLost;
+        local.fractionLost = block.fractionLost / 256.0f;
+        local.jitterUs = (int)((int64_t)block.jitter * 1000000 / session->mClockRate);
+        if (rttUs >= 0)
+            local.rttUs = rttUs;
+        local.updatedUs = nowUs;
+        session->publish(::maxRtcpSources, &local);
+    }
+}
+
+void CRtcpSession::byeIn(void *sessionRef, uint32_t ssrc)
+{
+    CRtcpSession* session = (CRtcpSession*)sessionRef;
+    int index = session->find(ssrc);
+    if (index >= 0)
+        session->remove(index);
+    if (session->mByeCallback != NULL)
+        session->mByeCallback(session->mByeRef, ssrc);
+}
+
+bool CRtcpSession::rtcpIn(const uint8_t* data, int length, int64_t nowUs)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mNowUs = nowUs;
+    return mParser.parse(data, length);
+}
+
+void CRtcpSession::report(int64_t nowUs, bool bye)
+{
+    // A reception report on every source heard since the last one, with
+    // the loss over the interval (RFC 3550, A.3).
+    CRtcpReportBlock blocks[::maxRtcpSources];
+    int count = 0;
+    for (int i = 0; i < ::maxRtcpSources && count < ::maxReportBlocks; i++) {
+        Source& source = mSources[i];
+        if (!source.used || !source.heard)
+            continue;
+        source.heard = false;
+        
+        uint32_t extended = source.cycles + source.maxSeq;
+        int64_t expected = (int64_t)extended - source.baseSeq + 1;
+        int64_t lost = expected - source.received;
+        
+        uint32_t expectedInterval = (uint32_t)expected - source.expectedPrior;
+        uint32_t receivedInterval = source.received - source.receivedPrior;
+        source.expectedPrior = (uint32_t)expected;
+        source.receivedPrior = source.received;
+        int32_t lostInterval = (int32_t)(expectedInterval - receivedInterval);
+        source.fraction = (expectedInterval == 0 || lostInterval <= 0) ? 0 : (uint8_t)std::min((lostInterval << 8) / expectedInterval, 255u);
+        
+        CRtcpReportBlock& block = blocks[count++];
+        block.ssrc = source.ssrc;
+        block.fractionLost = source.fraction;
+        block.cumulativeLost = (int32_t)std::min(std::max(lost, (int64_t)-0x800000), (int64_t)0x7fffff);
+        block.highestSeq = extended;
+        block.jitter = (uint32_t)source.jitter;
+        block.lsr = source.lsr;
+        block.dlsr = source.lsr != 0 ? (uint32_t)((nowUs - source.lsrUs) * 65536 / 1000000) : 0;
+        
+        publishSource(source, nowUs);
+    }
+    
+    // A sender is one that sent within the last two intervals (RFC 3550, 6.3.8).
+    CRtcpSenderInfo info;
+    bool sending;
+    {
+        std::lock_guard<std::mutex> guard(mSendLock);
+        sending = mPacketsSent > 0 && nowUs - mLastSentUs < 2 * (int64_t)mIntervalUs;
+        info.ntp = ntp(nowUs);
+        info.rtpTimestamp = mLastTimestamp + (uint32_t)((nowUs - mLastSentUs) * mClockRate / 1000000);
+        info.packetCount = mPacketsSent;
+        info.octetCount = mOctetsSent;
+        if (mLocal.sending != sending) {
+            mLocal.sending = sending;
+            publish(::maxRtcpSources, &mLocal);
+        }
+    }
+    
+    mWriter.clear();
+    if (sending)
+        mWriter.addSr(info, blocks, count);
+    else
+        mWriter.addRr(blocks, count);
+    mWriter.addSdes(mCname);
+    if (bye)
+        mWriter.addBye();
+    
+    mReports++;
+    mCallback(mCallbackRef, mWriter.data(), mWriter.length());
+}
+
+int64_t CRtcpSession::poll(int64_t nowUs)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    
+    // Randomized over half to one and a half intervals, so that endpoints
+    // do not fall into step. The first report goes out early.
+    std::uniform_int_distribution<int> spread(mIntervalUs / 2, mIntervalUs * 3 / 2);
+    if (mNextUs == 0) {
+        mNextUs = nowUs + spread(mRandom) / 2;
+        return mNextUs;
+    }
+    if (nowUs < mNextUs)
+        return mNextUs;
+    
+    report(nowUs, false);
+    
+    for (int i = 0; i < ::maxRtcpSources; i++) {
+        if (mSources[i].used && nowUs - mSources[i].lastUs > (int64_t)::rtcpTimeoutIntervals * mIntervalUs)
+            remove(i);
+    }
+    
+    mNextUs = nowUs + spread(mRandom);
+    return mNextUs;
+}
+
+void CRtcpSession::bye(int64_t nowUs)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    report(nowUs, true);
+}
@@ -0,0 +1,160 @@
+#ifndef __RTCP_SESSION_H__
+#define __RTCP_SESSION_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include "CRtpStream.h"
+#include "CRtcp.h"
+
+// Sender and receiver reports for one endpoint (RFC 3550, 6.4). Counts the
+// packets of our own stream as they go out and keeps, per source heard, the
+// sequence space, loss and interarrival jitter of appendix A. About once an
+// interval it sends an SR, or an RR when we send nothing, with a reception
+// report per source and our CNAME. The reports peers send back give the
+// round trip from LSR and DLSR, and the loss and jitter they see.
+//
+// The figures per SSRC are published to a seqlock snapshot, readable from
+// any thread without taking a lock.
+
+const int defaultRtcpIntervalUs = 1000000;
+const int maxRtcpSources = 16;        // Remote sources reported on.
+const int rtcpTimeoutIntervals = 5;   // A source silent this long is dropped (RFC 3550, 6.3.5).
+const int defaultRtpClockRate = 90000;
+
+struct CRtcpStats {
+    uint32_t ssrc;
+    bool sending;        // Ours, loss and jitter are what a receiver reported.
+    uint32_t packets;    // Sent, or received.
+    uint32_t octets;     // Payload octets sent, or received.
+    int32_t cumulativeLost;
+    float fractionLost;  // 0..1 over the last report interval.
+    int jitterUs;
+    int rttUs;           // Sending side only, -1 until a report comes back.
+    int64_t updatedUs;
+};
+
+class CRtcpSession {
+
+public:
+    // ssrc is that of the stream we send, or our own if we only receive.
+    // Compound RTCP packets go out through callback.
+    CRtcpSession(uint32_t ssrc, CRtpStreamOutCallback* callback, void *callbackRefCon);
+    
+    void setCname(const char* cname);
+    void setClockRate(int hz) { mClockRate = hz; }
+    void setInterval(int us) { mIntervalUs = us; }
+    // A peer's source said goodbye. Its figures are gone by then.
+    void setByeCallback(CRtcpByeCallback* callback, void *callbackRefCon);
+    
+    // A packet of ours as it leaves, others are ignored. Any thread.
+    void rtpSent(const uint8_t* data, int length, int64_t nowUs);
+    
+    // A peer's media packet as it arrives, before any repair.
+    void rtpReceived(uint32_t ssrc, uint16_t seq, uint32_t timestamp, int payloadLength, int64_t nowUs);
+    
+    // RTCP from the peers. False when it is malformed.
+    bool rtcpIn(const uint8_t* data, int length, int64_t nowUs);
+    
+    // Sends a report when one is due and drops silent sources. Returns when
+    // to call again.
+    int64_t poll(int64_t nowUs);
+    
+    // A last report and a BYE, when we leave.
+    void bye(int64_t nowUs);
+    
+    // The figures of one SSRC, ours or a peer's. Any thread, lock-free.
+    bool stats(uint32_t ssrc, CRtcpStats* stats) const;
+    
+    uint32_t ssrc() const { return mWriter.ssrc(); }
+    uint32_t reportsSent() const { return mReports; }
+    
+    // 32.32 NTP time of nowUs, on the wall clock.
+    uint64_t ntp(int64_t nowUs);
+
+private:
+    struct Source {
+        bool used;
+        uint32_t ssrc;
+        int64_t lastUs;
+        bool heard;             // Since the last report.
+        bool started;           // Its first packet came.
+        
+        // RFC 3550, A.1
+        uint16_t maxSeq;
+        uint32_t cycles;
+        uint32_t baseSeq;
+        uint32_t badSeq;
+        int probation;
+        uint32_t received;
+        uint32_t expectedPrior;
+        uint32_t receivedPrior;
+        uint32_t octets;
+        uint8_t fraction;
+        
+        // RFC 3550, A.8, in timestamp units
+        int32_t transit;
+        bool hasTransit;
+        double jitter;
+        
+        // The last SR it sent, for LSR and DLSR.
+        uint32_t lsr;
+        int64_t lsrUs;
+    };
+    
+    // One seqlock per SSRC, the last slot is ours.
+    static const int statsWords = (sizeof(CRtcpStats) + 3) / 4;
+    struct Snapshot {
+        std::atomic<uint32_t> version;
+        std::atomic<uint32_t> used;
+        std::atomic<uint32_t> words[statsWords];
+    };
+    
+    static void reportIn(void *sessionRef, uint32_t senderSsrc, const CRtcpSenderInfo* info,
+                         const CRtcpReportBlock* blocks, int count);
+    static void byeIn(void *sessionRef, uint32_t ssrc);
+    
+    int find(uint32_t ssrc) const;
+    int add(uint32_t ssrc, int64_t nowUs);
+    void remove(int index);
+    void initSeq(Source& source, uint16_t seq);
+    bool updateSeq(Source& source, uint16_t seq);
+    void publish(int index, const CRtcpStats* stats);
+    void publishSource(const Source& source, int64_t nowUs);
+    void report(int64_t nowUs, bool bye);
+    
+    CRtpStreamOutCallback* mCallback;
+    void *mCallbackRef;
+    CRtcpByeCallback* mByeCallback;
+    void *mByeRef;
+    
+    CRtcpWriter mWriter;
+    CRtcpParser mParser;
+    char mCname[256];
+    int mClockRate;
+    int mIntervalUs;
+    int64_t mNextUs;
+    int64_t mNowUs;
+    bool mWallSet;
+    int64_t mWallOffsetUs;
+    std::minstd_rand mRandom;
+    
+    Source mSources[::maxRtcpSources];
+    Snapshot mSnapshots[::maxRtcpSources + 1];
+    
+    std::mutex mLock;
+    
+    // Our stream, counted on whatever thread sends it.
+    std::mutex mSendLock;
+    uint32_t mPacketsSent;
+    uint32_t mOctetsSent;
+    uint32_t mLastTimestamp;
+    int64_t mLastSentUs;
+    CRtcpStats mLocal;
+    
+    uint32_t mReports;
+};
+
+#endif
@@ -0,0 +1,427 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include "CRtpPacer.h"
+#include "CRtpNackGenerator.h"
+#include "CRtpBandwidthEstimator.h"
+
+// Trendline filter and detector (draft-ietf-rmcat-gcc-02, 5.3 and 5.4)
+static const double smoothing = 0.9;
+static const double thresholdGain = 4.0;
+static const double initialThreshold = 12.5;
+static const double thresholdUp = 0.0087;
+static const double thresholdDown = 0.039;
+static const double maxAdaptOffsetMs = 15.0;
+static const double overusingTimeMs = 10.0;
+static const int maxBurstGroupUs = 100000;
+
+// Rate control (5.5)
+static const double decreaseFactor = 0.85;
+static const double increasePerSecond = 1.08;
+static const double capacityAlpha = 0.05;
+static const int responseTimeUs = 100000;
+
+// Loss (6)
+static const double lossHigh = 0.10;
+static const double lossLow = 0.02;
+static const int lossMinPackets = 20;
+static const int lossWindowUs = 1000000;
+
+static const float publishChange = 0.03f;
+
+CRtpBandwidthEstimator::CRtpBandwidthEstimator(CRtpBitrateCallback* callback, void *callbackRefCon)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mSent(::bweSentHistory)
+    , mAccumulated(0)
+    , mSmoothed(0)
+    , mNumDeltas(0)
+    , mFirstArrivalUs(-1)
+    , mPrevTrend(0)
+    , mThreshold(::initialThreshold)
+    , mThresholdUs(-1)
+    , mOverusingMs(-1)
+    , mOveruseCount(0)
+    , mUsage(bandwidthNormal)
+    , mAckedBytes(0)
+    , mState(rateIncrease)
+    , mBitrate(::defaultStartBitrate)
+    , mChangeUs(-1)
+    , mCapacityKbps(-1)
+    , mCapacityVar(0.4)
+    , mRttUs(::defaultRttUs)
+    , mMinBitrate(::defaultMinBitrate)
+    , mMaxBitrate(::defaultMaxBitrate)
+    , mLost(0)
+    , mReceived(0)
+    , mLossUs(-1)
+    , mLossCap(::defaultMaxBitrate)
+    , mLossDecreaseUs(-1)
+    , mPublished(0)
+{
+    mCurrent.valid = false;
+    mPrevious.valid = false;
+    for (size_t i = 0; i < mSent.size(); i++)
+        mSent[i].valid = false;
+}
+
+void CRtpBandwidthEstimator::setBitrates(int startBitrate, int minBitrate, int maxBitrate)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mMinBitrate = minBitrate;
+    mMaxBitrate = std::max(maxBitrate, minBitrate);
+    mBitrate = std::min(std::max(startBitrate, mMinBitrate), mMaxBitrate);
+    mLossCap = mMaxBitrate;
+}
+
+void CRtpBandwidthEstimator::setRtt(int us)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mRttUs = us;
+}
+
+int CRtpBandwidthEstimator::targetBitrate()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return (int)std::min(mBitrate, mLossCap);
+}
+
+int CRtpBandwidthEstimator::ackedBitrate()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mAcked.size() < 2)
+        return 0;
+    int64_t span = std::max(mAcked.back().first - mAcked.front().first, (int64_t)::ackedWindowUs / 5);
+    return (int)(mAckedBytes * 8 * 1000000 / span);
+}
+
+CRtpBandwidthUsage CRtpBandwidthEstimator::usage()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return mUsage;
+}
+
+void CRtpBandwidthEstimator::packetSentIn(void *estimatorRef, uint16_t seq, int length, int64_t sendUs)
+{
+    CRtpBandwidthEstimator* estimator = (CRtpBandwidthEstimator*)estimatorRef;
+    estimator->packetSent(seq, length, sendUs);
+}
+
+void CRtpBandwidthEstimator::packetSent(uint16_t seq, int length, int64_t sendUs)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    Sent& s = mSent[seq & (::bweSentHistory - 1)];
+    s.valid = true;
+    s.acked = false;
+    s.seq = seq;
+    s.length = length;
+    s.sendUs = sendUs;
+}
+
+void CRtpBandwidthEstimator::feedbackIn(void *estimatorRef, uint32_t, uint16_t baseSeq, uint8_t,
+                                        const int64_t* arrivalsUs, int count)
+{
+    CRtpBandwidthEstimator* estimator = (CRtpBandwidthEstimator*)estimatorRef;
+    estimator->feedback(baseSeq, arrivalsUs, count, CRtpPacer::nowUs());
+}
+
+void CRtpBandwidthEstimator::feedback(uint16_t baseSeq, const int64_t* arrivalsUs, int count, int64_t nowUs)
+{
+    int bitrate;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        
+        int lost = 0;
+        int received = 0;
+        for (int i = 0; i < count; i++) {
+            uint16_t seq = (uint16_t)(baseSeq + i);
+            Sent& s = mSent[seq & (::bweSentHistory - 1)];
+            if (!s.valid || s.seq != seq || s.acked)
+                continue;
+            
+            if (arrivalsUs[i] < 0) {
+                lost++;
+                continue;
+            }
+            s.acked = true;
+            received++;
+            arrived(s.sendUs, arrivalsUs[i], s.length);
+        }
+        if (lost + received == 0)
+            return;
+        
+        updateLoss(lost, received, nowUs);
+        updateRate(nowUs);
+        
+        bitrate = (int)std::min(mBitrate, mLossCap);
+        bitrate = std::min(std::max(bitrate, mMinBitrate), mMaxBitrate);
+        if (mPublished > 0 && std::abs(bitrate - mPublished) < mPublished * ::publishChange)
+            return;
+        mPublished = bitrate;
+    }
+    mCallback(mCallbackRef, bitrate);
+}
+
+bool CRtpBandwidthEstimator::inGroup(int64_t sendUs, int64_t arrivalUs) const
+{
+    if (sendUs - mCurrent.firstSendUs <= ::bweBurstUs)
+        return true;
+    
+    // Or it came in right behind the group, queued up with it on the way.
+    int64_t arrivalDelta = arrivalUs - mCurrent.lastArrivalUs;
+    int64_t sendDelta = sendUs - mCurrent.lastSendUs;
+    return arrivalDelta - sendDelta < 0 && arrivalDelta <= ::bweBurstUs &&
+           arrivalUs - mCurrent.firstArrivalUs < ::maxBurstGroupUs;
+}
+
+void CRtpBandwidthEstimator::arrived(int64_t sendUs, int64_t arrivalUs, int length)
+{
+    mAcked.push_back(std::make_pair(arrivalUs, length));
+    mAckedBytes += length;
+    while (mAcked.front().first < arrivalUs - ::ackedWindowUs) {
+        mAckedBytes -= mAcked.front().second;
+        mAcked.pop_front();
+    }
+    
+    if (!mCurrent.valid) {
+        Group g = { true, sendUs, sendUs, arrivalUs, arrivalUs };
+        mCurrent = g;
+        return;
+    }
+    
+    // Sent before the group under way, reordered.
+    if (sendUs < mCurrent.firstSendUs)
+        return;
+    
+    if (inGroup(sendUs, arrivalUs)) {
+        mCurrent.lastSendUs = std::max(mCurrent.lastSendUs, sendUs);
+        mCurrent.lastArrivalUs = std::max(mCurrent.lastArrivalUs, arrivalUs);
+        return;
+    }
+    
+    if (mPrevious.valid) {
+        int64_t sendDelta = mCurrent.lastSendUs - mPrevious.lastSendUs;
+        int64_t arrivalDelta = mCurrent.lastArrivalUs - mPrevious.lastArrivalUs;
+        
+        // A jump of seconds is a clock or a route that changed, not a queue.
+        if (arrivalDelta - sendDelta > 3000000 || arrivalDelta < 0) {
+            mDelays.clear();
+            mAccumulated = 0;
+            mSmoothed = 0;
+            mNumDeltas = 0;
+            mFirstArrivalUs = -1;
+        }
+        else {
+            trendlineIn((arrivalDelta - sendDelta) / 1000.0, sendDelta / 1000.0, mCurrent.lastArrivalUs);
+        }
+    }
+    mPrevious = mCurrent;
+    Group g = { true, sendUs, sendUs, arrivalUs, arrivalUs };
+    mCurrent = g;
+}
+
+void CRtpBandwidthEstimator::trendlineIn(double delayMs, double sendDeltaMs, int64_t arrivalUs)
+{
+    mNumDeltas = std::min(mNumDeltas + 1, 1000);
+    if (mFirstArrivalUs < 0)
+        mFirstArrivalUs = arrivalUs;
+    
+    mAccumulated += delayMs;
+    mSmoothed = ::smoothing * mSmoothed + (1 - ::smoothing) * mAccumulated;
+    mDelays.push_back(std::make_pair((arrivalUs - mFirstArrivalUs) / 1000.0, mSmoothed));
+    if ((int)mDelays.size() > ::trendlineWindow)
+        mDelays.pop_front();
+    
+    // Least squares slope of the smoothed delay over arrival time.
+    double trend = mPrevTrend;
+    if ((int)mDelays.size() == ::trendlineWindow) {
+        double sumX = 0, sumY = 0;
+        for (size_t i = 0; i < mDelays.size(); i++) {
+            sumX += mDelays[i].first;
+            sumY += mDelays[i].second;
+        }
+        double avgX = sumX / mDelays.size();
+        double avgY = sumY / mDelays.size();
+        double num = 0, den = 0;
+        for (size_t i = 0; i < mDelays.size(); i++) {
+            double x = mDelays[i].first - avgX;
+            num += x * (mDelays[i].second - avgY);
+            den += x * x;
+        }
+        if (den != 0)
+            trend = num / den;
+    }
+    
+    detect(trend, sendDeltaMs, arrivalUs);
+}
+
+void CRtpBandwidthEstimator::detect(double trend, double sendDeltaMs, int64_t arrivalUs)
+{
+    if (mNumDeltas < 2) {
+        mUsage = bandwidthNormal;
+        return;
+    }
+    
+    // Overuse once the trend held above the threshold for a while and is
+    // still rising.
+    double modified = std::min(mNumDeltas, 60) * trend * ::thresholdGain;
+    if (modified > mThreshold) {
+        if (mOverusingMs < 0)
+            mOverusingMs = sendDeltaMs / 2;
+        else
+            mOverusingMs += sendDeltaMs;
+        mOveruseCount++;
+        if (mOverusingMs > ::overusingTimeMs && mOveruseCount > 1 && trend >= mPrevTrend) {
+            mOverusingMs = 0;
+            mOveruseCount = 0;
+            mUsage = bandwidthOverusing;
+        }
+    }
+    else if (modified < -mThreshold) {
+        mOverusingMs = -1;
+        mOveruseCount = 0;
+        mUsage = bandwidthUnderusing;
+    }
+    else {
+        mOverusingMs = -1;
+        mOveruseCount = 0;
+        mUsage = bandwidthNormal;
+    }
+    mPrevTrend = trend;
+    updateThreshold(modified, arrivalUs);
+}
+
+void CRtpBandwidthEstimator::updateThreshold(double modifiedTrend, int64_t arrivalUs)
+{
+    if (mThresholdUs < 0)
+        mThresholdUs = arrivalUs;
+    
+    // Spikes far over the threshold do not move it, so that it does not
+    // grow out of reach of a real overuse.
+    double magnitude = fabs(modifiedTrend);
+    if (magnitude > mThreshold + ::maxAdaptOffsetMs) {
+        mThresholdUs = arrivalUs;
+        return;
+    }
+    
+    double k = magnitude < mThreshold ? ::thresholdDown : ::thresholdUp;
+    double elapsedMs = std::min((arrivalUs - mThresholdUs) / 1000.0, 100.0);
+    mThreshold += k * (magnitude - mThreshold) * elapsedMs;
+    mThreshold = std::min(std::max(mThreshold, 6.0), 600.0);
+    mThresholdUs = arrivalUs;
+}
+
+void CRtpBandwidthEstimator::updateCapacity(double sampleKbps)
+{
+    if (mCapacityKbps < 0)
+        mCapacityKbps = sampleKbps;
+    else
+        mCapacityKbps = (1 - ::capacityAlpha) * mCapacityKbps + ::capacityAlpha * sampleKbps;
+    
+    double error = mCapacityKbps - sampleKbps;
+    mCapacityVar = (1 - ::capacityAlpha) * mCapacityVar + ::capacityAlpha * error * error / std::max(mCapacityKbps, 1.0);
+    mCapacityVar = std::min(std::max(mCapacityVar, 0.4), 2.5);
+}
+
+double CRtpBandwidthEstimator::additiveIncrease(int64_t elapsedUs) const
+{
+    // About one packet per response time, packets as big as a frame at
+    // 30 fps cut into MTU sized ones.
+    double frameBits = mBitrate / 30;
+    double packets = ceil(frameBits / (1200 * 8));
+    double packetBits = frameBits / std::max(packets, 1.0);
+    double perSecond = std::max(4000.0, packetBits * 1000000 / (mRttUs + ::responseTimeUs));
+    return perSecond * elapsedUs / 1000000;
+}
+
+void CRtpBandwidthEstimator::updateRate(int64_t nowUs)
+{
+    int acked = 0;
+    if (mAcked.size() >= 2) {
+        int64_t span = std::max(mAcked.back().first - mAcked.front().first, (int64_t)::ackedWindowUs / 5);
+        acked = (int)(mAckedBytes * 8 * 1000000 / span);
+    }
+    if (mChangeUs < 0)
+        mChangeUs = nowUs;
+    
+    if (mUsage == bandwidthOverusing && mState != rateDecrease)
+        mState = rateDecrease;
+    else if (mUsage == bandwidthUnderusing)
+        mState = rateHold;
+    else if (mUsage == bandwidthNormal && mState == rateHold)
+        mState = rateIncrease;
+    
+    double ackedKbps = acked / 1000.0;
+    double deviation = mCapacityKbps >= 0 ? 3 * sqrt(mCapacityVar * mCapacityKbps) : 0;
+    
+    if (mState == rateIncrease) {
+        // Well above where it backed off before, the path changed.
+        if (mCapacityKbps >= 0 && ackedKbps > mCapacityKbps + deviation)
+            mCapacityKbps = -1;
+        
+        int64_t elapsed = std::min(nowUs - mChangeUs, (int64_t)1000000);
+        double increase;
+        if (mCapacityKbps >= 0)
+            increase = additiveIncrease(elapsed);
+        else
+            increase = std::max(mBitrate * (pow(::increasePerSecond, elapsed / 1e6) - 1), 1000.0 * elapsed / 1e6);
+        
+        // No further than the receiver shows the path can take, when the
+        // encoder does not fill what it has.
+        double bitrate = mBitrate + increase;
+        if (acked > 0)
+            bitrate = std::max(std::min(bitrate, 1.5 * acked + 10000), mBitrate);
+        mBitrate = bitrate;
+        mChangeUs = nowUs;
+    }
+    else if (mState == rateDecrease) {
+        // Once per response time, sooner when the rate collapsed.
+        int64_t reaction = std::min(std::max(mRttUs, 10000), 200000);
+        if (nowUs - mChangeUs >= reaction || (acked > 0 && acked < mBitrate / 2)) {
+            double bitrate = acked > 0 ? ::decreaseFactor * acked : ::decreaseFactor * mBitrate;
+            if (mCapacityKbps >= 0 && ackedKbps < mCapacityKbps - deviation)
+                mCapacityKbps = -1;
+            if (acked > 0)
+                updateCapacity(ackedKbps);
+            
+            mBitrate = std::min(mBitrate, bitrate);
+            mState = rateHold;
+            mChangeUs = nowUs;
+        }
+    }
+    else {
+        mChangeUs = nowUs;
+    }
+    
+    mBitrate = std::min(std::max(mBitrate, (double)mMinBitrate), (double)mMaxBitrate);
+}
+
+void CRtpBandwidthEstimator::updateLoss(int lost, int received, int64_t nowUs)
+{
+    mLost += lost;
+    mReceived += received;
+    if (mLossUs < 0)
+        mLossUs = nowUs;
+    if (mLost + mReceived < ::lossMinPackets || nowUs - mLossUs < ::lossWindowUs / 4)
+        return;
+    
+    double loss = (double)mLost / (mLost + mReceived);
+    double elapsed = std::min((nowUs - mLossUs) / 1e6, 1.0);
+    double target = std::min(mBitrate, mLossCap);
+    
+    if (loss > ::lossHigh) {
+        // Once per round trip and more, the previous cut needs to show first.
+        if (mLossDecreaseUs < 0 || nowUs - mLossDecreaseUs >= ::lossWindowUs / 4 + mRttUs) {
+            mLossCap = target * (1 - 0.5 * loss);
+            mLossDecreaseUs = nowUs;
+        }
+    }
+    else if (loss < ::lossLow) {
+        mLossCap = std::min(mLossCap * pow(::increasePerSecond, elapsed) + 1000 * elapsed, (double)mMaxBitrate);
+    }
+    
+    mLost = 0;
+    mReceived = 0;
+    mLossUs = nowUs;
+}
@@ -0,0 +1,139 @@
+#ifndef __RTP_BANDWIDTH_ESTIMATOR_H__
+#define __RTP_BANDWIDTH_ESTIMATOR_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+// Send side bandwidth estimate from transport-wide feedback, in the manner of
+// Google Congestion Control (draft-ietf-rmcat-gcc-02) with a trendline filter.
+//
+// Packets sent within a burst form a group. The growth of one-way delay from
+// group to group goes through a trendline filter, and its slope against an
+// adaptive threshold says whether the path is overused. On top of that, AIMD:
+// the rate grows by 8% a second until the first overuse and by about a
+// packet per round trip near the rate it last backed off from, and overuse
+// takes it down to 85% of what the receiver got. Loss over 10% caps it
+// further, loss under 2% lifts the cap again.
+
+const int defaultStartBitrate = 300000;
+const int defaultMinBitrate = 30000;
+const int defaultMaxBitrate = 2500000;
+const int bweSentHistory = 4096;      // Sent packets kept for their feedback, a power of two.
+const int bweBurstUs = 5000;          // Sent this close together, packets are one group.
+const int trendlineWindow = 20;       // Groups the slope is fitted over.
+const int ackedWindowUs = 500000;     // The rate the receiver got, over this long.
+
+enum CRtpBandwidthUsage {
+    bandwidthNormal,
+    bandwidthUnderusing,
+    bandwidthOverusing
+};
+
+// A new target for everything sent, media, repair and retransmissions.
+typedef void CRtpBitrateCallback(void *callbackRefCon, int bitrate);
+
+class CRtpBandwidthEstimator {
+
+public:
+    CRtpBandwidthEstimator(CRtpBitrateCallback* callback, void *callbackRefCon);
+    
+    void setBitrates(int startBitrate, int minBitrate, int maxBitrate);
+    // The response to a decrease is judged by it, e.g. from the RTCP reports.
+    void setRtt(int us);
+    
+    // Matches CRtpPacketSentCallback, so the pacer reports to the estimator
+    // directly. Any thread.
+    static void packetSentIn(void *estimatorRef, uint16_t seq, int length, int64_t sendUs);
+    void packetSent(uint16_t seq, int length, int64_t sendUs);
+    
+    // Matches CRtcpTransportFeedbackCallback.
+    static void feedbackIn(void *estimatorRef, uint32_t senderSsrc, uint16_t baseSeq, uint8_t fbCount,
+                           const int64_t* arrivalsUs, int count);
+    void feedback(uint16_t baseSeq, const int64_t* arrivalsUs, int count, int64_t nowUs);
+    
+    int targetBitrate();
+    int ackedBitrate();
+    CRtpBandwidthUsage usage();
+
+private:
+    struct Sent {
+        bool valid;
+        bool acked;
+        uint16_t seq;
+        int length;
+        int64_t sendUs;
+    };
+    
+    struct Group {
+        bool valid;
+        int64_t firstSendUs;
+        int64_t lastSendUs;
+        int64_t firstArrivalUs;
+        int64_t lastArrivalUs;
+    };
+    
+    enum RateState {
+        rateHold,
+        rateIncrease,
+        rateDecrease
+    };
+    
+    void arrived(int64_t sendUs, int64_t arrivalUs, int length);
+    bool inGroup(int64_t sendUs, int64_t arrivalUs) const;
+    void trendlineIn(double delayMs, double sendDeltaMs, int64_t arrivalUs);
+    void detect(double trend, double sendDeltaMs, int64_t arrivalUs);
+    void updateThreshold(double modifiedTrend, int64_t arrivalUs);
+    void updateRate(int64_t nowUs);
+    void updateLoss(int lost, int received, int64_t nowUs);
+    double additiveIncrease(int64_t elapsedUs) const;
+    void updateCapacity(double sampleKbps);
+    
+    CRtpBitrateCallback* mCallback;
+    void *mCallbackRef;
+    std::mutex mLock;
+    
+    std::vector<Sent> mSent;
+    
+    // Groups and the trendline
+    Group mCurrent;
+    Group mPrevious;
+    double mAccumulated;
+    double mSmoothed;
+    int mNumDeltas;
+    int64_t mFirstArrivalUs;
+    std::deque<std::pair<double, double> > mDelays;  // Arrival ms, smoothed delay ms
+    double mPrevTrend;
+    double mThreshold;
+    int64_t mThresholdUs;
+    double mOverusingMs;
+    int mOveruseCount;
+    CRtpBandwidthUsage mUsage;
+    
+    // What the receiver got
+    std::deque<std::pair<int64_t, int> > mAcked;
+    int64_t mAckedBytes;
+    
+    // AIMD
+    RateState mState;
+    double mBitrate;
+    int64_t mChangeUs;
+    double mCapacityKbps;      // At the last decreases, < 0 unknown
+    double mCapacityVar;
+    int mRttUs;
+    int mMinBitrate;
+    int mMaxBitrate;
+    
+    // Loss
+    int mLost;
+    int mReceived;
+    int64_t mLossUs;
+    double mLossCap;
+    int64_t mLossDecreaseUs;
+    
+    int mPublished;
+};
+
+#endif
@@ -0,0 +1,132 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "CRtpBufferPool.h"
+
+CRtpBufferPool::CRtpBufferPool()
+    : mInUse(0)
+    , mCached(0)
+    , mCacheLimit(::defaultPoolCache)
+{
+    mFree.resize(sizeClass(::maxPoolChunk) + 1);
+}
+
+CRtpBufferPool::~CRtpBufferPool()
+{
+    for (size_t i = 0; i < mFree.size(); i++) {
+        for (size_t j = 0; j < mFree[i].size(); j++)
+            delete [] mFree[i][j];
+    }
+}
+
+CRtpBufferPool& CRtpBufferPool::shared()
+{
+    static CRtpBufferPool pool;
+    return pool;
+}
+
+int CRtpBufferPool::sizeClass(size_t size)
+{
+    int n = 0;
+    for (size_t chunk = ::minPoolChunk; chunk < size; chunk <<= 1)
+        n++;
+    return n;
+}
+
+uint8_t* CRtpBufferPool::acquire(size_t size, size_t* capacity)
+{
+    if (size > ::maxPoolChunk)
+        return NULL;
+    
+    int n = sizeClass(size);
+    size_t chunk = ::minPoolChunk << n;
+    uint8_t* buffer = NULL;
+    
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mInUse += chunk;
+        if (!mFree[n].empty()) {
+            buffer = mFree[n].back();
+            mFree[n].pop_back();
+            mCached -= chunk;
+        }
+    }
+    
+    if (buffer == NULL)
+        buffer = new uint8_t[chunk];
+    
+    *capacity = chunk;
+    return buffer;
+}
+
+void CRtpBufferPool::release(uint8_t* buffer, size_t capacity)
+{
+    if (buffer == NULL)
+        return;
+    
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mInUse -= capacity;
+        if (mCached + capacity <= mCacheLimit) {
+            mFree[sizeClass(capacity)].push_back(buffer);
+            mCached += capacity;
+            return;
+        }
+    }
+    
+    delete [] buffer;
+}
+
+bool CRtpBufferPool::grow(uint8_t** buffer, size_t* capacity, size_t used, size_t size)
+{
+    if (*buffer != NULL && size <= *capacity)
+        return true;
+    
+    size_t newCapacity;
+    uint8_t* newBuffer = acquire(size, &newCapacity);
+    if (newBuffer == NULL)
+        return false;
+    
+    if (*buffer != NULL) {
+        memcpy(newBuffer, *buffer, used);
+        release(*buffer, *capacity);
+    }
+    
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+    return true;
+}
+
+void CRtpBufferPool::setCacheLimit(size_t bytes)
+{
+    std::vector<uint8_t*> trimmed;
+    
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mCacheLimit = bytes;
+        
+        // Largest classes go first.
+        for (int n = (int)mFree.size() - 1; n >= 0 && mCached > mCacheLimit; n--) {
+            while (!mFree[n].empty() && mCached > mCacheLimit) {
+                trimmed.push_back(mFree[n].back());
+                mFree[n].pop_back();
+                mCached -= ::minPoolChunk << n;
+            }
+        }
+    }
+    
+    for (size_t i = 0; i < trimmed.size(); i++)
+        delete [] trimmed[i];
+}
+
+size_t CRtpBufferPool::bytesInUse()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return mInUse;
+}
+
+size_t CRtpBufferPool::bytesCached()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return mCached;
+}
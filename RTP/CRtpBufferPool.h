@@ -0,0 +1,51 @@
+#ifndef __RTP_BUFFER_POOL_H__
+#define __RTP_BUFFER_POOL_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+
+// Size-classed pool of frame assembly buffers shared by all depacketizers.
+// Classes double from minPoolChunk to maxPoolChunk. Buffers handed back are
+// kept for reuse up to a cache limit and freed past it, so memory follows
+// the frames actually being assembled rather than the number of streams.
+
+const size_t minPoolChunk = 16 * 1024;
+const size_t maxPoolChunk = 16 * 1024 * 1024;
+const size_t defaultPoolCache = 8 * 1024 * 1024;
+
+class CRtpBufferPool {
+    
+public:
+    CRtpBufferPool();
+    ~CRtpBufferPool();
+    
+    static CRtpBufferPool& shared();
+    
+    // A buffer of at least size bytes, its real size in capacity. NULL when
+    // size is beyond the largest class.
+    uint8_t* acquire(size_t size, size_t* capacity);
+    void release(uint8_t* buffer, size_t capacity);
+    
+    // Moves data into a buffer with room for at least size bytes, keeping
+    // the first used bytes. The old buffer goes back to the pool. False, with
+    // nothing changed, when size is beyond the largest class.
+    bool grow(uint8_t** buffer, size_t* capacity, size_t used, size_t size);
+    
+    void setCacheLimit(size_t bytes);
+    
+    size_t bytesInUse();
+    size_t bytesCached();
+    
+private:
+    static int sizeClass(size_t size);
+    
+    std::mutex mLock;
+    std::vector<std::vector<uint8_t*> > mFree;
+    size_t mInUse;
+    size_t mCached;
+    size_t mCacheLimit;
+};
+
+#endif
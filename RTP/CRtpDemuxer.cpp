@@ -0,0 +1,495 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "CRtpHeader.h"
+#include "CRtpJitterBuffer.h"
+#include "CRtpUnpack.h"
+#include "CRtpNackGenerator.h"
+#include "CRtpFecDecoder.h"
+#include "CRtpRsDecoder.h"
+#include "CRtcpFeedbackSender.h"
+#include "CRtcpSession.h"
+#include "CRtpDemuxer.h"
+
+// NACKs collected per source and poll.
+static const int maxNacksPerPoll = 64;
+
+static void freeRtxBuffer(void *ref)
+{
+    delete [] (uint8_t*)ref;
+}
+
+CRtpDemuxer::CRtpDemuxer(CRtpDemuxerFrameCallback* callback, void *callbackRefCon, int maxSources)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mMaxSources(std::max(maxSources, 1))
+    , mCount(0)
+    , mIdleUs(::defaultSourceIdleUs)
+    , mRecovery(false)
+    , mFeedback(NULL)
+    , mNack(false)
+    , mRttUs(::defaultRttUs)
+    , mRtcp(NULL)
+{
+    // At most half full, probe sequences stay short.
+    uint32_t n = 4;
+    while (n < (uint32_t)mMaxSources * 2)
+        n <<= 1;
+    
+    Source empty = { false, 0, 0, 0, NULL, NULL, NULL, NULL, NULL };
+    mTable.resize(n, empty);
+    mMask = n - 1;
+}
+
+CRtpDemuxer::~CRtpDemuxer()
+{
+    for (size_t i = 0; i < mTable.size(); i++) {
+        if (mTable[i].used) {
+            delete mTable[i].jitterBuffer;
+            delete mTable[i].unpack;
+            delete mTable[i].nack;
+            delete mTable[i].fec;
+            delete mTable[i].rs;
+        }
+    }
+}
+
+void CRtpDemuxer::addPayloadType(int payloadType)
+{
+    if (std::find(mPayloadTypes.begin(), mPayloadTypes.end(), payloadType) == mPayloadTypes.end())
+        mPayloadTypes.push_back(payloadType);
+}
+
+void CRtpDemuxer::addRtxPayloadType(int rtxPayloadType, int mediaPayloadType)
+{
+    mRtxTypes.push_back(std::make_pair(rtxPayloadType, mediaPayloadType));
+}
+
+void CRtpDemuxer::addFecPayloadType(int fecPayloadType, int mediaPayloadType)
+{
+    mFecTypes.push_back(std::make_pair(fecPayloadType, mediaPayloadType));
+}
+
+void CRtpDemuxer::addRsPayloadType(int rsPayloadType, int mediaPayloadType)
+{
+    mRsTypes.push_back(std::make_pair(rsPayloadType, mediaPayloadType));
+}
+
+void CRtpDemuxer::setRtt(int us)
+{
+    mRttUs = us;
+    for (size_t i = 0; i < mTable.size(); i++) {
+        if (mTable[i].used)
+            setDelays(mTable[i]);
+    }
+}
+
+void CRtpDemuxer::setDelays(Source& source)
+{
+    if (source.nack == NULL && source.fec == NULL && source.rs == NULL)
+        return;
+    
+    // Parity comes in behind the whole frame. A hole is NACKed once it
+    // outlives that and the reordering, and the packet is back a round trip
+    // later. Hold frames as long as the repair takes, and a bit.
+    int repairUs = source.fec != NULL ? source.fec->parityLag() : 0;
+    if (source.rs != NULL)
+        repairUs = std::max(repairUs, source.rs->parityLag());
+    if (source.nack != NULL) {
+        int waitUs = repairUs + repairUs / 4;
+        source.nack->setMinDelay(std::max(::minNackDelayUs, waitUs));
+        source.nack->setRtt(mRttUs);
+        repairUs = waitUs + mRttUs;
+    }
+    
+    int minUs = ::defaultMinPlayoutUs + repairUs + repairUs / 4;
+    source.jitterBuffer->setPlayoutDelay(minUs, std::max(minUs, ::defaultMaxPlayoutUs));
+}
+
+uint32_t CRtpDemuxer::hash(uint32_t ssrc, int payloadType)
+{
+    uint32_t h = (ssrc ^ ((uint32_t)payloadType << 24)) * 0x9E3779B1u;
+    return h ^ (h >> 15);
+}
+
+int CRtpDemuxer::find(uint32_t ssrc, int payloadType)
+{
+    for (uint32_t i = hash(ssrc, payloadType) & mMask; mTable[i].used; i = (i + 1) & mMask) {
+        if (mTable[i].ssrc == ssrc && mTable[i].payloadType == payloadType)
+            return (int)i;
+    }
+    return -1;
+}
+
+CRtpDemuxer::Source* CRtpDemuxer::add(uint32_t ssrc, int payloadType, int64_t nowUs)
+{
+    if (mCount >= mMaxSources) {
+        // Full, the source heard from least recently makes room.
+        int oldest = -1;
+        for (size_t i = 0; i < mTable.size(); i++) {
+            if (mTable[i].used && (oldest < 0 || mTable[i].lastUs < mTable[oldest].lastUs))
+                oldest = (int)i;
+        }
+        remove(oldest);
+    }
+    
+    uint32_t i = hash(ssrc, payloadType) & mMask;
+    while (mTable[i].used)
+        i = (i + 1) & mMask;
+    
+    int error = 0;
+    Source& source = mTable[i];
+    source.used = true;
+    source.ssrc = ssrc;
+    source.payloadType = payloadType;
+    source.lastUs = nowUs;
+    source.jitterBuffer = new CRtpJitterBuffer();
+    source.unpack = new CRtpUnpack(error, (unsigned char)payloadType);
+    source.unpack->SetRecovery(mRecovery);
+    source.nack = (mNack && mFeedback != NULL) ? new CRtpNackGenerator() : NULL;
+    
+    // Parity comes after the packets it covers, they are kept from the start.
+    source.fec = NULL;
+    for (size_t t = 0; t < mFecTypes.size(); t++) {
+        if (mFecTypes[t].second == payloadType)
+            source.fec = new CRtpFecDecoder(ssrc);
+    }
+    source.rs = NULL;
+    for (size_t t = 0; t < mRsTypes.size(); t++) {
+        if (mRsTypes[t].second == payloadType)
+            source.rs = new CRtpRsDecoder(ssrc);
+    }
+    setDelays(source);
+    mCount++;
+    
+    return &source;
+}
+
+void CRtpDemuxer::remove(int index)
+{
+    Source& source = mTable[index];
+    for (size_t i = 0; i < mRtxStreams.size(); ) {
+        if (mRtxStreams[i].mediaSsrc == source.ssrc && mRtxStreams[i].mediaPayloadType == source.payloadType)
+            mRtxStreams.erase(mRtxStreams.begin() + i);
+        else
+            i++;
+    }
+    
+    delete source.jitterBuffer;
+    delete source.unpack;
+    delete source.nack;
+    delete source.fec;
+    delete source.rs;
+    source.used = false;
+    mCount--;
+    
+    // Backward shift deletion, so linear probing needs no tombstones: pull
+    // up every following entry whose home slot does not lie between the hole
+    // and itself.
+    uint32_t hole = (uint32_t)index;
+    for (uint32_t i = (hole + 1) & mMask; mTable[i].used; i = (i + 1) & mMask) {
+        uint32_t home = hash(mTable[i].ssrc, mTable[i].payloadType) & mMask;
+        if (((i - home) & mMask) >= ((i - hole) & mMask)) {
+            mTable[hole] = mTable[i];
+            mTable[i].used = false;
+            hole = i;
+        }
+    }
+}
+
+void CRtpDemuxer::removeSource(uint32_t ssrc, int payloadType)
+{
+    int index = find(ssrc, payloadType);
+    if (index >= 0)
+        remove(index);
+}
+
+void CRtpDemuxer::playout(Source& source, int64_t nowUs)
+{
+    CRtpPacket* packet;
+    while ((packet = source.jitterBuffer->pop(nowUs)) != NULL) {
+        unsigned int timestamp = 0;
+        CRtpFrame* frame = source.unpack->Parse_RTP_Packet(packet, &timestamp);
+        packet->release();
+        
+        // A packet that closes a frame cut short by loss and is a whole
+        // frame itself leaves the second one queued.
+        do {
+            if (mFeedback != NULL) {
+                // Dropping up to a keyframe, or concealing loss until one.
+                if (frame != NULL && source.unpack->IsKeyFrame())
+                    mFeedback->keyFrameReceived(source.ssrc);
+                else if (source.unpack->IsWaitingKeyFrame() || (frame != NULL && source.unpack->IsFrameDamaged()))
+                    mFeedback->requestKeyFrame(source.ssrc, nowUs);
+            }
+            
+            if (frame != NULL)
+                mCallback(mCallbackRef, source.ssrc, source.payloadType, frame, timestamp, source.unpack->IsFrameDamaged());
+        } while (frame != NULL && (frame = source.unpack->NextFrame(&timestamp)) != NULL);
+    }
+}
+
+void CRtpDemuxer::sendNacks(Source& source, int64_t nowUs)
+{
+    if (source.nack == NULL)
+        return;
+    
+    uint16_t seqs[maxNacksPerPoll];
+    int n = source.nack->collect(nowUs, seqs, maxNacksPerPoll);
+    if (n > 0)
+        mFeedback->sendNack(source.ssrc, seqs, n);
+}
+
+CRtpPacket* CRtpDemuxer::unwrapRtx(CRtpPacket* packet, const RtxMap& map)
+{
+    CRtpHeader header;
+    if (!header.parse(packet->data(), packet->length()) || header.payloadLength() < 2)
+        return NULL;
+    
+    // The original sequence number leads the payload (RFC 4588, 4).
+    int headerLength = header.headerLength();
+    int length = headerLength + header.payloadLength() - 2;
+    uint8_t* buf = new uint8_t[length];
+    
+    memcpy(buf, packet->data(), headerLength);
+    buf[0] &= ~0x20;
+    buf[1] = (uint8_t)((buf[1] & 0x80) | map.mediaPayloadType);
+    buf[2] = header.payload()[0];
+    buf[3] = header.payload()[1];
+    buf[8] = (uint8_t)(map.mediaSsrc >> 24);
+    buf[9] = (uint8_t)(map.mediaSsrc >> 16);
+    buf[10] = (uint8_t)(map.mediaSsrc >> 8);
+    buf[11] = (uint8_t)map.mediaSsrc;
+    memcpy(buf + headerLength, header.payload() + 2, header.payloadLength() - 2);
+    
+    return CRtpPacket::wrap(buf, length, freeRtxBuffer, buf);
+}
+
+bool CRtpDemuxer::insert(Source& source, CRtpPacket* packet, uint16_t seq, int64_t nowUs)
+{
+    if (source.nack != NULL)
+        source.nack->packetIn(seq, nowUs);
+    return source.jitterBuffer->insert(packet, nowUs);
+}
+
+void CRtpDemuxer::repair(Source& source, int64_t nowUs)
+{
+    // A packet one decoder rebuilds may be the one the other was missing,
+    // hand it over until neither has anything more.
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        
+        CRtpPacket* packet;
+        while (source.fec != NULL && (packet = source.fec->recovered()) != NULL) {
+            uint16_t seq = (uint16_t)((packet->data()[2] << 8) | packet->data()[3]);
+            insert(source, packet, seq, nowUs);
+            if (source.rs != NULL) {
+                source.rs->mediaIn(packet, seq, nowUs);
+                progress = true;
+            }
+            packet->release();
+        }
+        while (source.rs != NULL && (packet = source.rs->recovered()) != NULL) {
+            uint16_t seq = (uint16_t)((packet->data()[2] << 8) | packet->data()[3]);
+            insert(source, packet, seq, nowUs);
+            if (source.fec != NULL) {
+                source.fec->mediaIn(packet, seq, nowUs);
+                progress = true;
+            }
+            packet->release();
+        }
+    }
+}
+
+bool CRtpDemuxer::route(CRtpPacket* packet, uint32_t ssrc, int payloadType, uint16_t seq, int64_t nowUs)
+{
+    int index = find(ssrc, payloadType);
+    Source* source = index >= 0 ? &mTable[index] : add(ssrc, payloadType, nowUs);
+    
+    source->lastUs = nowUs;
+    bool inserted = insert(*source, packet, seq, nowUs);
+    if (source->fec != NULL)
+        source->fec->mediaIn(packet, seq, nowUs);
+    if (source->rs != NULL)
+        source->rs->mediaIn(packet, seq, nowUs);
+    if (source->fec != NULL || source->rs != NULL)
+        repair(*source, nowUs);
+    playout(*source, nowUs);
+    sendNacks(*source, nowUs);
+    return inserted;
+}
+
+bool CRtpDemuxer::routeFec(CRtpPacket* packet, int mediaPayloadType, bool reedSolomon, int64_t nowUs)
+{
+    // Both kinds name the source they protect in the CSRC.
+    uint32_t ssrc;
+    if (!CRtpFecDecoder::protectedSsrc(packet->data(), packet->length(), &ssrc))
+        return false;
+    
+    int index = find(ssrc, mediaPayloadType);
+    if (index < 0)
+        return false;
+    
+    Source& source = mTable[index];
+    if (reedSolomon ? (source.rs == NULL || !source.rs->fecIn(packet, nowUs))
+                    : (source.fec == NULL || !source.fec->fecIn(packet, nowUs)))
+        return false;
+    setDelays(source);
+    repair(source, nowUs);
+    playout(source, nowUs);
+    sendNacks(source, nowUs);
+    return true;
+}
+
+CRtpPacket* CRtpDemuxer::transportSeqIn(CRtpPacket* packet, const CRtpHeader& header, int64_t nowUs)
+{
+    const uint8_t* field;
+    int length;
+    if (header.extensionProfile() != ::rtpOneByteExtProfile ||
+        !header.findExtension(::transportSeqExtId, &field, &length) || length != 2)
+        return NULL;
+    
+    if (mFeedback != NULL)
+        mFeedback->packetArrived(header.ssrc(), (uint16_t)((field[0] << 8) | field[1]), nowUs);
+    
+    // The sender's pacer added the extension as it is, alone, to a packet
+    // without one, or the element as the last word of one there already.
+    int off = 12 + 4 * header.csrcCount();
+    if (header.extensionLength() == ::transportSeqExtLength - 4) {
+        CRtpPacket* stripped = CRtpPacket::create(packet->length() - ::transportSeqExtLength);
+        uint8_t* buf = stripped->storage();
+        memcpy(buf, packet->data(), off);
+        buf[0] &= ~0x10;
+        memcpy(buf + off, packet->data() + off + ::transportSeqExtLength, packet->length() - off - ::transportSeqExtLength);
+        return stripped;
+    }
+    
+    const uint8_t* end = header.extensionData() + header.extensionLength();
+    if (field != end - 3 || end[-1] != 0)
+        return NULL;
+    
+    int words = header.extensionLength() / 4 - 1;
+    int cut = (int)(end - packet->data()) - 4;
+    CRtpPacket* stripped = CRtpPacket::create(packet->length() - 4);
+    uint8_t* buf = stripped->storage();
+    memcpy(buf, packet->data(), cut);
+    buf[off + 2] = (uint8_t)(words >> 8);
+    buf[off + 3] = (uint8_t)words;
+    memcpy(buf + cut, packet->data() + cut + 4, packet->length() - cut - 4);
+    return stripped;
+}
+
+bool CRtpDemuxer::packetIn(CRtpPacket* packet, int64_t nowUs)
+{
+    CRtpHeader header;
+    if (!header.parse(packet->data(), packet->length()))
+        return false;
+    
+    CRtpPacket* stripped = transportSeqIn(packet, header, nowUs);
+    if (stripped != NULL) {
+        bool routed = packetIn(stripped, nowUs);
+        stripped->release();
+        return routed;
+    }
+    
+    // A probe carries nothing, it only has to be acknowledged.
+    uint16_t probeSeq;
+    if (CRtpStream::isProbe(packet->data(), packet->length(), &probeSeq)) {
+        if (mFeedback != NULL)
+            mFeedback->probeArrived(header.ssrc(), probeSeq);
+        return true;
+    }
+    
+    int payloadType = header.payloadType();
+    if (std::find(mPayloadTypes.begin(), mPayloadTypes.end(), payloadType) != mPayloadTypes.end()) {
+        if (mRtcp != NULL)
+            mRtcp->rtpReceived(header.ssrc(), header.seqNo(), header.timestamp(), header.payloadLength(), nowUs);
+        return route(packet, header.ssrc(), payloadType, header.seqNo(), nowUs);
+    }
+    
+    for (size_t f = 0; f < mFecTypes.size(); f++) {
+        if (mFecTypes[f].first == payloadType)
+            return routeFec(packet, mFecTypes[f].second, false, nowUs);
+    }
+    for (size_t f = 0; f < mRsTypes.size(); f++) {
+        if (mRsTypes[f].first == payloadType)
+            return routeFec(packet, mRsTypes[f].second, true, nowUs);
+    }
+    
+    size_t t = 0;
+    while (t < mRtxTypes.size() && mRtxTypes[t].first != payloadType)
+        t++;
+    if (t == mRtxTypes.size() || header.payloadLength() < 2)
+        return false;
+    
+    // RTX. Without signalling its SSRC, the stream belongs to the source
+    // that asked for the packet it carries (RFC 4588, 5.3).
+    uint16_t osn = (uint16_t)((header.payload()[0] << 8) | header.payload()[1]);
+    size_t m = 0;
+    while (m < mRtxStreams.size() && !(mRtxStreams[m].rtxSsrc == header.ssrc() && mRtxStreams[m].rtxPayloadType == payloadType))
+        m++;
+    
+    if (m == mRtxStreams.size()) {
+        for (size_t i = 0; i < mTable.size(); i++) {
+            Source& s = mTable[i];
+            if (s.used && s.payloadType == mRtxTypes[t].second && s.nack != NULL && s.nack->isRequested(osn)) {
+                RtxMap map = { header.ssrc(), s.ssrc, payloadType, s.payloadType };
+                mRtxStreams.push_back(map);
+                break;
+            }
+        }
+        if (m == mRtxStreams.size())
+            return false;
+    }
+    
+    RtxMap map = mRtxStreams[m];
+    if (find(map.mediaSsrc, map.mediaPayloadType) < 0)
+        return false;
+    
+    CRtpPacket* original = unwrapRtx(packet, map);
+    if (original == NULL)
+        return false;
+    
+    bool inserted = route(original, map.mediaSsrc, map.mediaPayloadType, osn, nowUs);
+    original->release();
+    return inserted;
+}
+
+int64_t CRtpDemuxer::poll(int64_t nowUs)
+{
+    int64_t next = -1;
+    
+    // The scan starts at an empty slot, the table is never full: no probe
+    // run wraps around behind it, and a backward shift only pulls entries
+    // not yet visited into the slot just emptied or past it. That slot is
+    // looked at again, nothing is visited twice.
+    uint32_t start = 0;
+    while (mTable[start].used)
+        start++;
+    
+    for (int k = 0; k < (int)mTable.size(); k++) {
+        uint32_t i = (start + k) & mMask;
+        if (!mTable[i].used)
+            continue;
+        
+        if (nowUs - mTable[i].lastUs > mIdleUs) {
+            remove((int)i);
+            k--;
+            continue;
+        }
+        
+        playout(mTable[i], nowUs);
+        sendNacks(mTable[i], nowUs);
+        
+        int64_t deadline = mTable[i].jitterBuffer->nextDeadline();
+        if (deadline >= 0 && (next < 0 || deadline < next))
+            next = deadline;
+        
+        deadline = mTable[i].nack != NULL ? mTable[i].nack->nextDeadline() : -1;
+        if (deadline >= 0 && (next < 0 || deadline < next))
+            next = deadline;
+    }
+    return next;
+}
@@ -0,0 +1,134 @@
+#ifndef __RTP_DEMUXER_H__
+#define __RTP_DEMUXER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <utility>
+#include "CRtpPacket.h"
+#include "CRtpFrame.h"
+
+class CRtpHeader;
+class CRtpJitterBuffer;
+class CRtpUnpack;
+class CRtpNackGenerator;
+class CRtpFecDecoder;
+class CRtpRsDecoder;
+class CRtcpFeedbackSender;
+class CRtcpSession;
+
+// Receiver front end for a transport carrying several RTP sources. Packets
+// are routed by SSRC and payload type to a jitter buffer and depacketizer of
+// their own, kept in a small open-addressing table. Sources that go quiet are
+// expired. Retransmissions on an RTX stream (RFC 4588) are unwrapped into the
+// source they repair, and parity packets (FlexFEC, RFC 8627) and
+// Reed-Solomon repair packets rebuild the packets lost from the source their
+// CSRC names. Transport-wide sequence numbers are reported to the feedback
+// sender and taken off, the repair covers the packets as they were before.
+
+const int defaultDemuxSources = 16;
+const int defaultSourceIdleUs = 5000000;
+
+// A frame completed by one source. Valid for the duration of the call.
+typedef void CRtpDemuxerFrameCallback(void *callbackRefCon, uint32_t ssrc, int payloadType,
+                                      CRtpFrame* frame, uint32_t timestamp, bool damaged);
+
+class CRtpDemuxer {
+    
+public:
+    CRtpDemuxer(CRtpDemuxerFrameCallback* callback, void *callbackRefCon, int maxSources = ::defaultDemuxSources);
+    ~CRtpDemuxer();
+    
+    // Payload types assembled as H.264. Packets of others are dropped.
+    void addPayloadType(int payloadType);
+    // RTX packets of rtxPayloadType repair sources of mediaPayloadType.
+    void addRtxPayloadType(int rtxPayloadType, int mediaPayloadType);
+    // Parity packets of fecPayloadType protect sources of mediaPayloadType.
+    void addFecPayloadType(int fecPayloadType, int mediaPayloadType);
+    // Reed-Solomon repair packets of rsPayloadType protect sources of mediaPayloadType.
+    void addRsPayloadType(int rsPayloadType, int mediaPayloadType);
+    void setIdleTimeout(int us) { mIdleUs = us; }
+    void setRecovery(bool recovery) { mRecovery = recovery; }
+    
+    // Asks a source for a keyframe when its stream breaks, instead of
+    // waiting for the next periodic one, and acknowledges MTU probes. Not
+    // owned.
+    void setFeedbackSender(CRtcpFeedbackSender* feedback) { mFeedback = feedback; }
+    
+    // NACK lost packets through the feedback sender. Sources hold frames
+    // back for about a round trip so that the retransmissions make it.
+    void setNack(bool nack) { mNack = nack; }
+    void setRtt(int us);
+    
+    // Counts media packets as they arrive, before any repair, for the
+    // reception reports. Not owned.
+    void setRtcpSession(CRtcpSession* session) { mRtcp = session; }
+    
+    // Routes one packet, taking a reference to it, and plays out what its
+    // source has due. False when the packet was dropped.
+    bool packetIn(CRtpPacket* packet, int64_t nowUs);
+    
+    // Plays out blocked frames that are due and expires idle sources.
+    // Returns when to call again, or -1.
+    int64_t poll(int64_t nowUs);
+    
+    bool hasSource(uint32_t ssrc, int payloadType) { return find(ssrc, payloadType) >= 0; }
+    void removeSource(uint32_t ssrc, int payloadType);
+    int sourceCount() { return mCount; }
+    
+private:
+    struct Source {
+        bool used;
+        uint32_t ssrc;
+        int payloadType;
+        int64_t lastUs;
+        CRtpJitterBuffer* jitterBuffer;
+        CRtpUnpack* unpack;
+        CRtpNackGenerator* nack;
+        CRtpFecDecoder* fec;
+        CRtpRsDecoder* rs;
+    };
+    
+    struct RtxMap {
+        uint32_t rtxSsrc;
+        uint32_t mediaSsrc;
+        int rtxPayloadType;
+        int mediaPayloadType;
+    };
+    
+    static uint32_t hash(uint32_t ssrc, int payloadType);
+    int find(uint32_t ssrc, int payloadType);
+    Source* add(uint32_t ssrc, int payloadType, int64_t nowUs);
+    void remove(int index);
+    void playout(Source& source, int64_t nowUs);
+    void sendNacks(Source& source, int64_t nowUs);
+    void setDelays(Source& source);
+    bool insert(Source& source, CRtpPacket* packet, uint16_t seq, int64_t nowUs);
+    void repair(Source& source, int64_t nowUs);
+    bool route(CRtpPacket* packet, uint32_t ssrc, int payloadType, uint16_t seq, int64_t nowUs);
+    bool routeFec(CRtpPacket* packet, int mediaPayloadType, bool reedSolomon, int64_t nowUs);
+    CRtpPacket* unwrapRtx(CRtpPacket* packet, const RtxMap& map);
+    CRtpPacket* transportSeqIn(CRtpPacket* packet, const CRtpHeader& header, int64_t nowUs);
+    
+    CRtpDemuxerFrameCallback* mCallback;
+    void *mCallbackRef;
+    
+    std::vector<Source> mTable;
+    uint32_t mMask;
+    int mMaxSources;
+    int mCount;
+    
+    std::vector<int> mPayloadTypes;
+    std::vector<std::pair<int, int> > mRtxTypes;  // RTX, media payload type
+    std::vector<RtxMap> mRtxStreams;
+    std::vector<std::pair<int, int> > mFecTypes;  // FEC, media payload type
+    std::vector<std::pair<int, int> > mRsTypes;   // Reed-Solomon, media payload type
+    int mIdleUs;
+    bool mRecovery;
+    CRtcpFeedbackSender* mFeedback;
+    bool mNack;
+    int mRttUs;
+    CRtcpSession* mRtcp;
+};
+
+#endif
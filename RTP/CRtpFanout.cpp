@@ -0,0 +1,431 @@
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include "CRtpHeader.h"
+#include "CRtcp.h"
+#include "CRtpPacer.h"
+#include "CRtpFanout.h"
+
+CRtpFanout::CRtpFanout(int queuePackets)
+    : mNextId(1)
+    , mVideoPayloadType(::defaultFanoutPayloadType)
+    , mMediaSsrc(0)
+    , mRtxPayloadType(-1)
+    , mFecPayloadType(-1)
+    , mRsPayloadType(-1)
+    , mTopLayer(0)
+    , mWindowUs(-1)
+{
+    int n = 16;
+    while (n < queuePackets && n < 65536)
+        n <<= 1;
+    mMask = (uint32_t)(n - 1);
+    
+    for (int l = 0; l < ::maxTemporalLayers; l++) {
+        mLayerBytes[l] = 0;
+        mLayerRates[l] = 0;
+    }
+}
+
+CRtpFanout::~CRtpFanout()
+{
+    for (;;) {
+        int id;
+        {
+            std::lock_guard<std::mutex> guard(mLock);
+            if (mSubscribers.empty())
+                break;
+            id = mSubscribers.back()->id;
+        }
+        unsubscribe(id);
+    }
+}
+
+void CRtpFanout::setVideoPayloadType(int payloadType)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mVideoPayloadType = payloadType;
+    for (size_t i = 0; i < mSubscribers.size(); i++)
+        mSubscribers[i]->filter.setPayloadTypes(mVideoPayloadType, mRtxPayloadType, mFecPayloadType, mRsPayloadType);
+}
+
+void CRtpFanout::setMediaSsrc(uint32_t ssrc)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mMediaSsrc = ssrc;
+    for (size_t i = 0; i < mSubscribers.size(); i++)
+        mSubscribers[i]->filter.setMediaSsrc(ssrc);
+}
+
+void CRtpFanout::setRepairPayloadTypes(int rtxPayloadType, int fecPayloadType, int rsPayloadType)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mRtxPayloadType = rtxPayloadType;
+    mFecPayloadType = fecPayloadType;
+    mRsPayloadType = rsPayloadType;
+    for (size_t i = 0; i < mSubscribers.size(); i++)
+        mSubscribers[i]->filter.setPayloadTypes(mVideoPayloadType, mRtxPayloadType, mFecPayloadType, mRsPayloadType);
+}
+
+int CRtpFanout::subscribe(CRtpStreamOutBatchCallback* callback, void *callbackRefCon,
+                          CRtpPacketSentCallback* sentCallback, void *sentRefCon)
+{
+    Subscriber* s = new Subscriber();
+    s->callback = callback;
+    s->callbackRef = callbackRefCon;
+    s->sentCallback = sentCallback;
+    s->sentRef = sentRefCon;
+    s->slots.resize(mMask + 1);
+    s->head.store(0, std::memory_order_relaxed);
+    s->tail.store(0, std::memory_order_relaxed);
+    s->epoch.store(0, std::memory_order_relaxed);
+    s->skipping = false;
+    s->waiting.store(false, std::memory_order_relaxed);
+    s->stopping.store(false, std::memory_order_relaxed);
+    s->packets.store(0, std::memory_order_relaxed);
+    s->dropped.store(0, std::memory_order_relaxed);
+    s->skips.store(0, std::memory_order_relaxed);
+    s->bitrate = 0;
+    s->capacity = -1;
+    s->layerDownUs = 0;
+    s->bytesOut.store(0, std::memory_order_relaxed);
+    s->busyUs.store(0, std::memory_order_relaxed);
+    s->lastBytesOut = 0;
+    s->lastBusyUs = 0;
+    
+    std::lock_guard<std::mutex> guard(mLock);
+    s->filter.setMediaSsrc(mMediaSsrc);
+    s->filter.setPayloadTypes(mVideoPayloadType, mRtxPayloadType, mFecPayloadType, mRsPayloadType);
+    s->id = mNextId++;
+    s->thread = std::thread(&CRtpFanout::run, this, s);
+    mSubscribers.push_back(s);
+    return s->id;
+}
+
+void CRtpFanout::unsubscribe(int id)
+{
+    Subscriber* s = NULL;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        for (size_t i = 0; i < mSubscribers.size(); i++) {
+            if (mSubscribers[i]->id == id) {
+                s = mSubscribers[i];
+                mSubscribers.erase(mSubscribers.begin() + i);
+                break;
+            }
+        }
+    }
+    if (s == NULL)
+        return;
+    
+    // Out of the list, nothing more is pushed.
+    {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->stopping.store(true, std::memory_order_release);
+        s->wakeup.notify_one();
+    }
+    s->thread.join();
+    drain(s);
+    delete s;
+}
+
+int CRtpFanout::subscribers()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return (int)mSubscribers.size();
+}
+
+bool CRtpFanout::stats(int id, CRtpSubscriberStats* stats)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    for (size_t i = 0; i < mSubscribers.size(); i++) {
+        Subscriber* s = mSubscribers[i];
+        if (s->id == id) {
+            stats->packets = s->packets.load(std::memory_order_relaxed);
+            stats->dropped = s->dropped.load(std::memory_order_relaxed);
+            stats->skips = s->skips.load(std::memory_order_relaxed);
+            stats->queued = (int)(s->tail.load(std::memory_order_relaxed) - s->head.load(std::memory_order_relaxed));
+            stats->layer = std::min(s->filter.maxLayer(), mTopLayer);
+            stats->bitrate = s->capacity > 0 ? (int)std::min(s->capacity, 2e9) : 0;
+            return true;
+        }
+    }
+    return false;
+}
+
+void CRtpFanout::setBitrate(int id, int bitrate)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    for (size_t i = 0; i < mSubscribers.size(); i++) {
+        if (mSubscribers[i]->id == id)
+            mSubscribers[i]->bitrate = bitrate;
+    }
+}
+
+int CRtpFanout::originalSeqs(int id, uint16_t* seqs, int count)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    for (size_t i = 0; i < mSubscribers.size(); i++) {
+        if (mSubscribers[i]->id == id)
+            return mSubscribers[i]->filter.originalSeqs(seqs, count);
+    }
+    return count;
+}
+
+void CRtpFanout::packetsIn(void *fanoutRef, const uint8_t* const* packets, const int* lengths, int count)
+{
+    CRtpFanout* fanout = (CRtpFanout*)fanoutRef;
+    fanout->publish(packets, lengths, count);
+}
+
+void CRtpFanout::publish(const uint8_t* const* packets, const int* lengths, int count)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mSubscribers.empty())
+        return;
+    
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] < 2)
+            continue;
+        
+        // One copy, referenced by every ring it goes into. The layer filters
+        // copy it again only to rewrite it.
+        CRtpPacket* packet = CRtpPacket::create(packets[i], lengths[i]);
+        CRtpHeader header;
+        bool rtp = !CRtcpParser::isRtcp(packets[i], lengths[i]);
+        bool parsed = rtp && header.parse(packet->data(), packet->length());
+        bool keyFrame = parsed && isKeyFrameStart(header);
+        
+        int layer;
+        bool start;
+        if (parsed && CRtpLayerFilter::frameMarking(header, &layer, &start))
+            mLayerBytes[std::min(layer, ::maxTemporalLayers - 1)] += lengths[i];
+        
+        for (size_t j = 0; j < mSubscribers.size(); j++) {
+            Subscriber* s = mSubscribers[j];
+            CRtpPacket* out = packet;
+            if (parsed)
+                out = s->filter.filter(packet, header);
+            else
+                packet->retain();
+            if (out != NULL) {
+                push(s, out, rtp, keyFrame);
+                out->release();
+            }
+        }
+        packet->release();
+    }
+    
+    updateLayers(CRtpPacer::nowUs());
+}
+
+void CRtpFanout::updateLayers(int64_t nowUs)
+{
+    if (mWindowUs < 0)
+        mWindowUs = nowUs;
+    int64_t elapsed = nowUs - mWindowUs;
+    if (elapsed < ::fanoutRateWindowUs)
+        return;
+    mWindowUs = nowUs;
+    
+    // Smoothed over a couple of seconds, a keyframe alone is no reason to
+    // take layers off.
+    int top = 0;
+    for (int l = 0; l < ::maxTemporalLayers; l++) {
+        double rate = mLayerBytes[l] * 8e6 / elapsed;
+        mLayerRates[l] = 0.875 * mLayerRates[l] + 0.125 * rate;
+        if (mLayerBytes[l] > 0)
+            top = l;
+        mLayerBytes[l] = 0;
+    }
+    mTopLayer = top;
+    
+    for (size_t i = 0; i < mSubscribers.size(); i++) {
+        Subscriber* s = mSubscribers[i];
+        
+        // What the callback got through while it was at it.
+        uint64_t bytes = s->bytesOut.load(std::memory_order_relaxed);
+        uint64_t busy = s->busyUs.load(std::memory_order_relaxed);
+        if (bytes > s->lastBytesOut && busy > s->lastBusyUs) {
+            double sample = (bytes - s->lastBytesOut) * 8e6 / (busy - s->lastBusyUs);
+            s->capacity = s->capacity < 0 ? sample : 0.75 * s->capacity + 0.25 * sample;
+        }
+        s->lastBytesOut = bytes;
+        s->lastBusyUs = busy;
+        
+        if (mTopLayer == 0)
+            continue;
+        
+        // The most layers that fit, one less with the ring filling up.
+        double budget = s->capacity < 0 ? 1e12 : s->capacity;
+        if (s->bitrate > 0)
+            budget = std::min(budget, (double)s->bitrate);
+        budget *= ::fanoutLayerHeadroom;
+        
+        int layer = mTopLayer;
+        double sum = 0;
+        for (int l = 0; l <= mTopLayer; l++)
+            sum += mLayerRates[l];
+        while (layer > 0 && sum > budget) {
+            sum -= mLayerRates[layer];
+            layer--;
+        }
+        
+        int current = std::min(s->filter.maxLayer(), mTopLayer);
+        uint32_t queued = s->tail.load(std::memory_order_relaxed) - s->head.load(std::memory_order_relaxed);
+        if (queued > (mMask + 1) / 4)
+            layer = std::min(layer, std::max(current - 1, 0));
+        
+        if (layer < current) {
+            s->filter.setMaxLayer(layer);
+            s->layerDownUs = nowUs;
+        }
+        else if (layer > current && nowUs - s->layerDownUs >= ::fanoutLayerHoldUs) {
+            s->filter.setMaxLayer(current + 1 == mTopLayer ? ::maxTemporalLayers : current + 1);
+            s->layerDownUs = nowUs;
+        }
+    }
+}
+
+bool CRtpFanout::isKeyFrameStart(const CRtpHeader& header) const
+{
+    if (header.payloadType() != mVideoPayloadType || header.payloadLength() < 2)
+        return false;
+    
+    // Parameter sets lead a keyframe, alone or aggregated (STAP-A). An IDR
+    // slice without them only at its start, whole or the first fragment
+    // (FU-A).
+    const uint8_t* p = header.payload();
+    int type = p[0] & 0x1f;
+    if (type == 28)
+        return (p[1] & 0x80) != 0 && (p[1] & 0x1f) == 5;
+    if (type == 24) {
+        int left = header.payloadLength();
+        for (int i = 1; i + 2 < left; ) {
+            int size = (p[i] << 8) | p[i + 1];
+            int inner = p[i + 2] & 0x1f;
+            if (inner == 5 || inner == 7)
+                return true;
+            i += 2 + size;
+        }
+        return false;
+    }
+    return type == 5 || type == 7;
+}
+
+void CRtpFanout::push(Subscriber* s, CRtpPacket* packet, bool rtp, bool keyFrame)
+{
+    if (rtp && s->skipping) {
+        if (!keyFrame) {
+            s->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        s->skipping = false;
+    }
+    
+    uint32_t tail = s->tail.load(std::memory_order_relaxed);
+    if (tail - s->head.load(std::memory_order_acquire) > mMask) {
+        // Everything queued is stale now, the thread drops it on the way
+        // out, and RTP waits for a keyframe.
+        s->epoch.fetch_add(1, std::memory_order_release);
+        s->skipping = true;
+        s->skips.fetch_add(1, std::memory_order_relaxed);
+        s->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    
+    packet->retain();
+    Slot slot = { packet, s->epoch.load(std::memory_order_relaxed) };
+    s->slots[tail & mMask] = slot;
+    s->tail.store(tail + 1, std::memory_order_release);
+    
+    // Pairs with the fence in run(), either the thread sees the packet or
+    // this sees it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (s->waiting.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> guard(s->lock);
+        s->wakeup.notify_one();
+    }
+}
+
+void CRtpFanout::run(Subscriber* s)
+{
+    CRtpPacket* batch[::maxFanoutBatch];
+    const uint8_t* ptrs[::maxFanoutBatch];
+    int lengths[::maxFanoutBatch];
+    
+    while (!s->stopping.load(std::memory_order_acquire)) {
+        uint32_t head = s->head.load(std::memory_order_relaxed);
+        uint32_t tail = s->tail.load(std::memory_order_acquire);
+        if (head == tail) {
+            std::unique_lock<std::mutex> lock(s->lock);
+            s->waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            s->wakeup.wait(lock, [s, head] {
+                return s->stopping.load(std::memory_order_acquire) ||
+                       s->tail.load(std::memory_order_acquire) != head;
+            });
+            s->waiting.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        
+        // Read with the tail, the epoch is at least that of every slot up
+        // to it.
+        int n = 0;
+        uint32_t stale = 0;
+        for (; head != tail && n < ::maxFanoutBatch; head++) {
+            Slot& slot = s->slots[head & mMask];
+            if (slot.epoch != s->epoch.load(std::memory_order_acquire)) {
+                slot.packet->release();
+                stale++;
+                continue;
+            }
+            batch[n] = slot.packet;
+            ptrs[n] = slot.packet->data();
+            lengths[n] = slot.packet->length();
+            n++;
+        }
+        // The slots are free again, the batch holds the references.
+        s->head.store(head, std::memory_order_release);
+        if (stale > 0)
+            s->dropped.fetch_add(stale, std::memory_order_relaxed);
+        
+        if (n > 0) {
+            int64_t startUs = CRtpPacer::nowUs();
+            s->callback(s->callbackRef, ptrs, lengths, n);
+            int bytes = 0;
+            for (int i = 0; i < n; i++)
+                bytes += lengths[i];
+            s->busyUs.fetch_add((uint64_t)(CRtpPacer::nowUs() - startUs), std::memory_order_relaxed);
+            s->bytesOut.fetch_add((uint64_t)bytes, std::memory_order_relaxed);
+            s->packets.fetch_add((uint32_t)n, std::memory_order_relaxed);
+            if (s->sentCallback != NULL)
+                reportSent(s, batch, n, startUs);
+            for (int i = 0; i < n; i++)
+                batch[i]->release();
+        }
+    }
+}
+
+void CRtpFanout::reportSent(Subscriber* s, CRtpPacket* const* batch, int count, int64_t sendUs)
+{
+    for (int i = 0; i < count; i++) {
+        const uint8_t* data = batch[i]->data();
+        int length = batch[i]->length();
+        CRtpHeader header;
+        const uint8_t* field;
+        int fieldLength;
+        if (CRtcpParser::isRtcp(data, length) || !header.parse(data, length) ||
+            !header.findExtension(::transportSeqExtId, &field, &fieldLength) || fieldLength != 2)
+            continue;
+        s->sentCallback(s->sentRef, (uint16_t)((field[0] << 8) | field[1]), length, sendUs);
+    }
+}
+
+void CRtpFanout::drain(Subscriber* s)
+{
+    uint32_t tail = s->tail.load(std::memory_order_acquire);
+    for (uint32_t head = s->head.load(std::memory_order_relaxed); head != tail; head++)
+        s->slots[head & mMask].packet->release();
+    s->head.store(tail, std::memory_order_relaxed);
+}
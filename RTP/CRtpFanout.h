@@ -0,0 +1,157 @@
+#ifndef __RTP_FANOUT_H__
+#define __RTP_FANOUT_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "CRtpStream.h"
+#include "CRtpPacket.h"
+#include "CRtpPacer.h"
+#include "CRtpLayerFilter.h"
+
+// One sender's packets to many subscribers. Each packet is copied once into
+// a CRtpPacket that every subscriber queue references. Each subscriber has
+// a bounded single-producer ring and a thread of its own that drains it, so
+// a subscriber stuck in its callback holds up only itself.
+//
+// When a ring is full, the subscriber drops what it has queued and all RTP
+// after it up to the start of the next keyframe. RTCP still goes through
+// unless the ring is full. A viewer that falls behind skips ahead to a
+// clean picture instead of getting further behind.
+//
+// With a temporally layered stream, each subscriber also gets only the
+// layers its bandwidth takes (CRtpLayerFilter). That bandwidth is what its
+// callback gets through while busy, or what setBitrate() says if less. A
+// ring filling up takes a layer off at once, layers come back one at a time
+// and no sooner than fanoutLayerHoldUs after the last one went.
+
+const int defaultFanoutQueue = 512;        // Packets per subscriber, a power of two.
+const int defaultFanoutPayloadType = 96;   // H.264, where keyframes are looked for.
+const int maxFanoutBatch = 64;             // Packets handed to a subscriber at once.
+const int fanoutRateWindowUs = 250000;     // Layer rates and subscriber bandwidth, measured over this.
+const int fanoutLayerHoldUs = 2000000;
+const float fanoutLayerHeadroom = 0.9f;    // Share of the bandwidth the layers kept may fill.
+
+struct CRtpSubscriberStats {
+    uint32_t packets;    // Handed to the callback.
+    uint32_t dropped;    // Queued or published, then dropped.
+    uint32_t skips;      // Times the ring overflowed.
+    int queued;
+    int layer;           // Highest temporal layer let through.
+    int bitrate;         // Bandwidth measured, 0 not yet.
+};
+
+class CRtpFanout {
+
+public:
+    CRtpFanout(int queuePackets = ::defaultFanoutQueue);
+    ~CRtpFanout();
+    
+    void setVideoPayloadType(int payloadType);
+    // The stream thinned per subscriber, with the payload types of its RTX
+    // and repair, -1 for none.
+    void setMediaSsrc(uint32_t ssrc);
+    void setRepairPayloadTypes(int rtxPayloadType, int fecPayloadType, int rsPayloadType);
+    
+    // The subscriber's packets go out through callback on its own thread, in
+    // batches of what is queued. Returns the id to unsubscribe with.
+    //
+    // sentCallback, if any, then gets each packet that went out carrying a
+    // transport-wide sequence number (CRtpPacer::setTransportSequence()), as
+    // its layer filter renumbered it. One bandwidth estimator per subscriber
+    // fed from here and from its feedback sees only its own path.
+    int subscribe(CRtpStreamOutBatchCallback* callback, void *callbackRefCon,
+                  CRtpPacketSentCallback* sentCallback = NULL, void *sentRefCon = NULL);
+    // Stops and joins the subscriber's thread, so not from its callback. The
+    // callback is not called again once this returns.
+    void unsubscribe(int id);
+    int subscribers();
+    
+    // Matches CRtpStreamOutBatchCallback, so the pacer can feed the fan-out
+    // directly. Any thread, publishers take turns.
+    static void packetsIn(void *fanoutRef, const uint8_t* const* packets, const int* lengths, int count);
+    void publish(const uint8_t* const* packets, const int* lengths, int count);
+    
+    bool stats(int id, CRtpSubscriberStats* stats);
+    
+    // Bandwidth to a subscriber as known otherwise, e.g. from its feedback,
+    // 0 to go by what its callback gets through alone.
+    void setBitrate(int id, int bitrate);
+    
+    // NACKed sequence numbers from a subscriber back to the sender's, see
+    // CRtpLayerFilter::originalSeqs(). Returns how many are left.
+    int originalSeqs(int id, uint16_t* seqs, int count);
+
+private:
+    struct Slot {
+        CRtpPacket* packet;
+        uint32_t epoch;
+    };
+    
+    struct Subscriber {
+        int id;
+        CRtpStreamOutBatchCallback* callback;
+        void *callbackRef;
+        CRtpPacketSentCallback* sentCallback;
+        void *sentRef;
+        std::thread thread;
+        
+        // The ring, written by the publisher and read by the thread
+        std::vector<Slot> slots;
+        std::atomic<uint32_t> head;     // Next to read
+        std::atomic<uint32_t> tail;     // Next to write
+        // Bumped on overflow, the thread drops slots of an older epoch
+        std::atomic<uint32_t> epoch;
+        bool skipping;                  // Publisher side, until a keyframe
+        
+        // Parking for the thread when the ring runs dry
+        std::mutex lock;
+        std::condition_variable wakeup;
+        std::atomic<bool> waiting;
+        std::atomic<bool> stopping;
+        
+        std::atomic<uint32_t> packets;
+        std::atomic<uint32_t> dropped;
+        std::atomic<uint32_t> skips;
+        
+        // Publisher side, the layers it gets
+        CRtpLayerFilter filter;
+        int bitrate;
+        double capacity;                // bps, < 0 unknown
+        int64_t layerDownUs;
+        // Thread side, what its callback got through and how long it took
+        std::atomic<uint64_t> bytesOut;
+        std::atomic<uint64_t> busyUs;
+        uint64_t lastBytesOut;
+        uint64_t lastBusyUs;
+    };
+    
+    bool isKeyFrameStart(const CRtpHeader& header) const;
+    static void reportSent(Subscriber* s, CRtpPacket* const* batch, int count, int64_t sendUs);
+    void push(Subscriber* s, CRtpPacket* packet, bool rtp, bool keyFrame);
+    void updateLayers(int64_t nowUs);
+    void run(Subscriber* s);
+    void drain(Subscriber* s);
+    
+    std::mutex mLock;   // Publishers, and the subscriber list
+    std::vector<Subscriber*> mSubscribers;
+    int mNextId;
+    uint32_t mMask;
+    int mVideoPayloadType;
+    uint32_t mMediaSsrc;
+    int mRtxPayloadType;
+    int mFecPayloadType;
+    int mRsPayloadType;
+    
+    // Bytes published per temporal layer, and their rates in bps
+    int64_t mLayerBytes[::maxTemporalLayers];
+    double mLayerRates[::maxTemporalLayers];
+    int mTopLayer;
+    int64_t mWindowUs;
+};
+
+#endif
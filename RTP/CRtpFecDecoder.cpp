@@ -0,0 +1,266 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "CFecXor.h"
+#include "CRtpHeader.h"
+#include "CRtpFecDecoder.h"
+
+static uint16_t load16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t load32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static void store16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+static void store32(uint8_t* p, uint32_t v) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+
+static void freeFecBuffer(void *ref)
+{
+    delete [] (uint8_t*)ref;
+}
+
+// Parity over packets this far behind the newest can no longer be used,
+// some of them have left the ring.
+static const int maxParityAge = ::fecMediaPackets - ::maxFecMaskBits;
+
+CRtpFecDecoder::CRtpFecDecoder(uint32_t mediaSsrc)
+    : mMediaSsrc(mediaSsrc)
+    , mHighest(0)
+    , mStarted(false)
+    , mLagUs(0)
+    , mRecovered(0)
+{
+    Slot empty = { NULL, 0, 0 };
+    mMedia.resize(::fecMediaPackets, empty);
+}
+
+CRtpFecDecoder::~CRtpFecDecoder()
+{
+    for (size_t i = 0; i < mMedia.size(); i++) {
+        if (mMedia[i].packet)
+            mMedia[i].packet->release();
+    }
+    for (size_t i = 0; i < mPending.size(); i++)
+        mPending[i].packet->release();
+    for (size_t i = 0; i < mRecoveredPackets.size(); i++)
+        mRecoveredPackets[i]->release();
+}
+
+bool CRtpFecDecoder::protectedSsrc(const uint8_t* data, int length, uint32_t* ssrc)
+{
+    if (length < 16 || (data[0] & 0xc0) != 0x80 || (data[0] & 0x0f) < 1)
+        return false;
+    *ssrc = load32(data + 12);
+    return true;
+}
+
+bool CRtpFecDecoder::present(uint16_t seq) const
+{
+    const Slot& s = mMedia[seq % ::fecMediaPackets];
+    return s.packet != NULL && s.seq == seq;
+}
+
+void CRtpFecDecoder::put(CRtpPacket* packet, uint16_t seq, int64_t nowUs)
+{
+    packet->retain();
+    Slot& s = mMedia[seq % ::fecMediaPackets];
+    if (s.packet)
+        s.packet->release();
+    s.packet = packet;
+    s.seq = seq;
+    s.arrivalUs = nowUs;
+    
+    if (!mStarted || (int16_t)(seq - mHighest) > 0)
+        mHighest = seq;
+    mStarted = true;
+}
+
+void CRtpFecDecoder::mediaIn(CRtpPacket* packet, uint16_t seq, int64_t nowUs)
+{
+    if (present(seq))
+        return;
+    put(packet, seq, nowUs);
+    repair(nowUs);
+}
+
+bool CRtpFecDecoder::fecIn(CRtpPacket* packet, int64_t nowUs)
+{
+    CRtpHeader header;
+    if (!header.parse(packet->data(), packet->length()) || header.csrcCount() < 1)
+        return false;
+    
+    // Only the flexible mask, R and F clear (RFC 8627, 4.2.2.1).
+    const uint8_t* h = header.payload();
+    int length = header.payloadLength();
+    if (length < 12 || (h[0] & 0xc0) != 0)
+        return false;
+    
+    Parity parity;
+    parity.packet = packet;
+    parity.header = h;
+    parity.count = 0;
+    
+    uint16_t base = load16(h + 8);
+    uint16_t mask0 = load16(h + 10);
+    int headerLength = 12;
+    for (int i = 0; i < 15; i++) {
+        if (mask0 & (1 << (14 - i)))
+            parity.seqs[parity.count++] = (uint16_t)(base + i);
+    }
+    
+    if (!(mask0 & 0x8000)) {
+        if (length < 16)
+            return false;
+        uint32_t mask1 = load32(h + 12);
+        headerLength = 16;
+        for (int i = 0; i < 31; i++) {
+            if (mask1 & (1u << (30 - i)))
+                parity.seqs[parity.count++] = (uint16_t)(base + 15 + i);
+        }
+        
+        if (!(mask1 & 0x80000000u)) {
+            if (length < 24)
+                return false;
+            uint64_t mask2 = ((uint64_t)load32(h + 16) << 32) | load32(h + 20);
+            headerLength = 24;
+            for (int i = 0; i < 63; i++) {
+                if (mask2 & (1ull << (62 - i)))
+                    parity.seqs[parity.count++] = (uint16_t)(base + 46 + i);
+            }
+        }
+    }
+    
+    if (parity.count == 0)
+        return false;
+    parity.payload = h + headerLength;
+    parity.payloadLength = length - headerLength;
+    
+    // Too late to be of use, or nothing it covers is missing.
+    if (mStarted && (int16_t)(mHighest - parity.seqs[0]) > ::maxParityAge)
+        return true;
+    int missing = 0;
+    int64_t firstUs = nowUs;
+    for (int k = 0; k < parity.count; k++) {
+        if (present(parity.seqs[k]))
+            firstUs = std::min(firstUs, mMedia[parity.seqs[k] % ::fecMediaPackets].arrivalUs);
+        else
+            missing++;
+    }
+    mLagUs = std::max(mLagUs * ::fecLagDecay, (double)(nowUs - firstUs));
+    if (missing == 0)
+        return true;
+    
+    if ((int)mPending.size() >= ::maxFecPending)
+        drop(0);
+    packet->retain();
+    mPending.push_back(parity);
+    repair(nowUs);
+    return true;
+}
+
+void CRtpFecDecoder::drop(size_t index)
+{
+    mPending[index].packet->release();
+    mPending.erase(mPending.begin() + index);
+}
+
+void CRtpFecDecoder::repair(int64_t nowUs)
+{
+    // Each packet rebuilt may complete another parity group, go round again
+    // until nothing changes.
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        
+        for (size_t i = 0; i < mPending.size(); ) {
+            const Parity& parity = mPending[i];
+            if ((int16_t)(mHighest - parity.seqs[0]) > ::maxParityAge) {
+                drop(i);
+                continue;
+            }
+            
+            int missing = 0;
+            uint16_t seq = 0;
+            for (int k = 0; k < parity.count && missing < 2; k++) {
+                if (!present(parity.seqs[k])) {
+                    seq = parity.seqs[k];
+                    missing++;
+                }
+            }
+            
+            if (missing == 0) {
+                drop(i);
+                continue;
+            }
+            if (missing > 1) {
+                i++;
+                continue;
+            }
+            
+            CRtpPacket* packet = rebuild(parity, seq);
+            drop(i);
+            if (packet != NULL) {
+                put(packet, seq, nowUs);
+                mRecoveredPackets.push_back(packet);
+                mRecovered++;
+                progress = true;
+            }
+        }
+    }
+}
+
+CRtpPacket* CRtpFecDecoder::rebuild(const Parity& parity, uint16_t seq)
+{
+    const uint8_t* h = parity.header;
+    uint8_t bits0 = h[0], bits1 = h[1];
+    uint16_t lengthRecovery = load16(h + 2);
+    uint32_t tsRecovery = load32(h + 4);
+    
+    mSrcs.clear();
+    mSrcLengths.clear();
+    for (int k = 0; k < parity.count; k++) {
+        if (parity.seqs[k] == seq)
+            continue;
+        
+        CRtpPacket* packet = mMedia[parity.seqs[k] % ::fecMediaPackets].packet;
+        const uint8_t* p = packet->data();
+        int length = packet->length() - 12;
+        if (length < 0 || length > parity.payloadLength)
+            return NULL;
+        
+        bits0 ^= p[0];
+        bits1 ^= p[1];
+        lengthRecovery ^= (uint16_t)length;
+        tsRecovery ^= load32(p + 4);
+        mSrcs.push_back(p + 12);
+        mSrcLengths.push_back(length);
+    }
+    
+    if (lengthRecovery > parity.payloadLength)
+        return NULL;
+    
+    // The parity payload with every other packet folded out of it.
+    int length = 12 + lengthRecovery;
+    uint8_t* buf = new uint8_t[12 + parity.payloadLength];
+    memcpy(buf + 12, parity.payload, parity.payloadLength);
+    fec::xorInto(buf + 12, mSrcs.data(), mSrcLengths.data(), (int)mSrcs.size());
+    
+    buf[0] = (uint8_t)(0x80 | (bits0 & 0x3f));
+    buf[1] = bits1;
+    store16(buf + 2, seq);
+    store32(buf + 4, tsRecovery);
+    store32(buf + 8, mMediaSsrc);
+    
+    CRtpHeader header;
+    if (!header.parse(buf, length)) {
+        delete [] buf;
+        return NULL;
+    }
+    return CRtpPacket::wrap(buf, length, freeFecBuffer, buf);
+}
+
+CRtpPacket* CRtpFecDecoder::recovered()
+{
+    if (mRecoveredPackets.empty())
+        return NULL;
+    CRtpPacket* packet = mRecoveredPackets.front();
+    mRecoveredPackets.pop_front();
+    return packet;
+}
@@ -0,0 +1,83 @@
+#ifndef __RTP_FEC_DECODER_H__
+#define __RTP_FEC_DECODER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include "CRtpPacket.h"
+#include "CRtpFecEncoder.h"
+
+// Receiver side of the parity FEC for one source (FlexFEC, RFC 8627, with
+// the flexible mask). Keeps the source's recent packets and the parity
+// packets that still cover a hole. A parity packet with one of its packets
+// missing rebuilds it, which may leave another parity packet with one
+// missing, so row and column parity repair what neither could alone.
+
+const int fecMediaPackets = 256;  // Recent packets kept, by sequence number.
+const int maxFecPending = 64;     // Parity packets waiting for a hole to repair.
+const double fecLagDecay = 0.99;  // Per parity packet.
+
+class CRtpFecDecoder {
+
+public:
+    CRtpFecDecoder(uint32_t mediaSsrc);
+    ~CRtpFecDecoder();
+    
+    // Every packet of the source, taking a reference.
+    void mediaIn(CRtpPacket* packet, uint16_t seq, int64_t nowUs);
+    
+    // A parity packet naming this source. False when it is malformed.
+    bool fecIn(CRtpPacket* packet, int64_t nowUs);
+    
+    // The next packet rebuilt by the last mediaIn() or fecIn(), the caller
+    // releases it, or NULL.
+    CRtpPacket* recovered();
+    
+    // The source a parity packet protects, from its CSRC.
+    static bool protectedSsrc(const uint8_t* data, int length, uint32_t* ssrc);
+    
+    // How long parity has lately come in after the first packet it covers,
+    // which is how long a hole may wait for its repair.
+    int parityLag() const { return (int)mLagUs; }
+    
+    uint32_t packetsRecovered() const { return mRecovered; }
+
+private:
+    struct Slot {
+        CRtpPacket* packet;
+        uint16_t seq;
+        int64_t arrivalUs;
+    };
+    
+    struct Parity {
+        CRtpPacket* packet;
+        const uint8_t* header;   // FEC header
+        const uint8_t* payload;
+        int payloadLength;
+        uint16_t seqs[::maxFecMaskBits];
+        int count;
+    };
+    
+    bool present(uint16_t seq) const;
+    void put(CRtpPacket* packet, uint16_t seq, int64_t nowUs);
+    void repair(int64_t nowUs);
+    CRtpPacket* rebuild(const Parity& parity, uint16_t seq);
+    void drop(size_t index);
+    
+    uint32_t mMediaSsrc;
+    std::vector<Slot> mMedia;
+    uint16_t mHighest;
+    bool mStarted;
+    double mLagUs;
+    
+    std::vector<Parity> mPending;
+    std::deque<CRtpPacket*> mRecoveredPackets;
+    
+    std::vector<const uint8_t*> mSrcs;
+    std::vector<int> mSrcLengths;
+    
+    uint32_t mRecovered;
+};
+
+#endif
@@ -0,0 +1,262 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <algorithm>
+#include "CFecXor.h"
+#include "CRtpFecEncoder.h"
+
+// Protection picked for a loss rate: none, rows of 10 and of 5 (10% and 20%
+// overhead, one loss a row), then 2D blocks for bursts (50% and 67%).
+static const struct {
+    float loss;
+    int columns;
+    int rows;
+    bool rowParity;
+    bool columnParity;
+} fecLevels[] = {
+    { 0.000f,  0, 0, false, false },
+    { 0.005f, 10, 1, true,  false },
+    { 0.020f,  5, 1, true,  false },
+    { 0.050f,  4, 4, true,  true  },
+    { 0.100f,  3, 3, true,  true  },
+};
+static const int fecLevelCount = sizeof(fecLevels) / sizeof(fecLevels[0]);
+
+static uint16_t load16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t load32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static void store16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+static void store32(uint8_t* p, uint32_t v) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+
+CRtpFecEncoder::CRtpFecEncoder(CRtpStreamOutBatchCallback* callback, void *callbackRefCon, int payloadType)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mMediaSsrc(0)
+    , mColumns(0)
+    , mRows(0)
+    , mRowParity(false)
+    , mColumnParity(false)
+    , mLevel(0)
+    , mLevelUs(0)
+    , mPayloadType(payloadType)
+    , mMediaPackets(0)
+    , mFecPackets(0)
+{
+    // The parity stream has its own random SSRC and sequence space.
+    std::random_device rd;
+    mSsrc = rd();
+    mSeqNo = (uint16_t)rd();
+}
+
+void CRtpFecEncoder::setMediaSsrc(uint32_t ssrc)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mMediaSsrc = ssrc;
+}
+
+void CRtpFecEncoder::setMatrix(int columns, int rows, bool rowParity, bool columnParity)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    
+    // A whole block has to fit in one mask.
+    mColumns = std::min(std::max(columns, 0), ::maxFecMaskBits);
+    mRows = std::min(std::max(rows, 1), ::maxFecMaskBits / std::max(mColumns, 1));
+    mRowParity = rowParity;
+    mColumnParity = columnParity && mRows > 1;
+}
+
+void CRtpFecEncoder::setLossRate(float loss, int64_t nowUs)
+{
+    int target = 0;
+    while (target + 1 < ::fecLevelCount && loss >= ::fecLevels[target + 1].loss)
+        target++;
+    
+    int level;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        if (target >= mLevel) {
+            mLevelUs = nowUs;
+            if (target == mLevel)
+                return;
+            mLevel = target;
+        }
+        else {
+            // Loss that went away may be loss the parity repaired, step down
+            // slowly and come back up as soon as it shows again.
+            if (nowUs - mLevelUs < ::fecHoldDownUs)
+                return;
+            mLevelUs = nowUs;
+            mLevel--;
+        }
+        level = mLevel;
+    }
+    
+    setMatrix(::fecLevels[level].columns, ::fecLevels[level].rows,
+              ::fecLevels[level].rowParity, ::fecLevels[level].columnParity);
+}
+
+void CRtpFecEncoder::packetsIn(void *encoderRef, const uint8_t* const* packets, const int* lengths, int count)
+{
+    CRtpFecEncoder* encoder = (CRtpFecEncoder*)encoderRef;
+    encoder->protect(packets, lengths, count);
+}
+
+void CRtpFecEncoder::addGroups(int count, int columns, int rows, bool rowParity, bool columnParity)
+{
+    // Blocks are cut from the frame's packets alone, so no parity waits for
+    // the next frame. The last block of a frame is usually short.
+    int block = columns * rows;
+    for (int b = 0; b < count; b += block) {
+        int n = std::min(block, count - b);
+        
+        if (rowParity) {
+            for (int r = 0; r * columns < n; r++) {
+                Group g = { b + r * columns, std::min(columns, n - r * columns), 1 };
+                mGroups.push_back(g);
+            }
+        }
+        
+        // A column of one packet would be its copy.
+        if (columnParity) {
+            for (int c = 0; c < columns && c < n; c++) {
+                Group g = { b + c, (n - c + columns - 1) / columns, columns };
+                if (g.count > 1)
+                    mGroups.push_back(g);
+            }
+        }
+    }
+}
+
+int CRtpFecEncoder::parityOut(const uint8_t* const* packets, const int* lengths, const Group& group, uint32_t mediaSsrc, uint8_t* out)
+{
+    uint16_t base = load16(packets[mProtected[group.first]] + 2);
+    uint8_t bits0 = 0, bits1 = 0;
+    uint16_t lengthRecovery = 0;
+    uint32_t tsRecovery = 0, timestamp = 0;
+    uint16_t mask0 = 0;
+    uint32_t mask1 = 0;
+    uint64_t mask2 = 0;
+    int maxOffset = 0;
+    
+    mSrcs.clear();
+    mSrcLengths.clear();
+    
+    // The fixed headers are folded field by field, everything past them
+    // (CSRCs, extension, payload, padding) as the parity payload.
+    for (int k = 0; k < group.count; k++) {
+        int i = mProtected[group.first + k * group.step];
+        const uint8_t* p = packets[i];
+        
+        int offset = (uint16_t)(load16(p + 2) - base);
+        if (offset >= ::maxFecMaskBits)
+            return 0;
+        maxOffset = std::max(maxOffset, offset);
+        
+        if (offset < 15)
+            mask0 |= (uint16_t)(1 << (14 - offset));
+        else if (offset < 46)
+            mask1 |= 1u << (30 - (offset - 15));
+        else
+            mask2 |= 1ull << (62 - (offset - 46));
+        
+        bits0 ^= p[0];
+        bits1 ^= p[1];
+        lengthRecovery ^= (uint16_t)(lengths[i] - 12);
+        tsRecovery ^= load32(p + 4);
+        timestamp = load32(p + 4);
+        
+        mSrcs.push_back(p + 12);
+        mSrcLengths.push_back(lengths[i] - 12);
+    }
+    
+    // RTP header, the CSRC names the protected source (RFC 8627, 4.1).
+    out[0] = 0x81;
+    out[1] = (uint8_t)mPayloadType;
+    store16(out + 2, mSeqNo++);
+    store32(out + 4, timestamp);
+    store32(out + 8, mSsrc);
+    store32(out + 12, mediaSsrc);
+    
+    // FEC header, R and F clear for the flexible mask (RFC 8627, 4.2.2.1).
+    uint8_t* h = out + 16;
+    h[0] = bits0 & 0x3f;
+    h[1] = bits1;
+    store16(h + 2, lengthRecovery);
+    store32(h + 4, tsRecovery);
+    store16(h + 8, base);
+    
+    // The mask is as long as the highest offset needs, k marks its end.
+    int headerLength;
+    if (maxOffset < 15) {
+        store16(h + 10, (uint16_t)(mask0 | 0x8000));
+        headerLength = 12;
+    }
+    else if (maxOffset < 46) {
+        store16(h + 10, mask0);
+        store32(h + 12, mask1 | 0x80000000u);
+        headerLength = 16;
+    }
+    else {
+        store16(h + 10, mask0);
+        store32(h + 12, mask1);
+        store32(h + 16, (uint32_t)(mask2 >> 32) | 0x80000000u);
+        store32(h + 20, (uint32_t)mask2);
+        headerLength = 24;
+    }
+    
+    uint8_t* payload = h + headerLength;
+    int payloadLength = *std::max_element(mSrcLengths.begin(), mSrcLengths.end());
+    memset(payload, 0, payloadLength);
+    fec::xorInto(payload, mSrcs.data(), mSrcLengths.data(), group.count);
+    
+    return 16 + headerLength + payloadLength;
+}
+
+void CRtpFecEncoder::protect(const uint8_t* const* packets, const int* lengths, int count)
+{
+    uint32_t mediaSsrc;
+    int columns, rows;
+    bool rowParity, columnParity;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mediaSsrc = mMediaSsrc;
+        columns = mColumns;
+        rows = mRows;
+        rowParity = mRowParity;
+        columnParity = mColumnParity;
+    }
+    
+    mProtected.clear();
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] >= 12 && load32(packets[i] + 8) == mediaSsrc)
+            mProtected.push_back(i);
+    }
+    mMediaPackets.fetch_add((uint32_t)mProtected.size(), std::memory_order_relaxed);
+    
+    mGroups.clear();
+    if (columns > 0 && (rowParity || columnParity))
+        addGroups((int)mProtected.size(), columns, rows, rowParity, columnParity);
+    
+    if (mGroups.empty()) {
+        mCallback(mCallbackRef, packets, lengths, count);
+        return;
+    }
+    
+    int stride = ::maxRtpMtu + ::maxFecOverhead;
+    if (mFecBuf.size() < mGroups.size() * stride)
+        mFecBuf.resize(mGroups.size() * stride);
+    
+    mOutPackets.assign(packets, packets + count);
+    mOutLengths.assign(lengths, lengths + count);
+    for (size_t g = 0; g < mGroups.size(); g++) {
+        uint8_t* out = mFecBuf.data() + g * stride;
+        int length = parityOut(packets, lengths, mGroups[g], mediaSsrc, out);
+        if (length > 0) {
+            mOutPackets.push_back(out);
+            mOutLengths.push_back(length);
+            mFecPackets.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    mCallback(mCallbackRef, mOutPackets.data(), mOutLengths.data(), (int)mOutPackets.size());
+}
@@ -0,0 +1,90 @@
+#ifndef __RTP_FEC_ENCODER_H__
+#define __RTP_FEC_ENCODER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "CRtpStream.h"
+
+// Parity FEC between the packetizer and the pacer (FlexFEC, RFC 8627, with
+// the flexible mask). The packets of each frame are laid out in rows of L,
+// D rows to a block. Every row gets one XOR parity packet, and with column
+// protection every column of a block gets one too, so a row and a column
+// between them repair a burst as long as a row. Parity goes out on a stream
+// of its own right behind the frame, so a loss is repaired without waiting
+// a round trip. A parity packet is up to maxFecOverhead bytes longer than
+// the longest packet it covers, the stream MTU has to leave room for it.
+
+const int defaultFecPayloadType = 98;
+const int maxFecMaskBits = 109;      // Packets one parity packet can cover.
+const int maxFecOverhead = 28;       // CSRC and FEC header with the longest mask.
+const int fecHoldDownUs = 5000000;   // Protection is lowered no faster than this.
+
+class CRtpFecEncoder {
+
+public:
+    // Media and parity packets go on through callback, one batch per frame.
+    CRtpFecEncoder(CRtpStreamOutBatchCallback* callback, void *callbackRefCon, int payloadType = ::defaultFecPayloadType);
+    
+    // Only packets of this source are protected, others (MTU probes) pass.
+    void setMediaSsrc(uint32_t ssrc);
+    uint32_t ssrc() const { return mSsrc; }
+    
+    // Rows of columns packets, rows rows to a block. Columns 0 turns FEC
+    // off. May be called from any thread, it takes effect with the next frame.
+    void setMatrix(int columns, int rows, bool rowParity, bool columnParity);
+    
+    // Picks the matrix for the loss rate seen by the receiver, 0..1. Raised
+    // at once, lowered a step at a time no faster than fecHoldDownUs.
+    void setLossRate(float loss, int64_t nowUs);
+    
+    // Matches CRtpStreamOutBatchCallback, so a CRtpStream can feed it.
+    static void packetsIn(void *encoderRef, const uint8_t* const* packets, const int* lengths, int count);
+    void protect(const uint8_t* const* packets, const int* lengths, int count);
+    
+    // Packets protected and parity sent so far, readable from any thread.
+    uint32_t mediaPackets() const { return mMediaPackets.load(std::memory_order_relaxed); }
+    uint32_t fecPackets() const { return mFecPackets.load(std::memory_order_relaxed); }
+
+private:
+    struct Group {
+        int first;
+        int count;
+        int step;
+    };
+    
+    void addGroups(int count, int columns, int rows, bool rowParity, bool columnParity);
+    int parityOut(const uint8_t* const* packets, const int* lengths, const Group& group, uint32_t mediaSsrc, uint8_t* out);
+    
+    CRtpStreamOutBatchCallback* mCallback;
+    void *mCallbackRef;
+    
+    std::mutex mLock;
+    uint32_t mMediaSsrc;
+    int mColumns;
+    int mRows;
+    bool mRowParity;
+    bool mColumnParity;
+    int mLevel;
+    int64_t mLevelUs;
+    
+    uint32_t mSsrc;
+    uint16_t mSeqNo;
+    int mPayloadType;
+    
+    std::vector<int> mProtected;
+    std::vector<Group> mGroups;
+    std::vector<const uint8_t*> mSrcs;
+    std::vector<int> mSrcLengths;
+    std::vector<uint8_t> mFecBuf;
+    std::vector<int> mFecOffsets;
+    std::vector<const uint8_t*> mOutPackets;
+    std::vector<int> mOutLengths;
+    
+    std::atomic<uint32_t> mMediaPackets;
+    std::atomic<uint32_t> mFecPackets;
+};
+
+#endif
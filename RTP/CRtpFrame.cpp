@@ -0,0 +1,111 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "CRtpFrame.h"
+
+CRtpFrame::CRtpFrame()
+    : mLength(0)
+{
+}
+
+CRtpFrame::~CRtpFrame()
+{
+    clear();
+}
+
+void CRtpFrame::appendPacket(CRtpPacket* packet, int offset, int length)
+{
+    if (length <= 0)
+        return;
+    
+    mLength += length;
+    
+    if (!mSegments.empty()) {
+        Segment& last = mSegments.back();
+        if (last.packet == packet && last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        }
+    }
+    
+    packet->retain();
+    Segment segment = { packet, offset, length };
+    mSegments.push_back(segment);
+}
+
+void CRtpFrame::appendBytes(const uint8_t* data, int length)
+{
+    if (length <= 0)
+        return;
+    
+    mLength += length;
+    
+    int offset = (int)mBytes.size();
+    mBytes.insert(mBytes.end(), data, data + length);
+    
+    if (!mSegments.empty()) {
+        Segment& last = mSegments.back();
+        if (last.packet == NULL && last.offset + last.length == offset) {
+            last.length += length;
+            return;
+        }
+    }
+    
+    Segment segment = { NULL, offset, length };
+    mSegments.push_back(segment);
+}
+
+void CRtpFrame::clear()
+{
+    for (size_t i = 0; i < mSegments.size(); i++) {
+        if (mSegments[i].packet)
+            mSegments[i].packet->release();
+    }
+    
+    mSegments.clear();
+    mBytes.clear();
+    mLength = 0;
+}
+
+void CRtpFrame::truncate(int length)
+{
+    while (!mSegments.empty() && mLength > length) {
+        Segment& last = mSegments.back();
+        int cut = std::min(last.length, mLength - length);
+        
+        last.length -= cut;
+        mLength -= cut;
+        if (last.packet == NULL)
+            mBytes.resize(last.offset + last.length);
+        
+        if (last.length == 0) {
+            if (last.packet)
+                last.packet->release();
+            mSegments.pop_back();
+        }
+    }
+}
+
+void CRtpFrame::swap(CRtpFrame& other)
+{
+    mSegments.swap(other.mSegments);
+    mBytes.swap(other.mBytes);
+    std::swap(mLength, other.mLength);
+}
+
+const uint8_t* CRtpFrame::segmentData(int i) const
+{
+    const Segment& segment = mSegments[i];
+    if (segment.packet)
+        return segment.packet->data() + segment.offset;
+    return mBytes.data() + segment.offset;
+}
+
+void CRtpFrame::copyTo(uint8_t* buffer) const
+{
+    for (int i = 0; i < (int)mSegments.size(); i++) {
+        memcpy(buffer, segmentData(i), mSegments[i].length);
+        buffer += mSegments[i].length;
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef __RTP_FRAME_H__
+#define __RTP_FRAME_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "CRtpPacket.h"
+
+// An access unit as a scatter list. Each segment is either a range of a
+// received packet, which the frame holds a reference to, or a range of the
+// start codes and NAL headers the depacketizer synthesized.
+
+class CRtpFrame {
+    
+public:
+    struct Segment {
+        CRtpPacket* packet; // NULL for synthesized bytes
+        int offset;         // Into the packet, or into the synthesized bytes.
+        int length;
+    };
+    
+    CRtpFrame();
+    ~CRtpFrame();
+    
+    // Ranges continuing the previous segment are merged into it.
+    void appendPacket(CRtpPacket* packet, int offset, int length);
+    void appendBytes(const uint8_t* data, int length);
+    
+    // Drops the packet references.
+    void clear();
+    // Cuts the frame back to its first length bytes.
+    void truncate(int length);
+    void swap(CRtpFrame& other);
+    
+    int length() const { return mLength; }
+    int segmentCount() const { return (int)mSegments.size(); }
+    const Segment& segment(int i) const { return mSegments[i]; }
+    const uint8_t* segmentData(int i) const;
+    
+    // Flattens the frame for decoders that want contiguous input.
+    void copyTo(uint8_t* buffer) const;
+    
+private:
+    CRtpFrame(const CRtpFrame&);
+    CRtpFrame& operator=(const CRtpFrame&);
+    
+    std::vector<Segment> mSegments;
+    std::vector<uint8_t> mBytes;
+    int mLength;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef __RTP_FRAME_AV_H__
+#define __RTP_FRAME_AV_H__
+
+#include <cstring>
+#include "CRtpFrame.h"
+
+extern "C" {
+#include "avcodec.h"
+#include "buffer.h"
+};
+
+// Adapters from CRtpFrame to refcounted FFmpeg buffers, for builds with
+// FFmpeg (USE_FFMPEG).
+
+inline void rtpFramePacketFree(void *opaque, uint8_t *data)
+{
+    ((CRtpPacket *)opaque)->release();
+}
+
+// One AVBufferRef per segment, in order. Ranges of received packets are
+// wrapped in place and keep their packet alive, only the synthesized start
+// codes and NAL headers are copied. Returns the number of buffers, or -1 when
+// max is too small or allocation fails.
+inline int rtpFrameToAVBuffers(const CRtpFrame& frame, AVBufferRef** buffers, int max)
+{
+    int count = frame.segmentCount();
+    if (count > max)
+        return -1;
+    
+    for (int i = 0; i < count; i++) {
+        const CRtpFrame::Segment& segment = frame.segment(i);
+        uint8_t* data = (uint8_t *)frame.segmentData(i);
+        
+        if (segment.packet) {
+            segment.packet->retain();
+            buffers[i] = av_buffer_create(data, segment.length, rtpFramePacketFree, segment.packet, AV_BUFFER_FLAG_READONLY);
+            if (buffers[i] == NULL)
+                segment.packet->release();
+        }
+        else {
+            buffers[i] = av_buffer_alloc(segment.length);
+            if (buffers[i])
+                memcpy(buffers[i]->data, data, segment.length);
+        }
+        
+        if (buffers[i] == NULL) {
+            while (i-- > 0)
+                av_buffer_unref(&buffers[i]);
+            return -1;
+        }
+    }
+    return count;
+}
+
+// For decoders that need contiguous input, libavcodec's H.264 decoder among
+// them: the frame is flattened once, straight from the received packets, into
+// the packet's own refcounted and padded buffer.
+inline int rtpFrameToAVPacket(const CRtpFrame& frame, AVPacket* packet)
+{
+    if (av_new_packet(packet, frame.length()) < 0)
+        return -1;
+    
+    frame.copyTo(packet->data);
+    return 0;
+}
+
+#endif
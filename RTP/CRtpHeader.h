@@ -0,0 +1,161 @@
+//
+//  CRtpHeader
+#ifndef __RTP_HEADER_H__
+#define __RTP_HEADER_H__
+
+#include <cstdint>
+#include <cstdlib>
+
+// Read-only view of an RTP header (RFC 3550, 5.1), parsed in place over the
+// packet bytes. Fields are read in network order one at a time, so the view
+// does not depend on host endianness or struct layout. The packet must
+// outlive the view.
+
+const uint16_t rtpOneByteExtProfile = 0xBEDE;  // RFC 8285, 4.2
+const uint16_t rtpTwoByteExtProfile = 0x1000;  // RFC 8285, 4.3, low 4 bits are app bits
+
+// Transport-wide sequence number (draft-holmer-rmcat-transport-wide-cc-
+// extensions-01, 2), one-byte form. Both ends of the demo agree on the id
+// without signalling. Alone it takes 8 bytes: profile, length, the element
+// and a byte of padding.
+const int transportSeqExtId = 3;
+const int transportSeqExtLength = 8;
+
+// Frame marking (draft-ietf-avtext-framemarking, 3.2), one-byte form, the
+// 3 byte element for layered streams:
+//
+//   S|E|I|D|B| TID |     LID = 0     |    TL0PICIDX    |
+//
+// start and end of frame, independent (IDR), discardable, base layer sync,
+// the temporal layer, and a count of layer 0 frames. Alone it takes 8 bytes.
+const int frameMarkingExtId = 4;
+const int frameMarkingExtLength = 8;
+
+class CRtpHeader {
+    
+public:
+    CRtpHeader()
+        : mData(NULL), mLength(0), mExtOffset(0), mHeaderLength(0), mPaddingLength(0), mPayloadLength(0)
+    {
+    }
+    
+    // Checks the version, the CSRC list, the extension length and the padding
+    // count against the packet length. Nothing else is valid when it fails.
+    bool parse(const uint8_t* data, int length)
+    {
+        mData = data;
+        mLength = length;
+        
+        if (length < 12 || (data[0] & 0xc0) != 0x80)
+            return false;
+        
+        int off = 12 + 4 * (data[0] & 0x0f);
+        int ext = 0;
+        if (data[0] & 0x10) {
+            if (off + 4 > length)
+                return false;
+            ext = 4 + 4 * load16(data + off + 2);
+        }
+        
+        // A padding count includes itself, so it can not be zero.
+        int pad = (data[0] & 0x20) ? data[length - 1] : 0;
+        
+        mExtOffset = off;
+        mHeaderLength = off + ext;
+        mPaddingLength = pad;
+        mPayloadLength = length - mHeaderLength - pad;
+        
+        return mPayloadLength >= 0 && ((data[0] & 0x20) == 0 || pad > 0);
+    }
+    
+    int version() const { return mData[0] >> 6; }
+    bool padding() const { return (mData[0] & 0x20) != 0; }
+    bool extension() const { return (mData[0] & 0x10) != 0; }
+    int csrcCount() const { return mData[0] & 0x0f; }
+    bool marker() const { return (mData[1] & 0x80) != 0; }
+    int payloadType() const { return mData[1] & 0x7f; }
+    uint16_t seqNo() const { return load16(mData + 2); }
+    uint32_t timestamp() const { return load32(mData + 4); }
+    uint32_t ssrc() const { return load32(mData + 8); }
+    uint32_t csrc(int i) const { return load32(mData + 12 + 4 * i); }
+    
+    uint16_t extensionProfile() const { return extension() ? load16(mData + mExtOffset) : 0; }
+    const uint8_t* extensionData() const { return mData + mExtOffset + 4; }
+    int extensionLength() const { return extension() ? mHeaderLength - mExtOffset - 4 : 0; }
+    
+    int headerLength() const { return mHeaderLength; }
+    int paddingLength() const { return mPaddingLength; }
+    const uint8_t* payload() const { return mData + mHeaderLength; }
+    int payloadLength() const { return mPayloadLength; }
+    
+    // Walks the extension elements of the one-byte and two-byte forms
+    // (RFC 8285). Start with offset 0, and pass back the offset returned until
+    // it is -1. Other profiles have no elements.
+    int nextExtension(int offset, int* id, const uint8_t** data, int* length) const
+    {
+        uint16_t profile = extensionProfile();
+        bool oneByte = profile == rtpOneByteExtProfile;
+        bool twoByte = (profile & 0xfff0) == rtpTwoByteExtProfile;
+        if (!oneByte && !twoByte)
+            return -1;
+        
+        const uint8_t* ext = extensionData();
+        int size = extensionLength();
+        
+        while (offset < size) {
+            if (ext[offset] == 0) { // padding
+                offset++;
+                continue;
+            }
+            
+            int elementId, elementLength, off;
+            if (oneByte) {
+                elementId = ext[offset] >> 4;
+                if (elementId == 15) // reserved, stops the walk
+                    return -1;
+                elementLength = (ext[offset] & 0x0f) + 1;
+                off = offset + 1;
+            }
+            else {
+                if (offset + 2 > size)
+                    return -1;
+                elementId = ext[offset];
+                elementLength = ext[offset + 1];
+                off = offset + 2;
+            }
+            
+            if (off + elementLength > size)
+                return -1;
+            
+            *id = elementId;
+            *data = ext + off;
+            *length = elementLength;
+            return off + elementLength;
+        }
+        return -1;
+    }
+    
+    bool findExtension(int id, const uint8_t** data, int* length) const
+    {
+        int elementId = 0;
+        for (int off = nextExtension(0, &elementId, data, length); off >= 0;
+             off = nextExtension(off, &elementId, data, length)) {
+            if (elementId == id)
+                return true;
+        }
+        return false;
+    }
+    
+private:
+    static uint16_t load16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+    static uint32_t load32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+    
+    const uint8_t* mData;
+    int mLength;
+    int mExtOffset;
+    int mHeaderLength;
+    int mPaddingLength;
+    int mPayloadLength;
+};
+
+#endif
@@ -0,0 +1,297 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include "CRtpJitterBuffer.h"
+
+// Each frame released lets the reorder estimate decay by this much.
+static const double reorderDecay = 0.995;
+
+CRtpJitterBuffer::CRtpJitterBuffer(int slots)
+    : mMinDelayUs(::defaultMinPlayoutUs)
+    , mMaxDelayUs(::defaultMaxPlayoutUs)
+    , mDelayUs(::defaultMinPlayoutUs)
+    , mJitterUs(0)
+    , mReorderUs(0)
+    , mHaveLast(false)
+    , mLastTs(0)
+    , mLastArrivalUs(0)
+    , mLostFrames(0)
+{
+    int n = 64;
+    while (n < slots && n < 32768)
+        n <<= 1;
+    
+    Slot empty = { NULL, false, 0, 0 };
+    mSlots.resize(n, empty);
+    mMask = (uint16_t)(n - 1);
+    mWindow = std::min(::defaultReorderWindow, n / 2);
+    
+    reset();
+}
+
+CRtpJitterBuffer::~CRtpJitterBuffer()
+{
+    reset();
+}
+
+void CRtpJitterBuffer::setReorderWindow(int packets)
+{
+    mWindow = std::min(std::max(packets, 1), (int)mSlots.size() / 2);
+}
+
+void CRtpJitterBuffer::setPlayoutDelay(int minUs, int maxUs)
+{
+    mMinDelayUs = minUs;
+    mMaxDelayUs = std::max(minUs, maxUs);
+    updateDelay();
+}
+
+void CRtpJitterBuffer::reset()
+{
+    for (size_t i = 0; i < mSlots.size(); i++) {
+        if (mSlots[i].packet)
+            mSlots[i].packet->release();
+        mSlots[i].packet = NULL;
+    }
+    for (size_t i = 0; i < mReady.size(); i++)
+        mReady[i]->release();
+    mReady.clear();
+    
+    mStarted = false;
+    mHolding = false;
+    mStartUs = 0;
+    mHead = 0;
+    mHighest = 0;
+    mSsrc = 0;
+    mCount = 0;
+    mRun = 0;
+    mBlockedUs = -1;
+    mBlockedSeq = 0;
+    mHaveLast = false;
+}
+
+void CRtpJitterBuffer::updateDelay()
+{
+    // Three times the interarrival jitter covers nearly all in-order
+    // arrivals, the reorder term covers the latest refill seen lately.
+    double delay = std::max(3 * mJitterUs, 1.5 * mReorderUs);
+    mDelayUs = (int)std::min(std::max(delay, (double)mMinDelayUs), (double)mMaxDelayUs);
+}
+
+CRtpPacket* CRtpJitterBuffer::take(uint16_t seq)
+{
+    Slot& s = slot(seq);
+    if (s.packet == NULL || s.seq != seq)
+        return NULL;
+    
+    CRtpPacket* packet = s.packet;
+    s.packet = NULL;
+    mCount--;
+    return packet;
+}
+
+void CRtpJitterBuffer::release(uint16_t seq)
+{
+    CRtpPacket* packet = take(seq);
+    if (packet)
+        packet->release();
+}
+
+void CRtpJitterBuffer::skipLost()
+{
+    // Drop what there is of the head frame and carry on at the first packet
+    // past the hole. CRtpUnpack sees the gap in sequence numbers.
+    while (present(mHead))
+        release(mHead++);
+    while (mCount > 0 && !present(mHead))
+        mHead++;
+    
+    mLostFrames++;
+    mBlockedUs = -1;
+}
+
+int CRtpJitterBuffer::wholeFrame()
+{
+    // How much of the head frame is here, up to its marker, 0 with a hole
+    // before the marker.
+    int n = 0;
+    for (uint16_t seq = mHead; present(seq); seq++) {
+        n++;
+        if (slot(seq).marker)
+            return n;
+    }
+    return 0;
+}
+
+void CRtpJitterBuffer::makeRoom(uint16_t seq)
+{
+    // What is left of a frame being released, then whole frames, go out in
+    // order now. A frame with a hole cannot wait any longer.
+    while (mRun > 0 && present(mHead)) {
+        mRun--;
+        mReady.push_back(take(mHead++));
+    }
+    mRun = 0;
+    while (mCount > 0 && (int16_t)(seq - mHead) >= mWindow) {
+        int n = wholeFrame();
+        if (n == 0) {
+            skipLost();
+            continue;
+        }
+        while (n-- > 0)
+            mReady.push_back(take(mHead++));
+        mReorderUs *= reorderDecay;
+    }
+    if ((int16_t)(seq - mHead) >= mWindow)
+        mHead = (uint16_t)(seq - mWindow + 1);
+    
+    mHolding = false;
+    mBlockedUs = -1;
+    updateDelay();
+}
+
+bool CRtpJitterBuffer::insert(const uint8_t* data, int length, int64_t nowUs)
+{
+    CRtpPacket* packet = CRtpPacket::create(data, length);
+    bool inserted = insert(packet, nowUs);
+    packet->release();
+    return inserted;
+}
+
+bool CRtpJitterBuffer::insert(CRtpPacket* packet, int64_t nowUs)
+{
+    const uint8_t* data = packet->data();
+    int length = packet->length();
+    
+    if (length < 12 || (data[0] >> 6) != 2)
+        return false;
+    
+    uint16_t seq = (uint16_t)((data[2] << 8) | data[3]);
+    uint32_t ts = ((uint32_t)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+    uint32_t ssrc = ((uint32_t)data[8] << 24) | (data[9] << 16) | (data[10] << 8) | data[11];
+    
+    if (mStarted && ssrc != mSsrc)
+        reset();
+    
+    if (!mStarted) {
+        mStarted = true;
+        mHolding = true;
+        mStartUs = nowUs;
+        mHead = seq;
+        mHighest = seq;
+        mSsrc = ssrc;
+    }
+    
+    int16_t diff = (int16_t)(seq - mHead);
+    if (diff < 0 && mHolding && (int16_t)(mHighest - seq) < mWindow) {
+        // Nothing played out yet, the stream starts further back.
+        mHead = seq;
+        diff = 0;
+    }
+    if (diff < 0)
+        return false;
+    
+    if (diff >= mWindow)
+        makeRoom(seq);
+    
+    if (present(seq))
+        return false;
+    
+    packet->retain();
+    Slot& s = slot(seq);
+    s.packet = packet;
+    s.marker = (data[1] & 0x80) != 0;
+    s.seq = seq;
+    s.arrivalUs = nowUs;
+    mCount++;
+    
+    if ((int16_t)(seq - mHighest) >= 0) {
+        // Interarrival jitter (RFC 3550, 6.4.1) over packets in order.
+        if (mHaveLast) {
+            double d = (double)(nowUs - mLastArrivalUs) - (int32_t)(ts - mLastTs) * 100.0 / 9;
+            mJitterUs += (std::abs(d) - mJitterUs) / 16;
+        }
+        mHaveLast = true;
+        mLastTs = ts;
+        mLastArrivalUs = nowUs;
+        mHighest = seq;
+    }
+    else {
+        // Late, by as long as since the first packet sent after it came in.
+        for (uint16_t next = (uint16_t)(seq + 1); next != (uint16_t)(mHighest + 1); next++) {
+            if (present(next)) {
+                mReorderUs = std::max(mReorderUs, (double)(nowUs - slot(next).arrivalUs));
+                break;
+            }
+        }
+    }
+    updateDelay();
+    
+    return true;
+}
+
+CRtpPacket* CRtpJitterBuffer::pop(int64_t nowUs)
+{
+    if (!mReady.empty()) {
+        CRtpPacket* packet = mReady.front();
+        mReady.pop_front();
+        return packet;
+    }
+    
+    while (mStarted && mCount > 0) {
+        // The first packet in need not be the first one sent. Give the
+        // ones before it a playout delay to turn up.
+        if (mHolding) {
+            if (nowUs - mStartUs < mDelayUs)
+                break;
+            mHolding = false;
+        }
+        
+        if (mRun > 0 && present(mHead)) {
+            mRun--;
+            return take(mHead++);
+        }
+        mRun = 0;
+        
+        int n = wholeFrame();
+        if (n > 0) {
+            mRun = n;
+            mBlockedUs = -1;
+            mReorderUs *= reorderDecay;
+            updateDelay();
+            continue;
+        }
+        
+        // Nothing past the end of what is here, the frame is still arriving.
+        n = 0;
+        while (present((uint16_t)(mHead + n)))
+            n++;
+        if (n == mCount)
+            break;
+        
+        // The hole showed when the first packet past it came in. Frames queued
+        // behind a frame given up on have mostly waited long enough already.
+        uint16_t hole = (uint16_t)(mHead + n);
+        if (mBlockedUs < 0 || mBlockedSeq != hole) {
+            uint16_t next = hole;
+            while (!present(next))
+                next++;
+            mBlockedUs = slot(next).arrivalUs;
+            mBlockedSeq = hole;
+        }
+        if (nowUs - mBlockedUs < mDelayUs)
+            break;
+        
+        skipLost();
+    }
+    
+    return NULL;
+}
+
+int64_t CRtpJitterBuffer::nextDeadline()
+{
+    if (mHolding)
+        return mStartUs + mDelayUs;
+    return mBlockedUs < 0 ? -1 : mBlockedUs + mDelayUs;
+}
@@ -0,0 +1,97 @@
+#ifndef __RTP_JITTER_BUFFER_H__
+#define __RTP_JITTER_BUFFER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include "CRtpPacket.h"
+
+// Sequence-indexed reorder buffer in front of CRtpUnpack. Packets are held, by
+// reference, in a fixed ring of slots and handed out in sequence order a whole frame at a
+// time. A frame with a hole is only given up on once it has been blocked for
+// the playout delay, which follows the measured jitter and reordering, or
+// when a burst runs past the reorder window and there is no room left to
+// wait for it. Whole frames are never dropped to make room.
+
+const int defaultJitterSlots = 1024;
+const int defaultReorderWindow = 512;
+const int defaultMinPlayoutUs = 10000;
+const int defaultMaxPlayoutUs = 200000;
+
+class CRtpJitterBuffer {
+    
+public:
+    CRtpJitterBuffer(int slots = ::defaultJitterSlots);
+    ~CRtpJitterBuffer();
+    
+    // A packet further than window ahead of the playout point makes room:
+    // the whole frames in front of it go out at once, ahead of their turn,
+    // and only a frame with a hole is given up on before its wait is over.
+    void setReorderWindow(int packets);
+    void setPlayoutDelay(int minUs, int maxUs);
+    
+    // Takes a reference to the packet. Duplicates, malformed packets and
+    // packets behind the playout point are dropped, returning false.
+    bool insert(CRtpPacket* packet, int64_t nowUs);
+    bool insert(const uint8_t* data, int length, int64_t nowUs);
+    
+    // Next packet in sequence order, or NULL when none is due. The caller
+    // owns the reference returned.
+    CRtpPacket* pop(int64_t nowUs);
+    
+    // When pop() has to be called again for a blocked frame, or -1.
+    int64_t nextDeadline();
+    
+    void reset();
+    
+    int playoutDelay() { return mDelayUs; }
+    int jitter() { return (int)mJitterUs; }
+    uint32_t lostFrames() { return mLostFrames; }
+    
+private:
+    struct Slot {
+        CRtpPacket* packet;
+        bool marker;
+        uint16_t seq;
+        int64_t arrivalUs;
+    };
+    
+    Slot& slot(uint16_t seq) { return mSlots[seq & mMask]; }
+    bool present(uint16_t seq) { Slot& s = slot(seq); return s.packet != NULL && s.seq == seq; }
+    
+    CRtpPacket* take(uint16_t seq);
+    void release(uint16_t seq);
+    void skipLost();
+    void makeRoom(uint16_t seq);
+    int wholeFrame();
+    void updateDelay();
+    
+    std::vector<Slot> mSlots;
+    uint16_t mMask;
+    int mWindow;
+    
+    bool mStarted;
+    bool mHolding;      // Nothing played out yet, see pop().
+    int64_t mStartUs;
+    uint16_t mHead;     // Next sequence number to play out.
+    uint16_t mHighest;
+    uint32_t mSsrc;
+    int mCount;
+    int mRun;           // Packets left of the frame being released.
+    std::deque<CRtpPacket*> mReady;   // Pushed out by makeRoom(), for pop()
+    
+    int64_t mBlockedUs; // Since when the head frame has had a hole, or -1.
+    uint16_t mBlockedSeq; // The hole, one filled in its turn may leave another.
+    int mMinDelayUs;
+    int mMaxDelayUs;
+    int mDelayUs;
+    double mJitterUs;
+    double mReorderUs;
+    bool mHaveLast;
+    uint32_t mLastTs;
+    int64_t mLastArrivalUs;
+    uint32_t mLostFrames;
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include <cstdint>
+#include <cstdlib>
+#include "CRtpStream.h"
+#include "CRtpLayerFilter.h"
+
+// Where a repair packet keeps the SN base of what it protects, from the
+// start of its payload.
+static const int fecBaseOffset = 8;   // FlexFEC (RFC 8627, 4.2.2.1)
+static const int rsBaseOffset = 0;    // CRtpRsEncoder
+
+static uint16_t load16(const uint8_t* p)
+{
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+CRtpLayerFilter::CRtpLayerFilter()
+    : mMediaSsrc(0)
+    , mVideoPayloadType(96)
+    , mRtxPayloadType(-1)
+    , mFecPayloadType(-1)
+    , mRsPayloadType(-1)
+    , mPendingLayer(::maxTemporalLayers)
+    , mLayer(::maxTemporalLayers)
+    , mLeftOut(0)
+    , mTransportLeftOut(0)
+{
+    Mapping none = { false, false, 0, 0 };
+    mOut.resize(::layerFilterHistory, none);
+    mBack.resize(::layerFilterHistory, none);
+}
+
+void CRtpLayerFilter::setPayloadTypes(int videoPayloadType, int rtxPayloadType, int fecPayloadType, int rsPayloadType)
+{
+    mVideoPayloadType = videoPayloadType;
+    mRtxPayloadType = rtxPayloadType;
+    mFecPayloadType = fecPayloadType;
+    mRsPayloadType = rsPayloadType;
+}
+
+bool CRtpLayerFilter::frameMarking(const CRtpHeader& header, int* layer, bool* start)
+{
+    const uint8_t* field;
+    int length;
+    if (!header.findExtension(::frameMarkingExtId, &field, &length) || length < 1)
+        return false;
+    
+    *layer = field[0] & 0x07;
+    *start = (field[0] & 0x80) != 0;
+    return true;
+}
+
+CRtpPacket* CRtpLayerFilter::filter(CRtpPacket* packet, const CRtpHeader& header)
+{
+    CRtpPacket* out = thin(packet, header);
+    
+    const uint8_t* field;
+    int length;
+    if (!header.findExtension(::transportSeqExtId, &field, &length) || length != 2)
+        return out;
+    if (out == NULL) {
+        mTransportLeftOut++;
+        return NULL;
+    }
+    if (mTransportLeftOut == 0)
+        return out;
+    
+    // At the same place in the packet as in what header was parsed over.
+    int offset = (int)(field - (header.payload() - header.headerLength()));
+    uint16_t seq = (uint16_t)(load16(field) - mTransportLeftOut);
+    if (out == packet) {
+        out = rewrite(packet, offset, seq);
+        packet->release();
+        return out;
+    }
+    uint8_t* p = out->storage() + offset;
+    p[0] = (uint8_t)(seq >> 8);
+    p[1] = (uint8_t)seq;
+    return out;
+}
+
+CRtpPacket* CRtpLayerFilter::thin(CRtpPacket* packet, const CRtpHeader& header)
+{
+    int payloadType = header.payloadType();
+    const uint8_t* payload = header.payload();
+    int headerLength = header.headerLength();
+    
+    if (header.ssrc() == mMediaSsrc && payloadType == mVideoPayloadType) {
+        // Layers change between frames only, never halfway through one.
+        int layer = 0;
+        bool start = false;
+        if (frameMarking(header, &layer, &start) && start)
+            mLayer = mPendingLayer;
+        
+        uint16_t seq = header.seqNo();
+        Mapping& out = mOut[seq & (::layerFilterHistory - 1)];
+        if (layer > mLayer) {
+            Mapping m = { true, false, seq, 0 };
+            out = m;
+            mLeftOut++;
+            return NULL;
+        }
+        
+        uint16_t to = (uint16_t)(seq - mLeftOut);
+        Mapping m = { true, true, seq, to };
+        out = m;
+        Mapping back = { true, true, to, seq };
+        mBack[to & (::layerFilterHistory - 1)] = back;
+        if (to == seq) {
+            packet->retain();
+            return packet;
+        }
+        return rewrite(packet, 2, to);
+    }
+    
+    if (payloadType == mRtxPayloadType && header.payloadLength() >= 2)
+        return mapped(packet, headerLength, load16(payload));
+    
+    int base = payloadType == mFecPayloadType ? ::fecBaseOffset : payloadType == mRsPayloadType ? ::rsBaseOffset : -1;
+    if (base >= 0 && header.csrcCount() > 0 && header.csrc(0) == mMediaSsrc && header.payloadLength() >= base + 2)
+        return mapped(packet, headerLength + base, load16(payload + base));
+    
+    packet->retain();
+    return packet;
+}
+
+CRtpPacket* CRtpLayerFilter::mapped(CRtpPacket* packet, int offset, uint16_t seq)
+{
+    const Mapping& out = mOut[seq & (::layerFilterHistory - 1)];
+    if (!out.valid || out.seq != seq) {
+        // Too old to tell, it only goes as it is while the numbers agree.
+        if (mLeftOut != 0)
+            return NULL;
+        packet->retain();
+        return packet;
+    }
+    
+    if (!out.forwarded)
+        return NULL;
+    if (out.mapped == seq) {
+        packet->retain();
+        return packet;
+    }
+    return rewrite(packet, offset, out.mapped);
+}
+
+CRtpPacket* CRtpLayerFilter::rewrite(CRtpPacket* packet, int offset, uint16_t value)
+{
+    CRtpPacket* copy = CRtpPacket::create(packet->data(), packet->length());
+    uint8_t* p = copy->storage() + offset;
+    p[0] = (uint8_t)(value >> 8);
+    p[1] = (uint8_t)value;
+    return copy;
+}
+
+int CRtpLayerFilter::originalSeqs(uint16_t* seqs, int count) const
+{
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        const Mapping& back = mBack[seqs[i] & (::layerFilterHistory - 1)];
+        if (back.valid && back.seq == seqs[i])
+            seqs[n++] = back.mapped;
+        else if (mLeftOut == 0)
+            seqs[n++] = seqs[i];
+    }
+    return n;
+}
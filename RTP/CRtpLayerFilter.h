@@ -0,0 +1,86 @@
+#ifndef __RTP_LAYER_FILTER_H__
+#define __RTP_LAYER_FILTER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "CRtpHeader.h"
+#include "CRtpPacket.h"
+
+// Thins a temporally layered stream (CRtpStream::setTemporalLayers) for one
+// receiver by leaving out the frames above a layer, without re-encoding.
+//
+// The receiver must not take the frames left out for losses, so media
+// sequence numbers are rewritten to run on without gaps. Everything that
+// names a media sequence number follows: RTX has its original sequence
+// number rewritten, the SN base of a FlexFEC or RS repair packet too (their
+// blocks never span frames), and NACKs coming back are mapped back to the
+// sender's numbers. RTX and repair for frames left out are left out too.
+//
+// Transport-wide sequence numbers (CRtpPacer::setTransportSequence()) run
+// on without gaps the same way, over every packet that carries one. The
+// receiver's transport feedback then counts as lost only what was sent to
+// it, and its bandwidth estimate is not taken down by the layers it does
+// not get.
+//
+// Not thread safe, the owner serializes calls.
+
+const int layerFilterHistory = 4096;   // Sequence numbers mapped, a power of two.
+
+class CRtpLayerFilter {
+
+public:
+    CRtpLayerFilter();
+    
+    void setMediaSsrc(uint32_t ssrc) { mMediaSsrc = ssrc; }
+    void setPayloadTypes(int videoPayloadType, int rtxPayloadType, int fecPayloadType, int rsPayloadType);
+    
+    // Frames of layers above go from the next frame on. maxTemporalLayers
+    // or more lets everything through.
+    void setMaxLayer(int layer) { mPendingLayer = layer; }
+    int maxLayer() const { return mPendingLayer; }
+    
+    // The packet to send on: packet itself retained, a rewritten copy, or
+    // NULL when it is left out. header is parsed over packet.
+    CRtpPacket* filter(CRtpPacket* packet, const CRtpHeader& header);
+    
+    // Sequence numbers the receiver NACKed, mapped back in place to those
+    // the sender knows. Ones it can not map are taken out, returns how many
+    // are left.
+    int originalSeqs(uint16_t* seqs, int count) const;
+    
+    uint32_t leftOut() const { return mLeftOut; }
+    uint16_t transportLeftOut() const { return mTransportLeftOut; }
+    
+    // The temporal layer and start of frame flag of a packet, false when it
+    // carries no frame marking.
+    static bool frameMarking(const CRtpHeader& header, int* layer, bool* start);
+
+private:
+    struct Mapping {
+        bool valid;
+        bool forwarded;
+        uint16_t seq;      // The side it is indexed by
+        uint16_t mapped;   // The other side
+    };
+    
+    CRtpPacket* thin(CRtpPacket* packet, const CRtpHeader& header);
+    CRtpPacket* mapped(CRtpPacket* packet, int offset, uint16_t seq);
+    static CRtpPacket* rewrite(CRtpPacket* packet, int offset, uint16_t value);
+    
+    uint32_t mMediaSsrc;
+    int mVideoPayloadType;
+    int mRtxPayloadType;
+    int mFecPayloadType;
+    int mRsPayloadType;
+    
+    int mPendingLayer;
+    int mLayer;
+    uint32_t mLeftOut;
+    uint16_t mTransportLeftOut;
+    
+    std::vector<Mapping> mOut;    // By the sender's sequence number
+    std::vector<Mapping> mBack;   // By the receiver's
+};
+
+#endif
@@ -0,0 +1,107 @@
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include "CRtpLoopbackTransport.h"
+
+CRtpLoopbackTransport::CRtpLoopbackTransport(int queuePackets)
+    : mPeer(this)
+    , mHead(0)
+    , mTail(0)
+    , mClosed(false)
+{
+    int size = 1;
+    while (size < queuePackets)
+        size <<= 1;
+    mQueue.resize(size, NULL);
+    mMask = size - 1;
+}
+
+CRtpLoopbackTransport::~CRtpLoopbackTransport()
+{
+    for (uint32_t i = mHead; i != mTail; i++)
+        mQueue[i & mMask]->release();
+}
+
+void CRtpLoopbackTransport::connect(CRtpLoopbackTransport* a, CRtpLoopbackTransport* b)
+{
+    a->mPeer = b;
+    b->mPeer = a;
+}
+
+int CRtpLoopbackTransport::send(const uint8_t* const* packets, const int* lengths, int count)
+{
+    // Copied outside the peer's lock, so its receiver waits only for the
+    // pointers to go in
+    CRtpPacket* copies[::maxTransportBatch];
+    int done = 0;
+    while (done < count) {
+        int n = std::min(count - done, ::maxTransportBatch);
+        uint64_t bytes = 0;
+        for (int i = 0; i < n; i++) {
+            copies[i] = CRtpPacket::create(packets[done + i], lengths[done + i]);
+            bytes += lengths[done + i];
+        }
+        
+        int queued = mPeer->put(copies, n);
+        if (queued < 0) {
+            for (int i = 0; i < n; i++)
+                copies[i]->release();
+            return done > 0 ? done : -1;
+        }
+        for (int i = queued; i < n; i++)
+            copies[i]->release();
+        
+        sent(n, bytes, 1);
+        dropped(n - queued);
+        done += n;
+    }
+    return done;
+}
+
+int CRtpLoopbackTransport::put(CRtpPacket* const* packets, int count)
+{
+    int queued = 0;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        if (mClosed)
+            return -1;
+        while (queued < count && mTail - mHead <= mMask)
+            mQueue[mTail++ & mMask] = packets[queued++];
+    }
+    if (queued > 0)
+        mReady.notify_one();
+    return queued;
+}
+
+int CRtpLoopbackTransport::receive(CRtpPacket** packets, int maxCount, int timeoutUs)
+{
+    std::unique_lock<std::mutex> guard(mLock);
+    if (timeoutUs < 0)
+        mReady.wait(guard, [this] { return mClosed || mHead != mTail; });
+    else if (timeoutUs > 0)
+        mReady.wait_for(guard, std::chrono::microseconds(timeoutUs), [this] { return mClosed || mHead != mTail; });
+    if (mHead == mTail)
+        return mClosed ? -1 : 0;
+    
+    int n = 0;
+    uint64_t bytes = 0;
+    while (n < maxCount && mHead != mTail) {
+        CRtpPacket* packet = mQueue[mHead++ & mMask];
+        bytes += packet->length();
+        packets[n++] = packet;
+    }
+    guard.unlock();
+    
+    received(n, bytes, 1);
+    return n;
+}
+
+void CRtpLoopbackTransport::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mClosed = true;
+    }
+    mReady.notify_all();
+}
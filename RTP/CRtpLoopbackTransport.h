@@ -0,0 +1,46 @@
+#ifndef __RTP_LOOPBACK_TRANSPORT_H__
+#define __RTP_LOOPBACK_TRANSPORT_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include "CRtpTransport.h"
+
+// A transport in memory. What one end sends, its peer receives, through a
+// bounded queue that drops what does not fit as a socket buffer would.
+// Unconnected, an end receives what it sends itself. Sends copy each packet
+// once, receives hand out those copies.
+
+const int defaultLoopbackQueue = 4096;   // Packets, a power of two.
+
+class CRtpLoopbackTransport : public CRtpTransport {
+
+public:
+    CRtpLoopbackTransport(int queuePackets = ::defaultLoopbackQueue);
+    ~CRtpLoopbackTransport();
+    
+    // Joins two ends, each receives what the other sends. Not while either
+    // is in use.
+    static void connect(CRtpLoopbackTransport* a, CRtpLoopbackTransport* b);
+    
+    int send(const uint8_t* const* packets, const int* lengths, int count);
+    int receive(CRtpPacket** packets, int maxCount, int timeoutUs);
+    void close();
+
+private:
+    int put(CRtpPacket* const* packets, int count);
+    
+    CRtpLoopbackTransport* mPeer;
+    
+    std::mutex mLock;
+    std::condition_variable mReady;
+    std::vector<CRtpPacket*> mQueue;
+    uint32_t mMask;
+    uint32_t mHead;
+    uint32_t mTail;
+    bool mClosed;
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include "CRtpNackGenerator.h"
+
+// Each packet in order lets the reorder estimate decay by this much.
+static const double reorderDecay = 0.999;
+
+CRtpNackGenerator::CRtpNackGenerator()
+    : mStarted(false)
+    , mHighest(0)
+    , mReorderUs(0)
+    , mRttUs(::defaultRttUs)
+    , mMinDelayUs(::minNackDelayUs)
+    , mMaxAgeUs(1000000)
+    , mRecovered(0)
+    , mAbandoned(0)
+{
+}
+
+int CRtpNackGenerator::reorderDelay()
+{
+    return std::max(mMinDelayUs, (int)(1.5 * mReorderUs));
+}
+
+void CRtpNackGenerator::packetIn(uint16_t seq, int64_t nowUs)
+{
+    if (!mStarted) {
+        mStarted = true;
+        mHighest = seq;
+        return;
+    }
+    
+    int16_t diff = (int16_t)(seq - mHighest);
+    if (diff > 0) {
+        if (diff > ::maxNackMissing) {
+            mAbandoned += (uint32_t)mMissing.size();
+            mMissing.clear();
+        }
+        else {
+            for (uint16_t s = (uint16_t)(mHighest + 1); s != seq; s++) {
+                Missing m = { s, nowUs, -1, 0 };
+                mMissing.push_back(m);
+            }
+            while ((int)mMissing.size() > ::maxNackMissing) {
+                mMissing.pop_front();
+                mAbandoned++;
+            }
+        }
+        mHighest = seq;
+        mReorderUs *= reorderDecay;
+        return;
+    }
+    
+    for (std::deque<Missing>::iterator it = mMissing.begin(); it != mMissing.end(); ++it) {
+        if (it->seq != seq)
+            continue;
+        
+        // Late before it was asked for, it was reordered. After that it may
+        // as well be the retransmission.
+        if (it->tries == 0)
+            mReorderUs = std::max(mReorderUs, (double)(nowUs - it->seenUs));
+        else
+            mRecovered++;
+        
+        mMissing.erase(it);
+        break;
+    }
+}
+
+int64_t CRtpNackGenerator::dueUs(const Missing& m)
+{
+    if (m.tries == 0)
+        return m.seenUs + reorderDelay();
+    return m.sentUs + mRttUs;
+}
+
+int CRtpNackGenerator::collect(int64_t nowUs, uint16_t* seqs, int max)
+{
+    int n = 0;
+    std::deque<Missing>::iterator it = mMissing.begin();
+    while (it != mMissing.end()) {
+        if (it->tries >= ::maxNackTries || nowUs - it->seenUs > mMaxAgeUs) {
+            it = mMissing.erase(it);
+            mAbandoned++;
+            continue;
+        }
+        
+        if (n < max && nowUs >= dueUs(*it)) {
+            seqs[n++] = it->seq;
+            it->sentUs = nowUs;
+            it->tries++;
+        }
+        ++it;
+    }
+    return n;
+}
+
+int64_t CRtpNackGenerator::nextDeadline()
+{
+    int64_t next = -1;
+    for (size_t i = 0; i < mMissing.size(); i++) {
+        // Past the last try that is when it is given up on.
+        int64_t due = dueUs(mMissing[i]);
+        if (next < 0 || due < next)
+            next = due;
+    }
+    return next;
+}
+
+bool CRtpNackGenerator::isRequested(uint16_t seq)
+{
+    for (size_t i = 0; i < mMissing.size(); i++) {
+        if (mMissing[i].seq == seq)
+            return mMissing[i].tries > 0;
+    }
+    return false;
+}
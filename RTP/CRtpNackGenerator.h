@@ -0,0 +1,69 @@
+#ifndef __RTP_NACK_GENERATOR_H__
+#define __RTP_NACK_GENERATOR_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+
+// Receiver side of retransmission for one source. Tracks the sequence
+// numbers that are missing and says when to NACK them: not before a hole
+// has outlived the reordering seen lately, then again every round trip for
+// a few tries.
+
+const int defaultRttUs = 100000;
+const int minNackDelayUs = 2000;
+const int maxNackTries = 3;
+const int maxNackMissing = 512;   // A larger hole is left to a keyframe request.
+
+class CRtpNackGenerator {
+    
+public:
+    CRtpNackGenerator();
+    
+    void setRtt(int us) { mRttUs = us; }
+    void setMaxAge(int us) { mMaxAgeUs = us; }
+    // Holes are left this long at least, for a repair that comes without
+    // asking (FEC).
+    void setMinDelay(int us) { mMinDelayUs = us; }
+    
+    // Every packet of the source, originals and retransmissions alike.
+    void packetIn(uint16_t seq, int64_t nowUs);
+    
+    // Fills seqs with up to max sequence numbers due for a NACK at nowUs, in
+    // sequence order, and counts them as asked for.
+    int collect(int64_t nowUs, uint16_t* seqs, int max);
+    
+    // When collect() has something next, or -1.
+    int64_t nextDeadline();
+    
+    // A hole already NACKed, which a retransmission would fill.
+    bool isRequested(uint16_t seq);
+    
+    int reorderDelay();
+    uint32_t packetsRecovered() const { return mRecovered; }
+    uint32_t packetsAbandoned() const { return mAbandoned; }
+    
+private:
+    struct Missing {
+        uint16_t seq;
+        int64_t seenUs;   // When the hole showed.
+        int64_t sentUs;   // Last NACK, or -1.
+        int tries;
+    };
+    
+    int64_t dueUs(const Missing& m);
+    
+    std::deque<Missing> mMissing;
+    bool mStarted;
+    uint16_t mHighest;
+    
+    double mReorderUs;
+    int mRttUs;
+    int mMinDelayUs;
+    int mMaxAgeUs;
+    
+    uint32_t mRecovered;
+    uint32_t mAbandoned;
+};
+
+#endif
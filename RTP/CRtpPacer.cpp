@@ -0,0 +1,332 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "CRtpHeader.h"
+#include "CRtpPacer.h"
+
+CRtpPacer::CRtpPacer(CRtpStreamOutBatchCallback* callback, void *callbackRefCon)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mRunning(false)
+    , mQueuedBytes(0)
+    , mHistory(NULL)
+    , mTransportSeqOn(false)
+    , mSentCallback(NULL)
+    , mSentRef(NULL)
+    , mTransportSeq(0)
+    , mFrameIntervalUs(1000000 / 20)
+    , mBurstFraction(::defaultBurstFraction)
+    , mTargetBitrate(0)
+    , mPacingFactor(::defaultPacingFactor)
+    , mRate(0)
+    , mTokens(0)
+    , mLastUs(-1)
+{
+}
+
+CRtpPacer::~CRtpPacer()
+{
+    stop();
+    
+    for (size_t i = 0; i < mQueue.size(); i++)
+        mQueue[i].packet->release();
+    for (size_t i = 0; i < mRtxQueue.size(); i++)
+        mRtxQueue[i].packet->release();
+}
+
+int64_t CRtpPacer::nowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CRtpPacer::setFrameRate(int fps)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (fps > 0)
+        mFrameIntervalUs = 1000000 / fps;
+}
+
+void CRtpPacer::setBurstFraction(float fraction)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mBurstFraction = std::min(std::max(fraction, 0.05f), 1.0f);
+}
+
+void CRtpPacer::setTargetBitrate(int bitrate)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mTargetBitrate = bitrate;
+}
+
+void CRtpPacer::setPacingFactor(float factor)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mPacingFactor = factor;
+}
+
+void CRtpPacer::setHistory(CRtpPacketHistory* history)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mHistory = history;
+}
+
+void CRtpPacer::setTransportSequence(CRtpPacketSentCallback* callback, void *callbackRefCon)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mTransportSeqOn = true;
+    mSentCallback = callback;
+    mSentRef = callbackRefCon;
+}
+
+int CRtpPacer::queuedPackets()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return (int)(mQueue.size() + mRtxQueue.size());
+}
+
+int CRtpPacer::queuedBytes()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    return mQueuedBytes;
+}
+
+void CRtpPacer::packetsIn(void *pacerRef, const uint8_t* const* packets, const int* lengths, int count)
+{
+    CRtpPacer* pacer = (CRtpPacer*)pacerRef;
+    pacer->enqueue(packets, lengths, count, nowUs());
+}
+
+void CRtpPacer::updateRate()
+{
+    // Fast enough to drain what is queued within the burst window, and never
+    // slower than the pacing rate.
+    double window = mFrameIntervalUs * mBurstFraction;
+    double rate = mQueuedBytes / window;
+    double floor = mTargetBitrate * mPacingFactor / 8 / 1e6;
+    mRate = std::max(rate, floor);
+}
+
+CRtpPacket* CRtpPacer::withTransportSeq(const uint8_t* data, int length)
+{
+    int off = length >= 12 ? 12 + 4 * (data[0] & 0x0f) : length + 1;
+    if (off > length)
+        return CRtpPacket::create(data, length);
+    
+    if ((data[0] & 0x10) != 0) {
+        // A one-byte extension gets the element as a word of its own at the
+        // end, one of another form goes out without.
+        if (off + 4 > length || ((data[off] << 8) | data[off + 1]) != ::rtpOneByteExtProfile)
+            return CRtpPacket::create(data, length);
+        int words = (data[off + 2] << 8) | data[off + 3];
+        int end = off + 4 + 4 * words;
+        if (end > length)
+            return CRtpPacket::create(data, length);
+        
+        CRtpPacket* packet = CRtpPacket::create(length + 4);
+        uint8_t* p = packet->storage();
+        memcpy(p, data, end);
+        p[off + 2] = (uint8_t)((words + 1) >> 8);
+        p[off + 3] = (uint8_t)(words + 1);
+        p[end] = (uint8_t)((::transportSeqExtId << 4) | 1);
+        p[end + 1] = p[end + 2] = p[end + 3] = 0;
+        memcpy(p + end + 4, data + end, length - end);
+        return packet;
+    }
+    
+    // Room for the sequence number behind the CSRCs, filled in on the way
+    // out.
+    CRtpPacket* packet = CRtpPacket::create(length + ::transportSeqExtLength);
+    uint8_t* p = packet->storage();
+    memcpy(p, data, off);
+    p[0] |= 0x10;
+    p[off] = (uint8_t)(::rtpOneByteExtProfile >> 8);
+    p[off + 1] = (uint8_t)::rtpOneByteExtProfile;
+    p[off + 2] = 0;
+    p[off + 3] = 1;
+    p[off + 4] = (uint8_t)((::transportSeqExtId << 4) | 1);
+    p[off + 5] = p[off + 6] = p[off + 7] = 0;
+    memcpy(p + off + ::transportSeqExtLength, data + off, length - off);
+    return packet;
+}
+
+int CRtpPacer::stampTransportSeq(Queued& queued)
+{
+    CRtpHeader header;
+    const uint8_t* field;
+    int length;
+    if (!header.parse(queued.packet->data(), queued.packet->length()) ||
+        !header.findExtension(::transportSeqExtId, &field, &length) || length != 2)
+        return -1;
+    
+    // A retransmission may share its bytes with the history, it goes out
+    // as a copy.
+    int off = (int)(field - queued.packet->data());
+    if (queued.retransmission || queued.packet->storage() == NULL) {
+        CRtpPacket* copy = CRtpPacket::create(queued.packet->data(), queued.packet->length());
+        queued.packet->release();
+        queued.packet = copy;
+    }
+    
+    uint16_t seq = mTransportSeq++;
+    uint8_t* p = queued.packet->storage() + off;
+    p[0] = (uint8_t)(seq >> 8);
+    p[1] = (uint8_t)seq;
+    return seq;
+}
+
+void CRtpPacer::enqueue(const uint8_t* const* packets, const int* lengths, int count, int64_t nowUs)
+{
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        
+        // The copy made here is the one the history keeps once sent.
+        for (int i = 0; i < count; i++) {
+            CRtpPacket* packet = mTransportSeqOn ? withTransportSeq(packets[i], lengths[i])
+                                                 : CRtpPacket::create(packets[i], lengths[i]);
+            Queued q = { packet, false };
+            mQueue.push_back(q);
+            mQueuedBytes += packet->length();
+        }
+        
+        if (mLastUs < 0) {
+            mTokens = ::maxRtpMtu;
+            mLastUs = nowUs;
+        }
+        updateRate();
+    }
+    mWakeup.notify_one();
+}
+
+void CRtpPacer::retransmissionIn(void *pacerRef, CRtpPacket* packet)
+{
+    CRtpPacer* pacer = (CRtpPacer*)pacerRef;
+    pacer->enqueueRetransmission(packet, nowUs());
+}
+
+void CRtpPacer::enqueueRetransmission(CRtpPacket* packet, int64_t nowUs)
+{
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        
+        packet->retain();
+        Queued q = { packet, true };
+        mRtxQueue.push_back(q);
+        mQueuedBytes += packet->length();
+        
+        if (mLastUs < 0) {
+            mTokens = ::maxRtpMtu;
+            mLastUs = nowUs;
+        }
+        updateRate();
+    }
+    mWakeup.notify_one();
+}
+
+int64_t CRtpPacer::process(int64_t nowUs)
+{
+    int64_t next = -1;
+    
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        
+        if (mLastUs >= 0 && nowUs > mLastUs) {
+            double depth = std::max(mRate * ::maxPacerBurstUs, (double)::maxRtpMtu);
+            mTokens = std::min(mTokens + mRate * (nowUs - mLastUs), depth);
+        }
+        mLastUs = std::max(mLastUs, nowUs);
+        
+        // A packet may go as long as there is credit left, the bucket runs
+        // into debt by at most one packet.
+        while ((!mQueue.empty() || !mRtxQueue.empty()) && mTokens > 0) {
+            // A retransmission is late already, it goes first.
+            std::deque<Queued>& queue = mRtxQueue.empty() ? mQueue : mRtxQueue;
+            int len = queue.front().packet->length();
+            mTokens -= len;
+            mQueuedBytes -= len;
+            
+            mOutPackets.push_back(queue.front());
+            mOutSeqs.push_back(mTransportSeqOn ? stampTransportSeq(mOutPackets.back()) : -1);
+            queue.pop_front();
+        }
+        
+        if ((!mQueue.empty() || !mRtxQueue.empty()) && mRate > 0)
+            next = mLastUs + (int64_t)(-mTokens / mRate) + 1;
+    }
+    
+    if (!mOutPackets.empty()) {
+        mOutPtrs.resize(mOutPackets.size());
+        mOutLengths.resize(mOutPackets.size());
+        for (size_t i = 0; i < mOutPackets.size(); i++) {
+            mOutPtrs[i] = mOutPackets[i].packet->data();
+            mOutLengths[i] = mOutPackets[i].packet->length();
+        }
+        
+        mCallback(mCallbackRef, mOutPtrs.data(), mOutLengths.data(), (int)mOutPackets.size());
+        
+        for (size_t i = 0; i < mOutPackets.size(); i++) {
+            if (mOutSeqs[i] >= 0 && mSentCallback != NULL)
+                mSentCallback(mSentRef, (uint16_t)mOutSeqs[i], mOutLengths[i], nowUs);
+        }
+        
+        std::lock_guard<std::mutex> guard(mLock);
+        for (size_t i = 0; i < mOutPackets.size(); i++) {
+            if (mHistory != NULL && !mOutPackets[i].retransmission)
+                mHistory->put(mOutPackets[i].packet, nowUs);
+            mOutPackets[i].packet->release();
+        }
+        mOutPackets.clear();
+        mOutSeqs.clear();
+    }
+    
+    return next;
+}
+
+void CRtpPacer::start()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mRunning)
+        return;
+    
+    mRunning = true;
+    mThread = std::thread(&CRtpPacer::run, this);
+}
+
+void CRtpPacer::stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        if (!mRunning)
+            return;
+        mRunning = false;
+    }
+    
+    mWakeup.notify_one();
+    mThread.join();
+}
+
+void CRtpPacer::run()
+{
+    int64_t next = -1;
+    
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            if (next < 0) {
+                mWakeup.wait(lock, [this] { return !mRunning || !mQueue.empty() || !mRtxQueue.empty(); });
+            }
+            else {
+                int64_t wait = next - nowUs();
+                if (wait > 0)
+                    mWakeup.wait_for(lock, std::chrono::microseconds(wait));
+            }
+            
+            if (!mRunning)
+                break;
+        }
+        
+        next = process(nowUs());
+    }
+}
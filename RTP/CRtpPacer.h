@@ -0,0 +1,117 @@
+#ifndef __RTP_PACER_H__
+#define __RTP_PACER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "CRtpStream.h"
+#include "CRtpPacket.h"
+#include "CRtpPacketHistory.h"
+
+// Token bucket between the packetizer and the transport. The packets of a
+// frame are spread over a fraction of the frame interval instead of leaving
+// back to back, at no less than the target bitrate times the pacing factor.
+
+const float defaultBurstFraction = 0.5f;
+const float defaultPacingFactor = 2.5f;
+const int maxPacerBurstUs = 5000; // Bucket depth, in time at the current rate.
+
+// A packet went out stamped with transport-wide sequence number seq.
+typedef void CRtpPacketSentCallback(void *callbackRefCon, uint16_t seq, int length, int64_t sendUs);
+
+class CRtpPacer {
+    
+public:
+    // Paced packets go out through a batch callback, several at a time when
+    // more than one is due.
+    CRtpPacer(CRtpStreamOutBatchCallback* callback, void *callbackRefCon);
+    ~CRtpPacer();
+    
+    void setFrameRate(int fps);
+    void setBurstFraction(float fraction);
+    void setTargetBitrate(int bitrate);
+    void setPacingFactor(float factor);
+    
+    // Queues the packets of one frame, copying them. Matches
+    // CRtpStreamOutBatchCallback so a CRtpStream can feed the pacer directly.
+    static void packetsIn(void *pacerRef, const uint8_t* const* packets, const int* lengths, int count);
+    void enqueue(const uint8_t* const* packets, const int* lengths, int count, int64_t nowUs);
+    
+    // Retransmissions go ahead of the media queue, taking a reference.
+    static void retransmissionIn(void *pacerRef, CRtpPacket* packet);
+    void enqueueRetransmission(CRtpPacket* packet, int64_t nowUs);
+    
+    // Media packets are recorded here as they go out. Not owned.
+    void setHistory(CRtpPacketHistory* history);
+    
+    // Stamps a transport-wide sequence number on every packet as it goes
+    // out, repair packets and retransmissions too, and reports each to
+    // callback for the bandwidth estimate. In a packet with a one-byte
+    // extension of its own it goes behind the other elements, packets with
+    // a two-byte extension go out without. callback may be NULL where the
+    // packets are renumbered and reported further on, per receiver by
+    // CRtpFanout.
+    void setTransportSequence(CRtpPacketSentCallback* callback, void *callbackRefCon);
+    
+    // Sends whatever the bucket allows at nowUs and returns the time of the
+    // next send, or -1 with nothing queued. Drives the pacer without a thread,
+    // e.g. from a simulated clock.
+    int64_t process(int64_t nowUs);
+    
+    // Or let the pacer drain itself on its own thread.
+    void start();
+    void stop();
+    
+    int queuedPackets();
+    int queuedBytes();
+    
+    static int64_t nowUs();
+    
+private:
+    void updateRate();
+    void run();
+    CRtpPacket* withTransportSeq(const uint8_t* data, int length);
+
+    CRtpStreamOutBatchCallback* mCallback;
+    void *mCallbackRef;
+    
+    std::mutex mLock;
+    std::condition_variable mWakeup;
+    std::thread mThread;
+    bool mRunning;
+    
+    struct Queued {
+        CRtpPacket* packet;
+        bool retransmission;
+    };
+    int stampTransportSeq(Queued& queued);
+    
+    std::deque<Queued> mQueue;
+    std::deque<Queued> mRtxQueue;
+    int mQueuedBytes;
+    CRtpPacketHistory* mHistory;
+    bool mTransportSeqOn;
+    CRtpPacketSentCallback* mSentCallback;
+    void *mSentRef;
+    uint16_t mTransportSeq;
+    
+    std::vector<Queued> mOutPackets;
+    std::vector<int> mOutSeqs;
+    std::vector<const uint8_t*> mOutPtrs;
+    std::vector<int> mOutLengths;
+    
+    int mFrameIntervalUs;
+    float mBurstFraction;
+    int mTargetBitrate;
+    float mPacingFactor;
+    
+    double mRate;   // bytes per microsecond
+    double mTokens; // bytes
+    int64_t mLastUs;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "CRtpPacket.h"
+
+CRtpPacket::CRtpPacket(const uint8_t* data, int length)
+    : mRefs(1)
+    , mData(data)
+    , mLength(length)
+    , mStorage(NULL)
+    , mFree(NULL)
+    , mFreeRef(NULL)
+{
+}
+
+CRtpPacket::~CRtpPacket()
+{
+    if (mFree)
+        mFree(mFreeRef);
+    delete [] mStorage;
+}
+
+CRtpPacket* CRtpPacket::create(const uint8_t* data, int length)
+{
+    uint8_t* storage = new uint8_t[length];
+    memcpy(storage, data, length);
+    
+    CRtpPacket* packet = new CRtpPacket(storage, length);
+    packet->mStorage = storage;
+    return packet;
+}
+
+CRtpPacket* CRtpPacket::create(int length)
+{
+    uint8_t* storage = new uint8_t[length];
+    
+    CRtpPacket* packet = new CRtpPacket(storage, length);
+    packet->mStorage = storage;
+    return packet;
+}
+
+CRtpPacket* CRtpPacket::wrap(const uint8_t* data, int length, FreeCallback* free, void *ref)
+{
+    CRtpPacket* packet = new CRtpPacket(data, length);
+    packet->mFree = free;
+    packet->mFreeRef = ref;
+    return packet;
+}
+
+void CRtpPacket::release()
+{
+    if (mRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
@@ -0,0 +1,47 @@
+#ifndef __RTP_PACKET_H__
+#define __RTP_PACKET_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+
+// Reference-counted packet. Lets the jitter buffer and the depacketizer keep
+// received packets, and frames point into them, and the sender's history
+// keep sent ones, without copying.
+
+class CRtpPacket {
+    
+public:
+    typedef void FreeCallback(void *ref);
+    
+    // A packet owning a copy of data.
+    static CRtpPacket* create(const uint8_t* data, int length);
+    // A packet owning length bytes, to be filled through storage().
+    static CRtpPacket* create(int length);
+    // A packet over memory owned elsewhere, free is called with ref once the
+    // last reference is gone.
+    static CRtpPacket* wrap(const uint8_t* data, int length, FreeCallback* free, void *ref);
+    
+    void retain() { mRefs.fetch_add(1, std::memory_order_relaxed); }
+    void release();
+    
+    const uint8_t* data() const { return mData; }
+    int length() const { return mLength; }
+    // The bytes of a packet that owns them, NULL for a wrapped one.
+    uint8_t* storage() { return mStorage; }
+    
+private:
+    CRtpPacket(const uint8_t* data, int length);
+    ~CRtpPacket();
+    CRtpPacket(const CRtpPacket&);
+    CRtpPacket& operator=(const CRtpPacket&);
+    
+    std::atomic<int> mRefs;
+    const uint8_t* mData;
+    int mLength;
+    uint8_t* mStorage;
+    FreeCallback* mFree;
+    void *mFreeRef;
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include <cstdint>
+#include <cstdlib>
+#include "CRtpPacketHistory.h"
+
+CRtpPacketHistory::CRtpPacketHistory(int packets)
+    : mFiltered(false)
+    , mSsrc(0)
+    , mMaxAgeUs(::defaultHistoryAgeUs)
+    , mMinResendUs(0)
+{
+    int n = 64;
+    while (n < packets && n < 32768)
+        n <<= 1;
+    
+    Slot empty = { NULL, 0, 0, 0 };
+    mSlots.resize(n, empty);
+    mMask = (uint16_t)(n - 1);
+}
+
+CRtpPacketHistory::~CRtpPacketHistory()
+{
+    clear();
+}
+
+void CRtpPacketHistory::clear()
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    for (size_t i = 0; i < mSlots.size(); i++) {
+        if (mSlots[i].packet)
+            mSlots[i].packet->release();
+        mSlots[i].packet = NULL;
+    }
+}
+
+void CRtpPacketHistory::setSsrc(uint32_t ssrc)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mFiltered = true;
+    mSsrc = ssrc;
+}
+
+void CRtpPacketHistory::put(CRtpPacket* packet, int64_t nowUs)
+{
+    if (packet->length() < 12)
+        return;
+    
+    const uint8_t* p = packet->data();
+    uint16_t seq = (uint16_t)((p[2] << 8) | p[3]);
+    uint32_t ssrc = ((uint32_t)p[8] << 24) | ((uint32_t)p[9] << 16) | ((uint32_t)p[10] << 8) | p[11];
+    
+    std::lock_guard<std::mutex> guard(mLock);
+    if (mFiltered && ssrc != mSsrc)
+        return;
+    
+    packet->retain();
+    Slot& s = mSlots[seq & mMask];
+    if (s.packet)
+        s.packet->release();
+    s.packet = packet;
+    s.seq = seq;
+    s.sentUs = nowUs;
+    s.resentUs = -1;
+}
+
+CRtpPacket* CRtpPacketHistory::get(uint16_t seq, int64_t nowUs)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    Slot& s = mSlots[seq & mMask];
+    if (s.packet == NULL || s.seq != seq || nowUs - s.sentUs > mMaxAgeUs)
+        return NULL;
+    
+    // The first retransmission may still be on its way.
+    if (s.resentUs >= 0 && nowUs - s.resentUs < mMinResendUs)
+        return NULL;
+    
+    s.resentUs = nowUs;
+    s.packet->retain();
+    return s.packet;
+}
@@ -0,0 +1,54 @@
+#ifndef __RTP_PACKET_HISTORY_H__
+#define __RTP_PACKET_HISTORY_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include "CRtpPacket.h"
+
+// The packets a sender has put on the wire lately, kept by reference in a
+// ring indexed by sequence number so a NACK can have them sent again.
+
+const int defaultHistoryPackets = 1024;
+const int defaultHistoryAgeUs = 1000000;
+
+class CRtpPacketHistory {
+    
+public:
+    CRtpPacketHistory(int packets = ::defaultHistoryPackets);
+    ~CRtpPacketHistory();
+    
+    // Keeps a reference to a packet just sent, under its RTP sequence number.
+    void put(CRtpPacket* packet, int64_t nowUs);
+    
+    // The packet sent as seq, retained for the caller, or NULL when it has
+    // aged out or was already resent within minResendUs.
+    CRtpPacket* get(uint16_t seq, int64_t nowUs);
+    
+    // Only packets of this source are kept, parity and probe packets share
+    // the pacer but not the sequence space.
+    void setSsrc(uint32_t ssrc);
+    
+    void setMaxAge(int us) { mMaxAgeUs = us; }
+    void setMinResendInterval(int us) { mMinResendUs = us; }
+    void clear();
+    
+private:
+    struct Slot {
+        CRtpPacket* packet;
+        uint16_t seq;
+        int64_t sentUs;
+        int64_t resentUs;
+    };
+    
+    std::mutex mLock;
+    std::vector<Slot> mSlots;
+    uint16_t mMask;
+    bool mFiltered;
+    uint32_t mSsrc;
+    int mMaxAgeUs;
+    int mMinResendUs;
+};
+
+#endif
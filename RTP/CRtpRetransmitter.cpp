@@ -0,0 +1,95 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include "CRtpHeader.h"
+#include "CRtpPacer.h"
+#include "CRtpRetransmitter.h"
+
+static void freeRtxBuffer(void *ref)
+{
+    delete [] (uint8_t*)ref;
+}
+
+CRtpRetransmitter::CRtpRetransmitter(CRtpPacketHistory* history, CRtpPacketOutCallback* callback, void *callbackRefCon)
+    : mHistory(history)
+    , mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mMediaSsrc(0)
+    , mRtx(false)
+    , mRtxPayloadType(::defaultRtxPayloadType)
+    , mResent(0)
+    , mMissed(0)
+{
+    // The RTX stream has its own random SSRC and sequence space.
+    std::random_device rd;
+    mRtxSsrc = rd();
+    mRtxSeqNo = (uint16_t)rd();
+}
+
+void CRtpRetransmitter::setRtx(int payloadType)
+{
+    mRtx = true;
+    mRtxPayloadType = payloadType;
+}
+
+void CRtpRetransmitter::nackIn(void *retransmitterRef, uint32_t, uint32_t mediaSsrc, const uint16_t* seqs, int count)
+{
+    CRtpRetransmitter* retransmitter = (CRtpRetransmitter*)retransmitterRef;
+    retransmitter->resend(mediaSsrc, seqs, count, CRtpPacer::nowUs());
+}
+
+void CRtpRetransmitter::resend(uint32_t mediaSsrc, const uint16_t* seqs, int count, int64_t nowUs)
+{
+    if (mediaSsrc != mMediaSsrc)
+        return;
+    
+    for (int i = 0; i < count; i++) {
+        CRtpPacket* packet = mHistory->get(seqs[i], nowUs);
+        if (packet == NULL) {
+            mMissed++;
+            continue;
+        }
+        
+        if (mRtx) {
+            CRtpPacket* rtx = wrapRtx(packet);
+            packet->release();
+            packet = rtx;
+            if (packet == NULL)
+                continue;
+        }
+        
+        mCallback(mCallbackRef, packet);
+        packet->release();
+        mResent++;
+    }
+}
+
+CRtpPacket* CRtpRetransmitter::wrapRtx(CRtpPacket* packet)
+{
+    CRtpHeader header;
+    if (!header.parse(packet->data(), packet->length()))
+        return NULL;
+    
+    // Same header but for the payload type, sequence number and SSRC, and
+    // no padding. The original sequence number leads the payload (RFC 4588, 4).
+    int headerLength = header.headerLength();
+    int length = headerLength + 2 + header.payloadLength();
+    uint8_t* buf = new uint8_t[length];
+    
+    memcpy(buf, packet->data(), headerLength);
+    buf[0] &= ~0x20;
+    buf[1] = (uint8_t)((buf[1] & 0x80) | mRtxPayloadType);
+    buf[2] = (uint8_t)(mRtxSeqNo >> 8);
+    buf[3] = (uint8_t)mRtxSeqNo;
+    buf[8] = (uint8_t)(mRtxSsrc >> 24);
+    buf[9] = (uint8_t)(mRtxSsrc >> 16);
+    buf[10] = (uint8_t)(mRtxSsrc >> 8);
+    buf[11] = (uint8_t)mRtxSsrc;
+    buf[headerLength] = (uint8_t)(header.seqNo() >> 8);
+    buf[headerLength + 1] = (uint8_t)header.seqNo();
+    memcpy(buf + headerLength + 2, header.payload(), header.payloadLength());
+    mRtxSeqNo++;
+    
+    return CRtpPacket::wrap(buf, length, freeRtxBuffer, buf);
+}
@@ -0,0 +1,55 @@
+#ifndef __RTP_RETRANSMITTER_H__
+#define __RTP_RETRANSMITTER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include "CRtpPacket.h"
+#include "CRtpPacketHistory.h"
+
+// Answers NACKs from the packet history. Packets are resent as they were,
+// in-band, or wrapped into an RTX stream of their own (RFC 4588) so the
+// receiver can tell them from the originals in its loss and jitter figures.
+
+const int defaultRtxPayloadType = 97;
+
+// A packet to be sent, the callee takes its own reference if it keeps it.
+typedef void CRtpPacketOutCallback(void *callbackRefCon, CRtpPacket* packet);
+
+class CRtpRetransmitter {
+    
+public:
+    CRtpRetransmitter(CRtpPacketHistory* history, CRtpPacketOutCallback* callback, void *callbackRefCon);
+    
+    // Only NACKs naming this source are answered.
+    void setMediaSsrc(uint32_t ssrc) { mMediaSsrc = ssrc; }
+    uint32_t mediaSsrc() const { return mMediaSsrc; }
+    
+    // Resend on an RTX stream instead of in-band.
+    void setRtx(int payloadType = ::defaultRtxPayloadType);
+    uint32_t rtxSsrc() const { return mRtxSsrc; }
+    
+    // Matches CRtcpNackCallback, so CRtcpParser can feed it directly.
+    static void nackIn(void *retransmitterRef, uint32_t senderSsrc, uint32_t mediaSsrc, const uint16_t* seqs, int count);
+    void resend(uint32_t mediaSsrc, const uint16_t* seqs, int count, int64_t nowUs);
+    
+    uint32_t packetsResent() const { return mResent; }
+    uint32_t packetsMissed() const { return mMissed; }
+    
+private:
+    CRtpPacket* wrapRtx(CRtpPacket* packet);
+    
+    CRtpPacketHistory* mHistory;
+    CRtpPacketOutCallback* mCallback;
+    void *mCallbackRef;
+    
+    uint32_t mMediaSsrc;
+    bool mRtx;
+    int mRtxPayloadType;
+    uint32_t mRtxSsrc;
+    uint16_t mRtxSeqNo;
+    
+    uint32_t mResent;
+    uint32_t mMissed;
+};
+
+#endif
@@ -0,0 +1,305 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include "CGf256.h"
+#include "CRtpHeader.h"
+#include "CRtpRsDecoder.h"
+
+static uint16_t load16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static void store16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+static void store32(uint8_t* p, uint32_t v) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+
+static void freeRsBuffer(void *ref)
+{
+    delete [] (uint8_t*)ref;
+}
+
+// Blocks starting this far behind the newest packet can no longer be
+// decoded, some of their packets have left the ring.
+static const int maxBlockAge = ::rsMediaPackets - 256;
+
+CRtpRsDecoder::CRtpRsDecoder(uint32_t mediaSsrc)
+    : mMediaSsrc(mediaSsrc)
+    , mHighest(0)
+    , mStarted(false)
+    , mLagUs(0)
+    , mRecovered(0)
+{
+    Slot empty = { NULL, 0, 0 };
+    mMedia.resize(::rsMediaPackets, empty);
+}
+
+CRtpRsDecoder::~CRtpRsDecoder()
+{
+    for (size_t i = 0; i < mMedia.size(); i++) {
+        if (mMedia[i].packet)
+            mMedia[i].packet->release();
+    }
+    while (!mPending.empty())
+        drop(mPending.size() - 1);
+    for (size_t i = 0; i < mRecoveredPackets.size(); i++)
+        mRecoveredPackets[i]->release();
+}
+
+bool CRtpRsDecoder::present(uint16_t seq) const
+{
+    const Slot& s = mMedia[seq % ::rsMediaPackets];
+    return s.packet != NULL && s.seq == seq;
+}
+
+void CRtpRsDecoder::put(CRtpPacket* packet, uint16_t seq, int64_t nowUs)
+{
+    packet->retain();
+    Slot& s = mMedia[seq % ::rsMediaPackets];
+    if (s.packet)
+        s.packet->release();
+    s.packet = packet;
+    s.seq = seq;
+    s.arrivalUs = nowUs;
+    
+    if (!mStarted || (int16_t)(seq - mHighest) > 0)
+        mHighest = seq;
+    mStarted = true;
+}
+
+void CRtpRsDecoder::drop(size_t index)
+{
+    Block& block = mPending[index];
+    for (size_t i = 0; i < block.repairs.size(); i++) {
+        if (block.repairs[i])
+            block.repairs[i]->release();
+    }
+    mPending.erase(mPending.begin() + index);
+}
+
+void CRtpRsDecoder::expire()
+{
+    for (size_t i = 0; i < mPending.size(); ) {
+        if ((int16_t)(mHighest - mPending[i].base) > ::maxBlockAge)
+            drop(i);
+        else
+            i++;
+    }
+}
+
+void CRtpRsDecoder::mediaIn(CRtpPacket* packet, uint16_t seq, int64_t nowUs)
+{
+    if (present(seq))
+        return;
+    put(packet, seq, nowUs);
+    expire();
+    
+    for (size_t i = 0; i < mPending.size(); ) {
+        Block& block = mPending[i];
+        if ((uint16_t)(seq - block.base) >= block.k) {
+            i++;
+            continue;
+        }
+        
+        block.present++;
+        if (block.present == block.k) {
+            drop(i);
+            continue;
+        }
+        if (block.present + block.received >= block.k) {
+            decode(block, nowUs);
+            drop(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+bool CRtpRsDecoder::fecIn(CRtpPacket* packet, int64_t nowUs)
+{
+    CRtpHeader header;
+    if (!header.parse(packet->data(), packet->length()) || header.csrcCount() < 1)
+        return false;
+    
+    const uint8_t* h = header.payload();
+    int length = header.payloadLength();
+    if (length < ::rsHeaderLength + ::rsSymbolHeader)
+        return false;
+    
+    uint16_t base = load16(h);
+    int k = h[2], m = h[3], index = h[4];
+    int symbolLength = load16(h + 6);
+    if (k < 1 || m < 1 || index >= m || k + m > 255 || symbolLength != length - ::rsHeaderLength)
+        return false;
+    
+    // Too late to be of use.
+    expire();
+    if (mStarted && (int16_t)(mHighest - base) > ::maxBlockAge)
+        return true;
+    
+    size_t i = 0;
+    while (i < mPending.size() && !(mPending[i].base == base && mPending[i].k == k && mPending[i].m == m))
+        i++;
+    
+    int count = 0;
+    int64_t firstUs = nowUs;
+    for (int j = 0; j < k; j++) {
+        uint16_t seq = (uint16_t)(base + j);
+        if (present(seq)) {
+            firstUs = std::min(firstUs, mMedia[seq % ::rsMediaPackets].arrivalUs);
+            count++;
+        }
+    }
+    mLagUs = std::max(mLagUs * ::rsLagDecay, (double)(nowUs - firstUs));
+    if (count == k)
+        return true;
+    
+    if (i == mPending.size()) {
+        if ((int)mPending.size() >= ::maxRsPending)
+            drop(0);
+        Block block;
+        block.base = base;
+        block.k = k;
+        block.m = m;
+        block.symbolLength = symbolLength;
+        block.present = count;
+        block.received = 0;
+        block.repairs.resize(m, NULL);
+        block.symbols.resize(m, NULL);
+        mPending.push_back(block);
+        i = mPending.size() - 1;
+    }
+    
+    Block& block = mPending[i];
+    if (block.repairs[index] != NULL || block.symbolLength != symbolLength)
+        return true;
+    
+    packet->retain();
+    block.repairs[index] = packet;
+    block.symbols[index] = h + ::rsHeaderLength;
+    block.received++;
+    
+    if (block.present + block.received >= block.k) {
+        decode(block, nowUs);
+        drop(i);
+    }
+    return true;
+}
+
+void CRtpRsDecoder::decode(const Block& block, int64_t nowUs)
+{
+    int k = block.k;
+    int S = block.symbolLength;
+    int payloadLength = S - ::rsSymbolHeader;
+    
+    mMissing.clear();
+    mHeaders.resize(k * ::rsSymbolHeader);
+    for (int j = 0; j < k; j++) {
+        uint16_t seq = (uint16_t)(block.base + j);
+        if (!present(seq)) {
+            mMissing.push_back(j);
+            continue;
+        }
+        
+        const uint8_t* p = mMedia[seq % ::rsMediaPackets].packet->data();
+        int length = mMedia[seq % ::rsMediaPackets].packet->length() - 12;
+        if (length < 0 || length > payloadLength)
+            return;
+        uint8_t* h = &mHeaders[j * ::rsSymbolHeader];
+        store16(h, (uint16_t)length);
+        h[2] = p[0];
+        h[3] = p[1];
+        memcpy(h + 4, p + 4, 4);
+    }
+    
+    int e = (int)mMissing.size();
+    mRows.clear();
+    for (int i = 0; i < block.m && (int)mRows.size() < e; i++) {
+        if (block.repairs[i] != NULL)
+            mRows.push_back(i);
+    }
+    if (e == 0 || (int)mRows.size() < e)
+        return;
+    
+    // Each repair symbol less the packets at hand leaves the missing ones
+    // weighted by their columns of its Cauchy row; invert those columns.
+    mMatrix.resize(e * e);
+    for (int a = 0; a < e; a++) {
+        for (int b = 0; b < e; b++)
+            mMatrix[a * e + b] = gf::inv((uint8_t)((k + mRows[a]) ^ mMissing[b]));
+    }
+    if (!gf::invert(mMatrix.data(), e))
+        return;
+    
+    mWork.resize((size_t)(e + 1) * S);
+    mCoefs.resize(k);
+    for (int a = 0; a < e; a++) {
+        uint8_t* syndrome = &mWork[(size_t)a * S];
+        memcpy(syndrome, block.symbols[mRows[a]], S);
+        
+        int n = 0;
+        mSrcs.resize(k);
+        mSrcLengths.resize(k);
+        for (int j = 0; j < k; j++) {
+            uint16_t seq = (uint16_t)(block.base + j);
+            if (!present(seq))
+                continue;
+            mCoefs[n] = gf::inv((uint8_t)((k + mRows[a]) ^ j));
+            mSrcs[n] = &mHeaders[j * ::rsSymbolHeader];
+            mSrcLengths[n] = ::rsSymbolHeader;
+            n++;
+        }
+        gf::mulAdd(syndrome, mSrcs.data(), mSrcLengths.data(), mCoefs.data(), n);
+        
+        n = 0;
+        for (int j = 0; j < k; j++) {
+            uint16_t seq = (uint16_t)(block.base + j);
+            if (!present(seq))
+                continue;
+            CRtpPacket* packet = mMedia[seq % ::rsMediaPackets].packet;
+            mSrcs[n] = packet->data() + 12;
+            mSrcLengths[n] = packet->length() - 12;
+            n++;
+        }
+        gf::mulAdd(syndrome + ::rsSymbolHeader, mSrcs.data(), mSrcLengths.data(), mCoefs.data(), n);
+    }
+    
+    uint8_t* symbol = &mWork[(size_t)e * S];
+    mSrcs.resize(e);
+    mSrcLengths.assign(e, S);
+    for (int a = 0; a < e; a++)
+        mSrcs[a] = &mWork[(size_t)a * S];
+    
+    for (int b = 0; b < e; b++) {
+        memset(symbol, 0, S);
+        gf::mulAdd(symbol, mSrcs.data(), mSrcLengths.data(), &mMatrix[b * e], e);
+        
+        int length = 12 + load16(symbol);
+        if (length - 12 > payloadLength)
+            continue;
+        
+        uint16_t seq = (uint16_t)(block.base + mMissing[b]);
+        uint8_t* buf = new uint8_t[length];
+        buf[0] = symbol[2];
+        buf[1] = symbol[3];
+        store16(buf + 2, seq);
+        memcpy(buf + 4, symbol + 4, 4);
+        store32(buf + 8, mMediaSsrc);
+        memcpy(buf + 12, symbol + ::rsSymbolHeader, length - 12);
+        
+        CRtpHeader header;
+        if (!header.parse(buf, length)) {
+            delete [] buf;
+            continue;
+        }
+        CRtpPacket* packet = CRtpPacket::wrap(buf, length, freeRsBuffer, buf);
+        put(packet, seq, nowUs);
+        mRecoveredPackets.push_back(packet);
+        mRecovered++;
+    }
+}
+
+CRtpPacket* CRtpRsDecoder::recovered()
+{
+    if (mRecoveredPackets.empty())
+        return NULL;
+    CRtpPacket* packet = mRecoveredPackets.front();
+    mRecoveredPackets.pop_front();
+    return packet;
+}
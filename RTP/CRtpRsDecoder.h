@@ -0,0 +1,87 @@
+#ifndef __RTP_RS_DECODER_H__
+#define __RTP_RS_DECODER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include "CRtpPacket.h"
+#include "CRtpRsEncoder.h"
+
+// Receiver side of the Reed-Solomon erasure code for one source. Keeps the
+// source's recent packets and the repair packets of blocks that still have
+// a hole. Once a block has as many repair packets as it misses packets, the
+// missing ones are solved for at once.
+
+const int rsMediaPackets = 1024; // Recent packets kept, by sequence number.
+const int maxRsPending = 16;     // Blocks waiting for repair.
+const double rsLagDecay = 0.99;  // Per repair packet.
+
+class CRtpRsDecoder {
+
+public:
+    CRtpRsDecoder(uint32_t mediaSsrc);
+    ~CRtpRsDecoder();
+    
+    // Every packet of the source, taking a reference.
+    void mediaIn(CRtpPacket* packet, uint16_t seq, int64_t nowUs);
+    
+    // A repair packet naming this source. False when it is malformed.
+    bool fecIn(CRtpPacket* packet, int64_t nowUs);
+    
+    // The next packet rebuilt by the last mediaIn() or fecIn(), the caller
+    // releases it, or NULL.
+    CRtpPacket* recovered();
+    
+    // How long repair has lately come in after the first packet of its
+    // block, which is how long a hole may wait for it.
+    int parityLag() const { return (int)mLagUs; }
+    
+    uint32_t packetsRecovered() const { return mRecovered; }
+
+private:
+    struct Slot {
+        CRtpPacket* packet;
+        uint16_t seq;
+        int64_t arrivalUs;
+    };
+    
+    struct Block {
+        uint16_t base;
+        int k;
+        int m;
+        int symbolLength;
+        int present;    // Media packets of the block at hand.
+        int received;   // Repair packets at hand.
+        std::vector<CRtpPacket*> repairs;
+        std::vector<const uint8_t*> symbols;
+    };
+    
+    bool present(uint16_t seq) const;
+    void put(CRtpPacket* packet, uint16_t seq, int64_t nowUs);
+    void decode(const Block& block, int64_t nowUs);
+    void drop(size_t index);
+    void expire();
+    
+    uint32_t mMediaSsrc;
+    std::vector<Slot> mMedia;
+    uint16_t mHighest;
+    bool mStarted;
+    double mLagUs;
+    
+    std::vector<Block> mPending;
+    std::deque<CRtpPacket*> mRecoveredPackets;
+    
+    std::vector<int> mMissing;
+    std::vector<int> mRows;
+    std::vector<uint8_t> mMatrix;
+    std::vector<uint8_t> mCoefs;
+    std::vector<uint8_t> mHeaders;
+    std::vector<const uint8_t*> mSrcs;
+    std::vector<int> mSrcLengths;
+    std::vector<uint8_t> mWork;
+    
+    uint32_t mRecovered;
+};
+
+#endif
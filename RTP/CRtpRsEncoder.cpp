@@ -0,0 +1,242 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include "CGf256.h"
+#include "CRtpRsEncoder.h"
+
+// Least repair share by default, a lost keyframe costs a round trip and
+// another keyframe.
+static const float defaultKeyShare = 0.05f;
+static const float defaultDeltaShare = 0.0f;
+
+static uint16_t load16(const uint8_t* p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t load32(const uint8_t* p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static void store16(uint8_t* p, uint16_t v) { p[0] = (uint8_t)(v >> 8); p[1] = (uint8_t)v; }
+static void store32(uint8_t* p, uint32_t v) { p[0] = (uint8_t)(v >> 24); p[1] = (uint8_t)(v >> 16); p[2] = (uint8_t)(v >> 8); p[3] = (uint8_t)v; }
+
+CRtpRsEncoder::CRtpRsEncoder(CRtpStreamOutBatchCallback* callback, void *callbackRefCon, int payloadType)
+    : mCallback(callback)
+    , mCallbackRef(callbackRefCon)
+    , mMediaSsrc(0)
+    , mKeyShare(::defaultKeyShare)
+    , mDeltaShare(::defaultDeltaShare)
+    , mLoss(0)
+    , mLossUs(0)
+    , mPayloadType(payloadType)
+    , mMediaPackets(0)
+    , mFecPackets(0)
+{
+    // The repair stream has its own random SSRC and sequence space.
+    std::random_device rd;
+    mSsrc = rd();
+    mSeqNo = (uint16_t)rd();
+}
+
+void CRtpRsEncoder::setMediaSsrc(uint32_t ssrc)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mMediaSsrc = ssrc;
+}
+
+void CRtpRsEncoder::setProtection(float keyFrame, float deltaFrame)
+{
+    std::lock_guard<std::mutex> guard(mLock);
+    mKeyShare = std::min(std::max(keyFrame, 0.0f), 1.0f);
+    mDeltaShare = std::min(std::max(deltaFrame, 0.0f), 1.0f);
+}
+
+void CRtpRsEncoder::setLossRate(float loss, int64_t nowUs)
+{
+    loss = std::min(std::max(loss, 0.0f), 1.0f);
+    
+    std::lock_guard<std::mutex> guard(mLock);
+    if (loss >= mLoss) {
+        mLoss = loss;
+        mLossUs = nowUs;
+    }
+    else if (nowUs - mLossUs >= ::rsHoldDownUs) {
+        // Loss that went away may be loss the repair hid, come down halfway.
+        mLoss = std::max(loss, mLoss / 2);
+        mLossUs = nowUs;
+    }
+}
+
+int CRtpRsEncoder::repairCount(int k, float loss, float share, bool keyFrame)
+{
+    // Enough for the mean loss of the block and two standard deviations
+    // above it, three for a keyframe.
+    int m = 0;
+    if (loss > 0) {
+        double mean = k * loss;
+        double z = keyFrame ? 3.0 : 2.0;
+        m = (int)ceil(mean + z * sqrt(mean * (1 - loss)));
+    }
+    m = std::max(m, (int)ceil(k * share));
+    return std::min(m, std::min(k, 255 - k));
+}
+
+void CRtpRsEncoder::packetsIn(void *encoderRef, const uint8_t* const* packets, const int* lengths, int count)
+{
+    CRtpRsEncoder* encoder = (CRtpRsEncoder*)encoderRef;
+    encoder->protect(packets, lengths, count);
+}
+
+bool CRtpRsEncoder::isKeyFrame(const uint8_t* packet, int length)
+{
+    int offset = 12 + 4 * (packet[0] & 0x0f);
+    if (length <= offset)
+        return false;
+    
+    // IDR slices and SPS, alone, fragmented (FU-A) or aggregated (STAP-A).
+    const uint8_t* p = packet + offset;
+    int left = length - offset;
+    int type = p[0] & 0x1f;
+    if (type == 28)
+        type = left > 1 ? p[1] & 0x1f : 0;
+    if (type == 24) {
+        for (int i = 1; i + 2 < left; ) {
+            int size = load16(p + i);
+            int inner = p[i + 2] & 0x1f;
+            if (inner == 5 || inner == 7)
+                return true;
+            i += 2 + size;
+        }
+        return false;
+    }
+    return type == 5 || type == 7;
+}
+
+int CRtpRsEncoder::blockOut(const uint8_t* const* packets, const int* lengths, const int* block, int k, int m, uint32_t mediaSsrc, uint8_t* out)
+{
+    uint16_t base = load16(packets[block[0]] + 2);
+    int payloadLength = 0;
+    
+    mHeaders.resize(k * ::rsSymbolHeader);
+    mHeaderSrcs.resize(k);
+    mHeaderLengths.assign(k, ::rsSymbolHeader);
+    mSrcs.resize(k);
+    mSrcLengths.resize(k);
+    
+    // The decoder places packets by their offset from the base.
+    for (int j = 0; j < k; j++) {
+        const uint8_t* p = packets[block[j]];
+        if (load16(p + 2) != (uint16_t)(base + j))
+            return 0;
+        
+        uint8_t* h = &mHeaders[j * ::rsSymbolHeader];
+        store16(h, (uint16_t)(lengths[block[j]] - 12));
+        h[2] = p[0];
+        h[3] = p[1];
+        memcpy(h + 4, p + 4, 4);
+        
+        mHeaderSrcs[j] = h;
+        mSrcs[j] = p + 12;
+        mSrcLengths[j] = lengths[block[j]] - 12;
+        payloadLength = std::max(payloadLength, mSrcLengths[j]);
+    }
+    
+    int symbolLength = ::rsSymbolHeader + payloadLength;
+    int packetLength = 16 + ::rsHeaderLength + symbolLength;
+    int stride = ::maxRtpMtu + ::maxRsOverhead;
+    uint32_t timestamp = load32(packets[block[k - 1]] + 4);
+    
+    mCoefs.resize(k);
+    for (int i = 0; i < m; i++) {
+        uint8_t* o = out + i * stride;
+        
+        // RTP header, the CSRC names the protected source.
+        o[0] = 0x81;
+        o[1] = (uint8_t)mPayloadType;
+        store16(o + 2, mSeqNo++);
+        store32(o + 4, timestamp);
+        store32(o + 8, mSsrc);
+        store32(o + 12, mediaSsrc);
+        
+        uint8_t* h = o + 16;
+        store16(h, base);
+        h[2] = (uint8_t)k;
+        h[3] = (uint8_t)m;
+        h[4] = (uint8_t)i;
+        h[5] = 0;
+        store16(h + 6, (uint16_t)symbolLength);
+        
+        // Row k + i of the Cauchy matrix, 1 / (x_i + y_j) with x_i = k + i
+        // and y_j = j, so every square submatrix of it is invertible.
+        for (int j = 0; j < k; j++)
+            mCoefs[j] = gf::inv((uint8_t)((k + i) ^ j));
+        
+        uint8_t* symbol = h + ::rsHeaderLength;
+        memset(symbol, 0, symbolLength);
+        gf::mulAdd(symbol, mHeaderSrcs.data(), mHeaderLengths.data(), mCoefs.data(), k);
+        gf::mulAdd(symbol + ::rsSymbolHeader, mSrcs.data(), mSrcLengths.data(), mCoefs.data(), k);
+    }
+    return packetLength;
+}
+
+void CRtpRsEncoder::protect(const uint8_t* const* packets, const int* lengths, int count)
+{
+    uint32_t mediaSsrc;
+    float keyShare, deltaShare, loss;
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        mediaSsrc = mMediaSsrc;
+        keyShare = mKeyShare;
+        deltaShare = mDeltaShare;
+        loss = mLoss;
+    }
+    
+    bool keyFrame = false;
+    mProtected.clear();
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] >= 12 && load32(packets[i] + 8) == mediaSsrc) {
+            mProtected.push_back(i);
+            keyFrame = keyFrame || isKeyFrame(packets[i], lengths[i]);
+        }
+    }
+    int n = (int)mProtected.size();
+    mMediaPackets.fetch_add((uint32_t)n, std::memory_order_relaxed);
+    
+    // Blocks of the frame alone, as even as they come, so no repair waits
+    // for the next frame.
+    int blocks = (n + ::maxRsBlock - 1) / ::maxRsBlock;
+    int repairs = 0;
+    for (int b = 0; b < blocks; b++) {
+        int k = n * (b + 1) / blocks - n * b / blocks;
+        repairs += repairCount(k, loss, keyFrame ? keyShare : deltaShare, keyFrame);
+    }
+    
+    if (repairs == 0) {
+        mCallback(mCallbackRef, packets, lengths, count);
+        return;
+    }
+    
+    int stride = ::maxRtpMtu + ::maxRsOverhead;
+    if (mFecBuf.size() < (size_t)repairs * stride)
+        mFecBuf.resize((size_t)repairs * stride);
+    
+    mOutPackets.assign(packets, packets + count);
+    mOutLengths.assign(lengths, lengths + count);
+    uint8_t* out = mFecBuf.data();
+    for (int b = 0; b < blocks; b++) {
+        int first = n * b / blocks;
+        int k = n * (b + 1) / blocks - first;
+        int m = repairCount(k, loss, keyFrame ? keyShare : deltaShare, keyFrame);
+        if (m == 0)
+            continue;
+        
+        int length = blockOut(packets, lengths, &mProtected[first], k, m, mediaSsrc, out);
+        if (length > 0) {
+            for (int i = 0; i < m; i++) {
+                mOutPackets.push_back(out + i * stride);
+                mOutLengths.push_back(length);
+            }
+            mFecPackets.fetch_add((uint32_t)m, std::memory_order_relaxed);
+        }
+        out += m * stride;
+    }
+    
+    mCallback(mCallbackRef, mOutPackets.data(), mOutLengths.data(), (int)mOutPackets.size());
+}
@@ -0,0 +1,106 @@
+#ifndef __RTP_RS_ENCODER_H__
+#define __RTP_RS_ENCODER_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "CRtpStream.h"
+
+// Reed-Solomon erasure code over GF(256) between the packetizer and the
+// pacer, an alternative to the XOR parity of CRtpFecEncoder for frames that
+// lose bursts. The packets of each access unit form blocks of up to
+// maxRsBlock, and every block gets m repair packets from a systematic
+// Cauchy code: any k of its k + m packets rebuild the others, however the
+// losses fall. Keyframes, whose loss stalls the stream until the next one,
+// get a wider margin than delta frames.
+//
+// A repair packet carries, behind an RTP header whose CSRC names the media
+// source, the RS header
+//
+//   0                   1                   2                   3
+//   0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+//  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  |            SN base            |       k       |       m       |
+//  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//  |     index     |   reserved    |         symbol length         |
+//  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//
+// and then one symbol. A media packet is coded as the symbol [length - 12,
+// its first two bytes, timestamp, everything past the fixed header], zero
+// padded to the longest of its block, so a rebuilt symbol is the packet.
+// Repair packets are up to maxRsOverhead bytes longer than the longest
+// packet of their block, the stream MTU has to leave room for it.
+
+const int defaultRsPayloadType = 99;
+const int maxRsBlock = 128;           // Source packets per block, k + m stays below 256.
+const int rsHeaderLength = 8;
+const int rsSymbolHeader = 8;         // Length, first two bytes and timestamp of a packet.
+const int maxRsOverhead = 4 + ::rsHeaderLength + ::rsSymbolHeader;  // CSRC, RS and symbol headers.
+const int rsHoldDownUs = 5000000;     // Protection is lowered no faster than this.
+
+class CRtpRsEncoder {
+
+public:
+    // Media and repair packets go on through callback, one batch per frame.
+    CRtpRsEncoder(CRtpStreamOutBatchCallback* callback, void *callbackRefCon, int payloadType = ::defaultRsPayloadType);
+    
+    // Only packets of this source are protected, others (MTU probes) pass.
+    void setMediaSsrc(uint32_t ssrc);
+    uint32_t ssrc() const { return mSsrc; }
+    
+    // Least share of repair packets per block, 0..1, whatever the loss. By
+    // default keyframes get 5% and delta frames none.
+    void setProtection(float keyFrame, float deltaFrame);
+    
+    // Sizes the repair for the loss rate seen by the receiver, 0..1, with
+    // room for the loss to run above its mean. Raised at once, lowered no
+    // faster than rsHoldDownUs.
+    void setLossRate(float loss, int64_t nowUs);
+    
+    // Repair packets for a block of k at that loss rate and least share.
+    static int repairCount(int k, float loss, float share, bool keyFrame);
+    
+    // Matches CRtpStreamOutBatchCallback, so a CRtpStream can feed it.
+    static void packetsIn(void *encoderRef, const uint8_t* const* packets, const int* lengths, int count);
+    void protect(const uint8_t* const* packets, const int* lengths, int count);
+    
+    // Packets protected and repair sent so far, readable from any thread.
+    uint32_t mediaPackets() const { return mMediaPackets.load(std::memory_order_relaxed); }
+    uint32_t fecPackets() const { return mFecPackets.load(std::memory_order_relaxed); }
+
+private:
+    static bool isKeyFrame(const uint8_t* packet, int length);
+    int blockOut(const uint8_t* const* packets, const int* lengths, const int* block, int k, int m, uint32_t mediaSsrc, uint8_t* out);
+    
+    CRtpStreamOutBatchCallback* mCallback;
+    void *mCallbackRef;
+    
+    std::mutex mLock;
+    uint32_t mMediaSsrc;
+    float mKeyShare;
+    float mDeltaShare;
+    float mLoss;
+    int64_t mLossUs;
+    
+    uint32_t mSsrc;
+    uint16_t mSeqNo;
+    int mPayloadType;
+    
+    std::vector<int> mProtected;
+    std::vector<const uint8_t*> mSrcs;
+    std::vector<int> mSrcLengths;
+    std::vector<uint8_t> mCoefs;
+    std::vector<uint8_t> mHeaders;
+    std::vector<const uint8_t*> mHeaderSrcs;
+    std::vector<int> mHeaderLengths;
+    std::vector<uint8_t> mFecBuf;
+    std::vector<const uint8_t*> mOutPackets;
+    std::vector<int> mOutLengths;
+    
+    std::atomic<uint32_t> mMediaPackets;
+    std::atomic<uint32_t> mFecPackets;
+};
+
+#endif
@@ -1,8 +1,11 @@
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <random>
+#include <algorithm>
 #include <arpa/inet.h>
 #include "CRtpStream.h"
+#include "CNalScanner.h"
 
 struct RtpFixHeader {
     uint8_t csrcLen:4;
@@ -39,172 +42,544 @@ struct RtpFuHeader {
 
 namespace nalu {
 
-    struct NaluUnit {
-        int length;
-        int forbidden_bit;
-        int nal_rfc_idsc;
-        int nal_unit_type;
-        uint8_t* data;
-    };
-    
-#define CHECK_NALU(data, idx) ((data[idx++] == 0x00) && \
-(data[idx++] == 0x00) && \
-(data[idx++] == 0x00) && \
-(data[idx++] == 0x01))
+    void makeNalu(const uint8_t* data, int length, nalu::NaluUnit& nalu)
+    {
+        nalu.data = (uint8_t*)data;
+        nalu.length = length;
+        nalu.forbidden_bit = data[0] & 0x80;
+        nalu.nal_rfc_idsc  = data[0] & 0x60;
+        nalu.nal_unit_type = data[0] & 0x1f;
+    }
     
     int readNalu(const uint8_t* data, int length, int offset, nalu::NaluUnit& nalu)
     {
-        int i = offset;
-        int j = 0;
+        const uint8_t* end = data + length;
+        const uint8_t* p = nalu::findStartCode3(data + offset, end);
+        if (end - p <= 3)
+            return 0;
         
-        while(i < length) {
-            if (CHECK_NALU(data, i)) {
-                nalu.data = (uint8_t*)&data[i];
-                nalu.forbidden_bit = nalu.data[0] & 0x80; // highest bit;
-                nalu.nal_rfc_idsc  = nalu.data[0] & 0x60; // 2 bits
-                nalu.nal_unit_type = nalu.data[0] & 0x1f; // low 5 bits.
-
-                if (nalu.nal_unit_type == 5 || nalu.nal_unit_type == 1) {
-                    nalu.length = length - i;
-                }
-                else {
-                    j = i;
-                    while(j < length) {
-                        if (CHECK_NALU(data, j))
-                            break;
-                    }
-
-                    if (j < length)
-                        j -= 4; // find nalu, then rollback sizeof NALU size.
-
-                    nalu.length = (j - i);
-                }
-
-                return (i - offset + nalu.length);
-            }
+        makeNalu(p + 3, (int)(end - p - 3), nalu);
+        
+        // A slice runs to the end of the access unit, anything else up to the
+        // next start code. Zeros in front of it belong to the start code
+        // (4 byte form) or are trailing_zero_8bits, a NAL unit never ends in one.
+        if (nalu.nal_unit_type != 5 && nalu.nal_unit_type != 1) {
+            const uint8_t* next = nalu::findStartCode3(nalu.data, end);
+            while (next < end && next > nalu.data && next[-1] == 0)
+                next--;
+            nalu.length = (int)(next - nalu.data);
         }
-        return 0;
+        
+        return (int)(nalu.data + nalu.length - (data + offset));
+    }
+    
+    int readNaluLength(const uint8_t* data, int lengthSize)
+    {
+        int len = 0;
+        for (int i = 0; i < lengthSize; i++)
+            len = (len << 8) | data[i];
+        return len;
     }
 }
 
-int CRtpStream::streamOut(const uint8_t* data, int length,  uint32_t timestamp)
+void CRtpStream::init()
 {
-    static uint16_t seqNo = 0;
-    nalu::NaluUnit nalu;
-    uint8_t* payload = NULL;
-    int len = 0;
-    int off = 0;
+    // RFC 3550 wants a random SSRC and a random initial sequence number.
+    std::random_device rd;
+    mSsrc  = rd();
+    mSeqNo = (uint16_t)rd();
+    mHeaderLen = 0;
+    mAggregation = true;
+    mNaluCount = 0;
+    mStapSize = 0;
+    mStapMarker = false;
     
-    while((len = nalu::readNalu(data, length, off, nalu)) > 0) {
-        memset(mOutbuf, 0, ::maxPktMtu);
-        
-        int sz = 0;
-        RtpFixHeader* hdr = (RtpFixHeader*)&mOutbuf[sz];
-        hdr->payload = 96; // h264;
-        hdr->version = 2;
-        hdr->seqNo   = htons(++seqNo);
-        hdr->ssrc    = htonl(10);
-        hdr->timestamp = htonl(timestamp);
-        
-        if (nalu.length <= ::maxPktMtu) { // All in one package.
-            hdr->marker = 1;
-            sz += sizeof(*hdr);
-            
-            RtpNaluHeader* nh = (RtpNaluHeader*)&mOutbuf[sz];
-            nh->forbidden_bit = nalu.forbidden_bit;
-            nh->nal_rfc_idsc  = nalu.nal_rfc_idsc >> 5; //?
-            nh->nal_unit_type = nalu.nal_unit_type;
-            sz += sizeof(*nh);
-            
-            payload = (uint8_t*)&mOutbuf[sz];
-            memcpy(payload, nalu.data + 1, nalu.length - 1); //wierd.
-            sz += nalu.length -1;
-            
-            mCallback(mCallbackRef, mOutbuf, sz);
-            
-            off += len;
-            continue;
+    mLayers = 1;
+    mLayer = 0;
+    mSinceBase = 0;
+    mIdr = false;
+    mTl0PicIdx = 0;
+    mMarkOffset = 0;
+    mFrameStart = false;
+    mSliceEnding = false;
+    
+    mMtu = ::maxPktMtu + (int)sizeof(RtpFixHeader);
+    mOverhead = 0;
+    mPktMtu = ::maxPktMtu;
+    
+    mProbing = false;
+    mProbeSsrc = rd();
+    mProbeSeqNo = (uint16_t)rd();
+    mProbeAcked = -1;
+}
+
+void CRtpStream::setMtu(int mtu)
+{
+    if (mtu < ::minRtpMtu)
+        mtu = ::minRtpMtu;
+    if (mtu > ::maxRtpMtu)
+        mtu = ::maxRtpMtu;
+    mMtu.store(mtu, std::memory_order_relaxed);
+}
+
+void CRtpStream::setTemporalLayers(int layers)
+{
+    mLayers = std::min(std::max(layers, 1), ::maxTemporalLayers);
+}
+
+void CRtpStream::setMtuProbing(bool enable)
+{
+    mProbeLow = ::minRtpMtu;
+    mProbeHigh = ::maxRtpMtu;
+    mProbePending = false;
+    mProbeFrames = 0;
+    mProbeAcked = -1;
+    mProbing.store(enable, std::memory_order_release);
+}
+
+void CRtpStream::probeDelivered(uint16_t probeSeq)
+{
+    if (mProbing.load(std::memory_order_acquire))
+        mProbeAcked.store(probeSeq, std::memory_order_relaxed);
+}
+
+void CRtpStream::probeAckIn(void *streamRef, uint32_t, uint32_t probeSsrc, uint16_t probeSeq)
+{
+    CRtpStream* stream = (CRtpStream*)streamRef;
+    if (probeSsrc == stream->mProbeSsrc)
+        stream->probeDelivered(probeSeq);
+}
+
+bool CRtpStream::isProbe(const uint8_t* data, int length, uint16_t* probeSeq)
+{
+    if (length < (int)sizeof(RtpFixHeader) || (data[0] >> 6) != 2 || (data[1] & 0x7f) != ::rtpProbePayloadType)
+        return false;
+    
+    if (probeSeq)
+        *probeSeq = (data[2] << 8) | data[3];
+    return true;
+}
+
+void CRtpStream::probeOut()
+{
+    // Binary search between the largest size known to get through and the
+    // smallest known not to, one probe in flight at a time.
+    if (mProbePending) {
+        int acked = mProbeAcked.exchange(-1);
+        if (acked == mProbeSeqNo) {
+            mProbeLow = mProbeSize;
+            mProbePending = false;
+        }
+        else if (++mProbeFrames > ::probeTimeoutFrames) {
+            mProbeHigh = mProbeSize - 1;
+            mProbePending = false;
+        }
+        else {
+            return;
         }
         
-        //Divide to serveral packages.
-        
-        int pktNum  = nalu.length / ::maxPktMtu;
-        int pktLast = nalu.length % ::maxPktMtu;
-        int idx = 0;
+        if (mProbeHigh - mProbeLow < ::probeGranularity) {
+            // Converged, size the media packets and search again later on
+            // in case the path changes.
+            setMtu(mProbeLow);
+            mProbeFrames = -::probeRestartFrames;
+            return;
+        }
+        else {
+            mProbeFrames = 0;
+        }
+    }
+    
+    if (mProbeFrames < 0) {
+        if (++mProbeFrames < 0)
+            return;
+        mProbeLow = ::minRtpMtu;
+        mProbeHigh = ::maxRtpMtu;
+    }
+    
+    static const uint8_t filler[::maxRtpMtu] = { 0 };
+    
+    mProbeSize = (mProbeLow + mProbeHigh + 1) / 2;
+    mProbePending = true;
+    mProbeFrames = 0;
+    
+    // Probes have their own SSRC, sequence numbers and payload type, so
+    // receivers that do not know about them drop them on the payload type.
+    memset(mHeader, 0, sizeof(mHeader));
+    RtpFixHeader* hdr = (RtpFixHeader*)&mHeader[0];
+    hdr->payload = ::rtpProbePayloadType;
+    hdr->version = 2;
+    hdr->seqNo   = htons(++mProbeSeqNo);
+    hdr->ssrc    = htonl(mProbeSsrc);
+    mHeaderLen = sizeof(*hdr);
+    mMarkOffset = 0;
+    
+    packetOut(filler, mProbeSize - mHeaderLen);
+}
+
+void CRtpStream::packetOut(const struct iovec* payload, int count)
+{
+    if (mMarkOffset > 0) {
+        // Frames above layer 0 are never referenced and reference layer 0
+        // only, so they are discardable and in sync with the base layer.
+        bool end = mSliceEnding && (mHeader[1] & 0x80) != 0;
+        mHeader[mMarkOffset] = (uint8_t)((mFrameStart ? 0x80 : 0) | (end ? 0x40 : 0) | (mIdr ? 0x20 : 0) |
+                                         (mLayer > 0 ? 0x18 : 0) | mLayer);
+        mFrameStart = false;
+        if (end)
+            mSliceEnding = false;
+    }
+    
+    if (mVecCallback) {
+        mIov[0].iov_base = mHeader;
+        mIov[0].iov_len  = mHeaderLen;
+        memcpy(&mIov[1], payload, count * sizeof(*payload));
         
-        // First package in thread of packages.
-        sz = 0;
-        hdr->marker = 0;
-        sz += sizeof(*hdr);
+        mVecCallback(mCallbackRef, mIov, count + 1);
+        return;
+    }
+    
+    if (mBatchCallback) {
+        int sz = mHeaderLen;
+        mBatchBuf.insert(mBatchBuf.end(), mHeader, mHeader + mHeaderLen);
+        for (int i = 0; i < count; i++) {
+            const uint8_t* base = (const uint8_t*)payload[i].iov_base;
+            mBatchBuf.insert(mBatchBuf.end(), base, base + payload[i].iov_len);
+            sz += payload[i].iov_len;
+        }
+        mBatchLengths.push_back(sz);
+        return;
+    }
+    
+    int sz = mHeaderLen;
+    memcpy(mOutbuf, mHeader, mHeaderLen);
+    for (int i = 0; i < count; i++) {
+        memcpy(mOutbuf + sz, payload[i].iov_base, payload[i].iov_len);
+        sz += payload[i].iov_len;
+    }
+    
+    mCallback(mCallbackRef, mOutbuf, sz);
+}
+
+void CRtpStream::packetOut(const uint8_t* payload, int length)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)payload;
+    iov.iov_len  = length;
+    packetOut(&iov, 1);
+}
+
+void CRtpStream::batchOut()
+{
+    if (mBatchLengths.empty())
+        return;
+    
+    // Resolve packet pointers only now, the buffer may have moved while growing.
+    mBatchPackets.resize(mBatchLengths.size());
+    const uint8_t* pkt = mBatchBuf.data();
+    for (size_t i = 0; i < mBatchLengths.size(); i++) {
+        mBatchPackets[i] = pkt;
+        pkt += mBatchLengths[i];
+    }
+    
+    mBatchCallback(mCallbackRef, mBatchPackets.data(), mBatchLengths.data(), (int)mBatchLengths.size());
+    
+    mBatchBuf.clear();
+    mBatchLengths.clear();
+}
+
+void CRtpStream::fixHeader(uint32_t timestamp, bool marker)
+{
+    memset(mHeader, 0, sizeof(mHeader));
+    
+    RtpFixHeader* hdr = (RtpFixHeader*)&mHeader[0];
+    hdr->payload = 96; // h264;
+    hdr->version = 2;
+    hdr->marker  = marker;
+    hdr->seqNo   = htons(++mSeqNo);
+    hdr->ssrc    = htonl(mSsrc);
+    hdr->timestamp = htonl(timestamp);
+    
+    mHeaderLen = sizeof(*hdr);
+    mMarkOffset = 0;
+    
+    if (mLayers > 1) {
+        // Frame marking alone in a one-byte extension, the flags are filled
+        // in packet by packet.
+        hdr->extension = 1;
+        uint8_t* ext = &mHeader[mHeaderLen];
+        ext[0] = (uint8_t)(::rtpOneByteExtProfile >> 8);
+        ext[1] = (uint8_t)::rtpOneByteExtProfile;
+        ext[2] = 0;
+        ext[3] = 1;
+        ext[4] = (uint8_t)((::frameMarkingExtId << 4) | 2);
+        ext[5] = 0;
+        ext[6] = 0;
+        ext[7] = mTl0PicIdx;
+        mMarkOffset = mHeaderLen + 5;
+        mHeaderLen += ::frameMarkingExtLength;
+    }
+}
+
+void CRtpStream::layerIn(bool reference, bool idr)
+{
+    mIdr = idr;
+    if (mLayers == 1 || reference) {
+        mLayer = 0;
+        mSinceBase = 0;
+        mTl0PicIdx++;
+        return;
+    }
+    
+    // 1 of 2 unreferenced frames on layer 1, with 3 layers 1 of 4 and the
+    // two between on layer 2, like a dyadic hierarchy. Dropping a layer
+    // halves the frame rate when the encoder leaves 2^(layers-1) - 1 frames
+    // unreferenced after each reference frame.
+    int period = 1 << (mLayers - 1);
+    int pos = ++mSinceBase % period;
+    int layer = 1;
+    if (pos != 0) {
+        layer = mLayers - 1;
+        while ((pos & 1) == 0 && layer > 1) {
+            pos >>= 1;
+            layer--;
+        }
+    }
+    mLayer = layer;
+}
+
+void CRtpStream::singleOut(const nalu::NaluUnit& nalu, uint32_t timestamp, bool marker)
+{
+    fixHeader(timestamp, marker);
+    
+    // The NAL header byte goes out as is, followed by the NAL payload.
+    packetOut(nalu.data, nalu.length);
+}
+
+void CRtpStream::aggregateOut(const nalu::NaluUnit* nalus, int count, uint32_t timestamp, bool marker)
+{
+    fixHeader(timestamp, marker);
+    
+    // STAP-A NAL header, F and NRI are the OR and the maximum of the aggregated ones (RFC 6184, 5.7).
+    RtpNaluHeader* nh = (RtpNaluHeader*)&mHeader[mHeaderLen];
+    nh->forbidden_bit = 0;
+    nh->nal_rfc_idsc  = 0;
+    nh->nal_unit_type = 24;
+    mHeaderLen += sizeof(*nh);
+    
+    struct iovec iov[2 * ::maxStapNalus];
+    for (int i = 0; i < count; i++) {
+        if (nalus[i].forbidden_bit)
+            nh->forbidden_bit = 1;
+        if ((nalus[i].nal_rfc_idsc >> 5) > nh->nal_rfc_idsc)
+            nh->nal_rfc_idsc = nalus[i].nal_rfc_idsc >> 5;
         
-        RtpFuIndicator* fui = (RtpFuIndicator*)&mOutbuf[sz];
-        fui->forbidden_bit = nalu.forbidden_bit;
-        fui->nal_rfc_idsc  = nalu.nal_rfc_idsc >> 5;
-        fui->nal_unit_type = 28;
-        sz += sizeof(*fui);
+        uint16_t size = htons((uint16_t)nalus[i].length);
+        memcpy(&mStapSizes[2 * i], &size, sizeof(size));
         
-        RtpFuHeader* fuh = (RtpFuHeader*)&mOutbuf[sz];
-        fuh->e = 0;
-        fuh->r = 0;
-        fuh->s = 1;
-        fuh->type = nalu.nal_unit_type;
-        sz += sizeof(*fuh);
+        iov[2 * i].iov_base = &mStapSizes[2 * i];
+        iov[2 * i].iov_len  = sizeof(size);
+        iov[2 * i + 1].iov_base = nalus[i].data;
+        iov[2 * i + 1].iov_len  = nalus[i].length;
+    }
+    
+    packetOut(iov, 2 * count);
+}
+
+void CRtpStream::fragmentOut(const nalu::NaluUnit& nalu, uint32_t timestamp, bool marker)
+{
+    fixHeader(timestamp, false);
+    
+    RtpFixHeader* hdr = (RtpFixHeader*)&mHeader[0];
+    
+    RtpFuIndicator* fui = (RtpFuIndicator*)&mHeader[mHeaderLen];
+    fui->forbidden_bit = nalu.forbidden_bit;
+    fui->nal_rfc_idsc  = nalu.nal_rfc_idsc >> 5;
+    fui->nal_unit_type = 28;
+    mHeaderLen += sizeof(*fui);
+    
+    RtpFuHeader* fuh = (RtpFuHeader*)&mHeader[mHeaderLen];
+    fuh->r = 0;
+    fuh->type = nalu.nal_unit_type;
+    mHeaderLen += sizeof(*fuh);
+    
+    // The NAL header byte is carried by the FU indicator and FU header, so
+    // fragments start right after it. As few fragments as the MTU allows,
+    // of one size but a last one a little shorter, never a tiny tail. Equal
+    // sizes let a UDP transport hand the NAL unit to the kernel as one GSO
+    // datagram.
+    const uint8_t* payload = nalu.data + 1;
+    int left = nalu.length - 1;
+    int budget = mPktMtu - 2;
+    int num = (left + budget - 1) / budget;
+    int sz = (left + num - 1) / num;
+    
+    fuh->s = 1;
+    while (left > 0) {
+        int len = std::min(sz, left);
+        left -= len;
         
-        payload = (uint8_t*)&mOutbuf[sz];
-        memcpy(payload, nalu.data + 1, ::maxPktMtu -1);
-        sz += ::maxPktMtu -1;
+        if (left == 0) {
+            /* the last package */
+            fuh->e = 1;
+            hdr->marker = marker;
+        }
+        else {
+            fuh->e = 0;
+            hdr->marker = 0;
+        }
         
-        mCallback(mCallbackRef, mOutbuf, sz);
-        idx++;
+        packetOut(payload, len);
+        payload += len;
         
-        // The middle packages.
-        while(idx < pktNum) {
-            sz = 0;
-            hdr->marker = 0;
-            hdr->seqNo  = htons(++seqNo);
-            sz += sizeof(*hdr);
-            
-            /* same rtpFuIndicator */
-            sz += sizeof(*fui);
-            
-            fuh->e = 0;
-            fuh->r = 0;
-            fuh->s = 0;
-            fuh->type = nalu.nal_unit_type;
-            sz += sizeof(*fuh);
-            
-            payload = (uint8_t*)&mOutbuf[sz];
-            memcpy(payload, nalu.data + idx*::maxPktMtu, ::maxPktMtu);
-            sz += ::maxPktMtu;
-            
-            mCallback(mCallbackRef, mOutbuf, sz);
-            idx++;
+        fuh->s = 0;
+        if (left > 0)
+            hdr->seqNo = htons(++mSeqNo);
+    }
+}
+
+void CRtpStream::nalOut(const nalu::NaluUnit& nalu, uint32_t timestamp, bool marker, bool lastSlice)
+{
+    // Small NAL units in a row (SPS, PPS, SEI ...) share one STAP-A packet,
+    // the rest go out as single NAL unit packets or FU-A fragments. The
+    // packet that carries the marker of the last slice ends the frame.
+    if (nalu.length > mPktMtu) {
+        flushOut(timestamp);
+        mSliceEnding = mSliceEnding || lastSlice;
+        fragmentOut(nalu, timestamp, marker);
+        return;
+    }
+    
+    // STAP-A NAL header byte plus a 16 bit size in front of every NAL unit.
+    int sz = 2 + nalu.length;
+    if (!mAggregation || mNaluCount == ::maxStapNalus || 1 + mStapSize + sz > mPktMtu)
+        flushOut(timestamp);
+    mSliceEnding = mSliceEnding || lastSlice;
+    
+    mNalus[mNaluCount++] = nalu;
+    mStapSize += sz;
+    mStapMarker = marker;
+}
+
+void CRtpStream::flushOut(uint32_t timestamp)
+{
+    if (mNaluCount == 1)
+        singleOut(mNalus[0], timestamp, mStapMarker);
+    else if (mNaluCount > 1)
+        aggregateOut(mNalus, mNaluCount, timestamp, mStapMarker);
+    
+    mNaluCount = 0;
+    mStapSize = 0;
+}
+
+void CRtpStream::frameIn()
+{
+    // Packet size is fixed for the whole frame, whatever setMtu() does meanwhile.
+    mPktMtu = mMtu.load(std::memory_order_relaxed) - (int)sizeof(RtpFixHeader) - mOverhead;
+    if (mLayers > 1)
+        mPktMtu -= ::frameMarkingExtLength;
+    
+    if (mProbing.load(std::memory_order_acquire))
+        probeOut();
+    
+    mFrameStart = true;
+    mSliceEnding = false;
+}
+
+void CRtpStream::frameOut(uint32_t timestamp)
+{
+    flushOut(timestamp);
+    
+    if (mBatchCallback)
+        batchOut();
+}
+
+int CRtpStream::streamOut(const uint8_t* data, int length,  uint32_t timestamp)
+{
+    nalu::NaluUnit nalu;
+    int len = 0;
+    int off = 0;
+    
+    // The layer of the frame goes out with its first packet, parameter
+    // sets included, so find its slices first.
+    bool reference = false;
+    bool idr = false;
+    while((len = nalu::readNalu(data, length, off, nalu)) > 0) {
+        off += len;
+        if (nalu.nal_unit_type == 1 || nalu.nal_unit_type == 5) {
+            reference = reference || nalu.nal_rfc_idsc != 0;
+            idr = idr || nalu.nal_unit_type == 5;
         }
+    }
+    layerIn(reference, idr);
+    
+    frameIn();
+    
+    // A slice runs to the end of the access unit, the first is the last.
+    off = 0;
+    while((len = nalu::readNalu(data, length, off, nalu)) > 0) {
+        off += len;
+        if (nalu.length > 0)
+            nalOut(nalu, timestamp, true, nalu.nal_unit_type == 1 || nalu.nal_unit_type == 5);
+    }
+    
+    frameOut(timestamp);
+    return 0;
+}
+
+int CRtpStream::streamOutAvcc(const uint8_t* data, int length, int lengthSize, uint32_t timestamp,
+                              const uint8_t* const* paramSets, const int* paramSetLengths, int paramSetCount)
+{
+    nalu::NaluUnit nalu;
+    int lastVcl = -1;
+    int off = 0;
+    bool reference = false;
+    bool idr = false;
+    
+    if (lengthSize < 1 || lengthSize > 4)
+        return -1;
+    
+    // Validate the length prefixes first and find the last slice of the
+    // access unit, which is the one to carry the marker bit.
+    while (off + lengthSize <= length) {
+        int len = nalu::readNaluLength(data + off, lengthSize);
+        if (len <= 0 || len > length - off - lengthSize)
+            return -1;
         
-        if (pktLast) {
-            /* the last package */
-            sz = 0;
-            hdr->marker = 1;
-            hdr->seqNo  = htons(++seqNo);
-            sz += sizeof(*hdr);
-            
-            /* same rtpFuIndicator*/
-            sz += sizeof(*fui);
-            
-            fuh->r = 0;
-            fuh->s = 0;
-            fuh->e = 1;
-            fuh->type = nalu.nal_unit_type;
-            sz += sizeof(*fuh);
-            
-            payload = (uint8_t*)&mOutbuf[sz];
-            memcpy(payload, nalu.data + idx*::maxPktMtu, pktLast);
-            sz += pktLast;
-            
-            mCallback(mCallbackRef, mOutbuf, sz);
+        int type = data[off + lengthSize] & 0x1f;
+        if (type >= 1 && type <= 5) {
+            lastVcl = off;
+            reference = reference || (data[off + lengthSize] & 0x60) != 0;
+            idr = idr || type == 5;
         }
+        off += lengthSize + len;
+    }
+    if (off != length)
+        return -1;
+    
+    layerIn(reference, idr);
+    frameIn();
+    
+    for (int i = 0; i < paramSetCount; i++) {
+        if (paramSetLengths[i] <= 0)
+            continue;
+        nalu::makeNalu(paramSets[i], paramSetLengths[i], nalu);
+        nalOut(nalu, timestamp, true);
+    }
+    
+    off = 0;
+    while (off + lengthSize <= length) {
+        int len = nalu::readNaluLength(data + off, lengthSize);
+        nalu::makeNalu(data + off + lengthSize, len, nalu);
         
-        off += len;
+        // Non-VCL units keep the marker as on the Annex-B path, slices only
+        // set it once the whole access unit is out.
+        bool vcl = nalu.nal_unit_type >= 1 && nalu.nal_unit_type <= 5;
+        nalOut(nalu, timestamp, !vcl || off == lastVcl, off == lastVcl);
+        
+        off += lengthSize + len;
     }
+    
+    frameOut(timestamp);
     return 0;
 }
@@ -5,25 +5,179 @@
 #include <cstdlib>
 #include <memory>
 #include <array>
+#include <vector>
+#include <atomic>
+#include <sys/uio.h>
+#include "CRtpHeader.h"
 
-const int maxRtpMtu = 1500;
-const int maxPktMtu = 1400;
+const int maxRtpMtu = 1472; // 1500 byte Ethernet datagram less IP and UDP headers.
+const int minRtpMtu = 548;  // 576 byte IPv4 datagram less IP and UDP headers.
+const int maxPktMtu = 1400; // Default RTP payload size.
+const int maxRtpHdr = 14; // RTP fixed header + FU indicator + FU header.
+const int maxTemporalLayers = 3;
+const int maxStapNalus = 16; // NAL units aggregated in one STAP-A packet at most.
+
+const int rtpProbePayloadType = 127;
+const int probeTimeoutFrames = 10;   // A probe not confirmed within this many frames is lost.
+const int probeGranularity = 16;     // Stop the search once the window is this small.
+const int probeRestartFrames = 600;  // Search again after this many frames.
 
 class CRtpStream;
+
+namespace nalu {
+    struct NaluUnit {
+        int length;
+        int forbidden_bit;
+        int nal_rfc_idsc;
+        int nal_unit_type;
+        uint8_t* data;
+    };
+}
+
 typedef void CRtpStreamOutCallback(void *callbackRefCon, const uint8_t *data, int length);
 
+// Scatter-gather output: iov[0] is the prebuilt RTP header (12 bytes, 13 for
+// STAP-A, 14 for FU-A, 8 more with temporal layers), the following entries
+// point into the buffer handed to streamOut() (interleaved with the 16 bit
+// NAL sizes of a STAP-A packet), so they are only valid for the duration of
+// the callback.
+typedef void CRtpStreamOutVecCallback(void *callbackRefCon, const struct iovec *iov, int iovcnt);
+
+// Batched output: every packet of one streamOut() call in a single callback.
+// The packets live back to back in a buffer owned by the stream and reused by
+// the next call, so they are only valid for the duration of the callback.
+typedef void CRtpStreamOutBatchCallback(void *callbackRefCon, const uint8_t* const* packets, const int* lengths, int count);
+
 class CRtpStream {
     
 public:
-    CRtpStream(CRtpStreamOutCallback* callback, void *callbackRefCon): mCallback(callback), mCallbackRef(callbackRefCon) {}
+    CRtpStream(CRtpStreamOutCallback* callback, void *callbackRefCon): mCallback(callback), mVecCallback(NULL), mBatchCallback(NULL), mCallbackRef(callbackRefCon) { init(); }
+    CRtpStream(CRtpStreamOutVecCallback* callback, void *callbackRefCon): mCallback(NULL), mVecCallback(callback), mBatchCallback(NULL), mCallbackRef(callbackRefCon) { init(); }
+    CRtpStream(CRtpStreamOutBatchCallback* callback, void *callbackRefCon): mCallback(NULL), mVecCallback(NULL), mBatchCallback(callback), mCallbackRef(callbackRefCon) { init(); }
     ~CRtpStream() {}
     
     int streamOut(const uint8_t* data, int length,  uint32_t timestamp);
     
+    // Length-prefixed (AVCC) input as handed out by VideoToolbox: the NAL units
+    // of one access unit, each behind a big-endian length of lengthSize bytes.
+    // Parameter sets (raw SPS/PPS, no start codes) go out in front of the frame.
+    // Returns -1, with nothing sent, if a length prefix runs past the end of
+    // the buffer or bytes too few for one are left over at the end.
+    int streamOutAvcc(const uint8_t* data, int length, int lengthSize, uint32_t timestamp,
+                      const uint8_t* const* paramSets = NULL, const int* paramSetLengths = NULL, int paramSetCount = 0);
+    
+    // STAP-A aggregation of small NAL units, on by default. Turn it off for
+    // peers that can only unpack single NAL unit and FU-A packets.
+    void setAggregation(bool enable) { mAggregation = enable; }
+    
+    // Largest RTP packet, header included, the stream sends; clamped to
+    // minRtpMtu..maxRtpMtu. May be called from any thread, it takes effect
+    // with the next frame.
+    void setMtu(int mtu);
+    int mtu() const { return mMtu.load(std::memory_order_relaxed); }
+    
+    // Bytes later stages add to a packet on its way out: the pacer's
+    // transport-wide sequence number extension (transportSeqExtLength), the
+    // headers of an FEC or RS repair packet over the longest packet it
+    // protects (maxFecOverhead, maxRsOverhead), the original sequence number
+    // of an RTX packet. Media packets are sized so that they and whatever
+    // is made of them still fit mtu(), probes are not. 0 by default, takes
+    // effect with the next frame.
+    void setPacketOverhead(int bytes) { mOverhead = bytes; }
+    
+    // Path MTU probing. Between frames the stream sends filler packets of
+    // growing or shrinking size (payload type rtpProbePayloadType) and
+    // settles setMtu() on the largest one that gets through. The receiving
+    // side spots them with isProbe() and acknowledges them, CRtpDemuxer does
+    // through CRtcpFeedbackSender::probeArrived(). The acks come back here
+    // through probeAckIn() from a CRtcpParser, or probeDelivered(); either
+    // may be called from any thread. Probes need a transport that sets DF,
+    // as CRtpUdpTransport::setDontFragment() does, or the network fragments
+    // them and they all get through.
+    void setMtuProbing(bool enable);
+    void probeDelivered(uint16_t probeSeq);
+    static bool isProbe(const uint8_t* data, int length, uint16_t* probeSeq);
+    // Matches CRtcpProbeAckCallback, acks of other streams' probes are let
+    // go.
+    static void probeAckIn(void *streamRef, uint32_t senderSsrc, uint32_t probeSsrc, uint16_t probeSeq);
+    
+    // Temporal scalability, off with 1 layer. Reference frames are layer 0,
+    // the frames the encoder leaves unreferenced (nal_ref_idc 0) between two
+    // of them are spread dyadically over layers 1..layers-1. Every packet
+    // carries a frame marking extension with its layer, so a forwarder can
+    // leave out the upper layers (CRtpLayerFilter) and what remains still
+    // decodes. Takes effect with the next frame.
+    void setTemporalLayers(int layers);
+    
+    uint32_t ssrc() const { return mSsrc; }
+    uint16_t seqNo() const { return mSeqNo; }
+    
 private:
+    void init();
+    void fixHeader(uint32_t timestamp, bool marker);
+    void layerIn(bool reference, bool idr);
+    void singleOut(const nalu::NaluUnit& nalu, uint32_t timestamp, bool marker);
+    void aggregateOut(const nalu::NaluUnit* nalus, int count, uint32_t timestamp, bool marker);
+    void fragmentOut(const nalu::NaluUnit& nalu, uint32_t timestamp, bool marker);
+    void nalOut(const nalu::NaluUnit& nalu, uint32_t timestamp, bool marker, bool lastSlice = false);
+    void flushOut(uint32_t timestamp);
+    void frameIn();
+    void frameOut(uint32_t timestamp);
+    void probeOut();
+    void packetOut(const struct iovec* payload, int count);
+    void packetOut(const uint8_t* payload, int length);
+    void batchOut();
+
     CRtpStreamOutCallback* mCallback;
+    CRtpStreamOutVecCallback* mVecCallback;
+    CRtpStreamOutBatchCallback* mBatchCallback;
     void *mCallbackRef;
+    
+    // All packetizer state is per stream, so several streams can run
+    // concurrently without sharing a sequence space or an SSRC.
+    uint32_t mSsrc;
+    uint16_t mSeqNo;
+    bool mAggregation;
+    std::atomic<int> mMtu;
+    int mOverhead;
+    int mPktMtu;
+    
+    std::atomic<bool> mProbing;
+    bool mProbePending;
+    int mProbeLow;
+    int mProbeHigh;
+    int mProbeSize;
+    int mProbeFrames;
+    uint32_t mProbeSsrc;
+    uint16_t mProbeSeqNo;
+    std::atomic<int> mProbeAcked;
+    
+    uint8_t mHeader[::maxRtpHdr + ::frameMarkingExtLength];
+    int mHeaderLen;
+    
+    // Temporal layers of the frame going out, and where its frame marking
+    // byte sits in mHeader, 0 without one.
+    int mLayers;
+    int mLayer;
+    int mSinceBase;
+    bool mIdr;
+    uint8_t mTl0PicIdx;
+    int mMarkOffset;
+    bool mFrameStart;
+    bool mSliceEnding;
+    
+    // NAL units waiting to go out together in one STAP-A packet.
+    nalu::NaluUnit mNalus[::maxStapNalus];
+    int mNaluCount;
+    int mStapSize;
+    bool mStapMarker;
+    uint8_t mStapSizes[2 * ::maxStapNalus];
+    struct iovec mIov[1 + 2 * ::maxStapNalus];
     uint8_t mOutbuf[::maxRtpMtu];
+    
+    std::vector<uint8_t> mBatchBuf;
+    std::vector<int> mBatchLengths;
+    std::vector<const uint8_t*> mBatchPackets;
 };
 
 #endif
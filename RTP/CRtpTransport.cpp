@@ -0,0 +1,52 @@
+#include <cstdint>
+#include <cstdlib>
+#include "CRtpTransport.h"
+
+CRtpTransport::CRtpTransport()
+    : mPacketsSent(0)
+    , mBytesSent(0)
+    , mPacketsReceived(0)
+    , mBytesReceived(0)
+    , mDropped(0)
+    , mCalls(0)
+{
+}
+
+void CRtpTransport::packetsIn(void *transportRef, const uint8_t* const* packets, const int* lengths, int count)
+{
+    CRtpTransport* transport = (CRtpTransport*)transportRef;
+    int sent = 0;
+    while (sent < count) {
+        int n = transport->send(packets + sent, lengths + sent, count - sent);
+        if (n <= 0) {
+            // What could not go is lost, as on the wire
+            transport->dropped(count - sent);
+            break;
+        }
+        sent += n;
+    }
+}
+
+void CRtpTransport::stats(CRtpTransportStats* stats) const
+{
+    stats->packetsSent = mPacketsSent.load(std::memory_order_relaxed);
+    stats->bytesSent = mBytesSent.load(std::memory_order_relaxed);
+    stats->packetsReceived = mPacketsReceived.load(std::memory_order_relaxed);
+    stats->bytesReceived = mBytesReceived.load(std::memory_order_relaxed);
+    stats->dropped = mDropped.load(std::memory_order_relaxed);
+    stats->calls = mCalls.load(std::memory_order_relaxed);
+}
+
+void CRtpTransport::sent(int packets, uint64_t bytes, int calls)
+{
+    mPacketsSent.fetch_add(packets, std::memory_order_relaxed);
+    mBytesSent.fetch_add(bytes, std::memory_order_relaxed);
+    mCalls.fetch_add(calls, std::memory_order_relaxed);
+}
+
+void CRtpTransport::received(int packets, uint64_t bytes, int calls)
+{
+    mPacketsReceived.fetch_add(packets, std::memory_order_relaxed);
+    mBytesReceived.fetch_add(bytes, std::memory_order_relaxed);
+    mCalls.fetch_add(calls, std::memory_order_relaxed);
+}
@@ -0,0 +1,70 @@
+#ifndef __RTP_TRANSPORT_H__
+#define __RTP_TRANSPORT_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <atomic>
+#include "CRtpPacket.h"
+
+// Where packets go out and come in, in batches. The stream, the pacer and
+// the fan-out send through packetsIn(), receivers hand what receive()
+// returns to a CRtpDemuxer. A UDP socket (CRtpUdpTransport) or a queue in
+// memory (CRtpLoopbackTransport), so the RTP stack runs, and can be loaded,
+// off the device as well.
+
+const int maxTransportBatch = 64;     // Packets per send or receive call.
+const int maxTransportPacket = 2048;  // Largest datagram received.
+
+struct CRtpTransportStats {
+    uint64_t packetsSent;
+    uint64_t bytesSent;
+    uint64_t packetsReceived;
+    uint64_t bytesReceived;
+    uint64_t dropped;     // Not sent, or lost on the way in.
+    uint64_t calls;       // Send and receive calls into the system or queue.
+};
+
+class CRtpTransport {
+
+public:
+    virtual ~CRtpTransport() {}
+    
+    // Sends the packets in order, as many at once as the backend takes.
+    // Returns how many went out, -1 with nothing sent on an error.
+    virtual int send(const uint8_t* const* packets, const int* lengths, int count) = 0;
+    
+    // Waits up to timeoutUs, 0 not at all and -1 for ever, for packets and
+    // returns up to maxCount of them, each with a reference for the caller.
+    // 0 on timeout, -1 once closed or on an error.
+    virtual int receive(CRtpPacket** packets, int maxCount, int timeoutUs) = 0;
+    
+    // Wakes a receive() waiting, from then on it returns -1 once nothing
+    // is left.
+    virtual void close() = 0;
+    
+    // Matches CRtpStreamOutBatchCallback, so a CRtpStream, the pacer or the
+    // fan-out can send straight through a transport.
+    static void packetsIn(void *transportRef, const uint8_t* const* packets, const int* lengths, int count);
+    
+    void stats(CRtpTransportStats* stats) const;
+
+protected:
+    CRtpTransport();
+    
+    void sent(int packets, uint64_t bytes, int calls);
+    void received(int packets, uint64_t bytes, int calls);
+    void dropped(int packets) { mDropped.fetch_add(packets, std::memory_order_relaxed); }
+
+private:
+    CRtpTransport(const CRtpTransport&);
+    CRtpTransport& operator=(const CRtpTransport&);
+    
+    std::atomic<uint64_t> mPacketsSent;
+    std::atomic<uint64_t> mBytesSent;
+    std::atomic<uint64_t> mPacketsReceived;
+    std::atomic<uint64_t> mBytesReceived;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mCalls;
+};
+
+#endif
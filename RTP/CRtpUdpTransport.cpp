@@ -0,0 +1,416 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE   // sendmmsg, recvmmsg
+#endif
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "CRtpUdpTransport.h"
+
+#if defined(__linux__) && defined(UDP_SEGMENT) && defined(UDP_GRO)
+#define RTP_UDP_OFFLOAD 1
+#endif
+
+static const int gsoSegments = 64;       // UDP_MAX_SEGMENTS before 6.9
+static const int gsoBytes = 65507;       // Largest UDP payload over IPv4
+static const int groBatch = 8;           // Coalesced datagrams received at once
+static const int groBuffer = 65536;
+
+CRtpUdpTransport::CRtpUdpTransport()
+    : mSocket(-1)
+    , mError(0)
+    , mClosed(false)
+    , mGso(false)
+    , mGro(false)
+    , mFamily(AF_INET)
+    , mOffload(false)
+    , mDontFragment(false)
+{
+}
+
+CRtpUdpTransport::~CRtpUdpTransport()
+{
+    for (size_t i = 0; i < mPending.size(); i++)
+        mPending[i]->release();
+    if (mSocket >= 0)
+        ::close(mSocket);
+}
+
+static bool resolve(const char* host, int port, int family, bool passive, sockaddr_storage* address, socklen_t* length, int* error)
+{
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+    
+    addrinfo* result = NULL;
+    if (getaddrinfo(host, service, &hints, &result) != 0 || result == NULL) {
+        *error = EADDRNOTAVAIL;
+        return false;
+    }
+    memcpy(address, result->ai_addr, result->ai_addrlen);
+    *length = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+bool CRtpUdpTransport::open(const char* host, int port)
+{
+    sockaddr_storage address;
+    socklen_t length;
+    // Any address is IPv4 any, unless host says otherwise
+    if (!resolve(host, port, host ? AF_UNSPEC : AF_INET, true, &address, &length, &mError))
+        return false;
+    
+    int fd = socket(address.ss_family, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        mError = errno;
+        return false;
+    }
+    if (bind(fd, (sockaddr*)&address, length) != 0) {
+        mError = errno;
+        ::close(fd);
+        return false;
+    }
+    
+    if (mSocket >= 0)
+        ::close(mSocket);
+    mSocket = fd;
+    mFamily = address.ss_family;
+    mClosed = false;
+    setBufferSize(::defaultUdpBufferSize);
+    
+    mGso = false;
+    mGro = false;
+#if defined(RTP_UDP_OFFLOAD)
+    if (mOffload) {
+        // GSO is asked for per send, whether the kernel does it shows there
+        int on = 1;
+        mGso = true;
+        mGro = setsockopt(fd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    }
+#endif
+    // Sized here, before any receive(), never while one runs
+    mBuffers.resize(mGro ? (size_t)::groBatch * ::groBuffer : (size_t)::maxTransportBatch * ::maxTransportPacket);
+    if (mDontFragment)
+        setDontFragment(true);
+    return true;
+}
+
+bool CRtpUdpTransport::connect(const char* host, int port)
+{
+    sockaddr_storage address;
+    socklen_t length;
+    if (mSocket < 0 && !open(NULL, 0))
+        return false;
+    if (!resolve(host, port, mFamily, false, &address, &length, &mError))
+        return false;
+    
+    if (::connect(mSocket, (sockaddr*)&address, length) != 0) {
+        mError = errno;
+        return false;
+    }
+    return true;
+}
+
+int CRtpUdpTransport::port() const
+{
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (mSocket < 0 || getsockname(mSocket, (sockaddr*)&address, &length) != 0)
+        return -1;
+    if (address.ss_family == AF_INET6)
+        return ntohs(((sockaddr_in6*)&address)->sin6_port);
+    return ntohs(((sockaddr_in*)&address)->sin_port);
+}
+
+void CRtpUdpTransport::setBufferSize(int bytes)
+{
+    if (mSocket < 0)
+        return;
+    // The kernel may cap it, the bursts of a keyframe still fit mostly
+    setsockopt(mSocket, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    setsockopt(mSocket, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+void CRtpUdpTransport::setDontFragment(bool enable)
+{
+    mDontFragment = enable;
+    if (mSocket < 0)
+        return;
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    // PROBE rather than DO: DF all the same, but sends are not held to the
+    // path MTU the kernel learnt, so a probe too large for the path is lost
+    // on the way and not refused here. Off is WANT, the kernel's default.
+    int mode = enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+    if (mFamily == AF_INET6) {
+        int mode6 = enable ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+        setsockopt(mSocket, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode6, sizeof(mode6));
+    }
+    setsockopt(mSocket, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+#elif defined(IP_DONTFRAG)
+    int on = enable ? 1 : 0;
+    if (mFamily == AF_INET6)
+        setsockopt(mSocket, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on));
+    else
+        setsockopt(mSocket, IPPROTO_IP, IP_DONTFRAG, &on, sizeof(on));
+#endif
+}
+
+void CRtpUdpTransport::setSegmentOffload(bool enable)
+{
+    // Taken up by open(): send() and receive() read it without a lock, and
+    // receive() cuts its buffers by it.
+    mOffload = enable;
+}
+
+int CRtpUdpTransport::send(const uint8_t* const* packets, const int* lengths, int count)
+{
+    if (mSocket < 0 || mClosed)
+        return -1;
+    
+    int done = 0;
+    while (done < count) {
+#if defined(__linux__)
+        mmsghdr messages[::maxTransportBatch];
+        iovec vecs[::maxTransportBatch];
+        int segments[::maxTransportBatch];   // Packets each message carries
+#if defined(RTP_UDP_OFFLOAD)
+        union {
+            cmsghdr align;
+            char data[CMSG_SPACE(sizeof(uint16_t))];
+        } controls[::maxTransportBatch];
+#endif
+        int batch = std::min(count - done, ::maxTransportBatch);
+        int n = 0;
+        for (int i = 0; i < batch; i++) {
+            vecs[i].iov_base = (void*)packets[done + i];
+            vecs[i].iov_len = lengths[done + i];
+        }
+        for (int i = 0; i < batch; n++) {
+            // Packets of one size, the last of them may be shorter, make
+            // one GSO datagram
+            int run = 1;
+            if (mGso) {
+                int size = lengths[done + i];
+                int bytes = size;
+                while (i + run < batch && run < ::gsoSegments) {
+                    int next = lengths[done + i + run];
+                    if (next > size || bytes + next > ::gsoBytes)
+                        break;
+                    bytes += next;
+                    run++;
+                    if (next < size)
+                        break;
+                }
+            }
+            memset(&messages[n], 0, sizeof(mmsghdr));
+            messages[n].msg_hdr.msg_iov = &vecs[i];
+            messages[n].msg_hdr.msg_iovlen = run;
+#if defined(RTP_UDP_OFFLOAD)
+            if (run > 1) {
+                memset(&controls[n], 0, sizeof(controls[n]));
+                messages[n].msg_hdr.msg_control = controls[n].data;
+                messages[n].msg_hdr.msg_controllen = sizeof(controls[n].data);
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&messages[n].msg_hdr);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t size = (uint16_t)lengths[done + i];
+                memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+            }
+#endif
+            segments[n] = run;
+            i += run;
+        }
+        int result = sendmmsg(mSocket, messages, n, 0);
+        if (result < 0 && mGso && n < batch && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+            // No GSO for this socket or route, one datagram a packet from now
+            mGso = false;
+            continue;
+        }
+        int messagesSent = result;
+        if (result > 0) {
+            result = 0;
+            for (int i = 0; i < messagesSent; i++)
+                result += segments[i];
+        }
+#else
+        int segments[1] = { 1 };
+        int result = (int)::send(mSocket, packets[done], lengths[done], 0) < 0 ? -1 : 1;
+#endif
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+            // An ICMP error for an earlier packet, these never went. Nor
+            // does one too large for the interface, a probe most likely.
+            if (errno == ECONNREFUSED || errno == EMSGSIZE) {
+                dropped(segments[0]);
+                done += segments[0];
+                continue;
+            }
+            mError = errno;
+            break;
+        }
+        
+        uint64_t bytes = 0;
+        for (int i = 0; i < result; i++)
+            bytes += lengths[done + i];
+        sent(result, bytes, 1);
+        done += result;
+    }
+    return done > 0 || count == 0 ? done : -1;
+}
+
+bool CRtpUdpTransport::wait(int timeoutUs)
+{
+    if (timeoutUs == 0)
+        return true;
+    
+    pollfd p;
+    p.fd = mSocket;
+    p.events = POLLIN;
+    p.revents = 0;
+    int result = poll(&p, 1, timeoutUs < 0 ? -1 : (timeoutUs + 999) / 1000);
+    return result > 0;
+}
+
+int CRtpUdpTransport::pendingOut(CRtpPacket** packets, int maxCount)
+{
+    int count = 0;
+    while (count < maxCount && !mPending.empty()) {
+        packets[count++] = mPending.front();
+        mPending.pop_front();
+    }
+    return count;
+}
+
+int CRtpUdpTransport::receive(CRtpPacket** packets, int maxCount, int timeoutUs)
+{
+    if (mSocket < 0)
+        return -1;
+    // What is left of a coalesced datagram first, without a call
+    if (!mPending.empty())
+        return pendingOut(packets, maxCount);
+    if (mClosed)
+        return -1;
+    if (!wait(timeoutUs))
+        return mClosed ? -1 : 0;
+    if (mClosed)
+        return -1;
+    
+    // Coalesced datagrams need room for 64K each, fewer of them at once
+    int n = std::min(maxCount, mGro ? ::groBatch : ::maxTransportBatch);
+    int size = mGro ? ::groBuffer : ::maxTransportPacket;
+    int lengths[::maxTransportBatch];
+    int segments[::maxTransportBatch];
+    int got = 0;
+#if defined(__linux__)
+    mmsghdr messages[::maxTransportBatch];
+    iovec vecs[::maxTransportBatch];
+#if defined(RTP_UDP_OFFLOAD)
+    union {
+        cmsghdr align;
+        char data[CMSG_SPACE(sizeof(int))];
+    } controls[::groBatch];
+#endif
+    memset(messages, 0, n * sizeof(mmsghdr));
+    for (int i = 0; i < n; i++) {
+        vecs[i].iov_base = &mBuffers[(size_t)i * size];
+        vecs[i].iov_len = size;
+        messages[i].msg_hdr.msg_iov = &vecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+#if defined(RTP_UDP_OFFLOAD)
+        if (mGro) {
+            messages[i].msg_hdr.msg_control = controls[i].data;
+            messages[i].msg_hdr.msg_controllen = sizeof(controls[i].data);
+        }
+#endif
+    }
+    int result = recvmmsg(mSocket, messages, n, MSG_DONTWAIT, NULL);
+    for (int i = 0; i < result; i++) {
+        lengths[i] = (messages[i].msg_hdr.msg_flags & MSG_TRUNC) ? -1 : (int)messages[i].msg_len;
+        segments[i] = lengths[i];
+#if defined(RTP_UDP_OFFLOAD)
+        // Coalesced, cut at the size the datagrams had
+        for (cmsghdr* cmsg = mGro ? CMSG_FIRSTHDR(&messages[i].msg_hdr) : NULL; cmsg != NULL; cmsg = CMSG_NXTHDR(&messages[i].msg_hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                memcpy(&segments[i], CMSG_DATA(cmsg), sizeof(int));
+        }
+#endif
+    }
+    got = result;
+#else
+    int result = 0;
+    while (got < n) {
+        ssize_t length = recv(mSocket, &mBuffers[got * size], size, MSG_DONTWAIT);
+        if (length < 0) {
+            result = got > 0 ? got : -1;
+            break;
+        }
+        lengths[got] = (int)length;
+        segments[got] = (int)length;
+        got++;
+        result = got;
+    }
+#endif
+    if (result < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+            return 0;
+        mError = errno;
+        return -1;
+    }
+    
+    // Each packet gets a copy of its own, the buffers are reused at once.
+    // Beyond maxCount they wait for the next call.
+    int count = 0;
+    int total = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < got; i++) {
+        if (lengths[i] < 0) {
+            dropped(1);
+            continue;
+        }
+        const uint8_t* data = &mBuffers[(size_t)i * size];
+        int segment = segments[i] > 0 ? segments[i] : lengths[i];
+        int at = 0;
+        do {
+            int length = std::min(segment, lengths[i] - at);
+            at += length;
+            if (length > ::maxTransportPacket) {
+                dropped(1);
+                continue;
+            }
+            CRtpPacket* packet = CRtpPacket::create(data + at - length, length);
+            if (count < maxCount)
+                packets[count++] = packet;
+            else
+                mPending.push_back(packet);
+            total++;
+            bytes += length;
+        } while (at < lengths[i]);
+    }
+    received(total, bytes, 1);
+    return count;
+}
+
+void CRtpUdpTransport::close()
+{
+    mClosed = true;
+    // Wakes a poll() waiting on the socket
+    if (mSocket >= 0)
+        shutdown(mSocket, SHUT_RDWR);
+}
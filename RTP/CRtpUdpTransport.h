@@ -0,0 +1,79 @@
+#ifndef __RTP_UDP_TRANSPORT_H__
+#define __RTP_UDP_TRANSPORT_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include "CRtpTransport.h"
+
+// A UDP socket as a transport. On Linux a batch goes out with one
+// sendmmsg() and comes in with one recvmmsg(), elsewhere a packet a call.
+// Sends block while the socket buffer is full, so a sender that outruns the
+// link slows down instead of losing packets in the kernel.
+//
+// With segment offload (Linux 4.18 for GSO, 5.0 for GRO) a run of packets
+// of one size in a batch, as the FU-A fragments of a NAL unit are, goes to
+// the kernel as one datagram it cuts up on the way out, and what comes in
+// coalesced is cut up here.
+//
+// With setDontFragment() packets go out with DF set, the network drops
+// what does not fit the path rather than fragmenting it, as MTU probes
+// (CRtpStream::setMtuProbing()) need. One larger than the interface takes
+// is dropped here.
+
+const int defaultUdpBufferSize = 1024 * 1024;   // Socket send and receive buffers.
+
+class CRtpUdpTransport : public CRtpTransport {
+
+public:
+    CRtpUdpTransport();
+    ~CRtpUdpTransport();
+    
+    // Binds to a local address and port, NULL and 0 for any. Names resolve,
+    // IPv4 or IPv6 by what host is. False on an error, see error().
+    bool open(const char* host, int port);
+    // Sends to host and port, and takes packets from there only.
+    bool connect(const char* host, int port);
+    // The port bound, -1 before open().
+    int port() const;
+    
+    void setBufferSize(int bytes);
+    // UDP_SEGMENT for sends and UDP_GRO for receives, off by default and
+    // not there off Linux. Takes effect at the next open(), set it before;
+    // on an open socket it changes nothing until then. A kernel that turns
+    // GSO down on the first send is not asked again.
+    void setSegmentOffload(bool enable);
+    bool segmentOffload() const { return mGso || mGro; }
+    // DF on everything sent, off by default: turn it on while the stream
+    // probes the path MTU, media is better fragmented than lost once the
+    // path shrinks. It holds across open().
+    void setDontFragment(bool enable);
+    // errno of the last call that failed.
+    int error() const { return mError; }
+    
+    int send(const uint8_t* const* packets, const int* lengths, int count);
+    int receive(CRtpPacket** packets, int maxCount, int timeoutUs);
+    void close();
+
+protected:
+    // For backends over the same socket
+    int mSocket;
+    int mError;
+    std::atomic<bool> mClosed;
+    bool mGso;
+    bool mGro;
+
+private:
+    bool wait(int timeoutUs);
+    int pendingOut(CRtpPacket** packets, int maxCount);
+    
+    int mFamily;
+    bool mOffload;
+    bool mDontFragment;
+    std::vector<uint8_t> mBuffers;   // Datagrams received at once, 64K each with GRO
+    std::deque<CRtpPacket*> mPending;   // Cut from a coalesced datagram, not returned yet
+};
+
+#endif
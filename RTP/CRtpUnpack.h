@@ -3,27 +3,19 @@
 #ifndef __RTP_UNPACK_H__
 #define __RTP_UNPACK_H__
 
+#include <cstring>
+#include "RtpLog.h"
+#include "CRtpHeader.h"
+#include "CRtpBufferPool.h"
+#include "CRtpFrame.h"
+
 
 class CRtpUnpack
 {
 
-#define RTP_VERSION 2
-#define BUF_SIZE (1024 * 1024)
-    
-    typedef struct
-    {
-        //LITTLE_ENDIAN
-        unsigned short   cc:4;      /* CSRC count                 */
-        unsigned short   x:1;       /* header extension flag      */
-        unsigned short   p:1;       /* padding flag               */
-        unsigned short   v:2;       /* packet type                */
-        unsigned short   pt:7;      /* payload type               */
-        unsigned short   m:1;       /* marker bit                 */
-        
-        unsigned short   seq;      /* sequence number            */
-        unsigned int     ts;       /* timestamp                  */
-        unsigned int     ssrc;     /* synchronization source     */
-    } rtp_hdr_t;
+#define FRAME_NONE 0
+#define FRAME_ASSEMBLED 1
+#define FRAME_SINGLE 2
     
 public:
     
@@ -35,123 +27,153 @@ public:
     , m_wSeq(1234)
     , m_ssrc(0)
     {
-        m_pBuf = new unsigned char[BUF_SIZE] ;
-        if ( m_pBuf == NULL )
-        {
-            error = 1 ;
-            return ;
-        }
+        // 帧缓冲从共享缓冲池按需获取，随帧大小增长，输出后归还。
+        m_pBuf = NULL ;
+        m_nCapacity = 0 ;
+        m_pOutBuf = NULL ;
+        m_nOutCapacity = 0 ;
+        m_pPacket = NULL ;
+        
+        m_bRecovery = false ;
+        m_bDamaged = false ;
+        m_bFrameLost = false ;
+        m_bFrameQueued = false ;
+        m_bQueuedKeyFrame = false ;
+        m_dwQueuedTs = 0 ;
+        m_bOutDamaged = false ;
+        m_bOutKeyFrame = false ;
+        m_bInNal = false ;
+        m_dwNalStart = 0 ;
+        m_dwFrameTs = 0 ;
         
         m_H264PAYLOADTYPE = H264PAYLOADTYPE ;
-        m_pEnd = m_pBuf + BUF_SIZE ;
-        m_pStart = m_pBuf ;
+        m_pEnd = NULL ;
+        m_pStart = NULL ;
         m_dwSize = 0 ;
         error = 0 ;
     }
     
     ~CRtpUnpack(void)
     {
-        delete [] m_pBuf;
+        ResetFrame () ;
+        ReleaseOutFrame () ;
+    }
+    
+    //恢复模式：丢包后不再等待关键帧，只丢掉不完整的NAL，帧照常输出并标记为受损，由解码器做错误隐藏。
+    void SetRecovery ( bool bRecovery )
+    {
+        m_bRecovery = bRecovery ;
+    }
+    
+    //最近输出的一帧是否缺少了NAL，或它前面有整帧丢了（恢复模式）。
+    bool IsFrameDamaged ()
+    {
+        return m_bOutDamaged ;
+    }
+    
+    //最近输出的一帧是否为关键帧（IDR）。
+    bool IsKeyFrame ()
+    {
+        return m_bOutKeyFrame ;
+    }
+    
+    //丢包后正在丢弃数据等待关键帧（非恢复模式），此时应向发送端请求关键帧。
+    bool IsWaitingKeyFrame ()
+    {
+        return m_bWaitKeyFrame ;
     }
     
     //pBuf为H264 RTP视频数据包，nSize为RTP视频数据包字节长度，outSize为输出视频数据帧字节长度。
     //返回值为指向视频数据帧的指针。输入数据可能被破坏。
     unsigned char* Parse_RTP_Packet(unsigned char *pBuf, unsigned short nSize, unsigned int *outSize, unsigned int *timestamp)
     {
-        if ( nSize <= 12 )
+        m_pPacket = NULL ;
+        
+        int Result = ParsePacket ( pBuf, nSize, outSize, timestamp ) ;
+        if ( Result == FRAME_SINGLE )
         {
-            return NULL ;
+            unsigned char *pPayload = pBuf + m_nSingleOffset - 4 ;
+            *((unsigned int*)(pPayload)) = 0x01000000 ;
+            *outSize += 4 ;
+            return pPayload ;
         }
         
-        unsigned char *cp = (unsigned char*)&m_RTP_Header;
-        cp[0] = pBuf[0] ;
-        cp[1] = pBuf[1] ;
-        
-        m_RTP_Header.seq = pBuf[2] ;
-        m_RTP_Header.seq <<= 8 ;
-        m_RTP_Header.seq |= pBuf[3] ;
+        return Result == FRAME_ASSEMBLED ? m_pOutBuf : NULL ;
+    }
+    
+    //零拷贝组帧：负载不再拷贝，返回的帧是引用收到的RTP包的分段列表，加上合成的起始码和NAL头。
+    //返回的帧在下一次调用前有效，输入数据不会被修改。
+    CRtpFrame* Parse_RTP_Packet(CRtpPacket *pPacket, unsigned int *timestamp)
+    {
+        m_pPacket = pPacket ;
         
-        m_RTP_Header.ts = pBuf[4] ;
-        m_RTP_Header.ts <<= 8 ;
-        m_RTP_Header.ts |= pBuf[5] ;
-        m_RTP_Header.ts <<= 8 ;
-        m_RTP_Header.ts |= pBuf[6] ;
-        m_RTP_Header.ts <<= 8 ;
-        m_RTP_Header.ts |= pBuf[7] ;
+        unsigned int outSize = 0 ;
+        int Result = ParsePacket ( pPacket->data (), pPacket->length (), &outSize, timestamp ) ;
+        if ( Result == FRAME_SINGLE )
+        {
+            m_SingleFrame.clear () ;
+            m_SingleFrame.appendBytes ( StartCode (), 4 ) ;
+            m_SingleFrame.appendPacket ( pPacket, m_nSingleOffset, outSize ) ;
+            return &m_SingleFrame ;
+        }
         
-        m_RTP_Header.ssrc = pBuf[8] ;
-        m_RTP_Header.ssrc <<= 8 ;
-        m_RTP_Header.ssrc |= pBuf[9] ;
-        m_RTP_Header.ssrc <<= 8 ;
-        m_RTP_Header.ssrc |= pBuf[10] ;
-        m_RTP_Header.ssrc <<= 8 ;
-        m_RTP_Header.ssrc |= pBuf[11] ;
+        return Result == FRAME_ASSEMBLED ? &m_OutFrame : NULL ;
+    }
+    
+    //恢复模式下一个包可能同时结束两帧：先返回上一帧，后一帧排队。每次Parse_RTP_Packet返回一帧后调用，直到返回NULL。
+    //返回的帧同样在下一次调用前有效。
+    unsigned char* NextFrame(unsigned int *outSize, unsigned int *timestamp)
+    {
+        if ( !HandOutQueued ( outSize, timestamp ) )
+        {
+            return NULL ;
+        }
+        return m_pOutBuf ;
+    }
+    
+    CRtpFrame* NextFrame(unsigned int *timestamp)
+    {
+        unsigned int outSize = 0 ;
+        if ( !HandOutQueued ( &outSize, timestamp ) )
+        {
+            return NULL ;
+        }
+        return &m_OutFrame ;
+    }
+    
+    //返回FRAME_ASSEMBLED表示组好一帧，FRAME_SINGLE表示单独的SPS/PPS（位于包内m_nSingleOffset处），FRAME_NONE表示没有输出。
+    int ParsePacket(const unsigned char *pBuf, int nSize, unsigned int *outSize, unsigned int *timestamp)
+    {
+        if ( nSize <= 12 || nSize > 0xffff )
+        {
+            return FRAME_NONE ;
+        }
         
-        unsigned char *pPayload = pBuf + 12 ;
-        unsigned short PayloadSize = nSize - 12 ;
+        ReleaseOutFrame () ; // 上一帧已交给调用者，归还缓冲
+        if ( m_bFrameQueued ) // 排队的帧没有取走，算作丢了
+        {
+            m_bFrameQueued = false ;
+            ResetFrame () ;
+            m_bFrameLost = true ;
+        }
         
-        // Check the RTP version number (it should be 2):
-        if ( m_RTP_Header.v != RTP_VERSION )
+        // Version, CSRC list, header extension and padding
+        if ( !m_RTP_Header.parse ( pBuf, nSize ) )
         {
-            return NULL ;
+            return FRAME_NONE ;
         }
         
-        /*
-         // Skip over any CSRC identifiers in the header:
-         if ( m_RTP_Header.cc )
-         {
-         long cc = m_RTP_Header.cc * 4 ;
-         if ( Size < cc )
-         {
-         return NULL ;
-         }
-         
-         Size -= cc ;
-         p += cc ;
-         }
-         
-         // Check for (& ignore) any RTP header extension
-         if ( m_RTP_Header.x )
-         {
-         if ( Size < 4 )
-         {
-         return NULL ;
-         }
-         
-         Size -= 4 ;
-         p += 2 ;
-         long l = p[0] ;
-         l <<= 8 ;
-         l |= p[1] ;
-         p += 2 ;
-         l *= 4 ;
-         if ( Size < l ) ;
-         {
-         return NULL ;
-         }
-         Size -= l ;
-         p += l ;
-         }
-         
-         // Discard any padding bytes:
-         if ( m_RTP_Header.p )
-         {
-         if ( Size == 0 )
-         {
-         return NULL ;
-         }
-         long Padding = p[Size-1] ;
-         if ( Size < Padding )
-         {
-         return NULL ;
-         }
-         Size -= Padding ;
-         }*/
+        const unsigned char *pPayload = pBuf + m_RTP_Header.headerLength () ;
+        unsigned short PayloadSize = m_RTP_Header.payloadLength () ;
+        if ( PayloadSize == 0 )
+        {
+            return FRAME_NONE ;
+        }
         
         // Check the Payload Type.
-        if ( m_RTP_Header.pt != m_H264PAYLOADTYPE )
+        if ( m_RTP_Header.payloadType () != m_H264PAYLOADTYPE )
         {
-            return NULL ;
+            return FRAME_NONE ;
         }
         
         int PayloadType = pPayload[0] & 0x1f ;
@@ -160,16 +182,24 @@ public:
         {
             if ( PayloadSize < 2 )
             {
-                return NULL ;
+                return FRAME_NONE ;
             }
             
             NALType = pPayload[1] & 0x1f ;
         }
+        else if ( NALType == 24 ) // STAP_A
+        {
+            NALType = STAP_A_Type ( pPayload, PayloadSize ) ;
+            if ( NALType < 0 )
+            {
+                return FRAME_NONE ;
+            }
+        }
         
-        if ( m_ssrc != m_RTP_Header.ssrc )
+        if ( m_ssrc != m_RTP_Header.ssrc () )
         {
-            NSLog(@"CRtpUnpack, ssrc = %d", m_RTP_Header.ssrc);
-            m_ssrc = m_RTP_Header.ssrc ;
+            RTP_LOG("CRtpUnpack, ssrc = %d", m_RTP_Header.ssrc ());
+            m_ssrc = m_RTP_Header.ssrc () ;
             SetLostPacket () ;
         }
         
@@ -180,45 +210,69 @@ public:
         
         if ( !m_bSPSFound )
         {
-            return NULL ;
+            return FRAME_NONE ;
         }
         
         if ( NALType == 0x07 || NALType == 0x08 ) // SPS PPS
         {
-            m_wSeq = m_RTP_Header.seq ;
+            m_wSeq = m_RTP_Header.seqNo () ;
             m_bPrevFrameEnd = true ;
             
-            pPayload -= 4 ;
-            *((unsigned int*)(pPayload)) = 0x01000000 ;
-            *outSize = PayloadSize + 4 ;
-            *timestamp = m_RTP_Header.ts ;
-            return pPayload ;
+            if ( PayloadType == 24 ) // STAP_A, aggregated parameter sets start a new frame
+            {
+                ResetFrame () ;
+                m_bAssemblingFrame = false ;
+                
+                bool bKeyFrame = false ;
+                if ( !Unpack_STAP_A ( pPayload, PayloadSize, &bKeyFrame ) )
+                {
+                    SetLostPacket () ;
+                    return FRAME_NONE ;
+                }
+                
+                *outSize = m_dwSize ;
+                *timestamp = m_RTP_Header.timestamp () ;
+                HandOutFrame () ;
+                
+                if ( bKeyFrame ) // small key frame aggregated with its parameter sets
+                {
+                    m_bWaitKeyFrame = false ;
+                    m_bOutKeyFrame = true ;
+                }
+                return FRAME_ASSEMBLED ;
+            }
+            
+            m_nSingleOffset = (int)( pPayload - pBuf ) ;
+            *outSize = PayloadSize ;
+            *timestamp = m_RTP_Header.timestamp () ;
+            m_bOutKeyFrame = false ;
+            return FRAME_SINGLE ;
         }
         
         if ( m_bWaitKeyFrame )
         {
-            if ( m_RTP_Header.m ) // frame end
+            if ( m_RTP_Header.marker () ) // frame end
             {
                 m_bPrevFrameEnd = true ;
                 if ( !m_bAssemblingFrame )
                 {
-                    m_wSeq = m_RTP_Header.seq ;
-                    return NULL ;
+                    m_wSeq = m_RTP_Header.seqNo () ;
+                    return FRAME_NONE ;
                 }
             }
             
             if ( !m_bPrevFrameEnd )
             {
-                m_wSeq = m_RTP_Header.seq ;
-                return NULL ;
+                m_wSeq = m_RTP_Header.seqNo () ;
+                return FRAME_NONE ;
             }
             else
             {
                 if ( NALType != 0x05 ) // KEY FRAME
                 {
-                    m_wSeq = m_RTP_Header.seq ;
+                    m_wSeq = m_RTP_Header.seqNo () ;
                     m_bPrevFrameEnd = false ;
-                    return NULL ;
+                    return FRAME_NONE ;
                 }
             }
         }
@@ -226,78 +280,192 @@ public:
         
         ///////////////////////////////////////////////////////////////
         
-        if ( m_RTP_Header.seq != (unsigned short)( m_wSeq + 1 ) ) // lost packet
+        int Result = FRAME_NONE ;
+        bool bGap = false ;
+        
+        if ( m_RTP_Header.seqNo () != (unsigned short)( m_wSeq + 1 ) ) // lost packet
         {
-            NSLog(@"CRtpUnpack, LostPacket ............... expected seq = %d, seq = %d", m_wSeq + 1, m_RTP_Header.seq);
-            m_wSeq = m_RTP_Header.seq ;
+            RTP_LOG("CRtpUnpack, LostPacket ............... expected seq = %d, seq = %d", m_wSeq + 1, m_RTP_Header.seqNo ());
+            m_wSeq = m_RTP_Header.seqNo () ;
+            if ( !m_bRecovery )
+            {
+                SetLostPacket () ;
+                return FRAME_NONE ;
+            }
+            
+            DropPartialNal () ;
+            bGap = true ;
+        }
+        
+        // 码流正常，或恢复模式下继续组帧
+        
+        m_wSeq = m_RTP_Header.seqNo () ;
+        m_bAssemblingFrame = true ;
+        
+        if ( m_bRecovery && ( m_dwSize > 0 || m_bDamaged ) && m_RTP_Header.timestamp () != m_dwFrameTs ) // 上一帧的结尾丢了
+        {
+            DropPartialNal () ;
+            if ( m_dwSize > 0 ) // 交出上一帧，本包开始新的一帧；本包若就是完整的一帧，它排队等NextFrame
+            {
+                *outSize = m_dwSize ;
+                *timestamp = m_dwFrameTs ;
+                m_bDamaged = true ;
+                HandOutFrame () ;
+                Result = FRAME_ASSEMBLED ;
+            }
+            else // 上一帧什么也没剩下
+            {
+                ResetFrame () ;
+                m_bFrameLost = true ;
+            }
+        }
+        
+        if ( bGap )
+        {
+            m_bDamaged = true ;
+        }
+        m_dwFrameTs = m_RTP_Header.timestamp () ;
+        
+        if ( PayloadType != 24 && !ReserveFrame ( PayloadSize + 4 ) ) // memory overflow
+        {
+            RTP_LOG("CRtpUnpack, LostPacket ............... memory overflow");
             SetLostPacket () ;
-            return NULL ;
+            return FRAME_NONE ;
         }
-        else
+        
+        if ( PayloadType == 24 ) // STAP_A
         {
-            // 码流正常
-            
-            m_wSeq = m_RTP_Header.seq ;
-            m_bAssemblingFrame = true ;
+            DropPartialNal () ;
+            if ( !Unpack_STAP_A ( pPayload, PayloadSize, NULL ) ) // memory overflow
+            {
+                RTP_LOG("CRtpUnpack, LostPacket ............... memory overflow");
+                SetLostPacket () ;
+                return FRAME_NONE ;
+            }
             
-            if ( PayloadType != 28 ) // whole NAL
+            PayloadSize = 0 ;
+        }
+        else if ( PayloadType != 28 ) // whole NAL
+        {
+            DropPartialNal () ;
+            AppendCode ( StartCode (), 4 ) ;
+        }
+        else // FU_A
+        {
+            bool bKeep = true ;
+            if ( pPayload[1] & 0x80 ) // FU_A start
             {
-                *((unsigned int*)(m_pStart)) = 0x01000000 ;
-                m_pStart += 4 ;
-                m_dwSize += 4 ;
+                DropPartialNal () ;
+                m_dwNalStart = m_dwSize ;
+                m_bInNal = true ;
+                
+                AppendCode ( StartCode (), 4 ) ;
+                
+                unsigned char NALHeader = ( pPayload[0] & 0xE0 ) | NALType ;
+                AppendCode ( &NALHeader, 1 ) ;
             }
-            else // FU_A
+            else if ( !m_bInNal ) // 开头的分片丢了，其余分片也丢弃
             {
-                if ( pPayload[1] & 0x80 ) // FU_A start
-                {
-                    *((unsigned int*)(m_pStart)) = 0x01000000 ;
-                    m_pStart += 4 ;
-                    m_dwSize += 4 ;
-                    
-                    pPayload[1] = ( pPayload[0] & 0xE0 ) | NALType ;
-                    
-                    pPayload += 1 ;
-                    PayloadSize -= 1 ;
-                }
-                else
-                {
-                    pPayload += 2 ;
-                    PayloadSize -= 2 ;
-                }
+                bKeep = false ;
             }
             
-            if ( m_pStart + PayloadSize < m_pEnd )
+            if ( pPayload[1] & 0x40 ) // FU_A end
             {
-                memcpy ( m_pStart, pPayload, PayloadSize ) ;
-                m_dwSize += PayloadSize ;
-                m_pStart += PayloadSize ;
+                m_bInNal = false ;
             }
-            else // memory overflow
+            
+            pPayload += 2 ;
+            PayloadSize = bKeep ? PayloadSize - 2 : 0 ;
+        }
+        
+        AppendPayload ( pPayload, PayloadSize ) ;
+        
+        if ( m_RTP_Header.marker () ) // frame end
+        {
+            DropPartialNal () ;
+            if ( m_dwSize == 0 ) // 整帧都丢了
             {
-                NSLog(@"CRtpUnpack, LostPacket ............... memory overflow");
-                SetLostPacket () ;
-                return NULL ;
+                m_bFrameLost = m_bFrameLost || m_bDamaged ;
+                ResetFrame () ;
+                return Result ;
             }
             
-            if ( m_RTP_Header.m ) // frame end
+            if ( Result == FRAME_ASSEMBLED ) // 上一帧已经交出，这一帧排队
             {
-                *outSize = m_dwSize ;
-                *timestamp = m_RTP_Header.ts ;
-                
-                m_pStart = m_pBuf ;
-                m_dwSize = 0 ;
-                
-                if ( NALType == 0x05 ) // KEY FRAME
+                m_bFrameQueued = true ;
+                m_bQueuedKeyFrame = NALType == 0x05 ;
+                m_dwQueuedTs = m_RTP_Header.timestamp () ;
+                if ( m_bQueuedKeyFrame )
                 {
                     m_bWaitKeyFrame = false ;
                 }
-                return m_pBuf ;
+                return Result ;
             }
-            else
+            
+            *outSize = m_dwSize ;
+            *timestamp = m_RTP_Header.timestamp () ;
+            HandOutFrame () ;
+            
+            if ( NALType == 0x05 ) // KEY FRAME
             {
-                return NULL ;
+                m_bWaitKeyFrame = false ;
+                m_bOutKeyFrame = true ;
             }
+            return FRAME_ASSEMBLED ;
         }
+        return Result ;
+    }
+    
+    //STAP_A (RFC 6184, 5.7.1)：返回聚合包中的代表NAL类型，含SPS时为SPS，含IDR时为IDR，否则为第一个NAL的类型。格式错误返回-1。
+    int STAP_A_Type ( const unsigned char *pPayload, unsigned short PayloadSize )
+    {
+        int NALType = -1 ;
+        unsigned short off = 1 ;
+        
+        while ( off + 2 < PayloadSize )
+        {
+            unsigned short NALSize = ( pPayload[off] << 8 ) | pPayload[off + 1] ;
+            off += 2 ;
+            if ( NALSize == 0 || off + NALSize > PayloadSize )
+            {
+                return -1 ;
+            }
+            
+            int Type = pPayload[off] & 0x1f ;
+            if ( NALType < 0 || Type == 0x07 || ( Type == 0x05 && NALType != 0x07 ) )
+            {
+                NALType = Type ;
+            }
+            off += NALSize ;
+        }
+        return NALType ;
+    }
+    
+    //把STAP_A中的每个NAL加上起始码追加到m_pStart。内存不够返回false。
+    bool Unpack_STAP_A ( const unsigned char *pPayload, unsigned short PayloadSize, bool *bKeyFrame )
+    {
+        unsigned short off = 1 ;
+        
+        while ( off + 2 < PayloadSize )
+        {
+            unsigned short NALSize = ( pPayload[off] << 8 ) | pPayload[off + 1] ;
+            off += 2 ;
+            
+            if ( !ReserveFrame ( 4 + NALSize ) )
+            {
+                return false ;
+            }
+            
+            if ( bKeyFrame && ( pPayload[off] & 0x1f ) == 0x05 )
+            {
+                *bKeyFrame = true ;
+            }
+            
+            AppendCode ( StartCode (), 4 ) ;
+            AppendPayload ( pPayload + off, NALSize ) ;
+            off += NALSize ;
+        }
+        return true ;
     }
     
     void SetLostPacket()
@@ -306,14 +474,168 @@ public:
         m_bWaitKeyFrame = true ;
         m_bPrevFrameEnd = false ;
         m_bAssemblingFrame = false ;
-        m_pStart = m_pBuf ;
+        ResetFrame () ;
+    }
+    
+    //丢掉还没收完的FU_A分片NAL，帧标记为受损。
+    void DropPartialNal()
+    {
+        if ( m_bInNal )
+        {
+            TruncateFrame ( m_dwNalStart ) ;
+            m_bInNal = false ;
+            m_bDamaged = true ;
+        }
+    }
+    
+    void TruncateFrame ( unsigned int nSize )
+    {
+        if ( m_pPacket )
+        {
+            m_Frame.truncate ( nSize ) ;
+        }
+        else
+        {
+            m_pStart = m_pBuf + nSize ;
+        }
+        m_dwSize = nSize ;
+    }
+    
+    //保证帧缓冲还能再写入nSize字节，不够时从缓冲池换一块更大的并拷贝已有数据。超过最大尺寸返回false。
+    bool ReserveFrame ( unsigned int nSize )
+    {
+        if ( m_pPacket ) // 零拷贝组帧不需要缓冲
+        {
+            return true ;
+        }
+        
+        size_t capacity = m_nCapacity ;
+        if ( !CRtpBufferPool::shared().grow ( &m_pBuf, &capacity, m_dwSize, m_dwSize + nSize ) )
+        {
+            return false ;
+        }
+        
+        m_nCapacity = capacity ;
+        m_pEnd = m_pBuf + m_nCapacity ;
+        m_pStart = m_pBuf + m_dwSize ;
+        return true ;
+    }
+    
+    //追加合成的起始码、NAL头。调用前先ReserveFrame。
+    void AppendCode ( const unsigned char *pData, unsigned int nSize )
+    {
+        if ( m_pPacket )
+        {
+            m_Frame.appendBytes ( pData, nSize ) ;
+        }
+        else
+        {
+            memcpy ( m_pStart, pData, nSize ) ;
+            m_pStart += nSize ;
+        }
+        m_dwSize += nSize ;
+    }
+    
+    //追加负载。零拷贝组帧时只引用负载所在的RTP包。
+    void AppendPayload ( const unsigned char *pData, unsigned int nSize )
+    {
+        if ( m_pPacket )
+        {
+            m_Frame.appendPacket ( m_pPacket, (int)( pData - m_pPacket->data () ), nSize ) ;
+        }
+        else
+        {
+            memcpy ( m_pStart, pData, nSize ) ;
+            m_pStart += nSize ;
+        }
+        m_dwSize += nSize ;
+    }
+    
+    static const unsigned char* StartCode()
+    {
+        static const unsigned char Code[4] = { 0, 0, 0, 1 } ;
+        return Code ;
+    }
+    
+    //丢弃正在组的帧，帧缓冲还给缓冲池。
+    void ResetFrame()
+    {
+        m_Frame.clear () ;
+        CRtpBufferPool::shared().release ( m_pBuf, m_nCapacity ) ;
+        m_pBuf = NULL ;
+        m_nCapacity = 0 ;
+        m_pStart = NULL ;
+        m_pEnd = NULL ;
         m_dwSize = 0 ;
+        m_bInNal = false ;
+        m_bDamaged = false ;
+    }
+    
+    //组好的帧交给调用者，下一次调用时归还。新的一帧另取缓冲。
+    void HandOutFrame()
+    {
+        m_pOutBuf = m_pBuf ;
+        m_nOutCapacity = m_nCapacity ;
+        m_OutFrame.swap ( m_Frame ) ;
+        m_bOutDamaged = m_bDamaged || m_bFrameLost ;
+        m_bFrameLost = false ;
+        m_bOutKeyFrame = false ;
+        
+        m_pBuf = NULL ;
+        m_nCapacity = 0 ;
+        ResetFrame () ;
+    }
+    
+    //交出排队的一帧，没有则返回false。
+    bool HandOutQueued ( unsigned int *outSize, unsigned int *timestamp )
+    {
+        if ( !m_bFrameQueued )
+        {
+            return false ;
+        }
+        
+        ReleaseOutFrame () ;
+        m_bFrameQueued = false ;
+        *outSize = m_dwSize ;
+        *timestamp = m_dwQueuedTs ;
+        HandOutFrame () ;
+        m_bOutKeyFrame = m_bQueuedKeyFrame ;
+        return true ;
+    }
+    
+    void ReleaseOutFrame()
+    {
+        m_OutFrame.clear () ;
+        CRtpBufferPool::shared().release ( m_pOutBuf, m_nOutCapacity ) ;
+        m_pOutBuf = NULL ;
+        m_nOutCapacity = 0 ;
     }
     
 private:
-    rtp_hdr_t m_RTP_Header ;
+    CRtpHeader m_RTP_Header ;
     
     unsigned char *m_pBuf ;
+    size_t m_nCapacity ;
+    unsigned char *m_pOutBuf ;
+    size_t m_nOutCapacity ;
+    
+    CRtpPacket *m_pPacket ;
+    CRtpFrame m_Frame ;
+    CRtpFrame m_OutFrame ;
+    CRtpFrame m_SingleFrame ;
+    int m_nSingleOffset ;
+    
+    bool m_bRecovery ;
+    bool m_bDamaged ;
+    bool m_bFrameLost ;     // 整帧丢了，下一帧输出时标为受损
+    bool m_bFrameQueued ;   // 组好的一帧在帧缓冲中等NextFrame取走
+    bool m_bQueuedKeyFrame ;
+    unsigned int m_dwQueuedTs ;
+    bool m_bOutDamaged ;
+    bool m_bOutKeyFrame ;
+    bool m_bInNal ;
+    unsigned int m_dwNalStart ;
+    unsigned int m_dwFrameTs ;
     
     bool m_bSPSFound ;
     bool m_bWaitKeyFrame ;
@@ -0,0 +1,608 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "CRtpUringTransport.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+static const unsigned recvRingEntries = 2 * ::maxTransportBatch;  // Buffers given back, one entry each
+static const unsigned recvCompletions = 8192;   // One per datagram, room for bursts
+static const int recvSlot = sizeof(io_uring_recvmsg_out) + ::maxTransportPacket;
+static const int recvBufferGroup = 0;
+static const uint64_t recvTag = ~0ULL;
+static const uint64_t provideTag = ~1ULL;
+static const int recvWaitUs = 100000;   // Shutdown does not end the receive, close() is seen by then
+
+// A ring as the kernel maps it, driven without liburing.
+struct CRtpUringRing {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    io_uring_sqe* sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+    void *sqMap;
+    size_t sqMapSize;
+    void *cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+    unsigned pending;       // Prepared, not submitted yet
+};
+
+static void ringClose(CRtpUringRing* ring);
+
+static bool ringSetup(CRtpUringRing* ring, unsigned entries, unsigned completions)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = completions;
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0 && errno == EINVAL) {
+        // Before 5.19, without the cooperative task running
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = completions;
+        fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (fd < 0)
+        return false;
+    ring->fd = fd;
+    
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sqMapSize = ring->cqMapSize = std::max(ring->sqMapSize, ring->cqMapSize);
+    
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sqMap == MAP_FAILED) {
+        ring->sqMap = NULL;
+        ringClose(ring);
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    }
+    else {
+        ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cqMap == MAP_FAILED) {
+            ring->cqMap = NULL;
+            ringClose(ring);
+            return false;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        ringClose(ring);
+        return false;
+    }
+    ring->sqes = (io_uring_sqe*)sqes;
+    
+    uint8_t* sq = (uint8_t*)ring->sqMap;
+    ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+    uint8_t* cq = (uint8_t*)ring->cqMap;
+    ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+}
+
+static void ringClose(CRtpUringRing* ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqMap && ring->cqMap != ring->sqMap)
+        munmap(ring->cqMap, ring->cqMapSize);
+    if (ring->sqMap)
+        munmap(ring->sqMap, ring->sqMapSize);
+    if (ring->fd >= 0)
+        ::close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// The next submission entry, cleared, or NULL with the queue full. The
+// kernel sees it with the next ringEnter().
+static io_uring_sqe* ringSqe(CRtpUringRing* ring)
+{
+    unsigned tail = *ring->sqTail + ring->pending;
+    if (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask)
+        return NULL;
+    
+    unsigned index = tail & ring->sqMask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->pending++;
+    return sqe;
+}
+
+// Submits what is prepared and waits for up to minComplete completions,
+// timeoutUs at most when above 0. -errno on an error, -ETIME timed out.
+static int ringEnter(CRtpUringRing* ring, unsigned minComplete, int timeoutUs)
+{
+    unsigned submit = ring->pending;
+    if (submit == 0 && minComplete == 0)
+        return 0;
+    ring->pending = 0;
+    __atomic_store_n(ring->sqTail, *ring->sqTail + submit, __ATOMIC_RELEASE);
+    
+    unsigned flags = minComplete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    long result;
+    if (minComplete > 0 && timeoutUs > 0) {
+        __kernel_timespec ts;
+        ts.tv_sec = timeoutUs / 1000000;
+        ts.tv_nsec = (timeoutUs % 1000000) * 1000LL;
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        result = syscall(__NR_io_uring_enter, ring->fd, submit, minComplete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+    else {
+        result = syscall(__NR_io_uring_enter, ring->fd, submit, minComplete, flags, NULL, 0);
+    }
+    return result < 0 ? -errno : (int)result;
+}
+
+static io_uring_cqe* ringCqe(CRtpUringRing* ring)
+{
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+static void ringSeen(CRtpUringRing* ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+#endif
+
+CRtpUringTransport::CRtpUringTransport(bool uring)
+    : mUringSend(uring)
+    , mUringReceive(uring)
+    , mRecvRing(NULL)
+    , mSendRing(NULL)
+    , mBufferRing(NULL)
+    , mBufferRingSize(0)
+    , mBufferTail(0)
+    , mRecvMsg(NULL)
+    , mArmed(false)
+    , mReceived(false)
+    , mProvided(false)
+    , mInFlight(0)
+{
+#if !defined(IORING_RECV_MULTISHOT) || !defined(__NR_io_uring_setup)
+    mUringSend = false;
+    mUringReceive = false;
+#endif
+}
+
+CRtpUringTransport::~CRtpUringTransport()
+{
+    stopReceive();
+    stopSend();
+}
+
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+
+bool CRtpUringTransport::startReceive()
+{
+    mRecvRing = new CRtpUringRing;
+    if (!ringSetup(mRecvRing, ::recvRingEntries, ::recvCompletions)) {
+        delete mRecvRing;
+        mRecvRing = NULL;
+        return false;
+    }
+    
+    // The buffer ring, shared with the kernel, hands it the buffers to
+    // receive into
+    long page = sysconf(_SC_PAGESIZE);
+    mBufferRingSize = (::defaultUringRecvBuffers * sizeof(io_uring_buf) + page - 1) / page * page;
+    void *memory = mmap(NULL, mBufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        stopReceive();
+        return false;
+    }
+    mBufferRing = memory;
+    
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)mBufferRing;
+    reg.ring_entries = ::defaultUringRecvBuffers;
+    reg.bgid = ::recvBufferGroup;
+    if (syscall(__NR_io_uring_register, mRecvRing->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        stopReceive();
+        return false;
+    }
+    
+    mRecvBuffers.resize((size_t)::defaultUringRecvBuffers * ::recvSlot);
+    io_uring_buf_ring* ring = (io_uring_buf_ring*)mBufferRing;
+    for (int i = 0; i < ::defaultUringRecvBuffers; i++) {
+        io_uring_buf* buf = &ring->bufs[i];
+        buf->addr = (uint64_t)(uintptr_t)&mRecvBuffers[(size_t)i * ::recvSlot];
+        buf->len = ::recvSlot;
+        buf->bid = (uint16_t)i;
+    }
+    mBufferTail = (uint16_t)::defaultUringRecvBuffers;
+    __atomic_store_n(&ring->tail, mBufferTail, __ATOMIC_RELEASE);
+    
+    // No name or control data, the payload follows the io_uring_recvmsg_out
+    msghdr* msg = new msghdr;
+    memset(msg, 0, sizeof(*msg));
+    mRecvMsg = msg;
+    mArmed = false;
+    mReceived = false;
+    mProvided = false;
+    return armReceive();
+}
+
+// From the ring to buffers handed over by submission. Some kernels take the
+// ring and then find nothing in it.
+bool CRtpUringTransport::provideBuffers()
+{
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = ::recvBufferGroup;
+    syscall(__NR_io_uring_register, mRecvRing->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(mBufferRing, mBufferRingSize);
+    mBufferRing = NULL;
+    
+    io_uring_sqe* sqe = ringSqe(mRecvRing);
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = ::defaultUringRecvBuffers;
+    sqe->addr = (uint64_t)(uintptr_t)mRecvBuffers.data();
+    sqe->len = ::recvSlot;
+    sqe->off = 0;
+    sqe->buf_group = ::recvBufferGroup;
+    sqe->user_data = ::provideTag;
+    mProvided = true;
+    return true;
+}
+
+void CRtpUringTransport::provideBuffer(int bid)
+{
+    if (!mProvided) {
+        io_uring_buf_ring* ring = (io_uring_buf_ring*)mBufferRing;
+        io_uring_buf* buf = &ring->bufs[mBufferTail & (::defaultUringRecvBuffers - 1)];
+        buf->addr = (uint64_t)(uintptr_t)&mRecvBuffers[(size_t)bid * ::recvSlot];
+        buf->len = ::recvSlot;
+        buf->bid = (uint16_t)bid;
+        mBufferTail++;
+        return;
+    }
+    
+    io_uring_sqe* sqe = ringSqe(mRecvRing);
+    if (sqe == NULL) {
+        // Full of buffers given back, they go now
+        ringEnter(mRecvRing, 0, 0);
+        sqe = ringSqe(mRecvRing);
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (uint64_t)(uintptr_t)&mRecvBuffers[(size_t)bid * ::recvSlot];
+    sqe->len = ::recvSlot;
+    sqe->off = bid;
+    sqe->buf_group = ::recvBufferGroup;
+    sqe->user_data = ::provideTag;
+}
+
+bool CRtpUringTransport::armReceive()
+{
+    io_uring_sqe* sqe = ringSqe(mRecvRing);
+    if (sqe == NULL)
+        return false;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = mSocket;
+    sqe->addr = (uint64_t)(uintptr_t)mRecvMsg;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ::recvBufferGroup;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = ::recvTag;
+    if (ringEnter(mRecvRing, 0, 0) < 0)
+        return false;
+    mArmed = true;
+    return true;
+}
+
+void CRtpUringTransport::stopReceive()
+{
+    if (mRecvRing != NULL) {
+        // Closing the ring cancels the receive and lets go of the buffers
+        ringClose(mRecvRing);
+        delete mRecvRing;
+        mRecvRing = NULL;
+    }
+    if (mBufferRing != NULL) {
+        munmap(mBufferRing, mBufferRingSize);
+        mBufferRing = NULL;
+    }
+    delete (msghdr*)mRecvMsg;
+    mRecvMsg = NULL;
+    mArmed = false;
+}
+
+int CRtpUringTransport::receive(CRtpPacket** packets, int maxCount, int timeoutUs)
+{
+    // Coalesced datagrams are cut up by the socket path
+    if (!mUringReceive || mGro)
+        return CRtpUdpTransport::receive(packets, maxCount, timeoutUs);
+    if (mSocket < 0 || mClosed)
+        return -1;
+    if (mRecvRing == NULL && !startReceive()) {
+        stopReceive();
+        mUringReceive = false;
+        return CRtpUdpTransport::receive(packets, maxCount, timeoutUs);
+    }
+    
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(std::max(timeoutUs, 0));
+    int count = 0;
+    int calls = 0;
+    uint64_t bytes = 0;
+    for (;;) {
+        io_uring_cqe* cqe;
+        while (count < maxCount && (cqe = ringCqe(mRecvRing)) != NULL) {
+            int result = cqe->res;
+            unsigned flags = cqe->flags;
+            uint64_t tag = cqe->user_data;
+            ringSeen(mRecvRing);
+            if (tag != ::recvTag) {
+                if (result < 0)
+                    mError = -result;
+                continue;
+            }
+            // Out of buffers, or the socket shut down, ends the multishot
+            if (!(flags & IORING_CQE_F_MORE))
+                mArmed = false;
+            
+            if (result == -ENOBUFS && !mReceived && !mProvided) {
+                // Nothing ever came from the ring, the buffers go by
+                // submission from here
+                if (!provideBuffers()) {
+                    mError = EIO;
+                    break;
+                }
+                continue;
+            }
+            if (!(flags & IORING_CQE_F_BUFFER)) {
+                if (result == -EINVAL && !mReceived) {
+                    // Multishot recvmsg is 6.0, the socket does it from here
+                    stopReceive();
+                    mUringReceive = false;
+                    received(count, bytes, calls);
+                    return count > 0 ? count : CRtpUdpTransport::receive(packets, maxCount, timeoutUs);
+                }
+                if (result < 0 && result != -ENOBUFS && result != -ECONNREFUSED)
+                    mError = -result;
+                continue;
+            }
+            
+            int bid = (int)(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (bid >= ::defaultUringRecvBuffers)
+                continue;
+            uint8_t* buffer = &mRecvBuffers[(size_t)bid * ::recvSlot];
+            io_uring_recvmsg_out* out = (io_uring_recvmsg_out*)buffer;
+            if (result >= (int)sizeof(*out) && !(out->flags & MSG_TRUNC) && out->payloadlen <= (unsigned)::maxTransportPacket) {
+                packets[count++] = CRtpPacket::create(buffer + sizeof(*out), out->payloadlen);
+                bytes += out->payloadlen;
+                mReceived = true;
+            }
+            else {
+                dropped(1);
+            }
+            
+            // Copied out, the buffer goes straight back
+            provideBuffer(bid);
+        }
+        if (!mProvided)
+            __atomic_store_n(&((io_uring_buf_ring*)mBufferRing)->tail, mBufferTail, __ATOMIC_RELEASE);
+        
+        if (count > 0 || mClosed)
+            break;
+        if (!mArmed) {
+            calls++;
+            if (!armReceive()) {
+                mError = EIO;
+                break;
+            }
+        }
+        
+        int waitUs = ::recvWaitUs;
+        if (timeoutUs >= 0) {
+            waitUs = (int)std::chrono::duration_cast<std::chrono::microseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (waitUs <= 0)
+                break;
+            waitUs = std::min(waitUs, ::recvWaitUs);
+        }
+        calls++;
+        int result = ringEnter(mRecvRing, 1, waitUs);
+        if (result == -ETIME)
+            continue;
+        if (result == -EINTR)
+            break;
+        if (result < 0) {
+            mError = -result;
+            break;
+        }
+    }
+    
+    received(count, bytes, calls);
+    if (count == 0 && mClosed)
+        return -1;
+    return count;
+}
+
+bool CRtpUringTransport::startSend()
+{
+    mSendRing = new CRtpUringRing;
+    if (!ringSetup(mSendRing, ::defaultUringSendBuffers, 2 * ::defaultUringSendBuffers)) {
+        delete mSendRing;
+        mSendRing = NULL;
+        return false;
+    }
+    
+    // Registered once, the kernel does not map them again for every write
+    mSendBuffers.resize((size_t)::defaultUringSendBuffers * ::maxTransportPacket);
+    iovec vec;
+    vec.iov_base = mSendBuffers.data();
+    vec.iov_len = mSendBuffers.size();
+    if (syscall(__NR_io_uring_register, mSendRing->fd, IORING_REGISTER_BUFFERS, &vec, 1) != 0) {
+        stopSend();
+        return false;
+    }
+    
+    mFreeSlots.clear();
+    for (int i = ::defaultUringSendBuffers - 1; i >= 0; i--)
+        mFreeSlots.push_back(i);
+    mInFlight = 0;
+    return true;
+}
+
+void CRtpUringTransport::stopSend()
+{
+    if (mSendRing != NULL) {
+        ringClose(mSendRing);
+        delete mSendRing;
+        mSendRing = NULL;
+    }
+    mFreeSlots.clear();
+    mInFlight = 0;
+}
+
+int CRtpUringTransport::reapSends(bool wait)
+{
+    if (wait && mInFlight > 0) {
+        int result = ringEnter(mSendRing, 1, -1);
+        if (result < 0 && result != -EINTR) {
+            mError = -result;
+            return -1;
+        }
+    }
+    
+    int reaped = 0;
+    io_uring_cqe* cqe;
+    while ((cqe = ringCqe(mSendRing)) != NULL) {
+        if (cqe->res < 0) {
+            // Gone already, or too large to go, as a datagram lost on the
+            // way
+            if (cqe->res != -ECONNREFUSED && cqe->res != -EMSGSIZE)
+                mError = -cqe->res;
+            dropped(1);
+        }
+        mFreeSlots.push_back((int)cqe->user_data);
+        mInFlight--;
+        reaped++;
+        ringSeen(mSendRing);
+    }
+    return reaped;
+}
+
+int CRtpUringTransport::send(const uint8_t* const* packets, const int* lengths, int count)
+{
+    if (!mUringSend || mGso)
+        return CRtpUdpTransport::send(packets, lengths, count);
+    if (mSocket < 0 || mClosed)
+        return -1;
+    if (mSendRing == NULL && !startSend()) {
+        stopSend();
+        mUringSend = false;
+        return CRtpUdpTransport::send(packets, lengths, count);
+    }
+    
+    reapSends(false);
+    int done = 0;
+    int calls = 0;
+    uint64_t bytes = 0;
+    while (done < count) {
+        if (lengths[done] > ::maxTransportPacket) {
+            dropped(1);
+            done++;
+            continue;
+        }
+        
+        io_uring_sqe* sqe = mFreeSlots.empty() ? NULL : ringSqe(mSendRing);
+        if (sqe == NULL) {
+            // Every buffer in flight, what is prepared goes and the
+            // oldest are waited for
+            calls++;
+            if (reapSends(true) < 0)
+                break;
+            continue;
+        }
+        
+        int slot = mFreeSlots.back();
+        mFreeSlots.pop_back();
+        uint8_t* buffer = &mSendBuffers[(size_t)slot * ::maxTransportPacket];
+        memcpy(buffer, packets[done], lengths[done]);
+        
+        // A write on a connected datagram socket sends one datagram
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = mSocket;
+        sqe->addr = (uint64_t)(uintptr_t)buffer;
+        sqe->len = lengths[done];
+        sqe->off = (uint64_t)-1;
+        sqe->buf_index = 0;
+        sqe->user_data = (uint64_t)slot;
+        mInFlight++;
+        bytes += lengths[done];
+        done++;
+    }
+    
+    // The whole batch in one call
+    calls++;
+    int result = ringEnter(mSendRing, 0, 0);
+    if (result < 0 && result != -EINTR)
+        mError = -result;
+    sent(done, bytes, calls);
+    return done > 0 || count == 0 ? done : -1;
+}
+
+#else
+
+void CRtpUringTransport::stopReceive()
+{
+}
+
+void CRtpUringTransport::stopSend()
+{
+}
+
+int CRtpUringTransport::send(const uint8_t* const* packets, const int* lengths, int count)
+{
+    return CRtpUdpTransport::send(packets, lengths, count);
+}
+
+int CRtpUringTransport::receive(CRtpPacket** packets, int maxCount, int timeoutUs)
+{
+    return CRtpUdpTransport::receive(packets, maxCount, timeoutUs);
+}
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef __RTP_URING_TRANSPORT_H__
+#define __RTP_URING_TRANSPORT_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "CRtpUdpTransport.h"
+
+// A UDP socket driven through io_uring, for relays where the system calls
+// per packet are what costs. One ring receives: a single multishot recvmsg
+// stays armed and takes each datagram into a buffer of a provided-buffer
+// ring, which goes back as soon as the packet is copied out. Where the
+// kernel will not take buffers from a ring, it is handed them one by one
+// with IORING_OP_PROVIDE_BUFFERS instead. Another ring sends: packets are
+// copied into registered buffers and a batch goes in with one submission,
+// its completions are collected by later sends.
+//
+// Without io_uring, an older kernel (provided-buffer rings are 5.19,
+// multishot recvmsg 6.0) or one that forbids it, the plain socket of
+// CRtpUdpTransport does the work. Linux only, elsewhere always that. With
+// segment offload on, a GSO datagram takes one call there anyway, so that
+// is the path too.
+
+const int defaultUringRecvBuffers = 1024;   // Provided buffers, a power of two.
+const int defaultUringSendBuffers = 256;    // Registered send buffers in flight.
+
+struct CRtpUringRing;
+
+class CRtpUringTransport : public CRtpUdpTransport {
+
+public:
+    // False to go by the plain socket from the start.
+    CRtpUringTransport(bool uring = true);
+    ~CRtpUringTransport();
+    
+    // Whether io_uring carries the packets each way. Each falls back on
+    // its own, the first time it is used.
+    bool uringSend() const { return mUringSend; }
+    bool uringReceive() const { return mUringReceive; }
+    
+    int send(const uint8_t* const* packets, const int* lengths, int count);
+    int receive(CRtpPacket** packets, int maxCount, int timeoutUs);
+
+private:
+    bool startReceive();
+    void stopReceive();
+    bool armReceive();
+    bool provideBuffers();
+    void provideBuffer(int bid);
+    bool startSend();
+    void stopSend();
+    int reapSends(bool wait);
+    
+    bool mUringSend;
+    bool mUringReceive;
+    CRtpUringRing* mRecvRing;
+    CRtpUringRing* mSendRing;
+    
+    // Receives
+    void *mBufferRing;       // io_uring_buf_ring shared with the kernel
+    size_t mBufferRingSize;
+    uint16_t mBufferTail;
+    std::vector<uint8_t> mRecvBuffers;
+    void *mRecvMsg;          // msghdr the multishot recvmsg was armed with
+    bool mArmed;
+    bool mReceived;          // A packet came through it, so multishot works
+    bool mProvided;          // Buffers handed over by IORING_OP_PROVIDE_BUFFERS
+    
+    // Sends
+    std::vector<uint8_t> mSendBuffers;
+    std::vector<int> mFreeSlots;
+    int mInFlight;
+};
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef __RTP_LOG_H__
+#define __RTP_LOG_H__
+
+// Logging for the RTP code, which is built both as Objective-C++ (NSLog) and
+// as plain C++ (stderr).
+
+#ifdef __OBJC__
+#import <Foundation/Foundation.h>
+#define RTP_LOG(fmt, ...) NSLog(@"" fmt, ##__VA_ARGS__)
+#else
+#include <cstdio>
+#define RTP_LOG(fmt, ...) fprintf(stderr, fmt "\n", ##__VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,246 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "CRtpFanout.h"
+#include "CRtpPacer.h"
+#include "RtpBench.h"
+
+// One stream to 1, 8 and 64 viewers. First the most packets a second the
+// fan-out gets through, then 8 seconds of 20 fps with one viewer too slow
+// for the rate: through CRtpFanout, and through the loop that used to call
+// every viewer in turn on the encoder's thread. Reports how long publishing
+// takes, how late the other viewers get their packets, whether they miss
+// any, and whether the slow one, when it skips, resumes on a keyframe.
+
+static const int packetSize = 1200;
+
+// The RTP header, then the NAL header at 12, the publish time at 16 and the
+// packet's number at 24, which the fan-out leaves alone.
+static const int publishedAt = 16;
+static const int packetNumber = 24;
+
+class Viewer {
+
+public:
+    Viewer(bool slow)
+        : mSlow(slow)
+        , mPackets(0)
+        , mLastNumber(-1)
+        , mGaps(0)
+        , mBadResumes(0)
+        , mSum(0)
+    {
+    }
+    
+    // Matches CRtpStreamOutBatchCallback.
+    static void packetsOut(void *viewerRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Viewer* viewer = (Viewer*)viewerRef;
+        int64_t nowUs = CRtpPacer::nowUs();
+        for (int i = 0; i < count; i++) {
+            const uint8_t* p = packets[i];
+            int32_t number;
+            int64_t sentUs;
+            memcpy(&number, p + ::packetNumber, 4);
+            memcpy(&sentUs, p + ::publishedAt, 8);
+            if (viewer->mLastNumber >= 0 && number != viewer->mLastNumber + 1) {
+                viewer->mGaps++;
+                if ((p[12] & 0x1f) != 7)
+                    viewer->mBadResumes++;
+            }
+            viewer->mLastNumber = number;
+            if (viewer->mLatencyUs.size() < 2000000)
+                viewer->mLatencyUs.push_back(nowUs - sentUs);
+            // Touch the packet as a socket write would
+            for (int j = 0; j < lengths[i]; j += 64)
+                viewer->mSum += p[j];
+        }
+        viewer->mPackets += count;
+        if (viewer->mSlow)
+            std::this_thread::sleep_for(std::chrono::microseconds(10000 * count));
+    }
+    
+    bool mSlow;
+    std::atomic<uint64_t> mPackets;
+    int mLastNumber;
+    int mGaps;
+    int mBadResumes;
+    uint64_t mSum;
+    std::vector<int64_t> mLatencyUs;
+};
+
+static double percentileMs(std::vector<int64_t>& values, double p)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    return values[(size_t)(p * (values.size() - 1))] / 1000.0;
+}
+
+// Packets per second published, and delivered to all viewers together,
+// none of them slow. The source backs off while a ring is half full, as a
+// paced one would.
+static void throughput(int viewers)
+{
+    const int queue = 4096;
+    CRtpFanout fanout(queue);
+    std::vector<Viewer*> all;
+    std::vector<int> ids;
+    for (int i = 0; i < viewers; i++) {
+        all.push_back(new Viewer(false));
+        ids.push_back(fanout.subscribe(Viewer::packetsOut, all.back()));
+    }
+    
+    const int batch = 16;
+    const int total = 200000;
+    std::vector<std::vector<uint8_t> > packets(batch, std::vector<uint8_t>(::packetSize, 0));
+    const uint8_t* data[batch];
+    int lengths[batch];
+    uint16_t seq = 0;
+    int64_t startUs = CRtpPacer::nowUs();
+    for (int k = 0; k < total; k += batch) {
+        for (int i = 0; i < batch; i++) {
+            uint8_t* p = packets[i].data();
+            p[0] = 0x80;
+            p[1] = 96;
+            p[2] = (uint8_t)(seq >> 8);
+            p[3] = (uint8_t)seq++;
+            p[12] = 0x41;
+            int32_t number = k + i;
+            memcpy(p + ::packetNumber, &number, 4);
+            memcpy(p + ::publishedAt, &startUs, 8);
+            data[i] = p;
+            lengths[i] = ::packetSize;
+        }
+        fanout.publish(data, lengths, batch);
+        if (k % 256 == 0) {
+            for (;;) {
+                int queued = 0;
+                for (int i = 0; i < viewers; i++) {
+                    CRtpSubscriberStats stats;
+                    fanout.stats(ids[i], &stats);
+                    queued = std::max(queued, stats.queued);
+                }
+                if (queued < queue / 2)
+                    break;
+                std::this_thread::yield();
+            }
+        }
+    }
+    for (int i = 0; i < viewers; i++) {
+        while (all[i]->mPackets < (uint64_t)total)
+            std::this_thread::yield();
+    }
+    double seconds = (CRtpPacer::nowUs() - startUs) / 1e6;
+    
+    printf("%2d viewers  %5.0f k packets/s published, %5.0f k delivered, %4.1f Gbit/s\n", viewers,
+           total / seconds / 1e3, (double)total * viewers / seconds / 1e3,
+           (double)total * viewers * ::packetSize * 8 / seconds / 1e9);
+    for (int i = 0; i < viewers; i++) {
+        fanout.unsubscribe(ids[i]);
+        benchSink += all[i]->mSum;
+        delete all[i];
+    }
+}
+
+// 20 fps for seconds, a keyframe of 60 packets led by its SPS every
+// second and 12 packets for the other frames.
+static void slowViewer(int viewers, bool inlineLoop, int seconds)
+{
+    CRtpFanout fanout;
+    std::vector<Viewer*> all;
+    std::vector<int> ids;
+    for (int i = 0; i < viewers; i++) {
+        all.push_back(new Viewer(i == 0));
+        if (!inlineLoop)
+            ids.push_back(fanout.subscribe(Viewer::packetsOut, all.back()));
+    }
+    
+    std::vector<int64_t> publishUs;
+    std::vector<std::vector<uint8_t> > packets(60, std::vector<uint8_t>(::packetSize, 0));
+    uint16_t seq = 0;
+    int32_t number = 0;
+    int frames = seconds * 20;
+    int64_t startUs = CRtpPacer::nowUs();
+    for (int f = 0; f < frames; f++) {
+        int64_t dueUs = startUs + (int64_t)f * 50000;
+        for (int64_t nowUs = CRtpPacer::nowUs(); nowUs < dueUs; nowUs = CRtpPacer::nowUs())
+            std::this_thread::sleep_for(std::chrono::microseconds(dueUs - nowUs));
+        
+        bool key = f % 20 == 0;
+        int count = key ? 60 : 12;
+        std::vector<const uint8_t*> data;
+        std::vector<int> lengths;
+        int64_t nowUs = CRtpPacer::nowUs();
+        for (int i = 0; i < count; i++) {
+            uint8_t* p = packets[i].data();
+            p[0] = 0x80;
+            p[1] = 96;
+            p[2] = (uint8_t)(seq >> 8);
+            p[3] = (uint8_t)seq++;
+            memset(p + 8, 0x11, 4);
+            p[12] = key && i == 0 ? 0x67 : 0x41;
+            memcpy(p + ::publishedAt, &nowUs, 8);
+            memcpy(p + ::packetNumber, &number, 4);
+            number++;
+            data.push_back(p);
+            lengths.push_back(::packetSize);
+        }
+        
+        int64_t beforeUs = CRtpPacer::nowUs();
+        if (inlineLoop) {
+            for (int i = 0; i < viewers; i++)
+                Viewer::packetsOut(all[i], data.data(), lengths.data(), count);
+        }
+        else {
+            fanout.publish(data.data(), lengths.data(), count);
+        }
+        publishUs.push_back(CRtpPacer::nowUs() - beforeUs);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    
+    uint64_t missing = 0;
+    std::vector<int64_t> latencyUs;
+    uint32_t skips = 0;
+    for (int i = 0; i < viewers; i++) {
+        if (!inlineLoop) {
+            CRtpSubscriberStats stats;
+            fanout.stats(ids[i], &stats);
+            if (i == 0)
+                skips = stats.skips;
+            fanout.unsubscribe(ids[i]);
+        }
+        if (i > 0) {
+            missing += number - all[i]->mPackets;
+            latencyUs.insert(latencyUs.end(), all[i]->mLatencyUs.begin(), all[i]->mLatencyUs.end());
+        }
+    }
+    
+    printf("%-8s %2d viewers  publish p99 %6.2f ms, max %6.2f ms  others p50 %6.2f ms, p99 %6.2f ms, %llu missing"
+           "  slow one %u skips, %d not on a keyframe\n", inlineLoop ? "inline" : "fan-out", viewers,
+           percentileMs(publishUs, 0.99), percentileMs(publishUs, 1.0), percentileMs(latencyUs, 0.5),
+           percentileMs(latencyUs, 0.99), (unsigned long long)missing, skips, all[0]->mBadResumes);
+    for (int i = 0; i < viewers; i++) {
+        benchSink += all[i]->mSum;
+        delete all[i];
+    }
+}
+
+int main()
+{
+    printf("%u cores\n", std::thread::hardware_concurrency());
+    const int viewers[] = { 1, 8, 64 };
+    for (size_t i = 0; i < sizeof(viewers) / sizeof(viewers[0]); i++)
+        throughput(viewers[i]);
+    for (size_t i = 0; i < sizeof(viewers) / sizeof(viewers[0]); i++) {
+        slowViewer(viewers[i], true, 8);
+        slowViewer(viewers[i], false, 8);
+    }
+    return 0;
+}
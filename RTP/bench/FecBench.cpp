@@ -0,0 +1,128 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <random>
+#include "CRtpFecEncoder.h"
+#include "CRtpFecDecoder.h"
+#include "CFecXor.h"
+#include "RtpTest.h"
+#include "RtpBench.h"
+
+// Parity FEC throughput over a frame of 20 packets of 1200 bytes, for each
+// matrix the encoder adapts between: encoding, and decoding with the first
+// packet of every row lost. Then the XOR kernel folding five packets into
+// one against a byte at a time.
+
+static const int packets = 20;
+static const int packetSize = 1200;
+
+static void discardOut(void *, const uint8_t* const*, const int*, int)
+{
+}
+
+struct Matrix {
+    const char* name;
+    int columns;
+    int rows;
+    bool columnParity;
+};
+
+int main()
+{
+    Packets media(::packets);
+    std::vector<const uint8_t*> data(::packets);
+    std::vector<int> lengths(::packets);
+    std::mt19937 rng(3);
+    for (int i = 0; i < ::packets; i++) {
+        media[i].resize(::packetSize);
+        for (int b = 0; b < ::packetSize; b++)
+            media[i][b] = (uint8_t)rng();
+        media[i][0] = 0x80;
+        media[i][1] = 96;
+        media[i][2] = 0;
+        media[i][3] = (uint8_t)i;
+        for (int b = 8; b < 12; b++)
+            media[i][b] = 0x55;
+        data[i] = media[i].data();
+        lengths[i] = ::packetSize;
+    }
+    
+    const Matrix matrices[] = {
+        { "rows of 10", 10, 1, false },
+        { "rows of 5", 5, 1, false },
+        { "2D 4x4", 4, 4, true },
+        { "2D 3x3", 3, 3, true },
+    };
+    for (size_t m = 0; m < sizeof(matrices) / sizeof(matrices[0]); m++) {
+        const Matrix& matrix = matrices[m];
+        CRtpFecEncoder encoder(discardOut, NULL);
+        encoder.setMediaSsrc(0x55555555);
+        encoder.setMatrix(matrix.columns, matrix.rows, true, matrix.columnParity);
+        const int encodes = 20000;
+        double start = cpuSeconds();
+        for (int i = 0; i < encodes; i++)
+            encoder.protect(data.data(), lengths.data(), ::packets);
+        double encodeSeconds = cpuSeconds() - start;
+        
+        Packets sent;
+        CRtpFecEncoder capture(packetsOut, &sent);
+        capture.setMediaSsrc(0x55555555);
+        capture.setMatrix(matrix.columns, matrix.rows, true, matrix.columnParity);
+        capture.protect(data.data(), lengths.data(), ::packets);
+        std::vector<CRtpPacket*> in;
+        for (size_t i = 0; i < sent.size(); i++)
+            in.push_back(CRtpPacket::create(sent[i].data(), (int)sent[i].size()));
+        
+        const int decodes = 5000;
+        int rebuilt = 0;
+        start = cpuSeconds();
+        for (int it = 0; it < decodes; it++) {
+            CRtpFecDecoder decoder(0x55555555);
+            for (size_t i = 0; i < in.size(); i++) {
+                const uint8_t* p = in[i]->data();
+                if ((p[1] & 0x7f) == ::defaultFecPayloadType)
+                    decoder.fecIn(in[i], 0);
+                else if (p[3] % matrix.columns != 0)
+                    decoder.mediaIn(in[i], p[3], 0);
+                while (CRtpPacket* packet = decoder.recovered()) {
+                    rebuilt++;
+                    packet->release();
+                }
+            }
+        }
+        double decodeSeconds = cpuSeconds() - start;
+        for (size_t i = 0; i < in.size(); i++)
+            in[i]->release();
+        
+        printf("%-10s  encode %5.1f Mpkt/s (%5.0f MB/s)  decode %5.1f Mpkt/s, %4.2f M rebuilt/s\n", matrix.name,
+               ::packets * encodes / encodeSeconds / 1e6, (double)::packets * ::packetSize * encodes / encodeSeconds / 1e6,
+               in.size() * decodes / decodeSeconds / 1e6, rebuilt / decodeSeconds / 1e6);
+    }
+    
+    std::vector<uint8_t> parity(::packetSize);
+    const int folds = 2000000;
+    double start = cpuSeconds();
+    for (int i = 0; i < folds; i++)
+        fec::xorInto(parity.data(), data.data(), lengths.data(), 5);
+    double kernelSeconds = cpuSeconds() - start;
+    
+    // A byte at a time, kept from being vectorized, for scale
+    const int byteFolds = folds / 20;
+    start = cpuSeconds();
+    for (int i = 0; i < byteFolds; i++) {
+        for (int k = 0; k < 5; k++) {
+            uint8_t* dst = parity.data();
+            for (int j = 0; j < ::packetSize; j++) {
+                dst[j] ^= data[k][j];
+                __asm__ volatile("" : : "r"(dst) : "memory");
+            }
+        }
+    }
+    double byteSeconds = cpuSeconds() - start;
+    benchSink += parity[0];
+    
+    printf("xor of 5 x %d bytes: %s %.1f GB/s, a byte at a time %.1f GB/s\n", ::packetSize, fec::xorName(),
+           5.0 * ::packetSize * folds / kernelSeconds / 1e9, 5.0 * ::packetSize * byteFolds / byteSeconds / 1e9);
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <random>
+#include "CRtpHeader.h"
+#include "RtpBench.h"
+
+// Parsing the headers of 4096 packets spread over 5 MB, so they come from
+// memory as a receiver's would, through CRtpHeader and through the
+// bitfield struct CRtpUnpack filled before. Both read the version, marker,
+// sequence number, timestamp and SSRC; CRtpHeader also checks the CSRC
+// list, extension and padding against the length.
+
+static const int packets = 4096;
+static const int packetSize = 1200;
+static const int rounds = 2000;
+
+// The header as CRtpUnpack decoded it before, little endian only.
+typedef struct
+{
+    unsigned short   cc:4;
+    unsigned short   x:1;
+    unsigned short   p:1;
+    unsigned short   v:2;
+    unsigned short   pt:7;
+    unsigned short   m:1;
+    
+    unsigned short   seq;
+    unsigned int     ts;
+    unsigned int     ssrc;
+} rtp_hdr_t;
+
+__attribute__((noinline)) static int oldParse(rtp_hdr_t& header, const uint8_t* pBuf, int nSize)
+{
+    unsigned char *cp = (unsigned char*)&header;
+    cp[0] = pBuf[0];
+    cp[1] = pBuf[1];
+    
+    header.seq = pBuf[2];
+    header.seq <<= 8;
+    header.seq |= pBuf[3];
+    
+    header.ts = pBuf[4];
+    header.ts <<= 8;
+    header.ts |= pBuf[5];
+    header.ts <<= 8;
+    header.ts |= pBuf[6];
+    header.ts <<= 8;
+    header.ts |= pBuf[7];
+    
+    header.ssrc = pBuf[8];
+    header.ssrc <<= 8;
+    header.ssrc |= pBuf[9];
+    header.ssrc <<= 8;
+    header.ssrc |= pBuf[10];
+    header.ssrc <<= 8;
+    header.ssrc |= pBuf[11];
+    
+    return header.v == 2 ? nSize - 12 : -1;
+}
+
+__attribute__((noinline)) static int newParse(CRtpHeader& header, const uint8_t* data, int length)
+{
+    return header.parse(data, length) ? header.payloadLength() : -1;
+}
+
+// Nanoseconds per packet, best of three.
+template <class Parse> static double run(const std::vector<uint8_t>& buffer, Parse parse)
+{
+    double best = 1e9;
+    for (int r = 0; r < 3; r++) {
+        double start = wallSeconds();
+        for (int it = 0; it < ::rounds; it++) {
+            for (int i = 0; i < ::packets; i++)
+                benchSink += parse(&buffer[i * ::packetSize]);
+        }
+        double ns = (wallSeconds() - start) * 1e9 / ((double)::rounds * ::packets);
+        if (ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+int main()
+{
+    // Random bytes behind a version 2 header without CSRCs or extension
+    std::vector<uint8_t> buffer(::packets * ::packetSize);
+    std::mt19937 rng(1);
+    for (size_t i = 0; i < buffer.size(); i++)
+        buffer[i] = (uint8_t)rng();
+    for (int i = 0; i < ::packets; i++)
+        buffer[i * ::packetSize] = 0x80;
+    
+    double oldNs = run(buffer, [](const uint8_t* p) {
+        rtp_hdr_t header;
+        int payload = oldParse(header, p, ::packetSize);
+        return (uint64_t)(payload + header.seq + header.ts + header.ssrc + header.m);
+    });
+    double newNs = run(buffer, [](const uint8_t* p) {
+        CRtpHeader header;
+        int payload = newParse(header, p, ::packetSize);
+        return (uint64_t)(payload + header.seqNo() + header.timestamp() + header.ssrc() + header.marker());
+    });
+    printf("rtp_hdr_t   %5.2f ns/packet\n", oldNs);
+    printf("CRtpHeader  %5.2f ns/packet\n", newNs);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <random>
+#include "CNalScanner.h"
+#include "RtpBench.h"
+
+// The start code scanner's kernels against the two loops it replaced, over
+// 64 MiB with no start code in it and a 00 00 03 every 97 bytes, as
+// emulation prevention leaves in a real stream. Each kernel is first
+// checked against a byte-by-byte search on short random buffers.
+
+static const uint8_t* reference(const uint8_t* p, const uint8_t* end)
+{
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    return end;
+}
+
+// The packetizer's loop before, 4 byte start codes only, stepping through
+// the bytes the comparison consumed.
+#define CHECK_NALU(data, idx) ((data[idx++] == 0x00) && \
+(data[idx++] == 0x00) && \
+(data[idx++] == 0x00) && \
+(data[idx++] == 0x01))
+
+static int oldPacketizerScan(const uint8_t* data, int length)
+{
+    int i = 0;
+    while (i < length) {
+        if (CHECK_NALU(data, i))
+            return i;
+    }
+    return length;
+}
+
+// The decoder's loop before, four bytes at a time.
+static const uint8_t* oldDecoderScan(const uint8_t* p, const uint8_t* end)
+{
+    const uint8_t* a = p + 4 - ((intptr_t)p & 3);
+    
+    for (end -= 3; p < a && p < end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    
+    for (end -= 3; p < end; p += 4) {
+        uint32_t x = *(const uint32_t*)p;
+        if ((x - 0x01010101) & (~x) & 0x80808080) {
+            if (p[1] == 0) {
+                if (p[0] == 0 && p[2] == 1)
+                    return p;
+                if (p[2] == 0 && p[3] == 1)
+                    return p + 1;
+            }
+            if (p[3] == 0) {
+                if (p[2] == 0 && p[4] == 1)
+                    return p + 2;
+                if (p[4] == 0 && p[5] == 1)
+                    return p + 3;
+            }
+        }
+    }
+    
+    for (end += 3; p < end; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+            return p;
+    }
+    return end + 3;
+}
+
+// Offsets into buffers of zeros, ones and random bytes where the kernel
+// and the reference disagree.
+static int mismatches()
+{
+    std::mt19937 rng(1);
+    int count = 0;
+    for (int it = 0; it < 20000; it++) {
+        std::vector<uint8_t> buffer(rng() % 300);
+        for (size_t i = 0; i < buffer.size(); i++) {
+            int r = rng() % 8;
+            buffer[i] = r < 4 ? 0 : r < 6 ? 1 : (uint8_t)rng();
+        }
+        const uint8_t* end = buffer.data() + buffer.size();
+        for (size_t off = 0; off <= buffer.size(); off += 1 + rng() % 7) {
+            if (nalu::findStartCode3(buffer.data() + off, end) != reference(buffer.data() + off, end))
+                count++;
+        }
+    }
+    return count;
+}
+
+// Best of three, in GB/s.
+template <class Scan> static double throughput(const std::vector<uint8_t>& buffer, Scan scan)
+{
+    double best = 0;
+    for (int r = 0; r < 3; r++) {
+        double start = wallSeconds();
+        benchSink += (uintptr_t)scan(buffer.data(), buffer.data() + buffer.size());
+        double rate = buffer.size() / (wallSeconds() - start) / 1e9;
+        if (rate > best)
+            best = rate;
+    }
+    return best;
+}
+
+int main()
+{
+    const size_t size = 64 << 20;
+    std::vector<uint8_t> buffer(size);
+    std::mt19937 rng(2);
+    for (size_t i = 0; i < size; i++) {
+        uint8_t b = (uint8_t)rng();
+        buffer[i] = b != 0 ? b : 0x80;
+    }
+    for (size_t i = 0; i + 2 < size; i += 97) {
+        buffer[i] = 0;
+        buffer[i + 1] = 0;
+        buffer[i + 2] = 3;
+    }
+    
+    const char* kernels[] = { "avx2", "sse2", "neon", "scalar" };
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (!nalu::useScanner(kernels[k]))
+            continue;
+        int wrong = mismatches();
+        printf("%-18s %5.2f GB/s  %s\n", kernels[k], throughput(buffer, nalu::findStartCode3),
+               wrong == 0 ? "agrees with the reference" : "DISAGREES with the reference");
+    }
+    printf("%-18s %5.2f GB/s\n", "old packetizer", throughput(buffer, [](const uint8_t* p, const uint8_t* end) {
+        return p + oldPacketizerScan(p, (int)(end - p));
+    }));
+    printf("%-18s %5.2f GB/s\n", "old decoder", throughput(buffer, oldDecoderScan));
+    return 0;
+}
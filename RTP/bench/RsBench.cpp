@@ -0,0 +1,188 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include "CGf256.h"
+#include "CRtpRsEncoder.h"
+#include "CRtpRsDecoder.h"
+#include "RtpTest.h"
+#include "RtpBench.h"
+
+// Reed-Solomon cost on 1080p keyframes of 100, 250 and 500 KB at 10, 25
+// and 50% repair: encoding, and decoding with as many packets lost as
+// there is repair. Then one encoder per thread on streams of their own,
+// and the multiply-add kernel against log and exp tables a byte at a time.
+
+static const int payloadSize = 1388;
+static const uint32_t ssrc = 0x55555555;
+
+static void discardOut(void *, const uint8_t* const*, const int*, int)
+{
+}
+
+// FU-A packets of a keyframe of the given size.
+struct KeyFrame {
+    KeyFrame(int bytes)
+    {
+        std::mt19937 rng(bytes);
+        int count = (bytes + ::payloadSize - 1) / ::payloadSize;
+        for (int i = 0; i < count; i++) {
+            int payload = i == count - 1 ? bytes - (count - 1) * ::payloadSize : ::payloadSize;
+            std::vector<uint8_t> packet(14 + payload);
+            for (size_t b = 0; b < packet.size(); b++)
+                packet[b] = (uint8_t)rng();
+            packet[0] = 0x80;
+            packet[1] = 96 | (i == count - 1 ? 0x80 : 0);
+            packet[2] = (uint8_t)((1000 + i) >> 8);
+            packet[3] = (uint8_t)(1000 + i);
+            for (int b = 0; b < 4; b++)
+                packet[8 + b] = (uint8_t)(::ssrc >> (24 - 8 * b));
+            packet[12] = 0x7c;
+            packet[13] = (i == 0 ? 0x80 : 0) | 5;
+            packets.push_back(packet);
+        }
+        for (size_t i = 0; i < packets.size(); i++) {
+            data.push_back(packets[i].data());
+            lengths.push_back((int)packets[i].size());
+        }
+    }
+    
+    int count() const { return (int)packets.size(); }
+    
+    Packets packets;
+    std::vector<const uint8_t*> data;
+    std::vector<int> lengths;
+};
+
+static void encodeDecode(const KeyFrame& frame, int bytes, float share)
+{
+    CRtpRsEncoder encoder(discardOut, NULL);
+    encoder.setMediaSsrc(::ssrc);
+    encoder.setProtection(share, share);
+    int encodes = std::max(20, (int)(1e8 / (bytes * share)));
+    double start = cpuSeconds();
+    for (int i = 0; i < encodes; i++)
+        encoder.protect(frame.data.data(), frame.lengths.data(), frame.count());
+    double encodeSeconds = cpuSeconds() - start;
+    
+    Packets sent;
+    CRtpRsEncoder capture(packetsOut, &sent);
+    capture.setMediaSsrc(::ssrc);
+    capture.setProtection(share, share);
+    capture.protect(frame.data.data(), frame.lengths.data(), frame.count());
+    std::vector<CRtpPacket*> media, repair;
+    for (size_t i = 0; i < sent.size(); i++) {
+        CRtpPacket* packet = CRtpPacket::create(sent[i].data(), (int)sent[i].size());
+        ((sent[i][1] & 0x7f) == ::defaultRsPayloadType ? repair : media).push_back(packet);
+    }
+    
+    // Every other packet from the start of each block, as many as the
+    // block has repair
+    std::vector<bool> lost(media.size(), false);
+    for (size_t i = 0; i < repair.size(); i++) {
+        const uint8_t* header = repair[i]->data() + 16;
+        int base = ((header[0] << 8) | header[1]) - 1000;
+        for (int k = 0; k < header[3]; k++)
+            lost[base + 2 * k] = true;
+    }
+    int lostCount = (int)std::count(lost.begin(), lost.end(), true);
+    
+    int decodes = std::max(10, (int)(1e8 / (bytes * share)));
+    int rebuilt = 0;
+    start = cpuSeconds();
+    for (int it = 0; it < decodes; it++) {
+        CRtpRsDecoder decoder(::ssrc);
+        for (size_t i = 0; i < media.size(); i++) {
+            if (!lost[i])
+                decoder.mediaIn(media[i], (uint16_t)(1000 + i), 0);
+        }
+        for (size_t i = 0; i < repair.size(); i++)
+            decoder.fecIn(repair[i], 0);
+        while (CRtpPacket* packet = decoder.recovered()) {
+            rebuilt++;
+            packet->release();
+        }
+    }
+    double decodeSeconds = cpuSeconds() - start;
+    for (size_t i = 0; i < media.size(); i++)
+        media[i]->release();
+    for (size_t i = 0; i < repair.size(); i++)
+        repair[i]->release();
+    
+    printf("%4d KB %3d packets +%3d repair (%2.0f%%)  encode %6.3f ms  decode %6.3f ms, %5.1f%% of %d lost rebuilt\n",
+           bytes / 1000, frame.count(), (int)repair.size(), 100 * share, encodeSeconds / encodes * 1e3,
+           decodeSeconds / decodes * 1e3, 100.0 * rebuilt / decodes / lostCount, lostCount);
+}
+
+static void encodeStream(const KeyFrame* frame, int frames)
+{
+    CRtpRsEncoder encoder(discardOut, NULL);
+    encoder.setMediaSsrc(::ssrc);
+    encoder.setProtection(0.25f, 0.25f);
+    for (int i = 0; i < frames; i++)
+        encoder.protect(frame->data.data(), frame->lengths.data(), frame->count());
+}
+
+int main()
+{
+    printf("kernel %s\n", gf::kernelName());
+    const int sizes[] = { 100000, 250000, 500000 };
+    const float shares[] = { 0.10f, 0.25f, 0.50f };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        KeyFrame frame(sizes[s]);
+        for (size_t k = 0; k < sizeof(shares) / sizeof(shares[0]); k++)
+            encodeDecode(frame, sizes[s], shares[k]);
+    }
+    
+    // Encoders share nothing, so keyframes per second should grow with the
+    // threads up to the core count
+    KeyFrame frame(250000);
+    int cores = (int)std::thread::hardware_concurrency();
+    printf("250 KB keyframes at 25%%, one stream per thread, %d cores\n", cores);
+    for (int threads = 1; threads <= 2 * cores; threads *= 2) {
+        const int frames = 400;
+        double start = wallSeconds();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++)
+            pool.push_back(std::thread(encodeStream, &frame, frames));
+        for (int t = 0; t < threads; t++)
+            pool[t].join();
+        double elapsed = wallSeconds() - start;
+        printf("%3d threads  %6.0f keyframes/s\n", threads, threads * frames / elapsed);
+    }
+    
+    // One repair row over 100 sources
+    std::vector<uint8_t> dst(::payloadSize + 12);
+    std::vector<const uint8_t*> srcs;
+    std::vector<int> lengths;
+    std::vector<uint8_t> coefs;
+    for (int i = 0; i < 100; i++) {
+        srcs.push_back(frame.data[i] + 12);
+        lengths.push_back(::payloadSize);
+        coefs.push_back((uint8_t)(i + 3));
+    }
+    const int rows = 20000;
+    double start = cpuSeconds();
+    for (int i = 0; i < rows; i++)
+        gf::mulAdd(dst.data(), srcs.data(), lengths.data(), coefs.data(), 100);
+    double kernelSeconds = cpuSeconds() - start;
+    
+    const int slowRows = rows / 50;
+    start = cpuSeconds();
+    for (int i = 0; i < slowRows; i++) {
+        for (int k = 0; k < 100; k++) {
+            for (int b = 0; b < ::payloadSize; b++)
+                dst[b] ^= gf::mul(coefs[k], srcs[k][b]);
+        }
+    }
+    double slowSeconds = cpuSeconds() - start;
+    benchSink += dst[0];
+    
+    printf("multiply-add of 100 x %d bytes: %s %.2f GB/s, log and exp a byte at a time %.2f GB/s\n", ::payloadSize,
+           gf::kernelName(), 100.0 * ::payloadSize * rows / kernelSeconds / 1e9,
+           100.0 * ::payloadSize * slowRows / slowSeconds / 1e9);
+    return 0;
+}
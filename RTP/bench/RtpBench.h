@@ -0,0 +1,28 @@
+#ifndef __RTP_BENCH_H__
+#define __RTP_BENCH_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <time.h>
+
+// Shared by the benchmarks: clocks, and somewhere for results to go that
+// the optimizer cannot see through. Test streams come from RtpTest.h.
+
+inline double wallSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// CPU time of the calling thread.
+inline double cpuSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+inline volatile uint64_t benchSink = 0;
+
+#endif
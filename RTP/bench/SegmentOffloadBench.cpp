@@ -0,0 +1,147 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "CRtpStream.h"
+#include "CRtpDemuxer.h"
+#include "CRtpPacer.h"
+#include "CRtpUdpTransport.h"
+#include "RtpTest.h"
+#include "RtpBench.h"
+
+// Stream to demuxer over UDP on 127.0.0.1, with GSO on the sending socket,
+// GRO on the receiving one, both or neither. First keyframes of 150 KB
+// only, about 110 packets each, then a stream with a keyframe every 30 and
+// P frames of 8 to 14 KB, as fast as the receiver drains them. Reports
+// frames out whole, CPU per frame on the sending thread, the receiving
+// thread and the whole process, and system calls each side.
+
+static const int frameTicks = 3000;
+
+// Frames the demuxer hands out whole, parameter sets apart.
+static void frameIn(void *countRef, uint32_t, int, CRtpFrame* frame, uint32_t, bool damaged)
+{
+    if (!damaged && frame->length() >= 100)
+        (*(int*)countRef)++;
+}
+
+static double processSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void run(const char* name, bool gso, bool gro, int frames, int keyEvery)
+{
+    CRtpUdpTransport out, in;
+    out.setSegmentOffload(gso);
+    in.setSegmentOffload(gro);
+    in.open("127.0.0.1", 0);
+    out.open("127.0.0.1", 0);
+    out.connect("127.0.0.1", in.port());
+    in.connect("127.0.0.1", out.port());
+    
+    std::vector<std::vector<uint8_t> > avcc(frames);
+    std::vector<std::vector<std::vector<uint8_t> > > paramSets(frames);
+    for (int i = 0; i < frames; i++) {
+        bool idr = i % keyEvery == 0;
+        toAvcc(makeFrame(idr, idr ? 150000 : 8000 + (i % 7) * 900, i), 4, &avcc[i], &paramSets[i]);
+    }
+    
+    std::atomic<bool> done(false);
+    std::atomic<long> received(0);
+    int whole = 0;
+    double rxSeconds = 0;
+    std::thread rx([&] {
+        double start = cpuSeconds();
+        CRtpDemuxer demuxer(frameIn, &whole);
+        demuxer.addPayloadType(96);
+        CRtpPacket* packets[::maxTransportBatch];
+        for (;;) {
+            int n = in.receive(packets, ::maxTransportBatch, 20000);
+            if (n < 0)
+                break;
+            int64_t nowUs = CRtpPacer::nowUs();
+            for (int i = 0; i < n; i++) {
+                demuxer.packetIn(packets[i], nowUs);
+                packets[i]->release();
+            }
+            received += n;
+            if (n == 0 && done)
+                break;
+            demuxer.poll(nowUs);
+        }
+        demuxer.poll(CRtpPacer::nowUs() + 10000000);
+        rxSeconds = cpuSeconds() - start;
+    });
+    
+    CRtpStream stream(CRtpTransport::packetsIn, &out);
+    double start = wallSeconds();
+    double processStart = processSeconds();
+    double txStart = cpuSeconds();
+    for (int i = 0; i < frames; i++) {
+        const uint8_t* sets[2];
+        int setLengths[2];
+        for (size_t k = 0; k < paramSets[i].size(); k++) {
+            sets[k] = paramSets[i][k].data();
+            setLengths[k] = (int)paramSets[i][k].size();
+        }
+        stream.streamOutAvcc(avcc[i].data(), (int)avcc[i].size(), 4, i * ::frameTicks, sets, setLengths,
+                             (int)paramSets[i].size());
+        // Keep within what the receiver drains, UDP on loopback drops
+        // otherwise
+        CRtpTransportStats sent;
+        out.stats(&sent);
+        double waitStart = wallSeconds();
+        while ((long)sent.packetsSent - received > 500 && wallSeconds() - waitStart < 0.005)
+            std::this_thread::yield();
+    }
+    double txSeconds = cpuSeconds() - txStart;
+    
+    // Until nothing more comes in
+    long last = -1;
+    double end = wallSeconds();
+    for (;;) {
+        long now = received;
+        if (now != last) {
+            last = now;
+            end = wallSeconds();
+        }
+        else if (wallSeconds() - end > 0.1) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double processCpu = processSeconds() - processStart;
+    done = true;
+    rx.join();
+    
+    CRtpTransportStats sent, stats;
+    out.stats(&sent);
+    in.stats(&stats);
+    printf("%-14s %5d frames, %5d whole  %5.0f fps  us/frame tx %6.1f rx %6.1f process %6.1f"
+           "  system calls tx %6llu rx %6llu  %llu of %llu packets in\n",
+           name, frames, whole, frames / (end - start), txSeconds * 1e6 / frames, rxSeconds * 1e6 / frames,
+           processCpu * 1e6 / frames, (unsigned long long)sent.calls, (unsigned long long)stats.calls,
+           (unsigned long long)stats.packetsReceived, (unsigned long long)sent.packetsSent);
+}
+
+int main()
+{
+    printf("%u cores\n", std::thread::hardware_concurrency());
+    for (int round = 0; round < 2; round++) {
+        printf("keyframes only, 150 KB:\n");
+        run("  plain", false, false, 1000, 1);
+        run("  gso", true, false, 1000, 1);
+        run("  gro", false, true, 1000, 1);
+        run("  gso and gro", true, true, 1000, 1);
+        printf("keyframe every 30, P frames of 8 to 14 KB:\n");
+        run("  plain", false, false, 4000, 30);
+        run("  gso and gro", true, true, 4000, 30);
+    }
+    return 0;
+}
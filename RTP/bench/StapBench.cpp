@@ -0,0 +1,157 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include "CRtpStream.h"
+#include "RtpTest.h"
+
+// Packets a stream takes with STAP-A aggregation and without. Given an
+// Annex-B file (a raw .h264 capture) it packs that, access unit by access
+// unit as VideoToolbox would hand them over; otherwise streams shaped like
+// the demo's: 30 fps, a keyframe every second with SPS, PPS and SEI, one
+// slice a frame, then the same with four slices a frame.
+
+typedef std::vector<std::vector<uint8_t> > AccessUnit;   // Its NAL units, no start codes
+
+static void countOut(void *countRef, const uint8_t*, int)
+{
+    (*(long*)countRef)++;
+}
+
+// Start of the next NAL unit at or after p, behind a 3 or 4 byte start
+// code, and where that start code begins.
+static size_t nextNal(const std::vector<uint8_t>& data, size_t p, size_t* codeStart)
+{
+    for (; p + 3 <= data.size(); p++) {
+        if (data[p] == 0 && data[p + 1] == 0 && data[p + 2] == 1) {
+            *codeStart = p > 0 && data[p - 1] == 0 ? p - 1 : p;
+            return p + 3;
+        }
+    }
+    *codeStart = data.size();
+    return data.size();
+}
+
+// Access units of an Annex-B stream: a new one at an access unit
+// delimiter, parameter set or SEI after a slice, or at a slice that starts
+// a picture (first_mb_in_slice 0) after one.
+static std::vector<AccessUnit> readAnnexB(const char* path)
+{
+    std::vector<AccessUnit> units;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return units;
+    std::vector<uint8_t> data;
+    uint8_t buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0)
+        data.insert(data.end(), buf, buf + n);
+    fclose(file);
+    
+    size_t codeStart;
+    size_t begin = nextNal(data, 0, &codeStart);
+    bool sliceSeen = false;
+    while (begin < data.size()) {
+        size_t next = nextNal(data, begin, &codeStart);
+        size_t end = codeStart;
+        while (end > begin && data[end - 1] == 0)
+            end--;
+        if (end > begin) {
+            int type = data[begin] & 0x1f;
+            bool slice = type == 1 || type == 5;
+            bool firstSlice = slice && end > begin + 1 && (data[begin + 1] & 0x80) != 0;
+            if (units.empty() || (sliceSeen && (type == 9 || type == 7 || type == 8 || type == 6 || firstSlice))) {
+                units.push_back(AccessUnit());
+                sliceSeen = false;
+            }
+            sliceSeen = sliceSeen || slice;
+            if (type != 9)
+                units.back().push_back(std::vector<uint8_t>(data.begin() + begin, data.begin() + end));
+        }
+        begin = next;
+    }
+    return units;
+}
+
+static std::vector<AccessUnit> makeStream(int frames, int slices)
+{
+    std::vector<AccessUnit> units;
+    for (int k = 0; k < frames; k++) {
+        std::vector<uint8_t> frame;
+        bool idr = k % 30 == 0;
+        if (idr) {
+            appendNal(frame, 0x67, 15, k);
+            appendNal(frame, 0x68, 4, k + 1);
+            appendNal(frame, 0x06, 12, k + 2);
+        }
+        // 60 KB keyframes, P-frames of 2 to 14 KB
+        int size = idr ? 60000 : 2000 + (k * 7919) % 12000;
+        for (int i = 0; i < slices; i++)
+            appendNal(frame, idr ? 0x65 : 0x41, size / slices, k * 8 + i);
+        
+        AccessUnit unit;
+        std::vector<uint8_t> avcc;
+        std::vector<std::vector<uint8_t> > paramSets;
+        toAvcc(frame, 4, &avcc, &paramSets);
+        unit = paramSets;
+        for (size_t p = 0; p + 4 <= avcc.size(); ) {
+            size_t length = (size_t)avcc[p] << 24 | avcc[p + 1] << 16 | avcc[p + 2] << 8 | avcc[p + 3];
+            unit.push_back(std::vector<uint8_t>(avcc.begin() + p + 4, avcc.begin() + p + 4 + length));
+            p += 4 + length;
+        }
+        units.push_back(unit);
+    }
+    return units;
+}
+
+static long packets(const std::vector<AccessUnit>& units, bool aggregation)
+{
+    long count = 0;
+    CRtpStream stream(countOut, &count);
+    stream.setAggregation(aggregation);
+    for (size_t k = 0; k < units.size(); k++) {
+        // Parameter sets apart, the rest behind 4 byte lengths
+        std::vector<const uint8_t*> sets;
+        std::vector<int> setLengths;
+        std::vector<uint8_t> avcc;
+        for (size_t i = 0; i < units[k].size(); i++) {
+            const std::vector<uint8_t>& nal = units[k][i];
+            int type = nal[0] & 0x1f;
+            if (type == 7 || type == 8) {
+                sets.push_back(nal.data());
+                setLengths.push_back((int)nal.size());
+                continue;
+            }
+            for (int b = 3; b >= 0; b--)
+                avcc.push_back((uint8_t)(nal.size() >> (8 * b)));
+            avcc.insert(avcc.end(), nal.begin(), nal.end());
+        }
+        stream.streamOutAvcc(avcc.data(), (int)avcc.size(), 4, (uint32_t)k * 3000, sets.data(), setLengths.data(),
+                             (int)sets.size());
+    }
+    return count;
+}
+
+static void report(const char* name, const std::vector<AccessUnit>& units)
+{
+    long with = packets(units, true);
+    long without = packets(units, false);
+    printf("%-28s %6zu frames  %7ld packets with STAP-A, %7ld without, %5.2f%% fewer\n",
+           name, units.size(), with, without, 100.0 * (without - with) / without);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        std::vector<AccessUnit> units = readAnnexB(argv[1]);
+        if (units.empty()) {
+            fprintf(stderr, "%s: no access units\n", argv[1]);
+            return 1;
+        }
+        report(argv[1], units);
+        return 0;
+    }
+    report("1 slice a frame", makeStream(9000, 1));
+    report("4 slices a frame", makeStream(9000, 4));
+    return 0;
+}
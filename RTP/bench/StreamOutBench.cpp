@@ -0,0 +1,63 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <sys/uio.h>
+#include "CRtpStream.h"
+#include "RtpTest.h"
+#include "RtpBench.h"
+
+// Packetizing 1080p keyframes through each output mode of CRtpStream. The
+// callbacks only look at what they are handed, as a transport about to
+// send it would: the copying mode has staged every packet in the stream's
+// buffer, the scatter-gather mode points into the frame.
+
+static void copyOut(void *, const uint8_t* data, int length)
+{
+    benchSink += data[0] + data[length - 1] + length;
+}
+
+static void vecOut(void *, const struct iovec* iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+        benchSink += iov[i].iov_len;
+}
+
+static void batchOut(void *, const uint8_t* const* packets, const int* lengths, int count)
+{
+    for (int i = 0; i < count; i++)
+        benchSink += packets[i][0] + lengths[i];
+}
+
+// Microseconds per frame, over at least half a second.
+static double run(CRtpStream& stream, const std::vector<uint8_t>& frame)
+{
+    int frames = 0;
+    double start = wallSeconds();
+    double elapsed;
+    do {
+        for (int i = 0; i < 100; i++)
+            stream.streamOut(frame.data(), (int)frame.size(), (frames + i) * 3000);
+        frames += 100;
+        elapsed = wallSeconds() - start;
+    } while (elapsed < 0.5);
+    return elapsed * 1e6 / frames;
+}
+
+int main()
+{
+    const int sizes[] = { 100000, 250000, 500000 };
+    printf("%-10s %19s %19s %19s\n", "keyframe", "copy", "scatter-gather", "batch");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        std::vector<uint8_t> frame = makeFrame(true, sizes[i], (uint32_t)i);
+        CRtpStream copyStream(copyOut, NULL);
+        CRtpStream vecStream(vecOut, NULL);
+        CRtpStream batchStream(batchOut, NULL);
+        double us[3] = { run(copyStream, frame), run(vecStream, frame), run(batchStream, frame) };
+        printf("%7d KB", sizes[i] / 1000);
+        for (int k = 0; k < 3; k++)
+            printf("   %6.1f us %5.1f GB/s", us[k], frame.size() / us[k] / 1000);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <set>
+#include <thread>
+#include "CRtpStream.h"
+#include "RtpTest.h"
+#include "RtpBench.h"
+
+// 64 streams packetized at once by a pool of 1 to 2 x cores threads, each
+// thread taking every n'th stream. Streams share no state, so frames per
+// second should grow with the threads up to the core count. Afterwards
+// every stream's SSRC is its own and its sequence numbers have moved by
+// its own packets alone.
+
+static const int streams = 64;
+static const int framesPerStream = 600;
+
+struct Stream {
+    Stream() : stream(packetOut, this), firstSeq(stream.seqNo()), packets(0), sum(0) {}
+    
+    static void packetOut(void *streamRef, const uint8_t* data, int length)
+    {
+        Stream* s = (Stream*)streamRef;
+        s->packets++;
+        s->sum += data[0] + length;
+    }
+    
+    CRtpStream stream;
+    uint16_t firstSeq;
+    uint64_t packets;
+    uint64_t sum;
+};
+
+static void work(std::vector<Stream*>& all, int thread, int threads, const std::vector<std::vector<uint8_t> >& frames)
+{
+    for (int k = 0; k < framesPerStream; k++) {
+        const std::vector<uint8_t>& frame = frames[k % frames.size()];
+        for (int i = thread; i < streams; i += threads)
+            all[i]->stream.streamOut(frame.data(), (int)frame.size(), k * 3000);
+    }
+}
+
+int main()
+{
+    // A second of 30 fps: an IDR, then P-frames
+    std::vector<std::vector<uint8_t> > frames;
+    for (int k = 0; k < 30; k++)
+        frames.push_back(makeFrame(k == 0, k == 0 ? 100000 : 8000, k));
+    
+    int cores = (int)std::thread::hardware_concurrency();
+    printf("%d cores, %d streams, %d frames each\n", cores, streams, framesPerStream);
+    double single = 0;
+    for (int threads = 1; threads <= 2 * cores && threads <= streams; threads *= 2) {
+        std::vector<Stream*> all;
+        for (int i = 0; i < streams; i++)
+            all.push_back(new Stream());
+        
+        double start = wallSeconds();
+        std::vector<std::thread> pool;
+        for (int t = 0; t < threads; t++)
+            pool.push_back(std::thread(work, std::ref(all), t, threads, std::cref(frames)));
+        for (int t = 0; t < threads; t++)
+            pool[t].join();
+        double elapsed = wallSeconds() - start;
+        
+        std::set<uint32_t> ssrcs;
+        int ownSeqs = 0;
+        for (int i = 0; i < streams; i++) {
+            ssrcs.insert(all[i]->stream.ssrc());
+            if ((uint16_t)(all[i]->stream.seqNo() - all[i]->firstSeq) == (uint16_t)all[i]->packets)
+                ownSeqs++;
+            benchSink += all[i]->sum;
+            delete all[i];
+        }
+        
+        double fps = streams * framesPerStream / elapsed;
+        if (threads == 1)
+            single = fps;
+        printf("%3d threads  %9.0f frames/s  x%.2f  SSRCs distinct %zu of %d, sequence numbers own %d of %d\n",
+               threads, fps, fps / single, ssrcs.size(), streams, ownSeqs, streams);
+    }
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include "CRtpLoopbackTransport.h"
+#include "CRtpUdpTransport.h"
+#include "CRtpUringTransport.h"
+#include "RtpBench.h"
+
+// Packets of 1200 bytes from one thread to another as fast as they go,
+// over UDP on 127.0.0.1 in batches of 1, 8, 32 and 64, and through the
+// queue in memory in batches of 1 and 64. Reports packets per second, and
+// per second of CPU on the sending and on the receiving thread. Then
+// io_uring against sendmmsg() and recvmmsg() on either end, where the CPU
+// of the whole process counts too, since the kernel does some of the
+// ring's work on threads of its own.
+
+static const int packetSize = 1200;
+
+static double processSeconds()
+{
+    timespec t;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void rate(const char* name, CRtpTransport* out, CRtpTransport* in, int batch, int total)
+{
+    std::vector<uint8_t> packet(::packetSize, 0x5a);
+    packet[0] = 0x80;
+    packet[1] = 96;
+    std::atomic<bool> stop(false);
+    std::atomic<long> received(0);
+    double rxSeconds = 0;
+    std::thread rx([&] {
+        double start = cpuSeconds();
+        CRtpPacket* packets[::maxTransportBatch];
+        for (;;) {
+            int n = in->receive(packets, ::maxTransportBatch, 50000);
+            if (n < 0)
+                break;
+            for (int i = 0; i < n; i++)
+                packets[i]->release();
+            received += n;
+            if (n == 0 && stop)
+                break;
+        }
+        rxSeconds = cpuSeconds() - start;
+    });
+    
+    std::vector<const uint8_t*> data(batch, packet.data());
+    std::vector<int> lengths(batch, ::packetSize);
+    double start = wallSeconds();
+    double processStart = processSeconds();
+    double txStart = cpuSeconds();
+    for (int sent = 0; sent < total; sent += batch) {
+        CRtpTransport::packetsIn(out, data.data(), lengths.data(), batch);
+        // Keep within what the receiver drains, UDP on loopback drops
+        // otherwise
+        while (sent - received > 4000)
+            std::this_thread::yield();
+    }
+    double txSeconds = cpuSeconds() - txStart;
+    double seconds = wallSeconds() - start;
+    stop = true;
+    rx.join();
+    double processCpu = processSeconds() - processStart;
+    
+    printf("%-20s batch %2d  %8.0f packets/s  tx %8.0f packets/CPU-s  rx %8.0f packets/CPU-s"
+           "  process %5.2f us/packet  %.3f delivered\n",
+           name, batch, total / seconds, total / txSeconds, received / std::max(rxSeconds, 1e-9),
+           processCpu * 1e6 / std::max(received.load(), 1L), (double)received / total);
+}
+
+static void openPair(CRtpUdpTransport& a, CRtpUdpTransport& b)
+{
+    b.open("127.0.0.1", 0);
+    a.open("127.0.0.1", 0);
+    a.connect("127.0.0.1", b.port());
+    b.connect("127.0.0.1", a.port());
+}
+
+int main()
+{
+    printf("%u cores\n", std::thread::hardware_concurrency());
+    const int udpBatches[] = { 1, 8, 32, 64 };
+    for (size_t i = 0; i < sizeof(udpBatches) / sizeof(udpBatches[0]); i++) {
+        CRtpUdpTransport a, b;
+        openPair(a, b);
+        rate("127.0.0.1", &a, &b, udpBatches[i], 400000);
+    }
+    const int loopbackBatches[] = { 1, 64 };
+    for (size_t i = 0; i < sizeof(loopbackBatches) / sizeof(loopbackBatches[0]); i++) {
+        CRtpLoopbackTransport a, b;
+        CRtpLoopbackTransport::connect(&a, &b);
+        rate("loopback", &a, &b, loopbackBatches[i], 1000000);
+    }
+    
+    // Each pairing twice, the first round warms the rings and the caches
+    for (int round = 0; round < 2; round++) {
+        {
+            CRtpUdpTransport a, b;
+            openPair(a, b);
+            rate("mmsg -> mmsg", &a, &b, 64, 400000);
+        }
+        {
+            CRtpUdpTransport a;
+            CRtpUringTransport b;
+            openPair(a, b);
+            rate(b.uringReceive() ? "mmsg -> io_uring" : "mmsg -> fallback", &a, &b, 64, 400000);
+        }
+        {
+            CRtpUringTransport a;
+            CRtpUdpTransport b;
+            openPair(a, b);
+            rate(a.uringSend() ? "io_uring -> mmsg" : "fallback -> mmsg", &a, &b, 64, 400000);
+        }
+        {
+            CRtpUringTransport a, b;
+            openPair(a, b);
+            rate("io_uring -> io_uring", &a, &b, 64, 400000);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fstream>
+#include <string>
+#include <malloc.h>
+#include "CRtpStream.h"
+#include "CRtpHeader.h"
+#include "CRtpUnpack.h"
+#include "RtpTest.h"
+
+// Resident memory of 100 receivers fed the same 40 frame stream, keyframes
+// of 200 KB and of 3 MB, as CRtpUnpack assembles frames now, in buffers
+// from the shared pool, and as it did before, each in a 1 MiB buffer of its
+// own allocated up front, dropping frames that did not fit.
+
+static const int receivers = 100;
+static const int frames = 40;
+static const size_t fixedSize = 1024 * 1024;
+
+static long rssKb()
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+            return atol(line.c_str() + 6);
+    }
+    return 0;
+}
+
+// The old assembly: payloads copied one after another into the receiver's
+// own buffer until the marker, a frame over the buffer dropped.
+class FixedReceiver {
+
+public:
+    FixedReceiver() : mBuffer(new uint8_t[::fixedSize]), mSize(0), mOverflow(false) {}
+    ~FixedReceiver() { delete[] mBuffer; }
+    
+    // The size of the frame the packet completes, or 0.
+    size_t packetIn(const uint8_t* data, int length)
+    {
+        CRtpHeader header;
+        if (!header.parse(data, length))
+            return 0;
+        if (mSize + header.payloadLength() > ::fixedSize)
+            mOverflow = true;
+        else {
+            memcpy(mBuffer + mSize, header.payload(), header.payloadLength());
+            mSize += header.payloadLength();
+        }
+        if (!header.marker())
+            return 0;
+        size_t size = mOverflow ? 0 : mSize;
+        mSize = 0;
+        mOverflow = false;
+        return size;
+    }
+
+private:
+    uint8_t* mBuffer;
+    size_t mSize;
+    bool mOverflow;
+};
+
+class PooledReceiver {
+
+public:
+    PooledReceiver()
+        : mError(0)
+        , mUnpack(mError)
+    {
+    }
+    
+    size_t packetIn(const uint8_t* data, int length)
+    {
+        // Parsing rewrites the packet in place
+        std::vector<uint8_t> packet(data, data + length);
+        unsigned int size, timestamp;
+        return mUnpack.Parse_RTP_Packet(packet.data(), (unsigned short)length, &size, &timestamp) != NULL ? size : 0;
+    }
+
+private:
+    int mError;
+    CRtpUnpack mUnpack;
+};
+
+// Resident memory over baseKb once the stream has gone through.
+template <class Receiver> static void run(const char* name, int keyframeSize, long baseKb)
+{
+    std::vector<Receiver*> all;
+    for (int i = 0; i < ::receivers; i++)
+        all.push_back(new Receiver());
+    
+    Packets packets;
+    CRtpStream stream(packetOut, &packets);
+    int keyframes = 0;
+    for (int k = 0; k < ::frames; k++) {
+        bool key = k % 20 == 0;
+        std::vector<uint8_t> frame = makeFrame(key, key ? keyframeSize : 2000, k);
+        packets.clear();
+        stream.streamOut(frame.data(), (int)frame.size(), k * 3000);
+        for (size_t p = 0; p < packets.size(); p++) {
+            for (int i = 0; i < ::receivers; i++) {
+                if (all[i]->packetIn(packets[p].data(), (int)packets[p].size()) >= (size_t)keyframeSize)
+                    keyframes++;
+            }
+        }
+    }
+    malloc_trim(0);
+    long after = rssKb();
+    
+    printf("%-7s keyframe %4d KB  %7.1f MB resident  %4d of %d keyframes out\n", name, keyframeSize / 1000,
+           (after - baseKb) / 1000.0, keyframes, ::receivers * 2);
+    for (int i = 0; i < ::receivers; i++)
+        delete all[i];
+    malloc_trim(0);
+}
+
+int main()
+{
+    // The fixed buffers go back to the system when freed, the pool keeps its
+    // cache, so the pool runs last and its cache counts in both its runs.
+    long baseKb = rssKb();
+    run<FixedReceiver>("fixed", 200000, baseKb);
+    run<FixedReceiver>("fixed", 3000000, baseKb);
+    run<PooledReceiver>("pooled", 200000, baseKb);
+    run<PooledReceiver>("pooled", 3000000, baseKb);
+    printf("pool in use %zu bytes, cached %zu bytes\n", CRtpBufferPool::shared().bytesInUse(),
+           CRtpBufferPool::shared().bytesCached());
+    return 0;
+}
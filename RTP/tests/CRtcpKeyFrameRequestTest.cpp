@@ -0,0 +1,226 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <random>
+#include "CRtpStream.h"
+#include "CRtpDemuxer.h"
+#include "CRtcp.h"
+#include "CRtcpFeedbackSender.h"
+#include "RtpTest.h"
+
+// A stub encoder, keyframes once a second and whenever asked, sends over a
+// lossy link into a demuxer on a simulated clock. With a feedback sender the
+// demuxer asks for a keyframe over RTCP after a loss, and the picture is
+// repaired a round trip later instead of at the next periodic keyframe.
+
+static const int fps = 20;
+static const int64_t tickUs = 1000;
+
+struct InFlight {
+    int64_t atUs;
+    std::vector<uint8_t> data;
+};
+
+class Loop {
+
+public:
+    Loop(int64_t rttUs, double loss, bool requests)
+        : mOneWayUs(rttUs / 2)
+        , mRng(3)
+        , mLoss(loss)
+        , mDropFrame(-1)
+        , mStream(mediaOut, this)
+        , mFeedback(rtcpOut, this)
+        , mDemuxer(frameIn, this)
+        , mNowUs(0)
+        , mFrame(0)
+        , mForce(false)
+        , mForced(0)
+        , mFrames(0)
+        , mTimestamp(0)
+        , mDamaged(0)
+        , mBroken(false)
+        , mBrokenUs(0)
+        , mEpisodes(0)
+        , mRepairUs(0)
+    {
+        mParser.setKeyFrameCallback(keyFrameIn, this);
+        mFeedback.setMinInterval((int)rttUs + 50000);
+        mDemuxer.addPayloadType(96);
+        mDemuxer.setRecovery(true);
+        if (requests)
+            mDemuxer.setFeedbackSender(&mFeedback);
+    }
+    
+    // The second packet of this frame is lost, on top of any random loss.
+    void setDropFrame(int frame) { mDropFrame = frame; }
+    
+    void run(int frames)
+    {
+        for (int k = 0; k < frames; k++) {
+            int64_t frameUs = (int64_t)k * 1000000 / ::fps;
+            for (mNowUs = frameUs; mNowUs < frameUs + 1000000 / ::fps; mNowUs += ::tickUs) {
+                if (mNowUs == frameUs)
+                    encode(k);
+                while (!mToReceiver.empty() && mToReceiver.front().atUs <= mNowUs) {
+                    std::vector<uint8_t>& data = mToReceiver.front().data;
+                    CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+                    mDemuxer.packetIn(packet, mNowUs);
+                    packet->release();
+                    mToReceiver.pop_front();
+                }
+                while (!mToSender.empty() && mToSender.front().atUs <= mNowUs) {
+                    std::vector<uint8_t>& data = mToSender.front().data;
+                    if (CRtcpParser::isRtcp(data.data(), (int)data.size()))
+                        mParser.parse(data.data(), (int)data.size());
+                    mToSender.pop_front();
+                }
+                mDemuxer.poll(mNowUs);
+            }
+        }
+    }
+    
+    double damagedShare() const { return (double)mDamaged / mFrames; }
+    int episodes() const { return mEpisodes; }
+    // From the first damaged frame to the next clean keyframe, on average.
+    int64_t meanRepairUs() const { return mEpisodes > 0 ? mRepairUs / mEpisodes : 0; }
+    int forced() const { return mForced; }
+    uint32_t requests() const { return mFeedback.requestsSent(); }
+
+private:
+    void encode(int frame)
+    {
+        bool key = frame % ::fps == 0 || mForce;
+        if (mForce && frame % ::fps != 0)
+            mForced++;
+        mForce = false;
+        mFrame = frame;
+        std::vector<uint8_t> data = makeFrame(key, key ? 30000 : 6000, frame);
+        mPacket = 0;
+        mStream.streamOut(data.data(), (int)data.size(), frame * (90000 / ::fps));
+    }
+    
+    static void mediaOut(void *loopRef, const uint8_t* data, int length)
+    {
+        Loop* loop = (Loop*)loopRef;
+        if (loop->mPacket++ == 1 && loop->mFrame == loop->mDropFrame)
+            return;
+        if (loop->mLoss > 0 && std::bernoulli_distribution(loop->mLoss)(loop->mRng))
+            return;
+        InFlight inFlight = { loop->mNowUs + loop->mOneWayUs, std::vector<uint8_t>(data, data + length) };
+        loop->mToReceiver.push_back(inFlight);
+    }
+    
+    static void rtcpOut(void *loopRef, const uint8_t* data, int length)
+    {
+        Loop* loop = (Loop*)loopRef;
+        InFlight inFlight = { loop->mNowUs + loop->mOneWayUs, std::vector<uint8_t>(data, data + length) };
+        loop->mToSender.push_back(inFlight);
+    }
+    
+    static void keyFrameIn(void *loopRef, uint32_t, uint32_t, bool)
+    {
+        ((Loop*)loopRef)->mForce = true;
+    }
+    
+    static void frameIn(void *loopRef, uint32_t, int, CRtpFrame* frame, uint32_t timestamp, bool damaged)
+    {
+        Loop* loop = (Loop*)loopRef;
+        std::vector<uint8_t> data(frame->length());
+        frame->copyTo(data.data());
+        bool key = false;
+        for (size_t i = 0; i + 4 < data.size() && !key; i++)
+            key = data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 0 && data[i + 3] == 1 && (data[i + 4] & 0x1f) == 5;
+        // A frame missing altogether leaves the picture as broken as a damaged
+        // one. Parameter sets may come ahead of their slice, on its timestamp.
+        if (loop->mFrames > 0 && (int32_t)(timestamp - loop->mTimestamp) > 90000 / ::fps)
+            damaged = true;
+        loop->mTimestamp = timestamp;
+        
+        if (key && !damaged) {
+            if (loop->mBroken)
+                loop->mRepairUs += loop->mNowUs - loop->mBrokenUs;
+            loop->mBroken = false;
+        }
+        else if (damaged && !loop->mBroken) {
+            loop->mBroken = true;
+            loop->mBrokenUs = loop->mNowUs;
+            loop->mEpisodes++;
+        }
+        loop->mFrames++;
+        if (loop->mBroken)
+            loop->mDamaged++;
+    }
+    
+    int64_t mOneWayUs;
+    std::mt19937 mRng;
+    double mLoss;
+    int mDropFrame;
+    CRtpStream mStream;
+    CRtcpParser mParser;
+    CRtcpFeedbackSender mFeedback;
+    CRtpDemuxer mDemuxer;
+    std::deque<InFlight> mToReceiver;
+    std::deque<InFlight> mToSender;
+    int64_t mNowUs;
+    
+    // Encoder side
+    int mFrame;
+    int mPacket;
+    bool mForce;
+    int mForced;
+    
+    // Decoder side
+    int mFrames;
+    uint32_t mTimestamp;
+    int mDamaged;
+    bool mBroken;
+    int64_t mBrokenUs;
+    int mEpisodes;
+    int64_t mRepairUs;
+};
+
+// One loss in the middle of a second.
+static void testSingleLoss()
+{
+    Loop periodic(100000, 0, false);
+    periodic.setDropFrame(5);
+    periodic.run(3 * ::fps);
+    CHECK(periodic.episodes() == 1);
+    CHECK(periodic.requests() == 0);
+    CHECK(periodic.meanRepairUs() > 600000);
+    
+    Loop requested(100000, 0, true);
+    requested.setDropFrame(5);
+    requested.run(3 * ::fps);
+    CHECK(requested.episodes() == 1);
+    // One on joining, before the first keyframe is through, and one for the loss
+    CHECK(requested.requests() == 2);
+    CHECK(requested.forced() == 2);
+    // The request goes out when the next frame shows the gap, and the
+    // keyframe is the one encoded after it arrives.
+    CHECK(requested.meanRepairUs() > 100000 && requested.meanRepairUs() <= 100000 + 3 * 1000000 / ::fps);
+}
+
+// Two minutes at 1% random loss.
+static void testRandomLoss()
+{
+    Loop periodic(100000, 0.01, false);
+    periodic.run(120 * ::fps);
+    Loop requested(100000, 0.01, true);
+    requested.run(120 * ::fps);
+    CHECK(periodic.damagedShare() > 0.05);
+    CHECK(requested.damagedShare() < periodic.damagedShare() * 0.6);
+    CHECK(requested.meanRepairUs() < periodic.meanRepairUs() / 2);
+    // No more than one request per interval
+    CHECK(requested.requests() <= 120 * 1000000 / 150000);
+    CHECK(requested.forced() > 0 && requested.forced() <= (int)requested.requests());
+}
+
+int main()
+{
+    testSingleLoss();
+    testRandomLoss();
+    return testResult("CRtcpKeyFrameRequestTest");
+}
@@ -0,0 +1,161 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <deque>
+#include <vector>
+#include <random>
+#include "CRtcp.h"
+#include "CRtcpSession.h"
+#include "CRtpHeader.h"
+#include "CRtpLoopbackTransport.h"
+#include "RtpTest.h"
+
+// Two sessions over a loopback pair on a simulated clock, with a one-way
+// delay, jitter on the media and every twentieth media packet lost. The
+// reports that come back give the round trip, the loss and the jitter.
+
+static const uint32_t ssrcA = 0x11111111;
+static const uint32_t ssrcB = 0x22222222;
+static const int64_t oneWayUs = 20000;
+static const int64_t jitterUs = 10000;     // Media only, uniform 0..jitterUs
+static const int lossEvery = 20;
+static const int64_t tickUs = 1000;        // Sent in one tick, picked up the next
+
+struct Delayed {
+    int64_t atUs;
+    CRtpPacket* packet;
+};
+
+struct End {
+    CRtpLoopbackTransport transport;
+    std::deque<Delayed> line;     // Received, not yet due
+    int rtcpOut;
+};
+
+static int byes = 0;
+
+static void rtcpOut(void *ref, const uint8_t* data, int length)
+{
+    End* end = (End*)ref;
+    end->transport.send(&data, &length, 1);
+    end->rtcpOut++;
+}
+
+static void byeIn(void *, uint32_t ssrc)
+{
+    if (ssrc == ssrcA)
+        byes++;
+}
+
+// Takes what the peer sent off the transport, and hands on what is due.
+static void deliver(End& end, CRtcpSession& session, int64_t nowUs, std::mt19937& rng)
+{
+    CRtpPacket* packets[64];
+    int n;
+    while ((n = end.transport.receive(packets, 64, 0)) > 0) {
+        for (int i = 0; i < n; i++) {
+            bool rtcp = CRtcpParser::isRtcp(packets[i]->data(), packets[i]->length());
+            int64_t delay = oneWayUs + (rtcp ? 0 : (int64_t)(rng() % jitterUs));
+            Delayed d = { nowUs + delay, packets[i] };
+            end.line.push_back(d);
+        }
+    }
+    
+    for (size_t i = 0; i < end.line.size();) {
+        if (end.line[i].atUs > nowUs) {
+            i++;
+            continue;
+        }
+        CRtpPacket* packet = end.line[i].packet;
+        if (CRtcpParser::isRtcp(packet->data(), packet->length())) {
+            CHECK(session.rtcpIn(packet->data(), packet->length(), nowUs));
+        }
+        else {
+            CRtpHeader header;
+            CHECK(header.parse(packet->data(), packet->length()));
+            session.rtpReceived(header.ssrc(), header.seqNo(), header.timestamp(), header.payloadLength(), nowUs);
+        }
+        packet->release();
+        end.line.erase(end.line.begin() + i);
+    }
+}
+
+int main()
+{
+    End a, b;
+    a.rtcpOut = b.rtcpOut = 0;
+    CRtpLoopbackTransport::connect(&a.transport, &b.transport);
+    CRtcpSession sessionA(ssrcA, rtcpOut, &a);
+    CRtcpSession sessionB(ssrcB, rtcpOut, &b);
+    sessionB.setByeCallback(byeIn, NULL);
+    
+    std::mt19937 rng(1);
+    int sent = 0, lost = 0;
+    uint16_t seq = 65000;   // Wraps on the way
+    const int64_t startUs = 1000000;
+    const int64_t endUs = startUs + 30000000;
+    for (int64_t now = startUs; now < endUs; now += tickUs) {
+        // 100 packets a second of A's media
+        if (now % 10000 == 0) {
+            uint8_t packet[212] = { 0x80, 96 };
+            uint32_t timestamp = (uint32_t)((now - startUs) * 90 / 1000);
+            packet[2] = (uint8_t)(seq >> 8);
+            packet[3] = (uint8_t)seq;
+            for (int k = 0; k < 4; k++) {
+                packet[4 + k] = (uint8_t)(timestamp >> (24 - 8 * k));
+                packet[8 + k] = (uint8_t)(ssrcA >> (24 - 8 * k));
+            }
+            sessionA.rtpSent(packet, sizeof(packet), now);
+            if (++sent % lossEvery == 0) {
+                lost++;
+            }
+            else {
+                const uint8_t* p = packet;
+                int length = sizeof(packet);
+                a.transport.send(&p, &length, 1);
+            }
+            seq++;
+        }
+        deliver(b, sessionB, now, rng);
+        deliver(a, sessionA, now, rng);
+        sessionA.poll(now);
+        sessionB.poll(now);
+    }
+    
+    // B's view of A's stream
+    CRtcpStats received;
+    CHECK(sessionB.stats(ssrcA, &received));
+    CHECK(!received.sending);
+    CHECK(received.packets + (uint32_t)lost >= (uint32_t)sent - 5 && received.packets + (uint32_t)lost <= (uint32_t)sent);
+    CHECK(received.octets == received.packets * 200);
+    CHECK(std::abs(received.cumulativeLost - lost) <= 1);
+    // Mean |D| of two uniform delays is a third of their range
+    CHECK(received.jitterUs > jitterUs / 3 * 0.75 && received.jitterUs < jitterUs / 3 * 1.25);
+    
+    // A's view of its own, from B's reports
+    CRtcpStats own;
+    CHECK(sessionA.stats(ssrcA, &own));
+    CHECK(own.sending);
+    CHECK(own.packets == (uint32_t)sent);
+    CHECK(own.octets == (uint32_t)sent * 200);
+    CHECK(std::abs(own.rttUs - 2 * (oneWayUs + tickUs)) < 500);
+    CHECK(std::fabs(own.fractionLost - 1.0f / lossEvery) < 0.02f);
+    // As of B's last report, up to a second behind
+    CHECK(own.cumulativeLost >= lost - 100 / lossEvery - 1 && own.cumulativeLost <= lost);
+    CHECK(std::abs(own.jitterUs - received.jitterUs) < jitterUs / 10);
+    
+    // About one report a second each way
+    CHECK(a.rtcpOut >= 20 && a.rtcpOut <= 45);
+    CHECK(b.rtcpOut >= 20 && b.rtcpOut <= 45);
+    
+    // A leaves, B forgets it
+    sessionA.bye(endUs);
+    for (int64_t now = endUs; now <= endUs + 2 * oneWayUs; now += tickUs)
+        deliver(b, sessionB, now, rng);
+    CHECK(byes == 1);
+    CHECK(!sessionB.stats(ssrcA, &received));
+    
+    for (size_t i = 0; i < a.line.size(); i++)
+        a.line[i].packet->release();
+    return testResult("CRtcpSessionTest");
+}
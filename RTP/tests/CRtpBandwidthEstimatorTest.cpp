@@ -0,0 +1,317 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <deque>
+#include <random>
+#include <algorithm>
+#include "CRtpPacer.h"
+#include "CRtpHeader.h"
+#include "CRtcp.h"
+#include "CRtcpFeedbackSender.h"
+#include "CRtpBandwidthEstimator.h"
+#include "RtpTest.h"
+
+// The estimator on a simulated clock, in the loop it runs in: frames at the
+// target rate into CRtpPacer::process(), a drop-tail bottleneck with
+// optional cross traffic and random loss, transport-wide feedback back over
+// RTCP to the estimator, and the estimate back into the pacer.
+
+static const int64_t stepUs = 250;
+static const int64_t warmupUs = 10000000;   // Left out of the link statistics
+static const int fps = 20;
+static const int maxPayload = 1200;
+static const int overhead = 28;              // IP and UDP, on the link
+
+struct Scenario {
+    double capacity[3];       // bps, from 0, switchUs[0] and switchUs[1]
+    int64_t switchUs[2];
+    double cross;             // bps, on for the odd ten seconds
+    double loss;
+    int64_t oneWayUs;
+    int64_t durationUs;
+};
+
+struct InFlight {
+    int64_t atUs;
+    std::vector<uint8_t> data;
+};
+
+class Link {
+
+public:
+    Link(const Scenario& scenario)
+        : mScenario(scenario)
+        , mRng(7)
+        , mUniform(0, 1)
+        , mPacer(pacedIn, this)
+        , mEstimator(bitrateIn, this)
+        , mFeedback(rtcpOut, this)
+        , mNowUs(0)
+        , mLinkFreeUs(0)
+        , mSeq(0)
+        , mSentBits(0)
+        , mCapacityBits(0)
+        , mPackets(0)
+        , mDropped(0)
+    {
+        mParser.setTransportFeedbackCallback(feedbackIn, this);
+        mPacer.setFrameRate(::fps);
+        mPacer.setTransportSequence(CRtpBandwidthEstimator::packetSentIn, &mEstimator);
+        mTarget = mEstimator.targetBitrate();
+        mPacer.setTargetBitrate(mTarget);
+    }
+    
+    void run()
+    {
+        int frames = 0;
+        int64_t nextCrossUs = 0;
+        for (mNowUs = 0; mNowUs < mScenario.durationUs; mNowUs += ::stepUs) {
+            if (mNowUs >= (int64_t)frames * 1000000 / ::fps)
+                frame(frames++);
+            double cross = crossRate(mNowUs);
+            if (cross > 0 && mNowUs >= nextCrossUs) {
+                uint8_t filler[1000] = { 0 };
+                link(filler, sizeof(filler) - ::overhead, false);
+                nextCrossUs = mNowUs + (int64_t)(sizeof(filler) * 8 * 1e6 / cross);
+            }
+            mPacer.process(mNowUs);
+            
+            // Arrivals keep departure order on a FIFO link
+            while (!mToReceiver.empty() && mToReceiver.front().atUs <= mNowUs) {
+                std::vector<uint8_t>& packet = mToReceiver.front().data;
+                CRtpHeader header;
+                const uint8_t* field = NULL;
+                int length;
+                if (header.parse(packet.data(), (int)packet.size()) && header.findExtension(::transportSeqExtId, &field, &length))
+                    mFeedback.packetArrived(header.ssrc(), (uint16_t)(field[0] << 8 | field[1]), mNowUs);
+                mToReceiver.pop_front();
+            }
+            mFeedback.poll(mNowUs);
+            while (!mToSender.empty() && mToSender.front().atUs <= mNowUs) {
+                mParser.parse(mToSender.front().data.data(), (int)mToSender.front().data.size());
+                mToSender.pop_front();
+            }
+            if (mNowUs > ::warmupUs)
+                mCapacityBits += (capacity(mNowUs) - cross) * ::stepUs * 1e-6;
+        }
+    }
+    
+    // Of what the cross traffic left, after the warm-up.
+    double utilization() const { return mSentBits / mCapacityBits; }
+    double queueDelayMs(int percentile)
+    {
+        if (mDelaysMs.empty())
+            return 0;
+        std::sort(mDelaysMs.begin(), mDelaysMs.end());
+        return mDelaysMs[mDelaysMs.size() * percentile / 100];
+    }
+    int packets() const { return mPackets; }
+    int dropped() const { return mDropped; }
+    int target() const { return mTarget; }
+    
+    // How long after fromUs the target first got to at least, or at most,
+    // bitrate. -1 if it never did.
+    int64_t reached(int bitrate, int64_t fromUs) const
+    {
+        for (size_t i = 0; i < mTargets.size(); i++)
+            if (mTargets[i].first >= fromUs && mTargets[i].second >= bitrate)
+                return mTargets[i].first - fromUs;
+        return -1;
+    }
+    int64_t fell(int bitrate, int64_t fromUs) const
+    {
+        for (size_t i = 0; i < mTargets.size(); i++)
+            if (mTargets[i].first >= fromUs && mTargets[i].second <= bitrate)
+                return mTargets[i].first - fromUs;
+        return -1;
+    }
+
+private:
+    double capacity(int64_t nowUs) const
+    {
+        if (mScenario.switchUs[1] > 0 && nowUs >= mScenario.switchUs[1])
+            return mScenario.capacity[2];
+        if (mScenario.switchUs[0] > 0 && nowUs >= mScenario.switchUs[0])
+            return mScenario.capacity[1];
+        return mScenario.capacity[0];
+    }
+    
+    double crossRate(int64_t nowUs) const
+    {
+        return (nowUs / 10000000) % 2 == 1 ? mScenario.cross : 0;
+    }
+    
+    // A frame of random size around the target, every fourth second three times that.
+    void frame(int index)
+    {
+        double bytes = mTarget / 8.0 / ::fps * (0.7 + 0.6 * mUniform(mRng));
+        if (index % (::fps * 4) == 0)
+            bytes *= 3;
+        int count = (int)ceil(bytes / ::maxPayload);
+        std::vector<std::vector<uint8_t> > packets(count);
+        std::vector<const uint8_t*> data(count);
+        std::vector<int> lengths(count);
+        uint32_t timestamp = (uint32_t)(mNowUs * 90 / 1000);
+        for (int i = 0; i < count; i++) {
+            std::vector<uint8_t>& packet = packets[i];
+            packet.assign((int)std::min((double)::maxPayload, bytes - i * ::maxPayload) + 12, 0);
+            packet[0] = 0x80;
+            packet[1] = 96 | (i == count - 1 ? 0x80 : 0);
+            packet[2] = (uint8_t)(mSeq >> 8);
+            packet[3] = (uint8_t)mSeq;
+            mSeq++;
+            for (int k = 0; k < 4; k++) {
+                packet[4 + k] = (uint8_t)(timestamp >> (24 - 8 * k));
+                packet[8 + k] = (uint8_t)(0x12345678 >> (24 - 8 * k));
+            }
+            data[i] = packet.data();
+            lengths[i] = (int)packet.size();
+        }
+        mPacer.enqueue(data.data(), lengths.data(), count, mNowUs);
+    }
+    
+    void link(const uint8_t* data, int length, bool media)
+    {
+        double bits = (length + ::overhead) * 8.0;
+        if (media && mUniform(mRng) < mScenario.loss)
+            return;
+        int64_t startUs = std::max(mNowUs, mLinkFreeUs);
+        if (startUs - mNowUs > 400000) {
+            if (media)
+                mDropped++;
+            return;
+        }
+        int64_t departUs = startUs + (int64_t)(bits * 1e6 / capacity(mNowUs));
+        mLinkFreeUs = departUs;
+        if (!media)
+            return;
+        mPackets++;
+        if (mNowUs > ::warmupUs) {
+            mDelaysMs.push_back((startUs - mNowUs) / 1000.0);
+            mSentBits += bits;
+        }
+        InFlight inFlight = { departUs + mScenario.oneWayUs, std::vector<uint8_t>(data, data + length) };
+        mToReceiver.push_back(inFlight);
+    }
+    
+    static void pacedIn(void *linkRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        for (int i = 0; i < count; i++)
+            ((Link*)linkRef)->link(packets[i], lengths[i], true);
+    }
+    
+    static void rtcpOut(void *linkRef, const uint8_t* data, int length)
+    {
+        Link* link = (Link*)linkRef;
+        InFlight inFlight = { link->mNowUs + link->mScenario.oneWayUs, std::vector<uint8_t>(data, data + length) };
+        link->mToSender.push_back(inFlight);
+    }
+    
+    static void feedbackIn(void *linkRef, uint32_t, uint16_t baseSeq, uint8_t,
+                           const int64_t* arrivalsUs, int count)
+    {
+        Link* link = (Link*)linkRef;
+        link->mEstimator.feedback(baseSeq, arrivalsUs, count, link->mNowUs);
+    }
+    
+    static void bitrateIn(void *linkRef, int bitrate)
+    {
+        Link* link = (Link*)linkRef;
+        link->mTarget = bitrate;
+        link->mPacer.setTargetBitrate(bitrate);
+        link->mTargets.push_back(std::make_pair(link->mNowUs, bitrate));
+    }
+    
+    Scenario mScenario;
+    std::mt19937 mRng;
+    std::uniform_real_distribution<double> mUniform;
+    CRtpPacer mPacer;
+    CRtpBandwidthEstimator mEstimator;
+    CRtcpFeedbackSender mFeedback;
+    CRtcpParser mParser;
+    
+    int64_t mNowUs;
+    int64_t mLinkFreeUs;
+    std::deque<InFlight> mToReceiver;
+    std::deque<InFlight> mToSender;
+    uint16_t mSeq;
+    int mTarget;
+    
+    std::vector<double> mDelaysMs;
+    std::vector<std::pair<int64_t, int> > mTargets;
+    double mSentBits;
+    double mCapacityBits;
+    int mPackets;
+    int mDropped;
+};
+
+static void testSteady()
+{
+    Scenario scenario = { { 1e6, 1e6, 1e6 }, { 0, 0 }, 0, 0, 20000, 60000000 };
+    Link link(scenario);
+    link.run();
+    CHECK(link.utilization() > 0.8);
+    CHECK(link.queueDelayMs(50) < 50);
+    CHECK(link.dropped() == 0);
+    int64_t rampUs = link.reached(800000, 0);
+    CHECK(rampUs > 0 && rampUs < 20000000);
+    CHECK(link.target() > 700000 && link.target() < 1000000);
+}
+
+static void testCapacityDrop()
+{
+    Scenario scenario = { { 2e6, 5e5, 2e6 }, { 20000000, 40000000 }, 0, 0, 20000, 70000000 };
+    Link link(scenario);
+    link.run();
+    int64_t downUs = link.fell(500000, 20000000);
+    CHECK(downUs >= 0 && downUs < 1500000);
+    int64_t upUs = link.reached(1500000, 40000000);
+    CHECK(upUs > 0 && upUs < 25000000);
+    CHECK(link.dropped() < link.packets() / 100);
+}
+
+static void testCrossTraffic()
+{
+    Scenario scenario = { { 1.5e6, 1.5e6, 1.5e6 }, { 0, 0 }, 7e5, 0, 20000, 60000000 };
+    Link link(scenario);
+    link.run();
+    CHECK(link.utilization() > 0.7);
+    CHECK(link.queueDelayMs(50) < 50);
+    CHECK(link.dropped() == 0);
+}
+
+static void testLongRtt()
+{
+    Scenario scenario = { { 2.5e6, 2.5e6, 2.5e6 }, { 0, 0 }, 0, 0, 100000, 60000000 };
+    Link link(scenario);
+    link.run();
+    CHECK(link.utilization() > 0.6);
+    CHECK(link.dropped() == 0);
+}
+
+static void testLoss()
+{
+    // Under 10% loss the rate is left to the delay
+    Scenario light = { { 1e6, 1e6, 1e6 }, { 0, 0 }, 0, 0.05, 20000, 60000000 };
+    Link lightLink(light);
+    lightLink.run();
+    CHECK(lightLink.target() > 500000);
+    CHECK(lightLink.dropped() == 0);
+    
+    // Over it the rate comes down however much the link would take
+    Scenario heavy = { { 3e6, 3e6, 3e6 }, { 0, 0 }, 0, 0.2, 20000, 60000000 };
+    Link heavyLink(heavy);
+    heavyLink.run();
+    CHECK(heavyLink.target() < ::defaultStartBitrate);
+}
+
+int main()
+{
+    testSteady();
+    testCapacityDrop();
+    testCrossTraffic();
+    testLongRtt();
+    testLoss();
+    return testResult("CRtpBandwidthEstimatorTest");
+}
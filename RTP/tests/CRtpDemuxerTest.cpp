@@ -0,0 +1,306 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <set>
+#include <random>
+#include <algorithm>
+#include "CRtpStream.h"
+#include "CRtpDemuxer.h"
+#include "CRtcpFeedbackSender.h"
+#include "CRtpRetransmitter.h"
+#include "RtpTest.h"
+
+// The source table: sources found again after others are added and removed
+// in any order, the least recently heard making room when it is full, idle
+// ones expired in poll() with every other one played out exactly once,
+// packets routed by SSRC and payload type, and RTX packets unwrapped into
+// the source that NACKed them.
+
+static const uint32_t frameTicks = 3000;
+
+typedef std::pair<uint32_t, int> SourceKey;  // SSRC, payload type
+
+// What came out of each source, and how often a source was called back.
+class Frames {
+
+public:
+    Frames()
+        : mDamaged(0)
+    {
+    }
+    
+    // Matches CRtpDemuxerFrameCallback.
+    static void frameIn(void *framesRef, uint32_t ssrc, int payloadType, CRtpFrame* frame, uint32_t, bool damaged)
+    {
+        Frames* frames = (Frames*)framesRef;
+        std::vector<uint8_t>& out = frames->mOut[SourceKey(ssrc, payloadType)];
+        size_t at = out.size();
+        out.resize(at + frame->length());
+        frame->copyTo(out.data() + at);
+        frames->mCalls[SourceKey(ssrc, payloadType)]++;
+        if (damaged)
+            frames->mDamaged++;
+    }
+    
+    std::map<SourceKey, std::vector<uint8_t> > mOut;
+    std::map<SourceKey, int> mCalls;
+    int mDamaged;
+};
+
+// The packets of a frame under another SSRC and payload type.
+static Packets restamp(const Packets& packets, uint32_t ssrc, int payloadType)
+{
+    Packets out = packets;
+    for (size_t i = 0; i < out.size(); i++) {
+        out[i][1] = (uint8_t)((out[i][1] & 0x80) | payloadType);
+        out[i][8] = (uint8_t)(ssrc >> 24);
+        out[i][9] = (uint8_t)(ssrc >> 16);
+        out[i][10] = (uint8_t)(ssrc >> 8);
+        out[i][11] = (uint8_t)ssrc;
+    }
+    return out;
+}
+
+static Packets packetsOf(CRtpStream& stream, Packets& sink, const std::vector<uint8_t>& frame, uint32_t timestamp)
+{
+    sink.clear();
+    CHECK(stream.streamOut(frame.data(), (int)frame.size(), timestamp) == 0);
+    return sink;
+}
+
+static bool packetIn(CRtpDemuxer& demuxer, const std::vector<uint8_t>& data, int64_t nowUs)
+{
+    CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+    bool routed = demuxer.packetIn(packet, nowUs);
+    packet->release();
+    return routed;
+}
+
+// Sources come and go at random in a table of 16 slots, 8 at most, so that
+// probe runs form and wrap around the end: each is found as long as it is
+// there, a ninth evicts the one heard from least recently, and any of them
+// can be taken out without losing the ones probed past it.
+static void testTable()
+{
+    Packets sink;
+    CRtpStream stream(packetOut, &sink);
+    std::vector<uint8_t> frame = makeFrame(false, 200, 1);
+    Packets packets = packetsOf(stream, sink, frame, 0);
+    Packets next = packetsOf(stream, sink, frame, ::frameTicks);
+    std::mt19937 rng(7);
+    
+    for (int round = 0; round < 500; round++) {
+        Frames frames;
+        CRtpDemuxer demuxer(Frames::frameIn, &frames, 8);
+        demuxer.addPayloadType(96);
+        std::vector<uint32_t> ssrcs;
+        while (ssrcs.size() < 9) {
+            uint32_t ssrc = rng();
+            if (std::find(ssrcs.begin(), ssrcs.end(), ssrc) == ssrcs.end())
+                ssrcs.push_back(ssrc);
+        }
+        
+        for (int i = 0; i < 8; i++) {
+            CHECK(packetIn(demuxer, restamp(packets, ssrcs[i], 96)[0], 1000 + i));
+            CHECK(demuxer.sourceCount() == i + 1);
+        }
+        for (int i = 0; i < 8; i++)
+            CHECK(demuxer.hasSource(ssrcs[i], 96) && !demuxer.hasSource(ssrcs[i], 97));
+        
+        // The first one heard from again, the second is now the oldest
+        CHECK(packetIn(demuxer, restamp(next, ssrcs[0], 96)[0], 2000));
+        CHECK(packetIn(demuxer, restamp(packets, ssrcs[8], 96)[0], 2001));
+        CHECK(demuxer.sourceCount() == 8);
+        CHECK(!demuxer.hasSource(ssrcs[1], 96));
+        ssrcs.erase(ssrcs.begin() + 1);
+        
+        std::shuffle(ssrcs.begin(), ssrcs.end(), rng);
+        while (!ssrcs.empty()) {
+            demuxer.removeSource(ssrcs.back(), 96);
+            CHECK(!demuxer.hasSource(ssrcs.back(), 96));
+            ssrcs.pop_back();
+            CHECK(demuxer.sourceCount() == (int)ssrcs.size());
+            for (size_t i = 0; i < ssrcs.size(); i++)
+                CHECK(demuxer.hasSource(ssrcs[i], 96));
+        }
+    }
+}
+
+// Half the sources last heard from before the idle timeout, half after,
+// their keyframes still held back for the playout delay: poll() drops the
+// first half unplayed, and plays out every one of the others once.
+static void testIdleExpiry()
+{
+    Packets sink;
+    CRtpStream stream(packetOut, &sink);
+    std::mt19937 rng(11);
+    
+    for (int round = 0; round < 300; round++) {
+        Frames frames;
+        CRtpDemuxer demuxer(Frames::frameIn, &frames, 4 + round % 13);
+        demuxer.addPayloadType(96);
+        demuxer.setIdleTimeout(1000000);
+        
+        std::vector<uint8_t> frame = makeFrame(true, 300, round);
+        Packets packets = packetsOf(stream, sink, frame, 0);
+        CHECK(packets.size() == 1);
+        std::set<uint32_t> stale, fresh;
+        while ((int)(stale.size() + fresh.size()) < 4 + round % 13) {
+            uint32_t ssrc = rng();
+            if (stale.count(ssrc) || fresh.count(ssrc))
+                continue;
+            bool idle = rng() % 2 == 0;
+            (idle ? stale : fresh).insert(ssrc);
+            CHECK(packetIn(demuxer, restamp(packets, ssrc, 96)[0], idle ? 0 : 900000));
+        }
+        CHECK(frames.mCalls.empty());
+        
+        CHECK(demuxer.poll(1100000) == -1);
+        CHECK(demuxer.sourceCount() == (int)fresh.size());
+        for (std::set<uint32_t>::const_iterator it = stale.begin(); it != stale.end(); ++it)
+            CHECK(!demuxer.hasSource(*it, 96) && frames.mCalls.count(SourceKey(*it, 96)) == 0);
+        for (std::set<uint32_t>::const_iterator it = fresh.begin(); it != fresh.end(); ++it) {
+            CHECK(demuxer.hasSource(*it, 96));
+            CHECK(frames.mCalls[SourceKey(*it, 96)] == 1);
+            CHECK(frames.mOut[SourceKey(*it, 96)] == frame);
+        }
+        
+        demuxer.poll(2000000);
+        CHECK(demuxer.sourceCount() == 0);
+    }
+}
+
+// Two sources on one SSRC under two payload types and a third SSRC, their
+// packets interleaved: each comes out whole, by itself. A payload type not
+// added is dropped without making a source.
+static void testRouting()
+{
+    // A stream each, sequence numbers run on per source
+    Packets sink;
+    CRtpStream stream0(packetOut, &sink), stream1(packetOut, &sink), stream2(packetOut, &sink);
+    CRtpStream* streams[3] = { &stream0, &stream1, &stream2 };
+    Frames frames;
+    CRtpDemuxer demuxer(Frames::frameIn, &frames);
+    demuxer.addPayloadType(96);
+    demuxer.addPayloadType(98);
+    
+    const SourceKey keys[3] = { SourceKey(0x1111, 96), SourceKey(0x1111, 98), SourceKey(0x2222, 96) };
+    std::map<SourceKey, std::vector<uint8_t> > sent;
+    std::vector<std::vector<uint8_t> > interleaved;
+    for (int k = 0; k < 10; k++) {
+        std::vector<Packets> each(3);
+        for (int s = 0; s < 3; s++) {
+            std::vector<uint8_t> frame = makeFrame(k == 0, 2000 + s * 1500 + k * 10, k * 3 + s);
+            sent[keys[s]].insert(sent[keys[s]].end(), frame.begin(), frame.end());
+            each[s] = restamp(packetsOf(*streams[s], sink, frame, k * ::frameTicks), keys[s].first, keys[s].second);
+        }
+        for (size_t p = 0; p < 5; p++) {
+            for (int s = 0; s < 3; s++) {
+                if (p < each[s].size())
+                    interleaved.push_back(each[s][p]);
+            }
+        }
+    }
+    
+    int64_t nowUs = 0;
+    for (size_t i = 0; i < interleaved.size(); i++, nowUs += 500)
+        CHECK(packetIn(demuxer, interleaved[i], nowUs));
+    CHECK(!packetIn(demuxer, restamp(Packets(1, interleaved[0]), 0x3333, 100)[0], nowUs));
+    demuxer.poll(nowUs + 1000000);
+    
+    CHECK(demuxer.sourceCount() == 3);
+    CHECK(!demuxer.hasSource(0x3333, 100));
+    CHECK(frames.mOut.size() == 3);
+    for (int s = 0; s < 3; s++)
+        CHECK(frames.mOut[keys[s]] == sent[keys[s]]);
+    CHECK(frames.mDamaged == 0);
+}
+
+static void rtcpOut(void *countRef, const uint8_t*, int)
+{
+    (*(int*)countRef)++;
+}
+
+// The packet of a frame in the middle is lost and NACKed. Its
+// retransmission on an RTX stream, the original sequence number ahead of
+// the payload, goes back into the source it belongs to and the frame comes
+// out whole. An RTX packet nobody asked for is dropped, and so is one
+// repeated.
+static void testRtx()
+{
+    Packets sink;
+    CRtpStream stream(packetOut, &sink);
+    Frames frames;
+    int rtcpPackets = 0;
+    CRtcpFeedbackSender feedback(rtcpOut, &rtcpPackets);
+    CRtpDemuxer demuxer(Frames::frameIn, &frames);
+    demuxer.addPayloadType(96);
+    demuxer.addRtxPayloadType(::defaultRtxPayloadType, 96);
+    demuxer.setFeedbackSender(&feedback);
+    demuxer.setNack(true);
+    
+    std::vector<uint8_t> key = makeFrame(true, 3000, 1);
+    std::vector<uint8_t> frame = makeFrame(false, 4000, 2);
+    Packets keyPackets = packetsOf(stream, sink, key, 0);
+    Packets packets = packetsOf(stream, sink, frame, ::frameTicks);
+    CHECK(packets.size() == 3);
+    SourceKey source(stream.ssrc(), 96);
+    
+    int64_t nowUs = 0;
+    for (size_t i = 0; i < keyPackets.size(); i++)
+        CHECK(packetIn(demuxer, keyPackets[i], nowUs));
+    // Held back a round trip and more with NACK on
+    nowUs += 300000;
+    demuxer.poll(nowUs);
+    CHECK(frames.mOut[source] == key);
+    
+    CHECK(packetIn(demuxer, packets[0], nowUs));
+    CHECK(packetIn(demuxer, packets[2], nowUs));
+    
+    // Into an RTX packet as the retransmitter makes it
+    const uint32_t rtxSsrc = 0x5555;
+    std::vector<uint8_t> rtx(packets[1].begin(), packets[1].begin() + 12);
+    rtx[1] = (uint8_t)((rtx[1] & 0x80) | ::defaultRtxPayloadType);
+    rtx[2] = 0;
+    rtx[3] = 1;
+    rtx[8] = (uint8_t)(rtxSsrc >> 24);
+    rtx[9] = (uint8_t)(rtxSsrc >> 16);
+    rtx[10] = (uint8_t)(rtxSsrc >> 8);
+    rtx[11] = (uint8_t)rtxSsrc;
+    rtx.push_back(packets[1][2]);
+    rtx.push_back(packets[1][3]);
+    rtx.insert(rtx.end(), packets[1].begin() + 12, packets[1].end());
+    
+    // Not asked for yet
+    CHECK(!packetIn(demuxer, rtx, nowUs));
+    for (int i = 0; i < 20 && feedback.nacksSent() == 0; i++) {
+        nowUs += 1000;
+        demuxer.poll(nowUs);
+    }
+    CHECK(feedback.nacksSent() > 0 && rtcpPackets > 0);
+    CHECK(frames.mOut[source] == key);
+    
+    CHECK(packetIn(demuxer, rtx, nowUs));
+    std::vector<uint8_t> both = key;
+    both.insert(both.end(), frame.begin(), frame.end());
+    CHECK(frames.mOut[source] == both);
+    CHECK(frames.mOut.size() == 1);
+    CHECK(!demuxer.hasSource(rtxSsrc, ::defaultRtxPayloadType));
+    
+    rtx[3] = 2;
+    CHECK(!packetIn(demuxer, rtx, nowUs));
+    demuxer.poll(nowUs + 1000000);
+    CHECK(frames.mOut[source] == both);
+    CHECK(frames.mDamaged == 0);
+}
+
+int main()
+{
+    testTable();
+    testIdleExpiry();
+    testRouting();
+    testRtx();
+    return testResult("CRtpDemuxerTest");
+}
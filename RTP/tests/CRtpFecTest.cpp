@@ -0,0 +1,322 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <map>
+#include <random>
+#include <algorithm>
+#include "CRtpStream.h"
+#include "CRtpPacer.h"
+#include "CRtpDemuxer.h"
+#include "CRtpFecEncoder.h"
+#include "CRtpFecDecoder.h"
+#include "RtpTest.h"
+
+// The parity FEC rebuilding lost packets byte for byte under random masks
+// and loss patterns, and end to end on a simulated clock: stream, parity
+// encoder and pacer into a link with random or bursty loss and a 300 ms
+// round trip, into the demuxer. Reports the share of frames that come out
+// whole with each protection, and what the parity costs.
+
+static const int fps = 20;
+static const int64_t tickUs = 500;
+static const int64_t oneWayUs = 150000;
+static const int jitterUs = 3000;
+static const uint32_t ssrc = 0x11223344;
+
+static void captureOut(void *ref, const uint8_t* const* packets, const int* lengths, int count)
+{
+    packetsOut(ref, packets, lengths, count);
+}
+
+// Random matrices over random frames of up to 60 packets, some padded,
+// shuffled with up to 30% of the media lost. Everything rebuilt has to be
+// the packet that was lost.
+static void testRandomMasks()
+{
+    std::mt19937 rng(1);
+    int recovered = 0, mismatched = 0;
+    for (int trial = 0; trial < 2000; trial++) {
+        Packets sent;
+        CRtpFecEncoder encoder(captureOut, &sent);
+        encoder.setMediaSsrc(::ssrc);
+        encoder.setMatrix(1 + rng() % 12, 1 + rng() % 6, rng() % 4 != 0, true);
+        
+        int count = 1 + rng() % 60;
+        Packets media(count);
+        std::vector<const uint8_t*> packets(count);
+        std::vector<int> lengths(count);
+        uint16_t seq = (uint16_t)rng();
+        std::map<uint16_t, std::vector<uint8_t> > original;
+        for (int i = 0; i < count; i++) {
+            int length = 12 + (rng() % 4 == 0 ? rng() % 40 : 200 + rng() % 1200);
+            std::vector<uint8_t>& packet = media[i];
+            packet.resize(length);
+            for (size_t b = 0; b < packet.size(); b++)
+                packet[b] = (uint8_t)rng();
+            packet[0] = 0x80;
+            if (rng() % 5 == 0 && length > 12) {
+                packet[0] |= 0x20;
+                packet.back() = (uint8_t)(1 + rng() % std::min(3, length - 12));
+            }
+            packet[1] = (rng() % 2 ? 0x80 : 0) | 96;
+            packet[2] = (uint8_t)(seq >> 8);
+            packet[3] = (uint8_t)seq;
+            for (int b = 0; b < 4; b++)
+                packet[8 + b] = (uint8_t)(::ssrc >> (24 - 8 * b));
+            original[seq++] = packet;
+            packets[i] = packet.data();
+            lengths[i] = length;
+        }
+        encoder.protect(packets.data(), lengths.data(), count);
+        
+        CRtpFecDecoder decoder(::ssrc);
+        std::vector<int> order(sent.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = (int)i;
+        std::shuffle(order.begin(), order.end(), rng);
+        int lossPercent = rng() % 30;
+        for (size_t i = 0; i < order.size(); i++) {
+            std::vector<uint8_t>& data = sent[order[i]];
+            bool parity = (data[1] & 0x7f) == ::defaultFecPayloadType;
+            if (!parity && (int)(rng() % 100) < lossPercent)
+                continue;
+            CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+            if (parity)
+                CHECK(decoder.fecIn(packet, 0));
+            else
+                decoder.mediaIn(packet, (uint16_t)((data[2] << 8) | data[3]), 0);
+            packet->release();
+            
+            while (CRtpPacket* rebuilt = decoder.recovered()) {
+                recovered++;
+                const std::vector<uint8_t>& lost = original[(uint16_t)((rebuilt->data()[2] << 8) | rebuilt->data()[3])];
+                if ((int)lost.size() != rebuilt->length() || memcmp(lost.data(), rebuilt->data(), lost.size()) != 0)
+                    mismatched++;
+                rebuilt->release();
+            }
+        }
+    }
+    CHECK(recovered > 1000);
+    CHECK(mismatched == 0);
+}
+
+struct InFlight {
+    int64_t atUs;
+    std::vector<uint8_t> data;
+};
+
+// Gilbert-Elliott loss: into the bad state with goodToBad, out with
+// badToGood, every packet lost while in it. Then the one way delay and up
+// to jitterUs more, in arrival order.
+class BurstyLink {
+
+public:
+    BurstyLink(double goodToBad, double badToGood)
+        : mRng(5)
+        , mGoodToBad(goodToBad)
+        , mBadToGood(badToGood)
+        , mJitter(0, ::jitterUs)
+        , mBad(false)
+        , mSent(0)
+        , mLost(0)
+    {
+    }
+    
+    void send(const uint8_t* data, int length, int64_t nowUs)
+    {
+        mSent++;
+        mBad = mBad ? !mBadToGood(mRng) : mGoodToBad(mRng);
+        if (mBad) {
+            mLost++;
+            return;
+        }
+        InFlight inFlight = { nowUs + ::oneWayUs + mJitter(mRng), std::vector<uint8_t>(data, data + length) };
+        std::deque<InFlight>::iterator it = mQueue.end();
+        while (it != mQueue.begin() && (it - 1)->atUs > inFlight.atUs)
+            --it;
+        mQueue.insert(it, inFlight);
+    }
+    
+    bool receive(std::vector<uint8_t>* data, int64_t nowUs)
+    {
+        if (mQueue.empty() || mQueue.front().atUs > nowUs)
+            return false;
+        data->swap(mQueue.front().data);
+        mQueue.pop_front();
+        return true;
+    }
+    
+    // Share of the packets lost since the last call.
+    double takeLoss()
+    {
+        double loss = mSent > 0 ? (double)mLost / mSent : 0;
+        mSent = mLost = 0;
+        return loss;
+    }
+
+private:
+    std::mt19937 mRng;
+    std::bernoulli_distribution mGoodToBad;
+    std::bernoulli_distribution mBadToGood;
+    std::uniform_int_distribution<int> mJitter;
+    bool mBad;
+    int mSent;
+    int mLost;
+    std::deque<InFlight> mQueue;
+};
+
+struct Protection {
+    const char* name;
+    int columns;      // 0 for none, -1 to follow the loss
+    int rows;
+    bool columnParity;
+};
+
+class Session {
+
+public:
+    Session(const Protection& protection, double goodToBad, double badToGood)
+        : mProtection(protection)
+        , mLink(goodToBad, badToGood)
+        , mPacer(linkOut, this)
+        , mEncoder(pacedIn, this)
+        , mStream(CRtpFecEncoder::packetsIn, &mEncoder)
+        , mDemuxer(frameIn, this)
+        , mNowUs(0)
+        , mFrames(0)
+        , mClean(0)
+    {
+        mPacer.setFrameRate(::fps);
+        mPacer.setTargetBitrate(1000000);
+        mEncoder.setMediaSsrc(mStream.ssrc());
+        if (protection.columns >= 0)
+            mEncoder.setMatrix(protection.columns, protection.rows, true, protection.columnParity);
+        mDemuxer.addPayloadType(96);
+        mDemuxer.addFecPayloadType(::defaultFecPayloadType, 96);
+        mDemuxer.setRecovery(true);
+    }
+    
+    void run(int frames)
+    {
+        int64_t reportUs = 0;
+        for (int k = 0; k < frames; k++) {
+            int64_t frameUs = (int64_t)k * 1000000 / ::fps;
+            for (mNowUs = frameUs; mNowUs < frameUs + 1000000 / ::fps; mNowUs += ::tickUs) {
+                if (mNowUs == frameUs) {
+                    bool key = k % ::fps == 0;
+                    std::vector<uint8_t> frame = makeFrame(key, key ? 30000 : 6000, k);
+                    mStream.streamOut(frame.data(), (int)frame.size(), k * (90000 / ::fps));
+                }
+                mPacer.process(mNowUs);
+                
+                std::vector<uint8_t> data;
+                while (mLink.receive(&data, mNowUs)) {
+                    CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+                    mDemuxer.packetIn(packet, mNowUs);
+                    packet->release();
+                }
+                mDemuxer.poll(mNowUs);
+                
+                // The receiver's report of the loss before repair, a second
+                // apart and half a round trip late
+                if (mProtection.columns < 0 && mNowUs - reportUs >= 1000000) {
+                    mEncoder.setLossRate((float)mLink.takeLoss(), mNowUs + ::oneWayUs);
+                    reportUs = mNowUs;
+                }
+            }
+        }
+        mFrames = frames;
+    }
+    
+    double cleanShare() const { return (double)mClean / mFrames; }
+    double overhead() const { return (double)mEncoder.fecPackets() / mEncoder.mediaPackets(); }
+
+private:
+    static void linkOut(void *sessionRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        for (int i = 0; i < count; i++)
+            session->mLink.send(packets[i], lengths[i], session->mNowUs);
+    }
+    
+    // CRtpPacer::packetsIn() would go by the real clock.
+    static void pacedIn(void *sessionRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        session->mPacer.enqueue(packets, lengths, count, session->mNowUs);
+    }
+    
+    static void frameIn(void *sessionRef, uint32_t, int, CRtpFrame* frame, uint32_t, bool damaged)
+    {
+        Session* session = (Session*)sessionRef;
+        // Parameter sets come out on their own ahead of the keyframe
+        if (frame->length() >= 100 && !damaged)
+            session->mClean++;
+    }
+    
+    Protection mProtection;
+    BurstyLink mLink;
+    CRtpPacer mPacer;
+    CRtpFecEncoder mEncoder;
+    CRtpStream mStream;
+    CRtpDemuxer mDemuxer;
+    int64_t mNowUs;
+    int mFrames;
+    int mClean;
+};
+
+// Two minutes on each channel, the share of frames whole per protection.
+static void testDelivery()
+{
+    const Protection protections[] = {
+        { "none", 0, 0, false },
+        { "rows of 5", 5, 1, false },
+        { "2D 4x4", 4, 4, true },
+        { "adaptive", -1, 0, false },
+    };
+    struct Channel {
+        const char* name;
+        double goodToBad;
+        double badToGood;
+    } channels[] = {
+        { "random 1%", 0.01, 0.99 },
+        { "random 5%", 0.05, 0.95 },
+        { "bursty 3%", 0.015, 0.5 },
+    };
+    
+    printf("%-10s %10s %10s %10s %10s\n", "clean", "none", "rows of 5", "2D 4x4", "adaptive");
+    for (size_t c = 0; c < sizeof(channels) / sizeof(channels[0]); c++) {
+        double clean[4], overhead[4];
+        for (int p = 0; p < 4; p++) {
+            Session session(protections[p], channels[c].goodToBad, channels[c].badToGood);
+            session.run(120 * ::fps);
+            clean[p] = session.cleanShare();
+            overhead[p] = session.overhead();
+        }
+        printf("%-10s %9.1f%% %9.1f%% %9.1f%% %9.1f%%   parity %.0f%% %.0f%% %.0f%%\n", channels[c].name,
+               100 * clean[0], 100 * clean[1], 100 * clean[2], 100 * clean[3],
+               100 * overhead[1], 100 * overhead[2], 100 * overhead[3]);
+        
+        CHECK(overhead[0] == 0);
+        // Over half of what goes wrong without parity is repaired, by rows
+        // alone only while losses come one at a time. Columns catch the
+        // bursts rows miss.
+        bool bursty = channels[c].badToGood < 0.9;
+        if (!bursty)
+            CHECK(1 - clean[1] < (1 - clean[0]) / 2);
+        else
+            CHECK(clean[2] > clean[1]);
+        CHECK(1 - clean[2] < (1 - clean[0]) / 2);
+        CHECK(1 - clean[3] < (1 - clean[0]) / 2);
+    }
+}
+
+int main()
+{
+    testRandomMasks();
+    testDelivery();
+    return testResult("CRtpFecTest");
+}
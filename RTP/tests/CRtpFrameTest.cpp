@@ -0,0 +1,314 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "CRtpStream.h"
+#include "CRtpUnpack.h"
+#include "CRtpFrameAV.h"
+#include "RtpTest.h"
+
+// A frame assembled in place over the received packets holds the same
+// bytes as the copying unpacker's flat buffer, whether flattened with
+// copyTo(), walked segment by segment, or handed to FFmpeg as one buffer
+// a segment or as one padded packet: frames of one NAL unit packet, of
+// several packets, of FU-A fragments and of STAP-A aggregates. The FFmpeg
+// buffers keep their packets alive after the unpacker has moved on.
+
+// The FFmpeg libraries in the tree are built for iOS; what CRtpFrameAV.h
+// calls, as libavutil and libavcodec do it, counting the buffers alive.
+static int buffersAlive = 0;
+
+struct AVBuffer {
+    uint8_t* data;
+    void (*free)(void *opaque, uint8_t *data);
+    void* opaque;
+};
+
+static void bufferFree(void *, uint8_t *data)
+{
+    free(data);
+}
+
+extern "C" {
+
+AVBufferRef *av_buffer_create(uint8_t *data, int size, void (*free)(void *opaque, uint8_t *data), void *opaque, int)
+{
+    AVBuffer* buffer = new AVBuffer;
+    buffer->data = data;
+    buffer->free = free;
+    buffer->opaque = opaque;
+    AVBufferRef* ref = new AVBufferRef;
+    ref->buffer = buffer;
+    ref->data = data;
+    ref->size = size;
+    buffersAlive++;
+    return ref;
+}
+
+AVBufferRef *av_buffer_alloc(int size)
+{
+    uint8_t* data = (uint8_t*)malloc(size);
+    return data != NULL ? av_buffer_create(data, size, bufferFree, NULL, 0) : NULL;
+}
+
+void av_buffer_unref(AVBufferRef **buf)
+{
+    if (*buf == NULL)
+        return;
+    AVBuffer* buffer = (*buf)->buffer;
+    buffer->free(buffer->opaque, buffer->data);
+    delete buffer;
+    delete *buf;
+    *buf = NULL;
+    buffersAlive--;
+}
+
+int av_new_packet(AVPacket *pkt, int size)
+{
+    AVBufferRef* buf = av_buffer_alloc(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (buf == NULL)
+        return -1;
+    memset(buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    pkt->size = size;
+    return 0;
+}
+
+}
+
+// Frames of each kind, a keyframe first for the unpacker to start on.
+// Annex-B access units run a slice to the end, the others go out as AVCC
+// as VideoToolbox hands them over.
+struct Sent {
+    const char* name;
+    std::vector<uint8_t> frame;
+    bool avcc;
+};
+
+static std::vector<Sent> makeFrames()
+{
+    std::vector<Sent> frames;
+    Sent key = { "keyframe", makeFrame(true, 30000, 1), true };
+    frames.push_back(key);
+    Sent single = { "one packet", makeFrame(false, 800, 2), false };
+    frames.push_back(single);
+    Sent slices = { "four packets", std::vector<uint8_t>(), true };
+    for (int i = 0; i < 4; i++)
+        appendNal(slices.frame, 0x41, 1000 + i * 100, 3 + i);
+    frames.push_back(slices);
+    Sent fragments = { "FU-A", makeFrame(false, 30000, 8), false };
+    frames.push_back(fragments);
+    Sent aggregate = { "STAP-A", std::vector<uint8_t>(), true };
+    appendNal(aggregate.frame, 0x41, 200, 9);
+    appendNal(aggregate.frame, 0x41, 300, 10);
+    appendNal(aggregate.frame, 0x41, 150, 11);
+    frames.push_back(aggregate);
+    Sent mixed = { "STAP-A, FU-A", std::vector<uint8_t>(), true };
+    appendNal(mixed.frame, 0x41, 200, 12);
+    appendNal(mixed.frame, 0x41, 250, 13);
+    appendNal(mixed.frame, 0x41, 5000, 14);
+    appendNal(mixed.frame, 0x41, 300, 15);
+    frames.push_back(mixed);
+    Sent smallKey = { "small keyframe", makeFrame(true, 300, 16), true };
+    frames.push_back(smallKey);
+    return frames;
+}
+
+static void frameOut(CRtpStream& stream, const Sent& sent, uint32_t timestamp)
+{
+    if (!sent.avcc) {
+        CHECK(stream.streamOut(sent.frame.data(), (int)sent.frame.size(), timestamp) == 0);
+        return;
+    }
+    std::vector<uint8_t> avcc;
+    std::vector<std::vector<uint8_t> > paramSets;
+    toAvcc(sent.frame, 4, &avcc, &paramSets);
+    const uint8_t* sets[2];
+    int setLengths[2];
+    for (size_t i = 0; i < paramSets.size(); i++) {
+        sets[i] = paramSets[i].data();
+        setLengths[i] = (int)paramSets[i].size();
+    }
+    CHECK(stream.streamOutAvcc(avcc.data(), (int)avcc.size(), 4, timestamp, sets, setLengths,
+                               (int)paramSets.size()) == 0);
+}
+
+static std::vector<uint8_t> segmentsOf(const CRtpFrame& frame)
+{
+    std::vector<uint8_t> bytes;
+    for (int i = 0; i < frame.segmentCount(); i++) {
+        const uint8_t* data = frame.segmentData(i);
+        bytes.insert(bytes.end(), data, data + frame.segment(i).length);
+    }
+    return bytes;
+}
+
+// Bytes the unpacker wrote itself, start codes and NAL headers, rather than
+// pointed into a packet for.
+static int synthesized(const CRtpFrame& frame)
+{
+    int bytes = 0;
+    for (int i = 0; i < frame.segmentCount(); i++) {
+        if (frame.segment(i).packet == NULL)
+            bytes += frame.segment(i).length;
+    }
+    return bytes;
+}
+
+static int startCodes(const std::vector<uint8_t>& frame)
+{
+    int count = 0;
+    for (size_t i = 0; i + 4 <= frame.size(); i++) {
+        if (frame[i] == 0 && frame[i + 1] == 0 && frame[i + 2] == 0 && frame[i + 3] == 1)
+            count++;
+    }
+    return count;
+}
+
+// FFmpeg buffers of one frame, held past the unpacker and the packets.
+struct Held {
+    std::vector<uint8_t> flat;
+    std::vector<AVBufferRef*> buffers;
+};
+
+static void testScatterMatchesFlat()
+{
+    std::vector<Sent> frames = makeFrames();
+    Packets packets;
+    CRtpStream stream(packetOut, &packets);
+    int error = 0;
+    CRtpUnpack copying(error);
+    CRtpUnpack scatter(error);
+    std::vector<Held> held;
+    std::vector<uint8_t> flatAll, sentAll;
+    int fuA = 0, stapA = 0;
+    
+    for (size_t k = 0; k < frames.size(); k++) {
+        packets.clear();
+        frameOut(stream, frames[k], (uint32_t)k * 3000);
+        sentAll.insert(sentAll.end(), frames[k].frame.begin(), frames[k].frame.end());
+        int out = 0, segments = 0;
+        for (size_t p = 0; p < packets.size(); p++) {
+            int type = packets[p][12] & 0x1f;
+            fuA += type == 28;
+            stapA += type == 24;
+            
+            // The copying unpacker writes into its input, the other one
+            // must not
+            std::vector<uint8_t> copy = packets[p];
+            unsigned int size, flatTs, scatterTs;
+            const uint8_t* data = copying.Parse_RTP_Packet(copy.data(), (unsigned short)copy.size(), &size, &flatTs);
+            CRtpPacket* in = CRtpPacket::create(packets[p].data(), (int)packets[p].size());
+            CRtpFrame* frame = scatter.Parse_RTP_Packet(in, &scatterTs);
+            in->release();
+            CHECK((data == NULL) == (frame == NULL));
+            if (data == NULL || frame == NULL)
+                continue;
+            
+            std::vector<uint8_t> flat(data, data + size);
+            flatAll.insert(flatAll.end(), flat.begin(), flat.end());
+            CHECK(scatterTs == flatTs);
+            CHECK(frame->length() == (int)size);
+            std::vector<uint8_t> copied(frame->length());
+            frame->copyTo(copied.data());
+            CHECK(copied == flat);
+            CHECK(segmentsOf(*frame) == flat);
+            // Only the start code and FU-A header of each NAL unit copied
+            CHECK(synthesized(*frame) <= 5 * startCodes(flat));
+            
+            Held h;
+            h.flat = flat;
+            h.buffers.resize(frame->segmentCount());
+            CHECK(rtpFrameToAVBuffers(*frame, h.buffers.data(), (int)h.buffers.size()) == frame->segmentCount());
+            if (frame->segmentCount() > 1)
+                CHECK(rtpFrameToAVBuffers(*frame, h.buffers.data(), frame->segmentCount() - 1) == -1);
+            held.push_back(h);
+            
+            AVPacket avPacket;
+            CHECK(rtpFrameToAVPacket(*frame, &avPacket) == 0);
+            CHECK(avPacket.size == (int)size && memcmp(avPacket.data, flat.data(), size) == 0);
+            for (int i = 0; i < AV_INPUT_BUFFER_PADDING_SIZE; i++)
+                CHECK(avPacket.data[size + i] == 0);
+            av_buffer_unref(&avPacket.buf);
+            out++;
+            segments += frame->segmentCount();
+        }
+        printf("%-14s %6zu bytes, %2zu packets: %d frames out, %3d segments\n",
+               frames[k].name, frames[k].frame.size(), packets.size(), out, segments);
+        CHECK(out > 0);
+    }
+    CHECK(flatAll == sentAll);
+    CHECK(fuA > 0 && stapA > 0);
+    
+    // The packets are gone but for the buffers' references
+    int buffers = 0;
+    for (size_t i = 0; i < held.size(); i++) {
+        std::vector<uint8_t> bytes;
+        for (size_t b = 0; b < held[i].buffers.size(); b++) {
+            bytes.insert(bytes.end(), held[i].buffers[b]->data, held[i].buffers[b]->data + held[i].buffers[b]->size);
+            buffers++;
+        }
+        CHECK(bytes == held[i].flat);
+    }
+    CHECK(buffersAlive == buffers);
+    for (size_t i = 0; i < held.size(); i++) {
+        for (size_t b = 0; b < held[i].buffers.size(); b++)
+            av_buffer_unref(&held[i].buffers[b]);
+    }
+    CHECK(buffersAlive == 0);
+}
+
+// Segments continuing one another merge, a truncate() cuts back across
+// them, and a packet outlives its last segment only as long as someone
+// else holds it.
+static void testSegments()
+{
+    uint8_t bytes[100];
+    for (int i = 0; i < 100; i++)
+        bytes[i] = (uint8_t)i;
+    static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+    CRtpPacket* packet = CRtpPacket::create(bytes, sizeof(bytes));
+    CRtpFrame frame;
+    frame.appendBytes(startCode, 4);
+    frame.appendPacket(packet, 10, 20);
+    frame.appendPacket(packet, 30, 20);
+    frame.appendBytes(startCode, 4);
+    frame.appendBytes(bytes, 1);
+    frame.appendPacket(packet, 60, 40);
+    CHECK(frame.segmentCount() == 4);
+    CHECK(frame.length() == 4 + 40 + 5 + 40);
+    
+    std::vector<uint8_t> expected(startCode, startCode + 4);
+    expected.insert(expected.end(), bytes + 10, bytes + 50);
+    expected.insert(expected.end(), startCode, startCode + 4);
+    expected.push_back(bytes[0]);
+    expected.insert(expected.end(), bytes + 60, bytes + 100);
+    CHECK(segmentsOf(frame) == expected);
+    
+    frame.truncate(4 + 40 + 2);
+    expected.resize(4 + 40 + 2);
+    CHECK(frame.segmentCount() == 3);
+    CHECK(segmentsOf(frame) == expected);
+    std::vector<uint8_t> copied(frame.length());
+    frame.copyTo(copied.data());
+    CHECK(copied == expected);
+    
+    CRtpFrame other;
+    other.swap(frame);
+    CHECK(frame.length() == 0 && frame.segmentCount() == 0);
+    CHECK(segmentsOf(other) == expected);
+    packet->release();
+    CHECK(other.segmentData(1)[0] == 10);
+    other.clear();
+    CHECK(other.length() == 0 && other.segmentCount() == 0);
+}
+
+int main()
+{
+    testScatterMatchesFlat();
+    testSegments();
+    return testResult("CRtpFrameTest");
+}
@@ -0,0 +1,134 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "CRtpHeader.h"
+#include "RtpTest.h"
+
+// The header view on packets with CSRCs, both extension forms and padding,
+// and on ones whose lengths do not add up.
+
+// Two CSRCs, an 8 byte extension of the given profile, 10 bytes of payload
+// and 3 of padding.
+static std::vector<uint8_t> makePacket(uint16_t profile, const uint8_t* elements)
+{
+    std::vector<uint8_t> packet(12 + 8 + 4 + 8 + 10 + 3, 0);
+    packet[0] = 0x80 | 0x20 | 0x10 | 2;
+    packet[1] = 0x80 | 96;
+    packet[2] = 0x12;
+    packet[3] = 0x34;
+    for (int i = 0; i < 4; i++) {
+        packet[4 + i] = (uint8_t)(0x10 + i);
+        packet[8 + i] = (uint8_t)(0x20 + i);
+        packet[12 + i] = (uint8_t)(0x30 + i);
+        packet[16 + i] = (uint8_t)(0x40 + i);
+    }
+    packet[20] = (uint8_t)(profile >> 8);
+    packet[21] = (uint8_t)profile;
+    packet[23] = 2;
+    for (int i = 0; i < 8; i++)
+        packet[24 + i] = elements[i];
+    packet[32] = 0xee;
+    packet.back() = 3;
+    return packet;
+}
+
+static void testFields()
+{
+    const uint8_t elements[8] = { (1 << 4) | 1, 0xaa, 0xbb, 0, (3 << 4) | 0, 0xcc, 0, 0 };
+    std::vector<uint8_t> packet = makePacket(::rtpOneByteExtProfile, elements);
+    CRtpHeader header;
+    CHECK(header.parse(packet.data(), (int)packet.size()));
+    CHECK(header.version() == 2);
+    CHECK(header.padding() && header.extension());
+    CHECK(header.csrcCount() == 2);
+    CHECK(header.marker());
+    CHECK(header.payloadType() == 96);
+    CHECK(header.seqNo() == 0x1234);
+    CHECK(header.timestamp() == 0x10111213);
+    CHECK(header.ssrc() == 0x20212223);
+    CHECK(header.csrc(0) == 0x30313233 && header.csrc(1) == 0x40414243);
+    CHECK(header.extensionProfile() == ::rtpOneByteExtProfile);
+    CHECK(header.extensionLength() == 8);
+    CHECK(header.headerLength() == 32);
+    CHECK(header.paddingLength() == 3);
+    CHECK(header.payloadLength() == 10);
+    CHECK(header.payload()[0] == 0xee);
+}
+
+static void testOneByteExtension()
+{
+    const uint8_t elements[8] = { (1 << 4) | 1, 0xaa, 0xbb, 0, (3 << 4) | 0, 0xcc, 0, 0 };
+    std::vector<uint8_t> packet = makePacket(::rtpOneByteExtProfile, elements);
+    CRtpHeader header;
+    CHECK(header.parse(packet.data(), (int)packet.size()));
+    
+    const uint8_t* data;
+    int length;
+    CHECK(header.findExtension(1, &data, &length) && length == 2 && data[0] == 0xaa && data[1] == 0xbb);
+    // Past the padding byte between them
+    CHECK(header.findExtension(3, &data, &length) && length == 1 && data[0] == 0xcc);
+    CHECK(!header.findExtension(2, &data, &length));
+    
+    // An id of 15 ends the walk
+    packet[27] = 0xf0;
+    packet[28] = (5 << 4) | 0;
+    CHECK(header.parse(packet.data(), (int)packet.size()));
+    CHECK(header.findExtension(1, &data, &length));
+    CHECK(!header.findExtension(5, &data, &length));
+}
+
+static void testTwoByteExtension()
+{
+    const uint8_t elements[8] = { 5, 3, 1, 2, 3, 0, 7, 0 };
+    std::vector<uint8_t> packet = makePacket(::rtpTwoByteExtProfile | 0x3, elements);
+    CRtpHeader header;
+    CHECK(header.parse(packet.data(), (int)packet.size()));
+    
+    const uint8_t* data;
+    int length;
+    CHECK(header.findExtension(5, &data, &length) && length == 3 && data[0] == 1 && data[2] == 3);
+    CHECK(header.findExtension(7, &data, &length) && length == 0);
+    
+    // Another profile has no elements
+    packet[20] = 0xab;
+    CHECK(header.parse(packet.data(), (int)packet.size()));
+    CHECK(!header.findExtension(5, &data, &length));
+}
+
+static void testMalformed()
+{
+    const uint8_t elements[8] = { (1 << 4) | 1, 0xaa, 0xbb, 0, 0, 0, 0, 0 };
+    std::vector<uint8_t> packet = makePacket(::rtpOneByteExtProfile, elements);
+    CRtpHeader header;
+    
+    // A padding count of zero, or more than the payload
+    packet.back() = 0;
+    CHECK(!header.parse(packet.data(), (int)packet.size()));
+    packet.back() = 14;
+    CHECK(!header.parse(packet.data(), (int)packet.size()));
+    packet.back() = 13;
+    CHECK(header.parse(packet.data(), (int)packet.size()) && header.payloadLength() == 0);
+    packet.back() = 3;
+    
+    // An extension running past the end
+    packet[23] = 20;
+    CHECK(!header.parse(packet.data(), (int)packet.size()));
+    packet[23] = 2;
+    
+    // The CSRC list running into the end
+    CHECK(!header.parse(packet.data(), 14));
+    CHECK(!header.parse(packet.data(), 11));
+    
+    // Not version 2
+    packet[0] = 0x40 | (packet[0] & 0x3f);
+    CHECK(!header.parse(packet.data(), (int)packet.size()));
+}
+
+int main()
+{
+    testFields();
+    testOneByteExtension();
+    testTwoByteExtension();
+    testMalformed();
+    return testResult("CRtpHeaderTest");
+}
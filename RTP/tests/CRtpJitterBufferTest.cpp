@@ -0,0 +1,177 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include "CRtpJitterBuffer.h"
+#include "RtpTest.h"
+
+// Reordered packets come out in sequence, a frame with a hole is held for
+// the playout delay and no longer, and a burst past the reorder window
+// lets whole frames out early instead of dropping them.
+
+static const int delayUs = 10000;
+
+static std::vector<uint8_t> makePacket(uint16_t seq, uint32_t timestamp, bool marker)
+{
+    std::vector<uint8_t> packet(40, 0x55);
+    packet[0] = 0x80;
+    packet[1] = (marker ? 0x80 : 0) | 96;
+    packet[2] = (uint8_t)(seq >> 8);
+    packet[3] = (uint8_t)seq;
+    for (int i = 0; i < 4; i++) {
+        packet[4 + i] = (uint8_t)(timestamp >> (24 - 8 * i));
+        packet[8 + i] = (uint8_t)(0x12345678 >> (24 - 8 * i));
+    }
+    return packet;
+}
+
+// frames of size packets each from seq, the last one of each marked.
+static Packets makeFrames(uint16_t seq, int frames, int size)
+{
+    Packets packets;
+    for (int f = 0; f < frames; f++) {
+        for (int i = 0; i < size; i++)
+            packets.push_back(makePacket(seq++, f * 3000, i == size - 1));
+    }
+    return packets;
+}
+
+static uint16_t seqOf(CRtpPacket* packet)
+{
+    return (uint16_t)((packet->data()[2] << 8) | packet->data()[3]);
+}
+
+// Everything due at nowUs, by sequence number.
+static std::vector<uint16_t> popAll(CRtpJitterBuffer& buffer, int64_t nowUs)
+{
+    std::vector<uint16_t> seqs;
+    while (CRtpPacket* packet = buffer.pop(nowUs)) {
+        seqs.push_back(seqOf(packet));
+        packet->release();
+    }
+    return seqs;
+}
+
+static bool inSequence(const std::vector<uint16_t>& seqs, uint16_t first, int count)
+{
+    if ((int)seqs.size() != count)
+        return false;
+    for (int i = 0; i < count; i++) {
+        if (seqs[i] != (uint16_t)(first + i))
+            return false;
+    }
+    return true;
+}
+
+// Packets shuffled in runs of 6, so up to 5 places out, across the 16 bit
+// wrap, each one arriving a millisecond after the last.
+static void testReorder()
+{
+    CRtpJitterBuffer buffer;
+    buffer.setPlayoutDelay(::delayUs, ::delayUs);
+    Packets packets = makeFrames(65000, 200, 4);
+    std::mt19937 rng(9);
+    for (size_t i = 0; i + 6 <= packets.size(); i += 6) {
+        if (rng() % 2 == 0)
+            std::shuffle(packets.begin() + i, packets.begin() + i + 6, rng);
+    }
+    
+    std::vector<uint16_t> out;
+    int64_t nowUs = 0;
+    for (size_t i = 0; i < packets.size(); i++, nowUs += 1000) {
+        CHECK(buffer.insert(packets[i].data(), (int)packets[i].size(), nowUs));
+        std::vector<uint16_t> due = popAll(buffer, nowUs);
+        out.insert(out.end(), due.begin(), due.end());
+    }
+    std::vector<uint16_t> due = popAll(buffer, nowUs + ::delayUs);
+    out.insert(out.end(), due.begin(), due.end());
+    
+    CHECK(inSequence(out, 65000, 800));
+    CHECK(buffer.lostFrames() == 0);
+    
+    // Duplicates and packets already played out are turned away
+    CHECK(!buffer.insert(packets.back().data(), (int)packets.back().size(), nowUs));
+    CHECK(!buffer.insert(packets.front().data(), (int)packets.front().size(), nowUs));
+}
+
+// A frame missing a packet holds up the ones behind it for the playout
+// delay from when the hole showed, then goes out without it.
+static void testHoleWaits()
+{
+    Packets packets = makeFrames(100, 3, 3);
+    for (int turnsUp = 0; turnsUp < 2; turnsUp++) {
+        CRtpJitterBuffer buffer;
+        buffer.setPlayoutDelay(::delayUs, ::delayUs);
+        // The first frame at 0, the others with 104 missing at 5 ms
+        for (size_t i = 0; i < packets.size(); i++) {
+            if (i != 4)
+                buffer.insert(packets[i].data(), (int)packets[i].size(), i < 3 ? 0 : 5000);
+        }
+        
+        // The first frame, once the start has waited for earlier packets
+        CHECK(popAll(buffer, ::delayUs - 1).empty());
+        CHECK(inSequence(popAll(buffer, ::delayUs), 100, 3));
+        CHECK(buffer.nextDeadline() == 5000 + ::delayUs);
+        CHECK(popAll(buffer, 5000 + ::delayUs - 1).empty());
+        
+        if (turnsUp) {
+            CHECK(buffer.insert(packets[4].data(), (int)packets[4].size(), 12000));
+            CHECK(inSequence(popAll(buffer, 12000), 103, 6));
+            CHECK(buffer.lostFrames() == 0);
+        }
+        else {
+            // Given up on: what there is of the second frame before the
+            // hole goes, the rest follows with the gap for CRtpUnpack
+            std::vector<uint16_t> rest = popAll(buffer, 5000 + ::delayUs);
+            CHECK(buffer.lostFrames() == 1);
+            CHECK(inSequence(rest, 105, 4));
+        }
+    }
+}
+
+// 10 keyframes of 110 packets arriving at once, more than the window of
+// 512 holds, while the start still waits for earlier packets. Nothing may
+// be lost and nothing may come out of order.
+static void testBurstPastWindow()
+{
+    CRtpJitterBuffer buffer;
+    buffer.setPlayoutDelay(::delayUs, ::delayUs);
+    Packets packets = makeFrames(40000, 10, 110);
+    std::vector<uint16_t> out;
+    for (size_t i = 0; i < packets.size(); i++) {
+        CHECK(buffer.insert(packets[i].data(), (int)packets[i].size(), 0));
+        std::vector<uint16_t> due = popAll(buffer, 0);
+        out.insert(out.end(), due.begin(), due.end());
+    }
+    // Frames pushed out by the burst do not wait for the start
+    CHECK(!out.empty());
+    std::vector<uint16_t> due = popAll(buffer, ::delayUs);
+    out.insert(out.end(), due.begin(), due.end());
+    CHECK(inSequence(out, 40000, 1100));
+    CHECK(buffer.lostFrames() == 0);
+    
+    // The same burst with one packet of the third frame missing and nothing
+    // popped on the way: only that frame is given up on
+    CRtpJitterBuffer holed;
+    holed.setPlayoutDelay(::delayUs, ::delayUs);
+    for (size_t i = 0; i < packets.size(); i++) {
+        if (i != 250)
+            holed.insert(packets[i].data(), (int)packets[i].size(), 0);
+    }
+    out = popAll(holed, 1000000);
+    CHECK(holed.lostFrames() == 1);
+    // The third frame up to the hole dropped, the rest of it let through
+    std::vector<uint16_t> before(out.begin(), out.begin() + std::min<size_t>(out.size(), 220));
+    std::vector<uint16_t> after(out.begin() + std::min<size_t>(out.size(), 220), out.end());
+    CHECK(inSequence(before, 40000, 220));
+    CHECK(inSequence(after, 40251, 1100 - 251));
+}
+
+int main()
+{
+    testReorder();
+    testHoleWaits();
+    testBurstPastWindow();
+    return testResult("CRtpJitterBufferTest");
+}
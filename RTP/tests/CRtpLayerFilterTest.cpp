@@ -0,0 +1,537 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <map>
+#include <random>
+#include "CRtpStream.h"
+#include "CRtpPacer.h"
+#include "CRtpDemuxer.h"
+#include "CRtpRsEncoder.h"
+#include "CRtpPacketHistory.h"
+#include "CRtpRetransmitter.h"
+#include "CRtpLayerFilter.h"
+#include "CRtcp.h"
+#include "CRtcpFeedbackSender.h"
+#include "RtpTest.h"
+
+// A temporally layered test stream, thinned per receiver by CRtpLayerFilter.
+// The frames carry real slice headers, nal_ref_idc and frame_num, so what
+// comes out can be checked the way a decoder would: every frame a receiver
+// gets refers only to frames it got before. All layers make full rate,
+// layers 0-1 half, layer 0 a quarter, each decodable throughout, and the
+// same holds for a receiver switched between them mid-stream and over a
+// lossy link with NACK and Reed-Solomon repair through the filter.
+
+static const int fps = 20;
+static const int gop = 80;
+static const int64_t oneWayUs = 20000;
+static const int videoPayloadType = 96;
+static const int rtxPayloadType = 97;
+static const int rsPayloadType = 99;
+
+// Exp-Golomb and fixed width fields, most significant bit first.
+class BitWriter {
+
+public:
+    BitWriter() : mBits(0) {}
+    
+    void bit(int b)
+    {
+        if (mBits % 8 == 0)
+            mBytes.push_back(0);
+        if (b)
+            mBytes.back() |= 0x80 >> (mBits % 8);
+        mBits++;
+    }
+    
+    void bits(int count, unsigned value)
+    {
+        for (int i = count - 1; i >= 0; i--)
+            bit((value >> i) & 1);
+    }
+    
+    void ue(unsigned value)
+    {
+        value++;
+        int length = 0;
+        while ((value >> length) > 1)
+            length++;
+        for (int i = 0; i < length; i++)
+            bit(0);
+        bits(length + 1, value);
+    }
+    
+    std::vector<uint8_t>& bytes() { return mBytes; }
+
+private:
+    std::vector<uint8_t> mBytes;
+    int mBits;
+};
+
+class BitReader {
+
+public:
+    BitReader(const uint8_t* data) : mData(data), mBit(0) {}
+    
+    int bit()
+    {
+        int b = (mData[mBit / 8] >> (7 - mBit % 8)) & 1;
+        mBit++;
+        return b;
+    }
+    
+    unsigned bits(int count)
+    {
+        unsigned value = 0;
+        for (int i = 0; i < count; i++)
+            value = value << 1 | bit();
+        return value;
+    }
+    
+    unsigned ue()
+    {
+        int zeros = 0;
+        while (!bit())
+            zeros++;
+        return (1u << zeros | bits(zeros)) - 1;
+    }
+
+private:
+    const uint8_t* mData;
+    int mBit;
+};
+
+// AVCC access units: an IDR every gop frames, a reference P every fourth
+// and non-reference P between, two slices each. frame_num counts reference
+// frames, log2_max_frame_num is 4.
+class LayeredSource {
+
+public:
+    LayeredSource() : mFrameNum(0), mSeed(1) {}
+    
+    std::vector<uint8_t> frame(int index, std::vector<std::vector<uint8_t> >* paramSets)
+    {
+        int k = index % ::gop;
+        bool idr = k == 0;
+        bool ref = k % 4 == 0;
+        if (idr)
+            mFrameNum = 0;
+        
+        paramSets->clear();
+        if (idr) {
+            static const uint8_t sps[5] = { 0x67, 0x42, 0xc0, 0x1e, 0xf4 };
+            static const uint8_t pps[4] = { 0x68, 0xce, 0x3c, 0x80 };
+            paramSets->push_back(std::vector<uint8_t>(sps, sps + sizeof(sps)));
+            paramSets->push_back(std::vector<uint8_t>(pps, pps + sizeof(pps)));
+        }
+        
+        std::vector<uint8_t> frame;
+        int sliceLength = (idr ? 9000 : ref ? 2600 : 1300) / 2;
+        for (int slice = 0; slice < 2; slice++) {
+            BitWriter writer;
+            writer.bits(8, (ref ? (idr ? 0x60 : 0x40) : 0x00) | (idr ? 5 : 1));
+            writer.ue(slice == 0 ? 0 : 150);   // first_mb_in_slice
+            writer.ue(idr ? 7 : 5);            // slice_type
+            writer.ue(0);                      // pic_parameter_set_id
+            writer.bits(4, mFrameNum);
+            if (idr)
+                writer.ue(index / ::gop & 0xff);   // idr_pic_id
+            writer.bits(7, 0x55);
+            std::vector<uint8_t>& nal = writer.bytes();
+            while ((int)nal.size() < sliceLength) {
+                mSeed = mSeed * 1664525 + 1013904223;
+                uint8_t b = (uint8_t)(mSeed >> 24);
+                nal.push_back(b != 0 ? b : 1);
+            }
+            uint32_t length = (uint32_t)nal.size();
+            for (int i = 0; i < 4; i++)
+                frame.push_back((uint8_t)(length >> (24 - 8 * i)));
+            frame.insert(frame.end(), nal.begin(), nal.end());
+        }
+        if (ref)
+            mFrameNum = (mFrameNum + 1) & 15;
+        return frame;
+    }
+
+private:
+    int mFrameNum;
+    uint32_t mSeed;
+};
+
+// What the demuxer should hand out for an AVCC access unit.
+static std::vector<uint8_t> toAnnexB(const std::vector<std::vector<uint8_t> >& paramSets, const std::vector<uint8_t>& avcc)
+{
+    static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+    std::vector<uint8_t> frame;
+    for (size_t i = 0; i < paramSets.size(); i++) {
+        frame.insert(frame.end(), startCode, startCode + 4);
+        frame.insert(frame.end(), paramSets[i].begin(), paramSets[i].end());
+    }
+    for (size_t off = 0; off + 4 <= avcc.size();) {
+        uint32_t length = avcc[off] << 24 | avcc[off + 1] << 16 | avcc[off + 2] << 8 | avcc[off + 3];
+        frame.insert(frame.end(), startCode, startCode + 4);
+        frame.insert(frame.end(), avcc.begin() + off + 4, avcc.begin() + off + 4 + length);
+        off += 4 + length;
+    }
+    return frame;
+}
+
+typedef std::map<uint32_t, std::vector<uint8_t> > SentFrames;
+
+// Decodability as a decoder sees it: from an IDR on, each frame's
+// frame_num follows the last reference frame's.
+class Checker {
+
+public:
+    Checker(const SentFrames* sent)
+        : mSent(sent)
+        , mPrevRef(-1)
+        , mBroken(true)
+        , mHeldTs(0)
+        , mDecoded(0)
+        , mUndecodable(0)
+        , mDamaged(0)
+        , mMismatched(0)
+    {
+    }
+    
+    void frameIn(CRtpFrame* frame, uint32_t timestamp, bool damaged)
+    {
+        std::vector<uint8_t> data(frame->length());
+        frame->copyTo(data.data());
+        if (damaged) {
+            mDamaged++;
+            mBroken = true;
+            mHeld.clear();
+            return;
+        }
+        
+        // Parameter sets come out ahead of their IDR, on its timestamp
+        if (!mHeld.empty() && mHeldTs == timestamp) {
+            mHeld.insert(mHeld.end(), data.begin(), data.end());
+            data.swap(mHeld);
+        }
+        mHeld.clear();
+        if (data.size() > 4 && (data[4] & 0x1f) == 7 && data.size() < 40) {
+            mHeld = data;
+            mHeldTs = timestamp;
+            return;
+        }
+        
+        SentFrames::const_iterator it = mSent->find(timestamp);
+        if (it == mSent->end() || it->second != data)
+            mMismatched++;
+        
+        int type = -1;
+        int refIdc = 0;
+        int frameNum = -1;
+        for (size_t i = 0; i + 5 < data.size(); i++) {
+            if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 0 || data[i + 3] != 1)
+                continue;
+            type = data[i + 4] & 0x1f;
+            if (type != 1 && type != 5)
+                continue;
+            refIdc = data[i + 4] >> 5;
+            BitReader reader(&data[i + 5]);
+            reader.ue();   // first_mb_in_slice
+            reader.ue();   // slice_type
+            reader.ue();   // pic_parameter_set_id
+            frameNum = (int)reader.bits(4);
+            break;
+        }
+        
+        if (type == 5 && frameNum == 0) {
+            mPrevRef = 0;
+            mBroken = false;
+            mDecoded++;
+            return;
+        }
+        if (mBroken || frameNum != ((mPrevRef + 1) & 15)) {
+            mBroken = true;
+            mUndecodable++;
+            return;
+        }
+        if (refIdc != 0)
+            mPrevRef = frameNum;
+        mDecoded++;
+    }
+    
+    int decoded() const { return mDecoded; }
+    int undecodable() const { return mUndecodable; }
+    int damaged() const { return mDamaged; }
+    int mismatched() const { return mMismatched; }
+
+private:
+    const SentFrames* mSent;
+    int mPrevRef;
+    bool mBroken;
+    std::vector<uint8_t> mHeld;
+    uint32_t mHeldTs;
+    int mDecoded;
+    int mUndecodable;
+    int mDamaged;
+    int mMismatched;
+};
+
+struct InFlight {
+    int64_t atUs;
+    std::vector<uint8_t> data;
+};
+
+// One viewer: its layer filter, a link with loss, a demuxer that NACKs
+// and repairs, and a retransmitter on the sender's history for its NACKs.
+class Receiver {
+
+public:
+    Receiver(const SentFrames* sent, CRtpPacketHistory* history, uint32_t mediaSsrc, int maxLayer, double loss, uint32_t seed)
+        : mChecker(sent)
+        , mDemuxer(frameIn, this)
+        , mFeedback(rtcpOut, this)
+        , mRetransmitter(history, resendIn, this)
+        , mRng(seed)
+        , mLoss(loss)
+        , mNowUs(0)
+        , mLastSeq(-1)
+        , mSeqJumps(0)
+        , mLastTransportSeq(-1)
+        , mTransportJumps(0)
+    {
+        mDemuxer.addPayloadType(::videoPayloadType);
+        mDemuxer.addRtxPayloadType(::rtxPayloadType, ::videoPayloadType);
+        mDemuxer.addRsPayloadType(::rsPayloadType, ::videoPayloadType);
+        mDemuxer.setRecovery(true);
+        mDemuxer.setFeedbackSender(&mFeedback);
+        mDemuxer.setNack(true);
+        mDemuxer.setRtt(2 * ::oneWayUs);
+        mParser.setNackCallback(nackIn, this);
+        mRetransmitter.setRtx(::rtxPayloadType);
+        mRetransmitter.setMediaSsrc(mediaSsrc);
+        mFilter.setMediaSsrc(mediaSsrc);
+        mFilter.setPayloadTypes(::videoPayloadType, ::rtxPayloadType, -1, ::rsPayloadType);
+        mFilter.setMaxLayer(maxLayer);
+    }
+    
+    CRtpLayerFilter& filter() { return mFilter; }
+    const Checker& checker() const { return mChecker; }
+    // Gaps in the media sequence numbers, and in the transport-wide ones of
+    // what the pacer sent, as they reach this receiver.
+    int seqJumps() const { return mSeqJumps; }
+    int transportJumps() const { return mTransportJumps; }
+    
+    void send(const uint8_t* data, int length)
+    {
+        CRtpPacket* packet = CRtpPacket::create(data, length);
+        CRtpHeader header;
+        header.parse(data, length);
+        CRtpPacket* out = mFilter.filter(packet, header);
+        packet->release();
+        if (out == NULL)
+            return;
+        
+        CRtpHeader sent;
+        sent.parse(out->data(), out->length());
+        if (sent.payloadType() == ::videoPayloadType) {
+            if (mLastSeq >= 0 && (uint16_t)(mLastSeq + 1) != sent.seqNo())
+                mSeqJumps++;
+            mLastSeq = sent.seqNo();
+        }
+        // Retransmissions here skip the pacer and keep the number they had
+        const uint8_t* field;
+        int fieldLength;
+        if (sent.payloadType() != ::rtxPayloadType && sent.findExtension(::transportSeqExtId, &field, &fieldLength) && fieldLength == 2) {
+            int seq = field[0] << 8 | field[1];
+            if (mLastTransportSeq >= 0 && (uint16_t)(mLastTransportSeq + 1) != seq)
+                mTransportJumps++;
+            mLastTransportSeq = seq;
+        }
+        
+        if (!mLoss(mRng)) {
+            InFlight inFlight = { mNowUs + ::oneWayUs, std::vector<uint8_t>(out->data(), out->data() + out->length()) };
+            mDown.push_back(inFlight);
+        }
+        out->release();
+    }
+    
+    void step(int64_t nowUs)
+    {
+        mNowUs = nowUs;
+        while (!mDown.empty() && mDown.front().atUs <= nowUs) {
+            CRtpPacket* packet = CRtpPacket::create(mDown.front().data.data(), (int)mDown.front().data.size());
+            mDemuxer.packetIn(packet, nowUs);
+            packet->release();
+            mDown.pop_front();
+        }
+        mDemuxer.poll(nowUs);
+        mFeedback.poll(nowUs);
+        while (!mUp.empty() && mUp.front().atUs <= nowUs) {
+            mParser.parse(mUp.front().data.data(), (int)mUp.front().data.size());
+            mUp.pop_front();
+        }
+    }
+
+private:
+    static void frameIn(void *receiverRef, uint32_t, int, CRtpFrame* frame, uint32_t timestamp, bool damaged)
+    {
+        ((Receiver*)receiverRef)->mChecker.frameIn(frame, timestamp, damaged);
+    }
+    
+    static void rtcpOut(void *receiverRef, const uint8_t* data, int length)
+    {
+        Receiver* receiver = (Receiver*)receiverRef;
+        InFlight inFlight = { receiver->mNowUs + ::oneWayUs, std::vector<uint8_t>(data, data + length) };
+        receiver->mUp.push_back(inFlight);
+    }
+    
+    // The receiver NACKs its own numbering, the history has the sender's.
+    static void nackIn(void *receiverRef, uint32_t, uint32_t mediaSsrc, const uint16_t* seqs, int count)
+    {
+        Receiver* receiver = (Receiver*)receiverRef;
+        std::vector<uint16_t> original(seqs, seqs + count);
+        count = receiver->mFilter.originalSeqs(original.data(), count);
+        receiver->mRetransmitter.resend(mediaSsrc, original.data(), count, receiver->mNowUs);
+    }
+    
+    static void resendIn(void *receiverRef, CRtpPacket* packet)
+    {
+        ((Receiver*)receiverRef)->send(packet->data(), packet->length());
+    }
+    
+    Checker mChecker;
+    CRtpLayerFilter mFilter;
+    CRtpDemuxer mDemuxer;
+    CRtcpFeedbackSender mFeedback;
+    CRtcpParser mParser;
+    CRtpRetransmitter mRetransmitter;
+    std::mt19937 mRng;
+    std::bernoulli_distribution mLoss;
+    int64_t mNowUs;
+    std::deque<InFlight> mDown;
+    std::deque<InFlight> mUp;
+    int mLastSeq;
+    int mSeqJumps;
+    int mLastTransportSeq;
+    int mTransportJumps;
+};
+
+class Sender {
+
+public:
+    Sender(double loss)
+        : mRs(pacedIn, this)
+        , mStream(CRtpRsEncoder::packetsIn, &mRs)
+        , mPacer(sentIn, this)
+        , mNowUs(0)
+    {
+        mStream.setTemporalLayers(3);
+        mRs.setMediaSsrc(mStream.ssrc());
+        mRs.setLossRate((float)loss, 0);
+        mHistory.setSsrc(mStream.ssrc());
+        mPacer.setFrameRate(::fps);
+        mPacer.setTargetBitrate(2000000);
+        mPacer.setHistory(&mHistory);
+        // Stamped here, renumbered per receiver by its filter
+        mPacer.setTransportSequence(NULL, NULL);
+    }
+    
+    uint32_t ssrc() const { return mStream.ssrc(); }
+    CRtpPacketHistory* history() { return &mHistory; }
+    const SentFrames* sent() const { return &mSent; }
+    void addReceiver(Receiver* receiver) { mReceivers.push_back(receiver); }
+    
+    // Each change of layers in switches takes effect at its frame.
+    void run(int frames, const std::map<int, std::pair<Receiver*, int> >& switches)
+    {
+        int index = 0;
+        for (mNowUs = 0; mNowUs < (int64_t)frames * 1000000 / ::fps + 1000000; mNowUs += 1000) {
+            if (mNowUs % (1000000 / ::fps) == 0 && index < frames) {
+                std::map<int, std::pair<Receiver*, int> >::const_iterator it = switches.find(index);
+                if (it != switches.end())
+                    it->second.first->filter().setMaxLayer(it->second.second);
+                
+                std::vector<std::vector<uint8_t> > paramSets;
+                std::vector<uint8_t> frame = mSource.frame(index, &paramSets);
+                const uint8_t* paramSetData[2];
+                int paramSetLengths[2];
+                for (size_t k = 0; k < paramSets.size(); k++) {
+                    paramSetData[k] = paramSets[k].data();
+                    paramSetLengths[k] = (int)paramSets[k].size();
+                }
+                uint32_t timestamp = (uint32_t)index * (90000 / ::fps);
+                mSent[timestamp] = toAnnexB(paramSets, frame);
+                CHECK(mStream.streamOutAvcc(frame.data(), (int)frame.size(), 4, timestamp,
+                                            paramSetData, paramSetLengths, (int)paramSets.size()) == 0);
+                index++;
+            }
+            mPacer.process(mNowUs);
+            for (size_t i = 0; i < mReceivers.size(); i++)
+                mReceivers[i]->step(mNowUs);
+        }
+    }
+
+private:
+    // CRtpPacer::packetsIn() would enqueue on the real clock
+    static void pacedIn(void *senderRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Sender* sender = (Sender*)senderRef;
+        sender->mPacer.enqueue(packets, lengths, count, sender->mNowUs);
+    }
+    
+    static void sentIn(void *senderRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Sender* sender = (Sender*)senderRef;
+        for (int i = 0; i < count; i++)
+            for (size_t k = 0; k < sender->mReceivers.size(); k++)
+                sender->mReceivers[k]->send(packets[i], lengths[i]);
+    }
+    
+    CRtpRsEncoder mRs;
+    CRtpStream mStream;
+    CRtpPacketHistory mHistory;
+    CRtpPacer mPacer;
+    LayeredSource mSource;
+    SentFrames mSent;
+    std::vector<Receiver*> mReceivers;
+    int64_t mNowUs;
+};
+
+static void testLayers(double loss)
+{
+    const int frames = 10 * ::gop;
+    Sender sender(loss);
+    Receiver full(sender.sent(), sender.history(), sender.ssrc(), 2, loss, 11);
+    Receiver half(sender.sent(), sender.history(), sender.ssrc(), 1, loss, 12);
+    Receiver quarter(sender.sent(), sender.history(), sender.ssrc(), 0, loss, 13);
+    Receiver switching(sender.sent(), sender.history(), sender.ssrc(), 2, loss, 14);
+    sender.addReceiver(&full);
+    sender.addReceiver(&half);
+    sender.addReceiver(&quarter);
+    sender.addReceiver(&switching);
+    
+    // All layers for a quarter, then layer 0, layers 0-1 and all again.
+    // Every switch lands on a base layer frame, so it is exact.
+    std::map<int, std::pair<Receiver*, int> > switches;
+    switches[frames / 4] = std::make_pair(&switching, 0);
+    switches[frames / 2] = std::make_pair(&switching, 1);
+    switches[3 * frames / 4] = std::make_pair(&switching, 2);
+    sender.run(frames, switches);
+    
+    Receiver* receivers[4] = { &full, &half, &quarter, &switching };
+    const int expected[4] = { frames, frames / 2, frames / 4, frames / 4 + frames / 16 + frames / 8 + frames / 4 };
+    for (int i = 0; i < 4; i++) {
+        const Checker& checker = receivers[i]->checker();
+        CHECK(checker.decoded() == expected[i]);
+        CHECK(checker.undecodable() == 0);
+        CHECK(checker.damaged() == 0);
+        CHECK(checker.mismatched() == 0);
+        CHECK(receivers[i]->seqJumps() == 0);
+        CHECK(receivers[i]->transportJumps() == 0);
+    }
+}
+
+int main()
+{
+    testLayers(0);
+    testLayers(0.03);
+    return testResult("CRtpLayerFilterTest");
+}
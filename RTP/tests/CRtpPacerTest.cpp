@@ -0,0 +1,235 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "CRtpStream.h"
+#include "CRtpPacer.h"
+#include "CRtpFecEncoder.h"
+#include "CRtpRsEncoder.h"
+#include "CRtpRetransmitter.h"
+#include "RtpTest.h"
+
+// A 1 Mbit/s stream into an 8 Mbit/s bottleneck on a simulated clock, 20
+// fps with a 60 KB keyframe every second and 3 KB P-frames in between.
+// Sent back to back, each keyframe stands in the bottleneck's queue whole;
+// paced over the frame interval the queue stays a fraction of that. Then
+// what leaves the pacer, repair packets and retransmissions with the
+// transport-wide sequence number added, has to keep to the stream's MTU.
+
+static const int64_t tickUs = 100;
+static const int fps = 20;
+static const int seconds = 10;
+static const double linkBytesPerUs = 1.0;   // 8 Mbit/s
+static const int overhead = 28;             // IP and UDP, on the link
+
+// Drains at the link rate, tracking how deep its queue gets.
+class Bottleneck {
+
+public:
+    Bottleneck()
+        : mQueuedBytes(0)
+        , mLastUs(0)
+        , mPeakBytes(0)
+        , mPackets(0)
+        , mBytes(0)
+    {
+    }
+    
+    void send(int length, int64_t nowUs)
+    {
+        drain(nowUs);
+        mQueuedBytes += length + ::overhead;
+        mPeakBytes = std::max(mPeakBytes, mQueuedBytes);
+        mPackets++;
+        mBytes += length;
+    }
+    
+    void drain(int64_t nowUs)
+    {
+        mQueuedBytes = std::max(0.0, mQueuedBytes - (nowUs - mLastUs) * ::linkBytesPerUs);
+        mLastUs = nowUs;
+    }
+    
+    double queuedBytes() const { return mQueuedBytes; }
+    double peakBytes() const { return mPeakBytes; }
+    double peakUs() const { return mPeakBytes / ::linkBytesPerUs; }
+    int packets() const { return mPackets; }
+    int64_t bytes() const { return mBytes; }
+
+private:
+    double mQueuedBytes;
+    int64_t mLastUs;
+    double mPeakBytes;
+    int mPackets;
+    int64_t mBytes;
+};
+
+class Sender {
+
+public:
+    // Paced with fraction of the frame interval, or back to back with 0.
+    Sender(float fraction)
+        : mPaced(fraction > 0)
+        , mPacer(linkOut, this)
+        , mStream(mPaced ? pacedIn : linkOut, this)
+        , mNowUs(0)
+    {
+        mPacer.setFrameRate(::fps);
+        mPacer.setTargetBitrate(1000000);
+        if (mPaced)
+            mPacer.setBurstFraction(fraction);
+    }
+    
+    void run()
+    {
+        for (int k = 0; k < ::seconds * ::fps; k++) {
+            int64_t frameUs = (int64_t)k * 1000000 / ::fps;
+            for (mNowUs = frameUs; mNowUs < frameUs + 1000000 / ::fps; mNowUs += ::tickUs) {
+                if (mNowUs == frameUs) {
+                    bool key = k % ::fps == 0;
+                    std::vector<uint8_t> frame = makeFrame(key, key ? 60000 : 3000, k);
+                    mStream.streamOut(frame.data(), (int)frame.size(), k * (90000 / ::fps));
+                }
+                if (mPaced)
+                    mPacer.process(mNowUs);
+                mLink.drain(mNowUs);
+            }
+        }
+    }
+    
+    const Bottleneck& link() const { return mLink; }
+    bool drained() { return mPacer.queuedPackets() == 0 && mLink.queuedBytes() == 0; }
+
+private:
+    static void linkOut(void *senderRef, const uint8_t* const*, const int* lengths, int count)
+    {
+        Sender* sender = (Sender*)senderRef;
+        for (int i = 0; i < count; i++)
+            sender->mLink.send(lengths[i], sender->mNowUs);
+    }
+    
+    // CRtpPacer::packetsIn() would go by the real clock.
+    static void pacedIn(void *senderRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Sender* sender = (Sender*)senderRef;
+        sender->mPacer.enqueue(packets, lengths, count, sender->mNowUs);
+    }
+    
+    bool mPaced;
+    CRtpPacer mPacer;
+    CRtpStream mStream;
+    Bottleneck mLink;
+    int64_t mNowUs;
+};
+
+static void report(const char* name, const Sender& sender)
+{
+    printf("%-16s peak queue %6.0f bytes, %5.1f ms\n", name, sender.link().peakBytes(), sender.link().peakUs() / 1000);
+}
+
+static void testPeakQueue()
+{
+    Sender burst(0);
+    burst.run();
+    Sender paced(::defaultBurstFraction);
+    paced.run();
+    Sender spread(1.0f);
+    spread.run();
+    
+    // The same packets make it onto the link, and out of it before the
+    // next frame
+    CHECK(paced.link().packets() == burst.link().packets());
+    CHECK(paced.link().bytes() == burst.link().bytes());
+    CHECK(spread.link().packets() == burst.link().packets());
+    CHECK(burst.drained() && paced.drained() && spread.drained());
+    
+    // Back to back the whole keyframe queues up, less what drains meanwhile
+    CHECK(burst.link().peakBytes() > 55000);
+    // Over half the interval the keyframe goes at 2.4 times the link rate
+    // and over half of it queues up. Over the whole interval, at 1.2 times,
+    // about a sixth of it does, plus the bucket's burst
+    CHECK(paced.link().peakBytes() < 0.65 * burst.link().peakBytes());
+    CHECK(spread.link().peakBytes() < 0.25 * burst.link().peakBytes());
+    
+    report("back to back", burst);
+    report("paced, half", paced);
+    report("paced, whole", spread);
+}
+
+// Largest packet out of stream, repair encoder and pacer with the
+// transport-wide sequence number on, resending every media packet on RTX
+// once it is out.
+static int largestOut(bool rs, int layers, int mtu, int overhead)
+{
+    Packets wire;
+    CRtpPacer pacer(packetsOut, &wire);
+    pacer.setFrameRate(::fps);
+    pacer.setTargetBitrate(1000000);
+    pacer.setTransportSequence(NULL, NULL);
+    CRtpPacketHistory history;
+    pacer.setHistory(&history);
+    CRtpRetransmitter retransmitter(&history, CRtpPacer::retransmissionIn, &pacer);
+    retransmitter.setRtx();
+    
+    CRtpFecEncoder parity(CRtpPacer::packetsIn, &pacer);
+    parity.setMatrix(4, 4, true, true);
+    CRtpRsEncoder reedSolomon(CRtpPacer::packetsIn, &pacer);
+    reedSolomon.setProtection(0.5f, 0.5f);
+    CRtpStream stream(rs ? CRtpRsEncoder::packetsIn : CRtpFecEncoder::packetsIn, rs ? (void *)&reedSolomon : (void *)&parity);
+    parity.setMediaSsrc(stream.ssrc());
+    reedSolomon.setMediaSsrc(stream.ssrc());
+    history.setSsrc(stream.ssrc());
+    retransmitter.setMediaSsrc(stream.ssrc());
+    stream.setMtu(mtu);
+    stream.setTemporalLayers(layers);
+    stream.setPacketOverhead(overhead);
+    
+    int64_t nowUs = CRtpPacer::nowUs();
+    for (int k = 0; k < 20; k++) {
+        std::vector<uint8_t> frame = makeFrame(k % 10 == 0, 500 + (k * 7919) % 20000, k);
+        stream.streamOut(frame.data(), (int)frame.size(), k * (90000 / ::fps));
+        for (; pacer.queuedPackets() > 0; nowUs += 1000)
+            pacer.process(nowUs);
+    }
+    std::vector<uint16_t> seqs;
+    for (size_t i = 0; i < wire.size(); i++) {
+        const uint8_t* p = wire[i].data();
+        if (((uint32_t)p[8] << 24 | p[9] << 16 | p[10] << 8 | p[11]) == stream.ssrc())
+            seqs.push_back((uint16_t)(p[2] << 8 | p[3]));
+    }
+    retransmitter.resend(stream.ssrc(), seqs.data(), (int)seqs.size(), nowUs);
+    for (; pacer.queuedPackets() > 0; nowUs += 1000)
+        pacer.process(nowUs);
+    CHECK(retransmitter.packetsResent() == seqs.size());
+    
+    size_t largest = 0;
+    for (size_t i = 0; i < wire.size(); i++)
+        largest = std::max(largest, wire[i].size());
+    return (int)largest;
+}
+
+static void testWireSize()
+{
+    for (int rs = 0; rs < 2; rs++) {
+        int overhead = ::transportSeqExtLength + (rs ? ::maxRsOverhead : ::maxFecOverhead);
+        for (int layers = 1; layers <= ::maxTemporalLayers; layers += ::maxTemporalLayers - 1) {
+            int mtus[] = { ::minRtpMtu, 1200, ::maxRtpMtu };
+            for (size_t m = 0; m < sizeof(mtus) / sizeof(mtus[0]); m++) {
+                int bare = largestOut(rs, layers, mtus[m], 0);
+                int reserved = largestOut(rs, layers, mtus[m], overhead);
+                printf("%s, %d layers, mtu %4d: largest packet out %4d, %4d with %d bytes reserved\n",
+                       rs ? "RS " : "XOR", layers, mtus[m], bare, reserved, overhead);
+                CHECK(bare > mtus[m]);
+                CHECK(reserved <= mtus[m]);
+            }
+        }
+    }
+}
+
+int main()
+{
+    testPeakQueue();
+    testWireSize();
+    return testResult("CRtpPacerTest");
+}
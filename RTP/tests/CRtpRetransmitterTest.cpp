@@ -0,0 +1,278 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <deque>
+#include <map>
+#include <random>
+#include "CRtpStream.h"
+#include "CRtpPacer.h"
+#include "CRtpPacketHistory.h"
+#include "CRtpRetransmitter.h"
+#include "CRtpDemuxer.h"
+#include "CRtcp.h"
+#include "CRtcpFeedbackSender.h"
+#include "RtpTest.h"
+
+// NACK and retransmission end to end on a simulated clock: stream, pacer
+// and packet history on one side, an emulated link with loss, jitter and
+// the reordering that comes of it, and a demuxer sending NACKs back over
+// RTCP on the other. Reports how many frames come out whole and what the
+// retransmissions add to their latency.
+
+static const int fps = 20;
+static const int64_t tickUs = 500;
+static const int jitterUs = 3000;
+
+enum Mode {
+    modeNone,
+    modeInBand,
+    modeRtx
+};
+
+struct InFlight {
+    int64_t atUs;
+    std::vector<uint8_t> data;
+};
+
+// Loss, then a delay of oneWayUs and up to jitterUs more. Packets come out
+// in arrival order, so those jittered past each other are reordered.
+class LossyLink {
+
+public:
+    LossyLink(int64_t oneWayUs, double loss, uint32_t seed)
+        : mOneWayUs(oneWayUs)
+        , mRng(seed)
+        , mLoss(loss)
+        , mJitter(0, ::jitterUs)
+        , mDropNext(-1)
+        , mSent(0)
+    {
+    }
+    
+    // The count'th packet from now is lost, whatever the loss rate.
+    void dropPacket(int count) { mDropNext = mSent + count; }
+    
+    void send(const uint8_t* data, int length, int64_t nowUs)
+    {
+        int index = mSent++;
+        if (index == mDropNext || mLoss(mRng))
+            return;
+        InFlight inFlight = { nowUs + mOneWayUs + mJitter(mRng), std::vector<uint8_t>(data, data + length) };
+        std::deque<InFlight>::iterator it = mQueue.end();
+        while (it != mQueue.begin() && (it - 1)->atUs > inFlight.atUs)
+            --it;
+        mQueue.insert(it, inFlight);
+    }
+    
+    bool receive(std::vector<uint8_t>* data, int64_t nowUs)
+    {
+        if (mQueue.empty() || mQueue.front().atUs > nowUs)
+            return false;
+        data->swap(mQueue.front().data);
+        mQueue.pop_front();
+        return true;
+    }
+
+private:
+    int64_t mOneWayUs;
+    std::mt19937 mRng;
+    std::bernoulli_distribution mLoss;
+    std::uniform_int_distribution<int> mJitter;
+    int mDropNext;
+    int mSent;
+    std::deque<InFlight> mQueue;
+};
+
+class Session {
+
+public:
+    Session(Mode mode, int64_t rttUs, double loss)
+        : mForward(rttUs / 2, loss, 5)
+        , mBack(rttUs / 2, loss, 6)
+        , mPacer(mediaOut, this)
+        , mStream(pacedIn, this)
+        , mRetransmitter(&mHistory, resendIn, this)
+        , mFeedback(rtcpOut, this)
+        , mDemuxer(frameIn, this)
+        , mNowUs(0)
+        , mRtxPackets(0)
+        , mFrames(0)
+        , mClean(0)
+        , mLatencyUs(0)
+    {
+        mPacer.setFrameRate(::fps);
+        mPacer.setTargetBitrate(1000000);
+        mRetransmitter.setMediaSsrc(mStream.ssrc());
+        if (mode == modeRtx)
+            mRetransmitter.setRtx(::defaultRtxPayloadType);
+        if (mode != modeNone)
+            mPacer.setHistory(&mHistory);
+        mParser.setNackCallback(nackIn, this);
+        
+        // Keyframe requests off, NACK alone repairs
+        mFeedback.setMinInterval(1 << 30);
+        mDemuxer.addPayloadType(96);
+        mDemuxer.addRtxPayloadType(::defaultRtxPayloadType, 96);
+        mDemuxer.setRecovery(true);
+        mDemuxer.setFeedbackSender(&mFeedback);
+        mDemuxer.setNack(mode != modeNone);
+        // As the reports would measure it, with the jitter both ways
+        mDemuxer.setRtt((int)rttUs + 2 * ::jitterUs);
+    }
+    
+    LossyLink& forward() { return mForward; }
+    
+    void run(int frames)
+    {
+        for (int k = 0; k < frames; k++) {
+            int64_t frameUs = (int64_t)k * 1000000 / ::fps;
+            for (mNowUs = frameUs; mNowUs < frameUs + 1000000 / ::fps; mNowUs += ::tickUs) {
+                if (mNowUs == frameUs) {
+                    bool key = k % ::fps == 0;
+                    std::vector<uint8_t> frame = makeFrame(key, key ? 30000 : 6000, k);
+                    uint32_t timestamp = k * (90000 / ::fps);
+                    mSentUs[timestamp] = mNowUs;
+                    mStream.streamOut(frame.data(), (int)frame.size(), timestamp);
+                }
+                mPacer.process(mNowUs);
+                
+                std::vector<uint8_t> data;
+                while (mForward.receive(&data, mNowUs)) {
+                    CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+                    mDemuxer.packetIn(packet, mNowUs);
+                    packet->release();
+                }
+                while (mBack.receive(&data, mNowUs))
+                    mParser.parse(data.data(), (int)data.size());
+                mDemuxer.poll(mNowUs);
+            }
+        }
+    }
+    
+    double cleanShare() const { return (double)mClean / mFrames; }
+    // From streamOut() to the frame coming out, on average.
+    int64_t meanLatencyUs() const { return mFrames > 0 ? mLatencyUs / mFrames : 0; }
+    uint32_t resent() const { return mRetransmitter.packetsResent(); }
+    uint32_t nacked() const { return mFeedback.nacksSent(); }
+    int rtxPackets() const { return mRtxPackets; }
+
+private:
+    static void mediaOut(void *sessionRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        for (int i = 0; i < count; i++) {
+            if (lengths[i] > 1 && (packets[i][1] & 0x7f) == ::defaultRtxPayloadType)
+                session->mRtxPackets++;
+            session->mForward.send(packets[i], lengths[i], session->mNowUs);
+        }
+    }
+    
+    // CRtpPacer::packetsIn() and CRtpRetransmitter::nackIn() would go by
+    // the real clock.
+    static void pacedIn(void *sessionRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        session->mPacer.enqueue(packets, lengths, count, session->mNowUs);
+    }
+    
+    static void nackIn(void *sessionRef, uint32_t, uint32_t mediaSsrc, const uint16_t* seqs, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        session->mRetransmitter.resend(mediaSsrc, seqs, count, session->mNowUs);
+    }
+    
+    static void resendIn(void *sessionRef, CRtpPacket* packet)
+    {
+        Session* session = (Session*)sessionRef;
+        session->mPacer.enqueueRetransmission(packet, session->mNowUs);
+    }
+    
+    static void rtcpOut(void *sessionRef, const uint8_t* data, int length)
+    {
+        Session* session = (Session*)sessionRef;
+        session->mBack.send(data, length, session->mNowUs);
+    }
+    
+    static void frameIn(void *sessionRef, uint32_t, int, CRtpFrame* frame, uint32_t timestamp, bool damaged)
+    {
+        Session* session = (Session*)sessionRef;
+        // Parameter sets come out on their own ahead of the keyframe
+        if (frame->length() < 100)
+            return;
+        session->mFrames++;
+        if (!damaged)
+            session->mClean++;
+        session->mLatencyUs += session->mNowUs - session->mSentUs[timestamp];
+    }
+    
+    LossyLink mForward;
+    LossyLink mBack;
+    CRtpPacer mPacer;
+    CRtpStream mStream;
+    CRtpPacketHistory mHistory;
+    CRtpRetransmitter mRetransmitter;
+    CRtcpParser mParser;
+    CRtcpFeedbackSender mFeedback;
+    CRtpDemuxer mDemuxer;
+    int64_t mNowUs;
+    int mRtxPackets;
+    
+    std::map<uint32_t, int64_t> mSentUs;
+    int mFrames;
+    int mClean;
+    int64_t mLatencyUs;
+};
+
+static void report(const char* name, const Session& session, const Session& none)
+{
+    printf("%-8s %5.1f%% of frames whole, latency %+5.1f ms, %u NACKs, %u resent\n", name,
+           100 * session.cleanShare(), (session.meanLatencyUs() - none.meanLatencyUs()) / 1000.0,
+           session.nacked(), session.resent());
+}
+
+// One packet lost, one NACK, one retransmission, every frame whole.
+static void testSingleLoss(Mode mode)
+{
+    Session session(mode, 100000, 0);
+    session.forward().dropPacket(50);
+    session.run(2 * ::fps);
+    CHECK(session.nacked() == 1);
+    CHECK(session.resent() == 1);
+    CHECK(session.cleanShare() == 1.0);
+    CHECK(session.rtxPackets() == (mode == modeRtx ? 1 : 0));
+}
+
+// A minute at 3% loss each way, 100 ms round trip.
+static void testRandomLoss()
+{
+    Session none(modeNone, 100000, 0.03);
+    none.run(60 * ::fps);
+    CHECK(none.cleanShare() < 0.9);
+    CHECK(none.nacked() == 0);
+    
+    Session inBand(modeInBand, 100000, 0.03);
+    inBand.run(60 * ::fps);
+    CHECK(inBand.cleanShare() > 0.95);
+    CHECK(inBand.resent() > 0);
+    // What waiting for the repairs adds, about a round trip and the NACK delay
+    int64_t addedUs = inBand.meanLatencyUs() - none.meanLatencyUs();
+    CHECK(addedUs > 0 && addedUs < 100000);
+    
+    Session rtx(modeRtx, 100000, 0.03);
+    rtx.run(60 * ::fps);
+    CHECK(rtx.cleanShare() > 0.95);
+    CHECK(rtx.rtxPackets() == (int)rtx.resent());
+    CHECK(rtx.meanLatencyUs() - none.meanLatencyUs() < 100000);
+    
+    report("none", none, none);
+    report("in-band", inBand, none);
+    report("rtx", rtx, none);
+}
+
+int main()
+{
+    testSingleLoss(modeInBand);
+    testSingleLoss(modeRtx);
+    testRandomLoss();
+    return testResult("CRtpRetransmitterTest");
+}
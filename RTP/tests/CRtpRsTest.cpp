@@ -0,0 +1,385 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <deque>
+#include <map>
+#include <random>
+#include <algorithm>
+#include "CGf256.h"
+#include "CRtpStream.h"
+#include "CRtpPacer.h"
+#include "CRtpDemuxer.h"
+#include "CRtpFecEncoder.h"
+#include "CRtpRsEncoder.h"
+#include "CRtpRsDecoder.h"
+#include "RtpTest.h"
+
+// The Reed-Solomon erasure code: the field arithmetic against shift and
+// add, packets rebuilt byte for byte under random blocks and losses, and
+// end to end on a simulated clock against the XOR parity, both adapting to
+// the loss the receiver reports, on links with random and bursty loss.
+
+static const int fps = 20;
+static const int64_t tickUs = 500;
+static const int64_t oneWayUs = 150000;
+static const int jitterUs = 3000;
+static const uint32_t ssrc = 0x11223344;
+
+static uint8_t slowMul(uint8_t a, uint8_t b)
+{
+    unsigned x = a, product = 0;
+    for (unsigned y = b; y != 0; y >>= 1) {
+        if (y & 1)
+            product ^= x;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= 0x11d;
+    }
+    return (uint8_t)product;
+}
+
+static void testField()
+{
+    int wrong = 0;
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            if (gf::mul(a, b) != slowMul(a, b))
+                wrong++;
+        }
+    }
+    for (int a = 1; a < 256; a++) {
+        if (gf::mul(a, gf::inv(a)) != 1)
+            wrong++;
+    }
+    CHECK(wrong == 0);
+    
+    // The kernel in use against byte by byte, odd lengths included
+    std::mt19937 rng(7);
+    for (int trial = 0; trial < 3000; trial++) {
+        int count = 1 + rng() % 20;
+        Packets sources(count);
+        std::vector<const uint8_t*> srcs(count);
+        std::vector<int> lengths(count);
+        std::vector<uint8_t> coefs(count);
+        int longest = 0;
+        for (int k = 0; k < count; k++) {
+            lengths[k] = rng() % 300;
+            sources[k].resize(lengths[k] + 1);
+            for (size_t i = 0; i < sources[k].size(); i++)
+                sources[k][i] = (uint8_t)rng();
+            srcs[k] = sources[k].data();
+            coefs[k] = (uint8_t)rng();
+            longest = std::max(longest, lengths[k]);
+        }
+        std::vector<uint8_t> dst(longest + 5);
+        for (size_t i = 0; i < dst.size(); i++)
+            dst[i] = (uint8_t)rng();
+        std::vector<uint8_t> expected = dst;
+        gf::mulAdd(dst.data(), srcs.data(), lengths.data(), coefs.data(), count);
+        for (int k = 0; k < count; k++) {
+            for (int i = 0; i < lengths[k]; i++)
+                expected[i] ^= slowMul(coefs[k], sources[k][i]);
+        }
+        CHECK(dst == expected);
+    }
+    
+    // Cauchy matrices are never singular
+    for (int trial = 0; trial < 200; trial++) {
+        int n = 1 + rng() % 40;
+        std::vector<uint8_t> matrix(n * n);
+        for (int a = 0; a < n; a++) {
+            for (int b = 0; b < n; b++)
+                matrix[a * n + b] = gf::inv((uint8_t)((n + a) ^ b));
+        }
+        std::vector<uint8_t> original = matrix;
+        CHECK(gf::invert(matrix.data(), n));
+        for (int a = 0; a < n; a++) {
+            for (int b = 0; b < n; b++) {
+                uint8_t x = 0;
+                for (int i = 0; i < n; i++)
+                    x ^= gf::mul(original[a * n + i], matrix[i * n + b]);
+                CHECK(x == (a == b ? 1 : 0));
+            }
+        }
+    }
+}
+
+// Random frames of up to 300 packets, some padded, random repair shares
+// and up to 40% loss of media and repair alike, in order or shuffled.
+// Everything rebuilt has to be the packet that was lost.
+static void testRandomBlocks()
+{
+    std::mt19937 rng(1);
+    int recovered = 0, mismatched = 0;
+    for (int trial = 0; trial < 3000; trial++) {
+        Packets sent;
+        CRtpRsEncoder encoder(packetsOut, &sent);
+        encoder.setMediaSsrc(::ssrc);
+        float share = (rng() % 50) / 100.0f;
+        encoder.setProtection(share, share);
+        if (rng() % 3 == 0)
+            encoder.setLossRate((rng() % 20) / 100.0f, 0);
+        
+        int count = 1 + rng() % 300;
+        Packets media(count);
+        std::vector<const uint8_t*> packets(count);
+        std::vector<int> lengths(count);
+        uint16_t seq = (uint16_t)rng();
+        std::map<uint16_t, std::vector<uint8_t> > original;
+        for (int i = 0; i < count; i++) {
+            int length = 12 + (rng() % 4 == 0 ? rng() % 40 : 200 + rng() % 1200);
+            std::vector<uint8_t>& packet = media[i];
+            packet.resize(length);
+            for (size_t b = 0; b < packet.size(); b++)
+                packet[b] = (uint8_t)rng();
+            packet[0] = 0x80;
+            if (rng() % 5 == 0 && length > 12) {
+                packet[0] |= 0x20;
+                packet.back() = (uint8_t)(1 + rng() % std::min(3, length - 12));
+            }
+            packet[1] = (rng() % 2 ? 0x80 : 0) | 96;
+            packet[2] = (uint8_t)(seq >> 8);
+            packet[3] = (uint8_t)seq;
+            for (int b = 0; b < 4; b++)
+                packet[8 + b] = (uint8_t)(::ssrc >> (24 - 8 * b));
+            original[seq++] = packet;
+            packets[i] = packet.data();
+            lengths[i] = length;
+        }
+        encoder.protect(packets.data(), lengths.data(), count);
+        
+        CRtpRsDecoder decoder(::ssrc);
+        std::vector<int> order(sent.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = (int)i;
+        if (rng() % 2)
+            std::shuffle(order.begin(), order.end(), rng);
+        int lossPercent = rng() % 40;
+        for (size_t i = 0; i < order.size(); i++) {
+            std::vector<uint8_t>& data = sent[order[i]];
+            if ((int)(rng() % 100) < lossPercent)
+                continue;
+            CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+            if ((data[1] & 0x7f) == ::defaultRsPayloadType)
+                CHECK(decoder.fecIn(packet, 0));
+            else
+                decoder.mediaIn(packet, (uint16_t)((data[2] << 8) | data[3]), 0);
+            packet->release();
+            
+            while (CRtpPacket* rebuilt = decoder.recovered()) {
+                recovered++;
+                const std::vector<uint8_t>& lost = original[(uint16_t)((rebuilt->data()[2] << 8) | rebuilt->data()[3])];
+                if ((int)lost.size() != rebuilt->length() || memcmp(lost.data(), rebuilt->data(), lost.size()) != 0)
+                    mismatched++;
+                rebuilt->release();
+            }
+        }
+    }
+    CHECK(recovered > 10000);
+    CHECK(mismatched == 0);
+}
+
+struct InFlight {
+    int64_t atUs;
+    std::vector<uint8_t> data;
+};
+
+// Gilbert-Elliott loss: into the bad state with goodToBad, out with
+// badToGood, every packet lost while in it. Then the one way delay and up
+// to jitterUs more, in arrival order.
+class BurstyLink {
+
+public:
+    BurstyLink(double goodToBad, double badToGood)
+        : mRng(5)
+        , mGoodToBad(goodToBad)
+        , mBadToGood(badToGood)
+        , mJitter(0, ::jitterUs)
+        , mBad(false)
+        , mSent(0)
+        , mLost(0)
+    {
+    }
+    
+    void send(const uint8_t* data, int length, int64_t nowUs)
+    {
+        mSent++;
+        mBad = mBad ? !mBadToGood(mRng) : mGoodToBad(mRng);
+        if (mBad) {
+            mLost++;
+            return;
+        }
+        InFlight inFlight = { nowUs + ::oneWayUs + mJitter(mRng), std::vector<uint8_t>(data, data + length) };
+        std::deque<InFlight>::iterator it = mQueue.end();
+        while (it != mQueue.begin() && (it - 1)->atUs > inFlight.atUs)
+            --it;
+        mQueue.insert(it, inFlight);
+    }
+    
+    bool receive(std::vector<uint8_t>* data, int64_t nowUs)
+    {
+        if (mQueue.empty() || mQueue.front().atUs > nowUs)
+            return false;
+        data->swap(mQueue.front().data);
+        mQueue.pop_front();
+        return true;
+    }
+    
+    // Share of the packets lost since the last call.
+    double takeLoss()
+    {
+        double loss = mSent > 0 ? (double)mLost / mSent : 0;
+        mSent = mLost = 0;
+        return loss;
+    }
+
+private:
+    std::mt19937 mRng;
+    std::bernoulli_distribution mGoodToBad;
+    std::bernoulli_distribution mBadToGood;
+    std::uniform_int_distribution<int> mJitter;
+    bool mBad;
+    int mSent;
+    int mLost;
+    std::deque<InFlight> mQueue;
+};
+
+// 4 Mbit/s of 150 KB keyframes every second and 8 KB delta frames, behind
+// the XOR parity or the RS code.
+class Session {
+
+public:
+    Session(bool rs, double goodToBad, double badToGood)
+        : mRs(rs)
+        , mLink(goodToBad, badToGood)
+        , mPacer(linkOut, this)
+        , mXor(pacedIn, this)
+        , mReedSolomon(pacedIn, this)
+        , mStream(rs ? CRtpRsEncoder::packetsIn : CRtpFecEncoder::packetsIn, rs ? (void *)&mReedSolomon : (void *)&mXor)
+        , mDemuxer(frameIn, this)
+        , mNowUs(0)
+        , mKeyFrames(0)
+        , mKeyFramesWhole(0)
+    {
+        mPacer.setFrameRate(::fps);
+        mPacer.setTargetBitrate(4000000);
+        mXor.setMediaSsrc(mStream.ssrc());
+        mReedSolomon.setMediaSsrc(mStream.ssrc());
+        mDemuxer.addPayloadType(96);
+        mDemuxer.addFecPayloadType(::defaultFecPayloadType, 96);
+        mDemuxer.addRsPayloadType(::defaultRsPayloadType, 96);
+        mDemuxer.setRecovery(true);
+    }
+    
+    void run(int frames)
+    {
+        int64_t reportUs = 0;
+        for (int k = 0; k < frames; k++) {
+            int64_t frameUs = (int64_t)k * 1000000 / ::fps;
+            for (mNowUs = frameUs; mNowUs < frameUs + 1000000 / ::fps; mNowUs += ::tickUs) {
+                if (mNowUs == frameUs) {
+                    bool key = k % ::fps == 0;
+                    std::vector<uint8_t> frame = makeFrame(key, key ? 150000 : 8000, k);
+                    mStream.streamOut(frame.data(), (int)frame.size(), k * (90000 / ::fps));
+                    if (key)
+                        mKeyFrames++;
+                }
+                mPacer.process(mNowUs);
+                
+                std::vector<uint8_t> data;
+                while (mLink.receive(&data, mNowUs)) {
+                    CRtpPacket* packet = CRtpPacket::create(data.data(), (int)data.size());
+                    mDemuxer.packetIn(packet, mNowUs);
+                    packet->release();
+                }
+                mDemuxer.poll(mNowUs);
+                
+                // The receiver's report of the loss before repair, a second
+                // apart and half a round trip late
+                if (mNowUs - reportUs >= 1000000) {
+                    float loss = (float)mLink.takeLoss();
+                    mXor.setLossRate(loss, mNowUs + ::oneWayUs);
+                    mReedSolomon.setLossRate(loss, mNowUs + ::oneWayUs);
+                    reportUs = mNowUs;
+                }
+            }
+        }
+    }
+    
+    double keyFramesWhole() const { return (double)mKeyFramesWhole / mKeyFrames; }
+    double overhead() const
+    {
+        return mRs ? (double)mReedSolomon.fecPackets() / mReedSolomon.mediaPackets()
+                   : (double)mXor.fecPackets() / mXor.mediaPackets();
+    }
+
+private:
+    static void linkOut(void *sessionRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        for (int i = 0; i < count; i++)
+            session->mLink.send(packets[i], lengths[i], session->mNowUs);
+    }
+    
+    // CRtpPacer::packetsIn() would go by the real clock.
+    static void pacedIn(void *sessionRef, const uint8_t* const* packets, const int* lengths, int count)
+    {
+        Session* session = (Session*)sessionRef;
+        session->mPacer.enqueue(packets, lengths, count, session->mNowUs);
+    }
+    
+    static void frameIn(void *sessionRef, uint32_t, int, CRtpFrame* frame, uint32_t timestamp, bool damaged)
+    {
+        Session* session = (Session*)sessionRef;
+        // Parameter sets come out on their own ahead of the keyframe
+        if (frame->length() >= 100 && !damaged && (timestamp / (90000 / ::fps)) % ::fps == 0)
+            session->mKeyFramesWhole++;
+    }
+    
+    bool mRs;
+    BurstyLink mLink;
+    CRtpPacer mPacer;
+    CRtpFecEncoder mXor;
+    CRtpRsEncoder mReedSolomon;
+    CRtpStream mStream;
+    CRtpDemuxer mDemuxer;
+    int64_t mNowUs;
+    int mKeyFrames;
+    int mKeyFramesWhole;
+};
+
+// Two minutes on each channel. RS keeps more keyframes whole, for less.
+static void testChannels()
+{
+    struct Channel {
+        const char* name;
+        double goodToBad;
+        double badToGood;
+    } channels[] = {
+        { "random 5%", 0.05, 0.95 },
+        { "bursty 5%", 0.0105, 0.2 },
+    };
+    printf("%-10s %24s %24s\n", "keyframes", "XOR whole, overhead", "RS whole, overhead");
+    for (size_t c = 0; c < sizeof(channels) / sizeof(channels[0]); c++) {
+        Session parity(false, channels[c].goodToBad, channels[c].badToGood);
+        parity.run(120 * ::fps);
+        Session rs(true, channels[c].goodToBad, channels[c].badToGood);
+        rs.run(120 * ::fps);
+        printf("%-10s %14.1f%% %8.1f%% %14.1f%% %8.1f%%\n", channels[c].name,
+               100 * parity.keyFramesWhole(), 100 * parity.overhead(), 100 * rs.keyFramesWhole(), 100 * rs.overhead());
+        
+        CHECK(rs.keyFramesWhole() > 0.9);
+        CHECK(rs.keyFramesWhole() > parity.keyFramesWhole());
+        CHECK(rs.overhead() < parity.overhead());
+    }
+}
+
+int main()
+{
+    testField();
+    testRandomBlocks();
+    testChannels();
+    return testResult("CRtpRsTest");
+}
@@ -0,0 +1,151 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include "CRtpStream.h"
+#include "CRtpUnpack.h"
+#include "RtpTest.h"
+
+// Frames packed with STAP-A aggregation and without come out of CRtpUnpack
+// as they went in, byte for byte, and aggregation takes fewer packets.
+
+// Keyframes of SPS, PPS, SEI and a large slice, P-frames of one to four
+// slices, some small enough to share a packet, some around the MTU.
+static std::vector<uint8_t> makeStapFrame(int k)
+{
+    // Not the first: an SEI on its own, without aggregation, is dropped
+    // while the unpacker waits for the first keyframe
+    if (k == 0) {
+        std::vector<uint8_t> frame;
+        appendNal(frame, 0x67, 20, k);
+        appendNal(frame, 0x68, 6, k + 1);
+        appendNal(frame, 0x65, 30000, k + 3);
+        return frame;
+    }
+    if (k % 20 == 0)
+        return makeFrame(true, 30000, k);
+    std::vector<uint8_t> frame;
+    int slices = 1 + k % 4;
+    for (int i = 0; i < slices; i++)
+        appendNal(frame, 0x41, k % 3 == 0 ? 1390 + i * 7 : 200 + 150 * i + k % 50, k * 4 + i);
+    return frame;
+}
+
+static int naluType(const std::vector<uint8_t>& packet)
+{
+    return packet.size() > 12 ? packet[12] & 0x1f : -1;
+}
+
+// As VideoToolbox hands frames over: an Annex-B access unit takes a slice
+// to run to its end, AVCC keeps the slices apart.
+static int avccOut(CRtpStream& stream, const std::vector<uint8_t>& frame, uint32_t timestamp)
+{
+    std::vector<uint8_t> avcc;
+    std::vector<std::vector<uint8_t> > paramSets;
+    toAvcc(frame, 4, &avcc, &paramSets);
+    const uint8_t* sets[2];
+    int setLengths[2];
+    for (size_t i = 0; i < paramSets.size(); i++) {
+        sets[i] = paramSets[i].data();
+        setLengths[i] = (int)paramSets[i].size();
+    }
+    return stream.streamOutAvcc(avcc.data(), (int)avcc.size(), 4, timestamp, sets, setLengths, (int)paramSets.size());
+}
+
+// All frames through a stream into an unpacker, what comes out end to end.
+static std::vector<uint8_t> roundTrip(bool aggregation, int frames, int* packetCount, int* stapCount)
+{
+    Packets packets;
+    CRtpStream stream(packetOut, &packets);
+    stream.setAggregation(aggregation);
+    int error;
+    CRtpUnpack unpack(error);
+    std::vector<uint8_t> out;
+    *packetCount = 0;
+    *stapCount = 0;
+    for (int k = 0; k < frames; k++) {
+        std::vector<uint8_t> frame = makeStapFrame(k);
+        packets.clear();
+        CHECK(avccOut(stream, frame, k * 3000) == 0);
+        *packetCount += (int)packets.size();
+        for (size_t p = 0; p < packets.size(); p++) {
+            if (naluType(packets[p]) == 24)
+                (*stapCount)++;
+            unsigned int size, timestamp;
+            const uint8_t* data = unpack.Parse_RTP_Packet(packets[p].data(), (unsigned short)packets[p].size(), &size, &timestamp);
+            if (data != NULL) {
+                CHECK(timestamp == (unsigned int)k * 3000);
+                out.insert(out.end(), data, data + size);
+            }
+        }
+    }
+    return out;
+}
+
+static void testRoundTrip()
+{
+    const int frames = 200;
+    std::vector<uint8_t> sent;
+    for (int k = 0; k < frames; k++) {
+        std::vector<uint8_t> frame = makeStapFrame(k);
+        sent.insert(sent.end(), frame.begin(), frame.end());
+    }
+    
+    int aggregated, single, staps, none;
+    std::vector<uint8_t> withStap = roundTrip(true, frames, &aggregated, &staps);
+    std::vector<uint8_t> without = roundTrip(false, frames, &single, &none);
+    printf("%d frames: %d packets, %d of them STAP-A; %d packets without aggregation\n",
+           frames, aggregated, staps, single);
+    CHECK(withStap == sent);
+    CHECK(without == sent);
+    CHECK(staps > 0 && none == 0);
+    CHECK(aggregated < single);
+}
+
+// A STAP-A with a NAL unit size running past the end of the packet, or one
+// of 0, is dropped whole, and the next keyframe still comes out.
+static void testMalformed()
+{
+    Packets packets;
+    CRtpStream stream(packetOut, &packets);
+    int error;
+    CRtpUnpack unpack(error);
+    unsigned int size, timestamp;
+    std::vector<uint8_t> key = makeStapFrame(0);
+    CHECK(avccOut(stream, key, 0) == 0);
+    for (size_t p = 0; p < packets.size(); p++)
+        unpack.Parse_RTP_Packet(packets[p].data(), (unsigned short)packets[p].size(), &size, &timestamp);
+    
+    std::vector<uint8_t> frame;
+    appendNal(frame, 0x41, 300, 1);
+    appendNal(frame, 0x41, 400, 2);
+    packets.clear();
+    CHECK(avccOut(stream, frame, 3000) == 0);
+    CHECK(packets.size() == 1 && naluType(packets[0]) == 24);
+    
+    std::vector<uint8_t> overrun = packets[0];
+    overrun[13] = 0xff;
+    CHECK(unpack.Parse_RTP_Packet(overrun.data(), (unsigned short)overrun.size(), &size, &timestamp) == NULL);
+    std::vector<uint8_t> empty = packets[0];
+    empty[13] = 0;
+    empty[14] = 0;
+    CHECK(unpack.Parse_RTP_Packet(empty.data(), (unsigned short)empty.size(), &size, &timestamp) == NULL);
+    
+    // Taken for lost, the next keyframe starts over
+    packets.clear();
+    CHECK(avccOut(stream, key, 6000) == 0);
+    std::vector<uint8_t> out;
+    for (size_t p = 0; p < packets.size(); p++) {
+        const uint8_t* data = unpack.Parse_RTP_Packet(packets[p].data(), (unsigned short)packets[p].size(), &size, &timestamp);
+        if (data != NULL)
+            out.insert(out.end(), data, data + size);
+    }
+    CHECK(out == key);
+}
+
+int main()
+{
+    testRoundTrip();
+    testMalformed();
+    return testResult("CRtpStapTest");
+}
@@ -0,0 +1,76 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "CRtpStream.h"
+#include "RtpTest.h"
+
+// AVCC input goes out as the same packets as the Annex-B form of the same
+// NAL units, and malformed length prefixes are refused before anything goes.
+
+static int avccOut(CRtpStream& stream, const std::vector<uint8_t>& frame, int lengthSize, uint32_t timestamp)
+{
+    std::vector<uint8_t> avcc;
+    std::vector<std::vector<uint8_t> > paramSets;
+    toAvcc(frame, lengthSize, &avcc, &paramSets);
+    
+    const uint8_t* sets[4];
+    int setLengths[4];
+    for (size_t i = 0; i < paramSets.size(); i++) {
+        sets[i] = paramSets[i].data();
+        setLengths[i] = (int)paramSets[i].size();
+    }
+    return stream.streamOutAvcc(avcc.data(), (int)avcc.size(), lengthSize, timestamp, sets, setLengths, (int)paramSets.size());
+}
+
+static void testSameAsAnnexB(int lengthSize)
+{
+    Packets annexB, avcc;
+    CRtpStream annexBStream(packetOut, &annexB);
+    CRtpStream avccStream(packetOut, &avcc);
+    
+    // Small slices aggregated, ones around the MTU, keyframes in many
+    // fragments; two byte lengths take slices under 64 KB only.
+    for (int k = 0; k < 40; k++) {
+        bool idr = k % 20 == 0;
+        int slice = idr ? (lengthSize == 2 ? 60000 : 200000) : (k % 3 == 0 ? 3000 : k % 3 == 1 ? 1401 : 900);
+        std::vector<uint8_t> frame = makeFrame(idr, slice, k);
+        CHECK(annexBStream.streamOut(frame.data(), (int)frame.size(), k * 4500) == 0);
+        CHECK(avccOut(avccStream, frame, lengthSize, k * 4500) == 0);
+    }
+    CHECK(!annexB.empty());
+    CHECK(samePackets(annexB, avcc));
+}
+
+static void testMalformed()
+{
+    Packets out;
+    CRtpStream stream(packetOut, &out);
+    
+    // A whole NAL unit, then two bytes of a length prefix of four
+    uint8_t truncated[] = { 0, 0, 0, 3, 0x41, 1, 2, 0, 0 };
+    CHECK(stream.streamOutAvcc(truncated, sizeof(truncated), 4, 0) == -1);
+    
+    // A length running past the end
+    uint8_t overrun[] = { 0, 0, 0, 9, 0x65, 1, 2 };
+    CHECK(stream.streamOutAvcc(overrun, sizeof(overrun), 4, 0) == -1);
+    
+    // A zero length
+    uint8_t empty[] = { 0, 0, 0, 0, 0, 0, 0, 2, 0x41, 1 };
+    CHECK(stream.streamOutAvcc(empty, sizeof(empty), 4, 0) == -1);
+    
+    CHECK(stream.streamOutAvcc(truncated, 7, 3, 0) == -1);
+    CHECK(stream.streamOutAvcc(truncated, 7, 5, 0) == -1);
+    CHECK(out.empty());
+    
+    // The same NAL unit alone goes
+    CHECK(stream.streamOutAvcc(truncated, 7, 4, 0) == 0);
+    CHECK(out.size() == 1);
+}
+
+int main()
+{
+    testSameAsAnnexB(4);
+    testSameAsAnnexB(2);
+    testMalformed();
+    return testResult("CRtpStreamAvccTest");
+}
@@ -0,0 +1,63 @@
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <sys/uio.h>
+#include "CRtpStream.h"
+#include "RtpTest.h"
+
+// The batch and scatter-gather callbacks hand out the same bytes as the
+// per-packet one, a frame per batch call.
+
+struct Batches {
+    Packets packets;
+    int calls;
+};
+
+static void batchOut(void *ref, const uint8_t* const* packets, const int* lengths, int count)
+{
+    Batches* batches = (Batches*)ref;
+    packetsOut(&batches->packets, packets, lengths, count);
+    batches->calls++;
+}
+
+static void vecOut(void *ref, const struct iovec* iov, int iovcnt)
+{
+    std::vector<uint8_t> packet;
+    for (int i = 0; i < iovcnt; i++)
+        packet.insert(packet.end(), (const uint8_t*)iov[i].iov_base, (const uint8_t*)iov[i].iov_base + iov[i].iov_len);
+    ((Packets*)ref)->push_back(packet);
+}
+
+static void testSameAsPerPacket(int layers)
+{
+    Packets single, vec;
+    Batches batches = { Packets(), 0 };
+    CRtpStream singleStream(packetOut, &single);
+    CRtpStream vecStream(vecOut, &vec);
+    CRtpStream batchStream(batchOut, &batches);
+    singleStream.setTemporalLayers(layers);
+    vecStream.setTemporalLayers(layers);
+    batchStream.setTemporalLayers(layers);
+    
+    // Aggregated, exactly one and two payloads, a tail of one byte, and a
+    // keyframe of about 150 packets
+    const int sizes[] = { 100, 1400, 1401, 2800, 2801, 5000, 200000, 60 };
+    const int count = sizeof(sizes) / sizeof(sizes[0]);
+    for (int k = 0; k < count; k++) {
+        std::vector<uint8_t> frame = makeFrame(k % 3 == 0, sizes[k], k);
+        CHECK(singleStream.streamOut(frame.data(), (int)frame.size(), k * 4500) == 0);
+        CHECK(vecStream.streamOut(frame.data(), (int)frame.size(), k * 4500) == 0);
+        CHECK(batchStream.streamOut(frame.data(), (int)frame.size(), k * 4500) == 0);
+    }
+    CHECK(single.size() > 150);
+    CHECK(samePackets(single, batches.packets));
+    CHECK(samePackets(single, vec));
+    CHECK(batches.calls == count);
+}
+
+int main()
+{
+    testSameAsPerPacket(1);
+    testSameAsPerPacket(3);
+    return testResult("CRtpStreamBatchTest");
+}
@@ -0,0 +1,155 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "CRtpStream.h"
+#include "RtpTest.h"
+
+// setMtu() keeps to minRtpMtu..maxRtpMtu, a NAL unit larger than the MTU
+// is cut into fragments of one size, and MTU probing settles on what the
+// path takes, probes larger than that never being acknowledged.
+
+static void testClamp()
+{
+    Packets packets;
+    CRtpStream stream(packetsOut, &packets);
+    stream.setMtu(100);
+    CHECK(stream.mtu() == ::minRtpMtu);
+    stream.setMtu(9000);
+    CHECK(stream.mtu() == ::maxRtpMtu);
+    CHECK(::maxRtpMtu == 1500 - 28);
+    stream.setMtu(1200);
+    CHECK(stream.mtu() == 1200);
+}
+
+// One slice in FU-A fragments at each MTU: as few as fit, all of one size
+// but the last, which is at most a byte per fragment shorter.
+static void testEvenSplit()
+{
+    const int mtus[] = { ::minRtpMtu, 1000, 1200, ::maxRtpMtu };
+    const int lengths[] = { 1400, 4999, 30000 };
+    for (size_t m = 0; m < sizeof(mtus) / sizeof(mtus[0]); m++) {
+        for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+            Packets packets;
+            CRtpStream stream(packetsOut, &packets);
+            stream.setMtu(mtus[m]);
+            std::vector<uint8_t> frame;
+            appendNal(frame, 0x41, lengths[l], (uint32_t)(m * 10 + l));
+            CHECK(stream.streamOut(frame.data(), (int)frame.size(), 0) == 0);
+            
+            // Whole in a single NAL unit packet where it fits
+            if (lengths[l] <= mtus[m] - 12) {
+                CHECK(packets.size() == 1 && (int)packets[0].size() == 12 + lengths[l]);
+                continue;
+            }
+            // RTP header, FU indicator and FU header ahead of the payload
+            int budget = mtus[m] - 14;
+            int fragments = (lengths[l] - 1 + budget - 1) / budget;
+            CHECK((int)packets.size() == fragments);
+            int payload = 0;
+            for (size_t i = 0; i < packets.size(); i++) {
+                CHECK((int)packets[i].size() <= mtus[m]);
+                CHECK(packets[i].size() <= packets[0].size());
+                CHECK(packets[0].size() - packets[i].size() < packets.size());
+                CHECK(i + 1 == packets.size() || packets[i].size() == packets[0].size());
+                payload += (int)packets[i].size() - 14;
+            }
+            CHECK(payload == lengths[l] - 1);
+        }
+    }
+}
+
+// Frames through a stream probing a path that takes pathMtu, each probe
+// that fits acknowledged before the next frame, the others never, or only
+// under another SSRC. Settles once mtu() holds the largest probe through,
+// within probeGranularity of the path or at minRtpMtu when nothing got
+// through; then no probe goes out until the search starts over, and media
+// packets keep to the new MTU.
+static void testProbe(int pathMtu)
+{
+    Packets packets;
+    CRtpStream stream(packetsOut, &packets);
+    stream.setMtuProbing(true);
+    std::vector<uint8_t> frame;
+    appendNal(frame, 0x41, 6000, pathMtu);
+    
+    int settled = -1, probes = 0, largest = 0, lastProbe = -1, restarted = -1;
+    bool mediaFits = true;
+    for (int f = 0; f < 1000 && restarted < 0; f++) {
+        packets.clear();
+        int before = stream.mtu();
+        CHECK(stream.streamOut(frame.data(), (int)frame.size(), f * 3000) == 0);
+        for (size_t i = 0; i < packets.size(); i++) {
+            uint16_t probeSeq;
+            int length = (int)packets[i].size();
+            if (!CRtpStream::isProbe(packets[i].data(), length, &probeSeq)) {
+                mediaFits = mediaFits && length <= before;
+                continue;
+            }
+            if (settled >= 0) {
+                restarted = f;
+                break;
+            }
+            probes++;
+            lastProbe = f;
+            largest = std::max(largest, length);
+            const uint8_t* p = packets[i].data();
+            uint32_t probeSsrc = (uint32_t)p[8] << 24 | p[9] << 16 | p[10] << 8 | p[11];
+            if (length <= pathMtu)
+                CRtpStream::probeAckIn(&stream, 1, probeSsrc, probeSeq);
+            else
+                CRtpStream::probeAckIn(&stream, 1, probeSsrc + 1, probeSeq);
+        }
+        if (settled < 0 && stream.mtu() != before)
+            settled = f;
+    }
+    printf("path %4d: mtu %4d after %3d frames, %d probes, largest %d, search again after %d frames\n",
+           pathMtu, stream.mtu(), settled, probes, largest, restarted - settled);
+    
+    CHECK(settled >= 0);
+    int fits = std::min(pathMtu, ::maxRtpMtu);
+    if (fits < ::minRtpMtu)
+        CHECK(stream.mtu() == ::minRtpMtu);
+    else
+        CHECK(stream.mtu() <= fits && stream.mtu() > fits - ::probeGranularity);
+    CHECK(largest <= ::maxRtpMtu);
+    CHECK(mediaFits);
+    // The last probe was the one that settled it
+    CHECK(lastProbe < settled);
+    CHECK(restarted - settled == ::probeRestartFrames);
+}
+
+// The search starts halfway between minRtpMtu and maxRtpMtu, and stops
+// with probing turned off.
+static void testProbeRestart()
+{
+    Packets packets;
+    CRtpStream stream(packetsOut, &packets);
+    stream.setMtuProbing(true);
+    std::vector<uint8_t> frame;
+    appendNal(frame, 0x41, 2000, 3);
+    CHECK(stream.streamOut(frame.data(), (int)frame.size(), 0) == 0);
+    CHECK(CRtpStream::isProbe(packets[0].data(), (int)packets[0].size(), NULL));
+    CHECK((int)packets[0].size() == (::minRtpMtu + ::maxRtpMtu + 1) / 2);
+    
+    // Not probing, nothing more goes out
+    stream.setMtuProbing(false);
+    packets.clear();
+    CHECK(stream.streamOut(frame.data(), (int)frame.size(), 3000) == 0);
+    for (size_t i = 0; i < packets.size(); i++)
+        CHECK(!CRtpStream::isProbe(packets[i].data(), (int)packets[i].size(), NULL));
+}
+
+int main()
+{
+    testClamp();
+    testEvenSplit();
+    // A path as wide as the largest probe, one a little narrower, and one
+    // that loses them all
+    testProbe(1500);
+    testProbe(1300);
+    testProbe(400);
+    testProbeRestart();
+    return testResult("CRtpStreamMtuTest");
+}
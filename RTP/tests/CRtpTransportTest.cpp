@@ -0,0 +1,310 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "CRtpStream.h"
+#include "CRtpDemuxer.h"
+#include "CRtpPacer.h"
+#include "CRtpLoopbackTransport.h"
+#include "CRtpUdpTransport.h"
+#include "CRtpUringTransport.h"
+#include "RtpTest.h"
+
+// Stream to demuxer through each transport, in memory, over UDP on
+// 127.0.0.1 and on ::1 where there is one, and through io_uring and its
+// fallback to the socket calls: every frame has to come out byte for byte
+// as it went in, and again with segment offload on. Then what is left of a
+// coalesced datagram after a short receive(), offload taking effect at
+// open(), and close() waking a receive() that waits for ever.
+
+// What went out, by timestamp, and how the frames compared coming out.
+class Receiver {
+
+public:
+    Receiver()
+        : mIdentical(0)
+        , mDiffering(0)
+        , mDamaged(0)
+    {
+    }
+    
+    // Matches CRtpDemuxerFrameCallback.
+    static void frameIn(void *receiverRef, uint32_t, int, CRtpFrame* frame, uint32_t timestamp, bool damaged)
+    {
+        Receiver* receiver = (Receiver*)receiverRef;
+        std::vector<uint8_t> data(frame->length());
+        frame->copyTo(data.data());
+        if (damaged) {
+            receiver->mDamaged++;
+            return;
+        }
+        // Parameter sets come out on their own ahead of the keyframe
+        if (data.size() > 4 && (data[4] & 0x1f) == 7)
+            return;
+        std::map<uint32_t, std::vector<uint8_t> >::const_iterator it = receiver->mSent.find(timestamp);
+        if (it != receiver->mSent.end() && it->second == data)
+            receiver->mIdentical++;
+        else
+            receiver->mDiffering++;
+    }
+    
+    std::map<uint32_t, std::vector<uint8_t> > mSent;
+    int mIdentical;
+    int mDiffering;
+    int mDamaged;
+};
+
+// The NAL units of an AVCC frame behind start codes, as the demuxer hands
+// them out.
+static std::vector<uint8_t> toAnnexB(const std::vector<uint8_t>& avcc)
+{
+    std::vector<uint8_t> frame;
+    for (size_t p = 0; p + 4 <= avcc.size(); ) {
+        size_t length = (size_t)avcc[p] << 24 | avcc[p + 1] << 16 | avcc[p + 2] << 8 | avcc[p + 3];
+        static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+        frame.insert(frame.end(), startCode, startCode + 4);
+        frame.insert(frame.end(), avcc.begin() + p + 4, avcc.begin() + p + 4 + length);
+        p += 4 + length;
+    }
+    return frame;
+}
+
+// Frames as VideoToolbox hands them over, a keyframe every 30, stamped at
+// 30 fps but sent at 500 so a socket receiving on the same core keeps up.
+// The jitter buffer sees them arrive far ahead of their playout, more
+// than its reorder window at the start, and has to let them all through.
+static const int frameUs = 2000;
+static const uint32_t frameTicks = 3000;
+
+static void testEndToEnd(const char* name, CRtpTransport* out, CRtpTransport* in, int frames)
+{
+    Receiver receiver;
+    std::vector<std::vector<uint8_t> > avcc(frames);
+    std::vector<std::vector<std::vector<uint8_t> > > paramSets(frames);
+    for (int i = 0; i < frames; i++) {
+        bool idr = i % 30 == 0;
+        // The SPS and PPS apart and the slice alone; an SEI would go out
+        // aggregated with the parameter sets
+        std::vector<uint8_t> frame;
+        if (idr) {
+            appendNal(frame, 0x67, 20, i);
+            appendNal(frame, 0x68, 6, i + 1);
+        }
+        appendNal(frame, idr ? 0x65 : 0x41, idr ? 30000 : 3000 + (i % 7) * 700, i + 2);
+        toAvcc(frame, 4, &avcc[i], &paramSets[i]);
+        receiver.mSent[i * ::frameTicks] = toAnnexB(avcc[i]);
+    }
+    
+    std::atomic<bool> done(false);
+    std::thread rx([&] {
+        CRtpDemuxer demuxer(Receiver::frameIn, &receiver);
+        demuxer.addPayloadType(96);
+        CRtpPacket* packets[::maxTransportBatch];
+        for (;;) {
+            int n = in->receive(packets, ::maxTransportBatch, 20000);
+            if (n < 0)
+                break;
+            int64_t nowUs = CRtpPacer::nowUs();
+            for (int i = 0; i < n; i++) {
+                demuxer.packetIn(packets[i], nowUs);
+                packets[i]->release();
+            }
+            if (n == 0 && done)
+                break;
+            demuxer.poll(nowUs);
+        }
+        demuxer.poll(CRtpPacer::nowUs() + 10000000);
+    });
+    
+    CRtpStream stream(CRtpTransport::packetsIn, out);
+    int64_t startUs = CRtpPacer::nowUs();
+    for (int i = 0; i < frames; i++) {
+        int64_t dueUs = startUs + (int64_t)i * ::frameUs;
+        for (int64_t nowUs = CRtpPacer::nowUs(); nowUs < dueUs; nowUs = CRtpPacer::nowUs())
+            std::this_thread::sleep_for(std::chrono::microseconds(dueUs - nowUs));
+        const uint8_t* sets[2];
+        int setLengths[2];
+        for (size_t k = 0; k < paramSets[i].size(); k++) {
+            sets[k] = paramSets[i][k].data();
+            setLengths[k] = (int)paramSets[i][k].size();
+        }
+        CHECK(stream.streamOutAvcc(avcc[i].data(), (int)avcc[i].size(), 4, i * ::frameTicks, sets, setLengths,
+                                   (int)paramSets[i].size()) == 0);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    done = true;
+    rx.join();
+    
+    CRtpTransportStats sent, received;
+    out->stats(&sent);
+    in->stats(&received);
+    printf("%-10s %d frames: %d identical, %d differ, %d damaged  %llu packets in %llu send calls, %llu in %llu receive calls\n",
+           name, frames, receiver.mIdentical, receiver.mDiffering, receiver.mDamaged,
+           (unsigned long long)sent.packetsSent, (unsigned long long)sent.calls,
+           (unsigned long long)received.packetsReceived, (unsigned long long)received.calls);
+    CHECK(receiver.mIdentical == frames);
+    CHECK(receiver.mDiffering == 0);
+    CHECK(receiver.mDamaged == 0);
+    CHECK(sent.packetsSent == received.packetsReceived);
+    CHECK(sent.dropped == 0 && received.dropped == 0);
+}
+
+static bool openPair(CRtpUdpTransport& a, CRtpUdpTransport& b, const char* host)
+{
+    if (!b.open(host, 0) || !a.open(host, 0))
+        return false;
+    return a.connect(host, b.port()) && b.connect(host, a.port());
+}
+
+// One datagram cut into 40 packets on the way out, and with GRO maybe
+// coalesced again on the way in, taken 7 at a time: each comes back once,
+// in order and at its own length.
+static void testCoalescedRemainder()
+{
+    CRtpUdpTransport a, b;
+    a.setSegmentOffload(true);
+    b.setSegmentOffload(true);
+    CHECK(openPair(a, b, "127.0.0.1"));
+    
+    const int count = 40;
+    std::vector<std::vector<uint8_t> > packets(count);
+    const uint8_t* data[count];
+    int lengths[count];
+    for (int i = 0; i < count; i++) {
+        packets[i].assign(i == count - 1 ? 300 : 1000, (uint8_t)i);
+        data[i] = packets[i].data();
+        lengths[i] = (int)packets[i].size();
+    }
+    CHECK(a.send(data, lengths, count) == count);
+    
+    int received = 0, calls = 0;
+    bool inOrder = true;
+    CRtpPacket* in[7];
+    for (;;) {
+        int n = b.receive(in, 7, 50000);
+        if (n <= 0)
+            break;
+        calls++;
+        for (int i = 0; i < n; i++) {
+            if (received >= count || in[i]->length() != lengths[received] || in[i]->data()[0] != received)
+                inOrder = false;
+            received++;
+            in[i]->release();
+        }
+    }
+    CRtpTransportStats sent, stats;
+    a.stats(&sent);
+    b.stats(&stats);
+    printf("coalesced  %d packets in %llu send calls, %d back in %d receive() calls, %llu system calls\n",
+           count, (unsigned long long)sent.calls, received, calls, (unsigned long long)stats.calls);
+    CHECK(sent.calls == 1);
+    CHECK(received == count);
+    CHECK(inOrder);
+}
+
+// Offload turned on for an open socket waits for the next open(), so a
+// receive() running meanwhile never has its buffers resized under it.
+static void testOffloadAtOpen()
+{
+    CRtpUdpTransport a;
+    CHECK(a.open("127.0.0.1", 0));
+    a.setSegmentOffload(true);
+    CHECK(!a.segmentOffload());
+    CHECK(a.open("127.0.0.1", 0));
+    CHECK(a.segmentOffload());
+    a.setSegmentOffload(false);
+    CHECK(a.segmentOffload());
+    CHECK(a.open("127.0.0.1", 0));
+    CHECK(!a.segmentOffload());
+}
+
+static void testCloseWakes(CRtpTransport* transport)
+{
+    int result = 0;
+    std::thread waiting([&] {
+        CRtpPacket* packets[4];
+        result = transport->receive(packets, 4, -1);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    transport->close();
+    waiting.join();
+    CHECK(result == -1);
+}
+
+int main()
+{
+    {
+        CRtpLoopbackTransport a, b;
+        CRtpLoopbackTransport::connect(&a, &b);
+        testEndToEnd("loopback", &a, &b, 600);
+    }
+    {
+        CRtpUdpTransport a, b;
+        CHECK(openPair(a, b, "127.0.0.1"));
+        testEndToEnd("127.0.0.1", &a, &b, 600);
+    }
+    {
+        // Not every machine has IPv6 on its loopback
+        CRtpUdpTransport a, b;
+        if (openPair(a, b, "::1"))
+            testEndToEnd("::1", &a, &b, 200);
+        else
+            printf("::1        skipped, errno %d\n", b.error());
+    }
+    {
+        CRtpUdpTransport a, b;
+        a.setSegmentOffload(true);
+        b.setSegmentOffload(true);
+        CHECK(openPair(a, b, "127.0.0.1"));
+        testEndToEnd("gso -> gro", &a, &b, 600);
+    }
+    {
+        CRtpUdpTransport a, b;
+        a.setSegmentOffload(true);
+        b.setSegmentOffload(true);
+        if (openPair(a, b, "::1"))
+            testEndToEnd("::1 gso", &a, &b, 200);
+    }
+    {
+        // Where the kernel has no io_uring both ends are on the socket calls
+        CRtpUringTransport a, b;
+        CHECK(openPair(a, b, "127.0.0.1"));
+        testEndToEnd("io_uring", &a, &b, 600);
+        printf("io_uring   send %s, receive %s\n", a.uringSend() ? "on the ring" : "fallen back",
+               b.uringReceive() ? "on the ring" : "fallen back");
+    }
+    {
+        CRtpUringTransport a(false), b(false);
+        CHECK(openPair(a, b, "127.0.0.1"));
+        CHECK(!a.uringSend() && !b.uringReceive());
+        testEndToEnd("fallback", &a, &b, 300);
+    }
+    {
+        // Offload takes the directions it is on off the rings
+        CRtpUringTransport a, b;
+        a.setSegmentOffload(true);
+        b.setSegmentOffload(true);
+        CHECK(openPair(a, b, "127.0.0.1"));
+        testEndToEnd("io_uring+o", &a, &b, 300);
+    }
+    testCoalescedRemainder();
+    testOffloadAtOpen();
+    {
+        CRtpLoopbackTransport loopback;
+        testCloseWakes(&loopback);
+        CRtpUdpTransport udp;
+        CHECK(udp.open("127.0.0.1", 0));
+        CHECK(udp.connect("127.0.0.1", udp.port()));
+        testCloseWakes(&udp);
+        // A multishot receive is not ended by shutdown()
+        CRtpUringTransport uring;
+        CHECK(uring.open("127.0.0.1", 0));
+        CHECK(uring.connect("127.0.0.1", uring.port()));
+        testCloseWakes(&uring);
+    }
+    return testResult("CRtpTransportTest");
+}
@@ -0,0 +1,218 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <set>
+#include <random>
+#include "CRtpStream.h"
+#include "CRtpUnpack.h"
+#include "RtpTest.h"
+
+// Random packet loss into CRtpUnpack, waiting for the next keyframe after a
+// gap and in recovery mode, with one slice per frame and with four. Five
+// minutes at 20 fps, a 20 KB keyframe every second and 4 KB P-frames.
+// Reports the share of frames never shown, which recovery should cut to a
+// fraction, the more so the more slices a frame is cut into.
+
+static const int fps = 20;
+static const int frames = 300 * ::fps;
+
+struct Result {
+    double frozen;    // Share of frames not shown
+    double damaged;   // Share of frames shown damaged
+};
+
+// A keyframe's parameter sets and slices, or a P-frame's slices.
+static std::vector<uint8_t> makeSlicedFrame(bool idr, int size, int slices, uint32_t seed)
+{
+    std::vector<uint8_t> frame;
+    if (idr) {
+        appendNal(frame, 0x67, 20, seed);
+        appendNal(frame, 0x68, 6, seed + 1);
+    }
+    for (int i = 0; i < slices; i++)
+        appendNal(frame, idr ? 0x65 : 0x41, size / slices, seed + 10 + i);
+    return frame;
+}
+
+static Result run(double loss, bool recovery, int slices)
+{
+    Packets packets;
+    CRtpStream stream(packetOut, &packets);
+    int error;
+    CRtpUnpack unpack(error);
+    unpack.SetRecovery(recovery);
+    std::mt19937 rng(42);
+    std::bernoulli_distribution drop(loss);
+    
+    std::set<unsigned int> shown;
+    int damaged = 0;
+    for (int k = 0; k < ::frames; k++) {
+        bool idr = k % ::fps == 0;
+        std::vector<uint8_t> frame = makeSlicedFrame(idr, idr ? 20000 : 4000, slices, k);
+        // AVCC, so every slice goes out as its own NAL unit
+        std::vector<uint8_t> avcc;
+        std::vector<std::vector<uint8_t> > paramSets;
+        toAvcc(frame, 4, &avcc, &paramSets);
+        const uint8_t* sets[2];
+        int setLengths[2];
+        for (size_t i = 0; i < paramSets.size(); i++) {
+            sets[i] = paramSets[i].data();
+            setLengths[i] = (int)paramSets[i].size();
+        }
+        packets.clear();
+        stream.streamOutAvcc(avcc.data(), (int)avcc.size(), 4, k * (90000 / ::fps), sets, setLengths, (int)paramSets.size());
+        
+        for (size_t p = 0; p < packets.size(); p++) {
+            if (drop(rng))
+                continue;
+            unsigned int size, timestamp;
+            const uint8_t* data = unpack.Parse_RTP_Packet(packets[p].data(), (unsigned short)packets[p].size(), &size, &timestamp);
+            for (; data != NULL; data = unpack.NextFrame(&size, &timestamp)) {
+                // Parameter sets come out on their own ahead of the keyframe
+                if (size < 100 || !shown.insert(timestamp).second)
+                    continue;
+                if (unpack.IsFrameDamaged())
+                    damaged++;
+            }
+        }
+    }
+    Result result = { (double)(::frames - shown.size()) / ::frames, (double)damaged / ::frames };
+    return result;
+}
+
+static void testNoLoss()
+{
+    for (int recovery = 0; recovery < 2; recovery++) {
+        Result result = run(0, recovery, 4);
+        CHECK(result.frozen == 0);
+        CHECK(result.damaged == 0);
+    }
+}
+
+static void testRandomLoss()
+{
+    printf("loss  baseline  recovery, 1 slice  recovery, 4 slices\n");
+    const double losses[] = { 0.01, 0.03, 0.05 };
+    for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); i++) {
+        Result baseline = run(losses[i], false, 1);
+        Result one = run(losses[i], true, 1);
+        Result four = run(losses[i], true, 4);
+        printf("%3.0f%%  %7.1f%%  %16.1f%%  %17.1f%%\n", 100 * losses[i],
+               100 * baseline.frozen, 100 * one.frozen, 100 * four.frozen);
+        
+        // Waiting for a keyframe shows nothing damaged and loses the rest of
+        // the GOP
+        CHECK(baseline.damaged == 0);
+        CHECK(baseline.frozen > 10 * losses[i]);
+        // Recovery loses only frames whose every slice is gone
+        CHECK(one.frozen < baseline.frozen / 2.5);
+        CHECK(four.frozen < one.frozen / 2);
+        CHECK(four.damaged > 0);
+    }
+}
+
+// What comes out of one unpacker, a frame at a time.
+struct Out {
+    std::vector<uint8_t> data;
+    unsigned int timestamp;
+    bool damaged;
+    bool key;
+};
+
+// Through the copying or the zero-copy form of the unpacker, each frame
+// a packet gives and any queued behind it.
+static std::vector<Out> parse(CRtpUnpack& unpack, std::vector<uint8_t> packet, bool zeroCopy)
+{
+    std::vector<Out> out;
+    unsigned int size, timestamp;
+    if (zeroCopy) {
+        CRtpPacket* in = CRtpPacket::create(packet.data(), (int)packet.size());
+        for (CRtpFrame* frame = unpack.Parse_RTP_Packet(in, &timestamp); frame != NULL; frame = unpack.NextFrame(&timestamp)) {
+            Out o = { std::vector<uint8_t>(frame->length()), timestamp, unpack.IsFrameDamaged(), unpack.IsKeyFrame() };
+            frame->copyTo(o.data.data());
+            out.push_back(o);
+        }
+        in->release();
+        return out;
+    }
+    const uint8_t* data = unpack.Parse_RTP_Packet(packet.data(), (unsigned short)packet.size(), &size, &timestamp);
+    for (; data != NULL; data = unpack.NextFrame(&size, &timestamp)) {
+        Out o = { std::vector<uint8_t>(data, data + size), timestamp, unpack.IsFrameDamaged(), unpack.IsKeyFrame() };
+        out.push_back(o);
+    }
+    return out;
+}
+
+// A frame of two slices, one packet and three, loses its last packet, and
+// the next frame is one packet, so that packet both closes the first frame
+// and is a whole frame itself: the first slice comes out damaged, the next
+// frame queued behind it, whole, a keyframe when it is one. Nothing is
+// left queued after.
+static void testCutShortBeforeWholeFrame()
+{
+    for (int zeroCopy = 0; zeroCopy < 2; zeroCopy++) {
+        for (int key = 0; key < 2; key++) {
+            Packets packets;
+            CRtpStream stream(packetOut, &packets);
+            int error;
+            CRtpUnpack unpack(error);
+            unpack.SetRecovery(true);
+            
+            std::vector<uint8_t> first;
+            appendNal(first, 0x67, 20, 1);
+            appendNal(first, 0x68, 6, 2);
+            appendNal(first, 0x65, 2000, 3);
+            std::vector<uint8_t> cut;
+            appendNal(cut, 0x41, 600, 4);
+            size_t firstSlice = cut.size();
+            appendNal(cut, 0x41, 3000, 7);
+            std::vector<uint8_t> whole;
+            appendNal(whole, key ? 0x65 : 0x41, 500, 5);
+            std::vector<uint8_t> next;
+            appendNal(next, 0x41, 700, 6);
+            
+            std::vector<Out> out;
+            stream.streamOut(first.data(), (int)first.size(), 0);
+            std::vector<uint8_t> avcc;
+            std::vector<std::vector<uint8_t> > none;
+            toAvcc(cut, 4, &avcc, &none);
+            stream.streamOutAvcc(avcc.data(), (int)avcc.size(), 4, 3000);
+            // The parameter sets, two for the keyframe, four for the cut one
+            CHECK(packets.size() == 1 + 2 + 4);
+            packets.pop_back();
+            for (size_t p = 0; p < packets.size(); p++) {
+                std::vector<Out> o = parse(unpack, packets[p], zeroCopy);
+                out.insert(out.end(), o.begin(), o.end());
+            }
+            packets.clear();
+            stream.streamOut(whole.data(), (int)whole.size(), 6000);
+            stream.streamOut(next.data(), (int)next.size(), 9000);
+            CHECK(packets.size() == 2);
+            std::vector<Out> both = parse(unpack, packets[0], zeroCopy);
+            std::vector<Out> after = parse(unpack, packets[1], zeroCopy);
+            
+            // The parameter sets, then the keyframe
+            CHECK(out.size() == 2 && out[1].key);
+            std::vector<uint8_t> keyFrame;
+            for (size_t i = 0; i < out.size(); i++)
+                keyFrame.insert(keyFrame.end(), out[i].data.begin(), out[i].data.end());
+            CHECK(keyFrame == first);
+            CHECK(both.size() == 2);
+            if (both.size() == 2) {
+                CHECK(both[0].timestamp == 3000 && both[0].damaged && !both[0].key);
+                CHECK(both[0].data == std::vector<uint8_t>(cut.begin(), cut.begin() + firstSlice));
+                CHECK(both[1].timestamp == 6000 && both[1].data == whole && both[1].key == (key != 0));
+            }
+            CHECK(after.size() == 1 && after[0].timestamp == 9000 && after[0].data == next && !after[0].damaged);
+        }
+    }
+}
+
+int main()
+{
+    testNoLoss();
+    testCutShortBeforeWholeFrame();
+    testRandomLoss();
+    return testResult("CRtpUnpackRecoveryTest");
+}
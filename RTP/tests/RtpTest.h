@@ -0,0 +1,127 @@
+#ifndef __RTP_TEST_H__
+#define __RTP_TEST_H__
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+
+// Shared by the tests: a check that counts failures and goes on, packets
+// collected from the stream callbacks, and H.264 access units of random
+// bytes that never form a start code.
+
+inline int testFailures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            testFailures++; \
+        } \
+    } while (0)
+
+// What main() returns.
+inline int testResult(const char* name)
+{
+    if (testFailures > 0)
+        fprintf(stderr, "%s: %d checks failed\n", name, testFailures);
+    else
+        printf("%s: passed\n", name);
+    return testFailures > 0 ? 1 : 0;
+}
+
+typedef std::vector<std::vector<uint8_t> > Packets;
+
+// Matches CRtpStreamOutCallback, ref is a Packets.
+inline void packetOut(void *ref, const uint8_t* data, int length)
+{
+    ((Packets*)ref)->push_back(std::vector<uint8_t>(data, data + length));
+}
+
+// Matches CRtpStreamOutBatchCallback, ref is a Packets.
+inline void packetsOut(void *ref, const uint8_t* const* packets, const int* lengths, int count)
+{
+    for (int i = 0; i < count; i++)
+        ((Packets*)ref)->push_back(std::vector<uint8_t>(packets[i], packets[i] + lengths[i]));
+}
+
+// Equal but for where sequence numbers start and the SSRC, which every
+// stream picks at random.
+inline bool samePackets(const Packets& a, const Packets& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].size() < 12 || a[i].size() != b[i].size())
+            return false;
+        uint16_t seqA = (uint16_t)(((a[i][2] << 8) | a[i][3]) - ((a[0][2] << 8) | a[0][3]));
+        uint16_t seqB = (uint16_t)(((b[i][2] << 8) | b[i][3]) - ((b[0][2] << 8) | b[0][3]));
+        if (seqA != seqB)
+            return false;
+        for (size_t k = 0; k < a[i].size(); k++) {
+            bool random = k == 2 || k == 3 || (k >= 8 && k < 12);
+            if (!random && a[i][k] != b[i][k])
+                return false;
+        }
+    }
+    return true;
+}
+
+// One NAL unit behind a 4 byte start code, length bytes with its header.
+inline void appendNal(std::vector<uint8_t>& frame, uint8_t header, int length, uint32_t seed)
+{
+    static const uint8_t startCode[4] = { 0, 0, 0, 1 };
+    frame.insert(frame.end(), startCode, startCode + 4);
+    frame.push_back(header);
+    for (int i = 1; i < length; i++) {
+        seed = seed * 1664525 + 1013904223;
+        uint8_t b = (uint8_t)(seed >> 24);
+        frame.push_back(b != 0 ? b : 1);
+    }
+}
+
+// Annex-B access unit: SPS, PPS, SEI and an IDR slice, or a P slice.
+inline std::vector<uint8_t> makeFrame(bool idr, int sliceLength, uint32_t seed)
+{
+    std::vector<uint8_t> frame;
+    if (idr) {
+        appendNal(frame, 0x67, 20, seed);
+        appendNal(frame, 0x68, 6, seed + 1);
+        appendNal(frame, 0x06, 30, seed + 2);
+        appendNal(frame, 0x65, sliceLength, seed + 3);
+    }
+    else {
+        appendNal(frame, 0x41, sliceLength, seed + 4);
+    }
+    return frame;
+}
+
+// The NAL units of an Annex-B access unit behind big-endian lengths of
+// lengthSize bytes, the parameter sets taken out as VideoToolbox hands
+// them apart.
+inline void toAvcc(const std::vector<uint8_t>& frame, int lengthSize,
+                   std::vector<uint8_t>* avcc, std::vector<std::vector<uint8_t> >* paramSets)
+{
+    std::vector<size_t> starts;
+    for (size_t i = 0; i + 4 <= frame.size(); i++) {
+        if (frame[i] == 0 && frame[i + 1] == 0 && frame[i + 2] == 0 && frame[i + 3] == 1) {
+            starts.push_back(i + 4);
+            i += 3;
+        }
+    }
+    for (size_t k = 0; k < starts.size(); k++) {
+        size_t begin = starts[k];
+        size_t end = k + 1 < starts.size() ? starts[k + 1] - 4 : frame.size();
+        int type = frame[begin] & 0x1f;
+        if (type == 7 || type == 8) {
+            paramSets->push_back(std::vector<uint8_t>(frame.begin() + begin, frame.begin() + end));
+            continue;
+        }
+        size_t length = end - begin;
+        for (int b = lengthSize - 1; b >= 0; b--)
+            avcc->push_back((uint8_t)(length >> (8 * b)));
+        avcc->insert(avcc->end(), frame.begin() + begin, frame.begin() + end);
+    }
+}
+
+#endif
@@ -110,6 +110,12 @@ extension Device : WhisperStreamDelegate
     }
     
     func didReceiveStreamData(_ stream: WhisperStream, _ data: Data) {
+        // Feedback on the video we send to this device
+        if VideoEncoder.isFeedbackPacket(data) {
+            DeviceManager.sharedInstance.didReceiveFeedback(data, from: self)
+            return
+        }
+        
         if decoder == nil {
             decoder = VideoDecoder()
             decoder?.delegate = self
@@ -316,6 +322,12 @@ extension Device : VideoDecoderDelegate
             videoPlayView?.image = image
         }
     }
+
+    func videoDecoder(_ decoder: VideoDecoder!, sendFeedback data: Data!) {
+        if let stream = self.stream, state == .Connected {
+            _ = try? stream.writeData(data)
+        }
+    }
 }
 
 // MARK: - Hashable
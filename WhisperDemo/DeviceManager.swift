@@ -439,6 +439,7 @@ extension DeviceManager : WhisperDelegate
         if status == .Disconnected {
             self.devices.removeAll()
             self.remotePlayingDevices.removeAll()
+            encoder?.removeAllViewers()
         }
         
         NotificationCenter.default.post(name: DeviceManager.DeviceListChanged, object: nil)
@@ -513,6 +514,7 @@ extension DeviceManager : WhisperDelegate
                     device.remotePlaying = false
                     device.closeSession()
                     self.remotePlayingDevices.remove(device)
+                    encoder?.removeViewer(device)
                     self.checkAndStopVideoCapture()
                 }
                 
@@ -554,6 +556,7 @@ extension DeviceManager : WhisperDelegate
                 device.closeSession();
 
                 self.remotePlayingDevices.remove(device)
+                encoder?.removeViewer(device)
                 self.devices.remove(at: index)
                 
                 NotificationCenter.default.post(name: DeviceManager.DeviceListChanged, object: nil)
@@ -628,10 +631,12 @@ extension DeviceManager : WhisperDelegate
                     if let device = devices.first(where: {$0.deviceId == deviceId}) {
                         if videoPlay {
                             remotePlayingDevices.insert(device)
+                            encoder?.addViewer(device)
                             startVideoCapture()
                         }
                         else {
                             remotePlayingDevices.remove(device)
+                            encoder?.removeViewer(device)
                             checkAndStopVideoCapture()
                         }
                         device.remotePlaying = videoPlay
@@ -785,6 +790,9 @@ extension DeviceManager : AVCaptureVideoDataOutputSampleBufferDelegate
             if encoder == nil {
                 encoder = VideoEncoder()
                 encoder?.delegate = self
+                for device in self.remotePlayingDevices {
+                    encoder?.addViewer(device)
+                }
             }
             encoder?.encode(sampleBuffer)
         }
@@ -793,23 +801,33 @@ extension DeviceManager : AVCaptureVideoDataOutputSampleBufferDelegate
 
 extension DeviceManager : VideoEncoderDelegate
 {
-    func videoEncoder(_ encoder: VideoEncoder!, appendBytes bytes: UnsafeRawPointer!, length: Int) {
-        let data = Data(bytes: bytes, count: length)
-        for device in self.remotePlayingDevices {
-            if device.state == .Connected {
-                do {
-                    let result = try device.stream!.writeData(data)
-                    if result.intValue != length {
-                        NSLog("Warning: writeData result: \(result), total length: \(length)")
-                    }
-                }
-                catch {
-                    NSLog("writeData error: \(error.localizedDescription)")
+    func videoEncoder(_ encoder: VideoEncoder!, appendPackets packets: UnsafePointer<UnsafeRawPointer?>!, lengths: UnsafePointer<Int32>!, count: Int, toViewer viewer: Any!) {
+        // On the viewer's own thread, a slow stream holds up no one else.
+        // The packets stay valid until we return, so wrap them without copying.
+        guard let device = viewer as? Device, device.state == .Connected, let stream = device.stream else {
+            return
+        }
+
+        for index in 0..<count {
+            let bytes = UnsafeMutableRawPointer(mutating: packets[index]!)
+            let data = Data(bytesNoCopy: bytes, count: Int(lengths[index]), deallocator: .none)
+            do {
+                let result = try stream.writeData(data)
+                if result.intValue != data.count {
+                    NSLog("Warning: writeData result: \(result), total length: \(data.count)")
                 }
             }
+            catch {
+                NSLog("writeData error: \(error.localizedDescription)")
+                break
+            }
         }
     }
     
     func videoEncoder(_ encoder: VideoEncoder!, error: String!) {
     }
+    
+    func didReceiveFeedback(_ data: Data, from device: Device) {
+        encoder?.receiveFeedback(data, fromViewer: device)
+    }
 }
@@ -21,5 +21,7 @@
 - (void)videoDecoder:(VideoDecoder *)decoder gotVideoImage:(UIImage *)image;
 - (void)videoDecoder:(VideoDecoder *)decoder gotSampleBuffer:(CMSampleBufferRef)sampleBuffer;
 - (void)videoDecoder:(VideoDecoder *)decoder error:(NSString *)error;
+// RTCP for the sender of the video, e.g. keyframe requests after loss.
+- (void)videoDecoder:(VideoDecoder *)decoder sendFeedback:(NSData *)data;
 
 @end
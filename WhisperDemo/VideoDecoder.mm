@@ -1,5 +1,9 @@
 #import "VideoDecoder.h"
-#include "CRtpUnpack.h"
+#include "CRtpDemuxer.h"
+#include "CRtcpFeedbackSender.h"
+#include "CRtcpSession.h"
+#include "CRtpPacer.h"
+#include "CNalScanner.h"
 
 #ifdef USE_FFMPEG
 extern "C" {
@@ -10,14 +14,27 @@ extern "C" {
 #include "frame.h"
 #include "opt.h"
 };
+#include "CRtpFrameAV.h"
 #else
 #import <VideoToolbox/VideoToolbox.h>
 #endif
 
+static const int videoPayloadType = 96;
+static const int rtxPayloadType = 97;
+static const int fecPayloadType = 98;
+static const int rsPayloadType = 99;
+
 @implementation VideoDecoder
 {
     dispatch_queue_t queue;
-    CRtpUnpack *rtpUnpack;
+    CRtpDemuxer *demuxer;
+    CRtcpFeedbackSender *feedbackSender;
+    // Receiver reports on the sources, and their sender reports
+    CRtcpSession *rtcpSession;
+    int64_t demuxDeadline;
+    // Only one of the sources on the stream is shown
+    BOOL following;
+    uint32_t followSsrc;
 #ifdef USE_FFMPEG
     // for ffmpeg decoder
     AVCodecContext  *pCodecCtx;
@@ -63,42 +80,130 @@ extern "C" {
     queue = NULL;
 }
 
+static void releasePacketData(void *ref)
+{
+    CFRelease(ref);
+}
+
+static void didDemuxFrame(void *ref, uint32_t ssrc, int payloadType, CRtpFrame *frame,
+                          uint32_t timestamp, bool damaged);
+
+static void didRtcpOut(void *ref, const uint8_t *data, int length)
+{
+    VideoDecoder *decoder = (__bridge VideoDecoder *)ref;
+    if ([(NSObject *)decoder.delegate respondsToSelector:@selector(videoDecoder:sendFeedback:)]) {
+        [decoder.delegate videoDecoder:decoder sendFeedback:[NSData dataWithBytes:data length:length]];
+    }
+}
+
+static void didRtcpBye(void *ref, uint32_t ssrc)
+{
+    VideoDecoder *decoder = (__bridge VideoDecoder *)ref;
+    [decoder removeSource:ssrc];
+}
+
+- (void)removeSource:(uint32_t)ssrc
+{
+    demuxer->removeSource(ssrc, videoPayloadType);
+    if (following && followSsrc == ssrc)
+        following = NO;
+}
+
 - (void)decode:(NSData *)data
 {
     dispatch_async(queue, ^{
         
-        if (rtpUnpack == NULL) {
-            int initError;
-            rtpUnpack = new CRtpUnpack(initError);
-            if (initError != 0) {
-                delete rtpUnpack;
-                rtpUnpack = NULL;
-                
-                NSLog(@"RTP: Create CRtpUnpack error: %d", initError);
-                [self.delegate videoDecoder:self error:@"Create CRtpUnpack failed"];
-                return;
-            }
+        if (demuxer == NULL) {
+            demuxer = new CRtpDemuxer(didDemuxFrame, (__bridge void *)self);
+            demuxer->addPayloadType(videoPayloadType);
+            // Keep decoding past losses, the decoder conceals missing slices
+            demuxer->setRecovery(true);
+            // and asks for a keyframe to end the concealment
+            feedbackSender = new CRtcpFeedbackSender(didRtcpOut, (__bridge void *)self);
+            demuxer->setFeedbackSender(feedbackSender);
+            // Lost packets are NACKed first and come back on the RTX stream
+            demuxer->addRtxPayloadType(rtxPayloadType, videoPayloadType);
+            demuxer->setNack(true);
+            // Parity behind each frame repairs most of it before that
+            demuxer->addFecPayloadType(fecPayloadType, videoPayloadType);
+            demuxer->addRsPayloadType(rsPayloadType, videoPayloadType);
+            // Reports go out under the SSRC the feedback carries
+            rtcpSession = new CRtcpSession(feedbackSender->ssrc(), didRtcpOut, (__bridge void *)self);
+            rtcpSession->setByeCallback(didRtcpBye, (__bridge void *)self);
+            demuxer->setRtcpSession(rtcpSession);
+            demuxDeadline = -1;
+            following = NO;
         }
         
-        unsigned short rtpLength = data.length;
-        unsigned char *pRtpData = new unsigned char[rtpLength];
-        [data getBytes:pRtpData length:rtpLength];
+        // Sender reports come in with the video
+        if (CRtcpParser::isRtcp((const uint8_t *)data.bytes, (int)data.length)) {
+            rtcpSession->rtcpIn((const uint8_t *)data.bytes, (int)data.length, CRtpPacer::nowUs());
+            [self pollDemuxer];
+            return;
+        }
         
-        unsigned int frameLength = 0;
-        unsigned int timestamp = 0;
-        unsigned char *pFrameData = rtpUnpack->Parse_RTP_Packet(pRtpData, rtpLength, &frameLength, &timestamp);
-        if (pFrameData != NULL && frameLength > 4)
-        {
+        // The packet keeps a reference to the data rather than a copy of it.
+        CRtpPacket *packet = CRtpPacket::wrap((const uint8_t *)data.bytes, (int)data.length,
+                                              releasePacketData, (void *)CFBridgingRetain(data));
+        demuxer->packetIn(packet, CRtpPacer::nowUs());
+        packet->release();
+        
+        [self pollDemuxer];
+    });
+}
+
+// Plays out blocked frames, expires idle sources and sends the receiver
+// reports and transport feedback, and comes back when the next frame with a
+// hole is due to be given up on or the next report or feedback is.
+- (void)pollDemuxer
+{
+    if (demuxer == NULL)
+        return;
+    
+    int64_t deadline = demuxer->poll(CRtpPacer::nowUs());
+    int64_t report = rtcpSession->poll(CRtpPacer::nowUs());
+    if (deadline < 0 || report < deadline)
+        deadline = report;
+    int64_t feedback = feedbackSender->poll(CRtpPacer::nowUs());
+    if (feedback >= 0 && (deadline < 0 || feedback < deadline))
+        deadline = feedback;
+    if (following && !demuxer->hasSource(followSsrc, videoPayloadType))
+        following = NO;
+    
+    if (deadline >= 0 && deadline != demuxDeadline) {
+        demuxDeadline = deadline;
+        int64_t wait = deadline - CRtpPacer::nowUs();
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, wait > 0 ? wait * NSEC_PER_USEC : 0), queue, ^{
+            if (demuxDeadline == deadline) {
+                demuxDeadline = -1;
+                [self pollDemuxer];
+            }
+        });
+    }
+}
+
+- (void)decodeFrame:(CRtpFrame *)frame ofSource:(uint32_t)ssrc withTimestamp:(unsigned int)timestamp
+{
+    // Follow the first source heard, until it goes away
+    if (!following) {
+        following = YES;
+        followSsrc = ssrc;
+    }
+    if (ssrc != followSsrc || frame->length() <= 4)
+        return;
+    
 #ifdef USE_FFMPEG
-            [self ffmpegDecodeFrameData:pFrameData length:frameLength withTimestamp:timestamp];
+    [self ffmpegDecodeFrame:frame withTimestamp:timestamp];
 #else
-            [self hardwareDecodeFrameData:pFrameData length:frameLength];
+    [self hardwareDecodeFrame:frame];
 #endif
-        }
-        
-        delete [] pRtpData;
-        pRtpData = NULL;
-    });
+}
+
+static void didDemuxFrame(void *ref, uint32_t ssrc, int payloadType, CRtpFrame *frame,
+                          uint32_t timestamp, bool damaged)
+{
+    VideoDecoder *decoder = (__bridge VideoDecoder *)ref;
+    [decoder decodeFrame:frame ofSource:ssrc withTimestamp:timestamp];
 }
 
 #ifdef USE_FFMPEG
@@ -141,9 +246,9 @@ extern "C" {
     return YES;
 }
 
-- (void)ffmpegDecodeFrameData:(unsigned char*)pFrameData length:(unsigned int)length withTimestamp:(unsigned int)timestamp
+- (void)ffmpegDecodeFrame:(CRtpFrame *)frame withTimestamp:(unsigned int)timestamp
 {
-    if (pFrameData == NULL || length == 0) {
+    if (frame == NULL || frame->length() == 0) {
         return;
     }
 
@@ -152,8 +257,9 @@ extern "C" {
 
     @synchronized(self) {
         AVPacket packet;
-        av_new_packet(&packet, length);
-        memcpy(packet.data, pFrameData, length);
+        if (rtpFrameToAVPacket(*frame, &packet) < 0) {
+            return;
+        }
         result = avcodec_decode_video2(pCodecCtx, pFrame, &decoderFrameOK, &packet);
         av_free_packet(&packet);
     }
@@ -225,45 +331,77 @@ extern "C" {
 
 #else
 
-- (void)hardwareDecodeFrameData:(unsigned char*)pFrameData length:(unsigned int)frameLength
+- (void)parameterSetData:(unsigned char*)nalData length:(unsigned int)nalLength type:(int)naluType
 {
-    int naluType = ((uint8_t)pFrameData[4] & 0x1F);
-    //NSLog(@"RTP: timestamp: %d, nalu header: %x, type: %d, size: %d", timestamp, pFrameData[4], naluType, length);
+    if (videoFormatDescription != NULL) {
+        return;
+    }
     
-    if ((naluType == 7 || naluType == 8) && videoFormatDescription == NULL) {
-        if (naluType == 7) {
-            spsData = [NSData dataWithBytes:pFrameData + 4 length:frameLength - 4];
-        }
+    if (naluType == 7) {
+        spsData = [NSData dataWithBytes:nalData length:nalLength];
+    }
+    
+    if (naluType == 8) {
+        ppsData = [NSData dataWithBytes:nalData length:nalLength];
+    }
+    
+    if (spsData != nil && ppsData != nil) {
+        const uint8_t* const parameterSetPointers[2] = { (const uint8_t*)[spsData bytes], (const uint8_t*)[ppsData bytes] };
+        const size_t parameterSetSizes[2] = { spsData.length, ppsData.length };
         
-        if (naluType == 8) {
-            ppsData = [NSData dataWithBytes:pFrameData + 4 length:frameLength - 4];
+        //construct h.264 parameter set
+        CMVideoFormatDescriptionRef formatDesc = NULL;
+        OSStatus formatCreateResult = CMVideoFormatDescriptionCreateFromH264ParameterSets(kCFAllocatorDefault, 2, parameterSetPointers, parameterSetSizes, 4, &formatDesc);
+        if (formatCreateResult == noErr) {
+            videoFormatDescription = formatDesc;
+            if (decompressionSession == NULL || VTDecompressionSessionCanAcceptFormatDescription(decompressionSession, formatDesc) == NO) {
+                [self createDecompSession];
+            }
+        }
+        else {
+            NSLog(@"H264 decode: CMVideoFormatDescriptionCreateFromH264ParameterSets error : %d", (int)formatCreateResult);
+            [self stop];
+            [self.delegate videoDecoder:self error:@"Create video format description failed"];
+        }
+    }
+}
+
+- (void)hardwareDecodeFrame:(CRtpFrame *)frame
+{
+    // VideoToolbox takes AVCC in one block, so the frame is flattened once. The
+    // block buffer owns the copy, the sample buffer may outlive this call.
+    unsigned int frameLength = frame->length();
+    unsigned char* pFrameBase = (unsigned char*)malloc(frameLength);
+    if (pFrameBase == NULL) {
+        return;
+    }
+    frame->copyTo(pFrameBase);
+    unsigned char* pFrameData = pFrameBase;
+    
+    // Parameter sets may arrive on their own or aggregated (STAP-A) in front of a
+    // slice, so walk the leading non-VCL NAL units before decoding the rest. A
+    // start code with nothing behind it ends the walk.
+    unsigned char* frameEnd = pFrameData + frameLength;
+    while (frameEnd - pFrameData > 4) {
+        int naluType = ((uint8_t)pFrameData[4] & 0x1F);
+        //NSLog(@"RTP: nalu header: %x, type: %d, size: %d", pFrameData[4], naluType, frameLength);
+        if (naluType == 1 || naluType == 5) {
+            break;
         }
         
-        if (spsData != nil && ppsData != nil) {
-            const uint8_t* const parameterSetPointers[2] = { (const uint8_t*)[spsData bytes], (const uint8_t*)[ppsData bytes] };
-            const size_t parameterSetSizes[2] = { spsData.length, ppsData.length };
-            
-            //construct h.264 parameter set
-            CMVideoFormatDescriptionRef formatDesc = NULL;
-            OSStatus formatCreateResult = CMVideoFormatDescriptionCreateFromH264ParameterSets(kCFAllocatorDefault, 2, parameterSetPointers, parameterSetSizes, 4, &formatDesc);
-            if (formatCreateResult == noErr) {
-                videoFormatDescription = formatDesc;
-                if (decompressionSession == NULL || VTDecompressionSessionCanAcceptFormatDescription(decompressionSession, formatDesc) == NO) {
-                    [self createDecompSession];
-                }
-            }
-            else {
-                NSLog(@"H264 decode: CMVideoFormatDescriptionCreateFromH264ParameterSets error : %d", (int)formatCreateResult);
-                [self stop];
-                [self.delegate videoDecoder:self error:@"Create video format description failed"];
-            }
+        unsigned char* nal_end = nalu::findStartCode(pFrameData + 4, frameEnd);
+        if (naluType == 7 || naluType == 8) {
+            [self parameterSetData:pFrameData + 4 length:(unsigned int)(nal_end - pFrameData - 4) type:naluType];
         }
+        pFrameData = nal_end;
     }
-    else if ((naluType == 1 || naluType == 5) && videoFormatDescription) {
+    frameLength = (unsigned int)(frameEnd - pFrameData);
+    
+    if (frameLength > 4 && videoFormatDescription) {
 
         unsigned char* nal_start = pFrameData;
         do {
-            unsigned char* nal_end = avc_find_startcode(nal_start + 4, pFrameData + frameLength);
+            unsigned char* nal_end = nalu::findStartCode(nal_start + 4, pFrameData + frameLength);
             uint32_t nal_len = htonl(nal_end - nal_start - 4);
             memcpy (nal_start, &nal_len, sizeof(uint32_t));
 //            uint32_t nal_len = nal_end - nal_start - 4;
@@ -289,7 +427,8 @@ extern "C" {
 //        else {
 //            DLogError(@"Create empty block buffer failed : %d", status);
 //        }
-        OSStatus status = CMBlockBufferCreateWithMemoryBlock(NULL, pFrameData, frameLength, kCFAllocatorNull, NULL, 0, frameLength, 0, &blockBuffer);
+        OSStatus status = CMBlockBufferCreateWithMemoryBlock(NULL, pFrameBase, frameEnd - pFrameBase, kCFAllocatorMalloc, NULL,
+                                                             pFrameData - pFrameBase, frameLength, 0, &blockBuffer);
         if (status == kCMBlockBufferNoErr) {
             const size_t sampleSize = frameLength; // CMBlockBufferGetDataLength(blockBuffer);
             CMSampleBufferRef sampleBuffer = NULL;
@@ -322,11 +461,15 @@ extern "C" {
             CFRelease(blockBuffer);
         }
         else {
+            free(pFrameBase);
             NSLog(@"H264 decode: CMBlockBufferCreateWithMemoryBlock error : %d", (int)status);
             [self stop];
             [self.delegate videoDecoder:self error:@"Create block buffer failed"];
         }
     }
+    else {
+        free(pFrameBase);
+    }
 }
 
 -(void) createDecompSession
@@ -426,50 +569,6 @@ void decompressionSessionDecodeFrameCallback(void *decompressionOutputRefCon,
     }
 }
 
-uint8_t *avc_find_startcode(uint8_t *p, uint8_t *end)
-{
-    uint8_t *out= avc_find_startcode_internal(p, end);
-    if(p<out && out<end && !out[-1]) out--;
-    return out;
-}
-
-uint8_t *avc_find_startcode_internal(uint8_t *p, uint8_t *end)
-{
-    const uint8_t *a = p + 4 - ((intptr_t)p & 3);
-
-    for (end -= 3; p < a && p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    for (end -= 3; p < end; p += 4) {
-        uint32_t x = *(const uint32_t*)p;
-        //if ((x - 0x01000100) & (~x) & 0x80008000) { // little endian
-        //if ((x - 0x00010001) & (~x) & 0x00800080) { // big endian
-        if ((x - 0x01010101) & (~x) & 0x80808080) { // generic
-            if (p[1] == 0) {
-                if (p[0] == 0 && p[2] == 1)
-                    return p;
-                if (p[2] == 0 && p[3] == 1)
-                    return p+1;
-            }
-            if (p[3] == 0) {
-                if (p[2] == 0 && p[4] == 1)
-                    return p+2;
-                if (p[4] == 0 && p[5] == 1)
-                    return p+3;
-            }
-        }
-    }
-
-    for (end += 3; p < end; p++) {
-        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
-            return p;
-    }
-
-    return end + 3;
-}
-
 #endif
 
 - (void)end
@@ -480,9 +579,23 @@ uint8_t *avc_find_startcode_internal(uint8_t *p, uint8_t *end)
 }
 
 - (void)stop {
-    if (rtpUnpack) {
-        delete rtpUnpack;
-        rtpUnpack = NULL;
+    if (rtcpSession) {
+        rtcpSession->bye(CRtpPacer::nowUs());
+    }
+    
+    if (demuxer) {
+        delete demuxer;
+        demuxer = NULL;
+    }
+    
+    if (feedbackSender) {
+        delete feedbackSender;
+        feedbackSender = NULL;
+    }
+    
+    if (rtcpSession) {
+        delete rtcpSession;
+        rtcpSession = NULL;
     }
 
 #ifndef USE_FFMPEG
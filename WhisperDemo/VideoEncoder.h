@@ -9,13 +9,31 @@
 - (void)encode:(CMSampleBufferRef)sampleBuffer;
 - (void)end;
 
+// RTCP from a receiver shares the stream with the video going the other way.
+// Sender reports on that video are not feedback, the decoder takes them.
++ (BOOL)isFeedbackPacket:(NSData *)data;
+// Keyframe requests (PLI/FIR) make the next frame an IDR. Receiver reports
+// give the loss, jitter and round trip of the video sent. NACKs from a
+// viewer are mapped back through the layers it was sent. Transport feedback
+// drives a bandwidth estimate per viewer, the lowest sets the bitrate.
+- (void)receiveFeedback:(NSData *)data fromViewer:(id)viewer;
+
+// Each viewer gets the packets through a queue and a thread of its own. One
+// that can not keep up skips to the next keyframe rather than holding up
+// the others or the encoder, and gets fewer temporal layers, so a lower
+// frame rate, for as long as its bandwidth calls for.
+- (void)addViewer:(id)viewer;
+- (void)removeViewer:(id)viewer;
+- (void)removeAllViewers;
+
 @property (weak, nonatomic) id<VideoEncoderDelegate> delegate;
 
 @end
 
 @protocol VideoEncoderDelegate
 
-- (void)videoEncoder:(VideoEncoder *)encoder appendBytes:(const void *)bytes length:(NSInteger)length;
+// On the viewer's own thread, the packets are valid until it returns.
+- (void)videoEncoder:(VideoEncoder *)encoder appendPackets:(const void * const *)packets lengths:(const int *)lengths count:(NSInteger)count toViewer:(id)viewer;
 - (void)videoEncoder:(VideoEncoder *)encoder error:(NSString *)error;
 
 @end
@@ -1,11 +1,27 @@
 #import <Foundation/Foundation.h>
 #import "VideoEncoder.h"
 #import "CRtpStream.h"
+#import "CRtpPacer.h"
+#import "CRtcp.h"
+#import "CRtcpSession.h"
+#import "CRtpBandwidthEstimator.h"
+#import "CRtpFanout.h"
+#import "CRtpPacketHistory.h"
+#import "CRtpRetransmitter.h"
+#import "CRtpFecEncoder.h"
+#import "CRtpRsEncoder.h"
 
 static const int fps = 20;
 
+// Set on the encoder queue, to tell when already on it
+static void *queueKey = &queueKey;
+
 #define CROP_IMAGE 0
 
+// Reed-Solomon repair per frame instead of XOR parity. Heavier to compute,
+// but it repairs any losses up to its repair count, bursts included.
+#define REED_SOLOMON_FEC 1
+
 #if CROP_IMAGE
 #import <CoreImage/CoreImage.h>
 
@@ -13,6 +29,32 @@ static const CGFloat width = 320;
 static const CGFloat height = 240;
 #endif
 
+// What a viewer's thread calls back with
+@interface VideoEncoderViewer : NSObject
+{
+@public
+    __weak VideoEncoder *encoder;
+    id viewer;
+    int subscription;
+    // The packets that reached this viewer and its feedback on them, apart
+    // from every other viewer's
+    CRtpBandwidthEstimator *bwe;
+    int bitrate;
+    // The last MTU probe this viewer acknowledged, -1 before the first
+    int probeAcked;
+}
+@end
+
+@implementation VideoEncoderViewer
+
+- (void)dealloc
+{
+    // Unsubscribed, and no feedback block holds it any more
+    delete bwe;
+}
+
+@end
+
 @implementation VideoEncoder
 {
     dispatch_queue_t queue;
@@ -22,6 +64,31 @@ static const CGFloat height = 240;
     CIContext *ciContext;
 #endif
     CRtpStream *rtp;
+    CRtpPacer *pacer;
+    CRtpPacketHistory *history;
+    CRtpRetransmitter *retransmitter;
+    CRtpFecEncoder *fecEncoder;
+    CRtpRsEncoder *rsEncoder;
+    // Loss as the NACKs tell it, over about a second
+    uint32_t nackedPackets;
+    uint32_t lossMediaPackets;
+    uint32_t lossFecPackets;
+    int64_t lossUs;
+    // Repair and retransmissions for every media packet, taken off the
+    // estimate before it reaches the encoder
+    float repairOverhead;
+    // Where a viewer's estimate starts
+    int initialBitrate;
+    CRtcpParser *rtcpParser;
+    // Sender reports, and the loss, jitter and round trip the receivers see
+    CRtcpSession *rtcpSession;
+    BOOL forceKeyFrame;
+    // Every packet out, media and RTCP, to each viewer
+    CRtpFanout *fanout;
+    NSMutableArray<VideoEncoderViewer *> *viewers;
+    // Whose feedback is being parsed, its NACKs name the sequence numbers
+    // of the layers it gets and its transport feedback goes to its estimate
+    VideoEncoderViewer *feedbackViewer;
 }
 
 - (instancetype)init
@@ -30,20 +97,99 @@ static const CGFloat height = 240;
     if (self) {
         // Custom initialization
         queue = dispatch_queue_create("videoEncoder", NULL);
+        dispatch_queue_set_specific(queue, queueKey, queueKey, NULL);
+        fanout = new CRtpFanout();
+        viewers = [NSMutableArray array];
+        initialBitrate = defaultStartBitrate;
     }
     return self;
 }
 
 - (void)dealloc
 {
-    [self end];
+    // Every block queued held self, none is left to wait for
+    [self endSession];
+    [self removeAllViewers];
+    delete fanout;
+    fanout = NULL;
     queue = NULL;
 }
 
-void didRtpStreamOut(void *callbackRefCon, const uint8_t *data, int length)
+void didRtpStreamOut(void *callbackRefCon, const uint8_t* const* packets, const int* lengths, int count)
+{
+    VideoEncoder* encoder = (__bridge VideoEncoder*)callbackRefCon;
+    if (encoder->rtcpSession != NULL) {
+        int64_t now = CRtpPacer::nowUs();
+        for (int i = 0; i < count; i++)
+            encoder->rtcpSession->rtpSent(packets[i], lengths[i], now);
+    }
+    encoder->fanout->publish(packets, lengths, count);
+}
+
+void didRtcpStreamOut(void *callbackRefCon, const uint8_t *data, int length)
 {
     VideoEncoder* encoder = (__bridge VideoEncoder*)callbackRefCon;
-    [encoder->_delegate videoEncoder:encoder appendBytes:data length:length];
+    encoder->fanout->publish(&data, &length, 1);
+}
+
+void didViewerOut(void *callbackRefCon, const uint8_t* const* packets, const int* lengths, int count)
+{
+    VideoEncoderViewer* viewer = (__bridge VideoEncoderViewer*)callbackRefCon;
+    VideoEncoder* encoder = viewer->encoder;
+    [encoder.delegate videoEncoder:encoder appendPackets:(const void * const *)packets lengths:lengths count:count toViewer:viewer->viewer];
+}
+
+void didUpdateBitrate(void *callbackRefCon, int bitrate)
+{
+    // From a viewer's feedback, on the encoder queue already
+    VideoEncoderViewer* viewer = (__bridge VideoEncoderViewer*)callbackRefCon;
+    viewer->bitrate = bitrate;
+    [viewer->encoder updateBitrate];
+}
+
+void didRequestKeyFrame(void *callbackRefCon, uint32_t senderSsrc, uint32_t mediaSsrc, bool fullIntra)
+{
+    VideoEncoder* encoder = (__bridge VideoEncoder*)callbackRefCon;
+    if (encoder->rtp != NULL && mediaSsrc == encoder->rtp->ssrc()) {
+        // Requests until the next frame is encoded all get the same IDR
+        encoder->forceKeyFrame = YES;
+    }
+}
+
+void didRequestRetransmission(void *callbackRefCon, uint32_t senderSsrc, uint32_t mediaSsrc, const uint16_t* seqs, int count)
+{
+    VideoEncoder* encoder = (__bridge VideoEncoder*)callbackRefCon;
+    if (encoder->retransmitter != NULL && mediaSsrc == encoder->retransmitter->mediaSsrc()) {
+        std::vector<uint16_t> original(seqs, seqs + count);
+        if (encoder->feedbackViewer != nil)
+            count = encoder->fanout->originalSeqs(encoder->feedbackViewer->subscription, original.data(), count);
+        encoder->nackedPackets += count;
+        CRtpRetransmitter::nackIn(encoder->retransmitter, senderSsrc, mediaSsrc, original.data(), count);
+    }
+}
+
+void didTransportFeedback(void *callbackRefCon, uint32_t senderSsrc, uint16_t baseSeq, uint8_t fbCount, const int64_t* arrivalsUs, int count)
+{
+    VideoEncoder* encoder = (__bridge VideoEncoder*)callbackRefCon;
+    if (encoder->feedbackViewer != nil)
+        CRtpBandwidthEstimator::feedbackIn(encoder->feedbackViewer->bwe, senderSsrc, baseSeq, fbCount, arrivalsUs, count);
+}
+
+void didProbeAck(void *callbackRefCon, uint32_t senderSsrc, uint32_t probeSsrc, uint16_t probeSeq)
+{
+    // One stream goes to every viewer, so a probe only got through once the
+    // path to each of them took it
+    VideoEncoder* encoder = (__bridge VideoEncoder*)callbackRefCon;
+    if (encoder->feedbackViewer != nil) {
+        encoder->feedbackViewer->probeAcked = probeSeq;
+        @synchronized (encoder->viewers) {
+            for (VideoEncoderViewer *v in encoder->viewers) {
+                if (v->probeAcked != probeSeq)
+                    return;
+            }
+        }
+    }
+    CRtpStream::probeAckIn(encoder->rtp, senderSsrc, probeSsrc, probeSeq);
 }
 
 void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStatus status, VTEncodeInfoFlags infoFlags, CMSampleBufferRef sampleBuffer)
@@ -59,16 +205,10 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
         return;
     }
     
-    NSMutableData *streamData = [NSMutableData data];
     VideoEncoder* encoder = (__bridge VideoEncoder*)outputCallbackRefCon;
     
-    // This is the start code that we will write to
-    // the elementary stream before every NAL unit
-    static const size_t startCodeLength = 4;
-    static const uint8_t startCode[] = {0x00, 0x00, 0x00, 0x01};
-    
     // Find out if the sample buffer contains an I-Frame.
-    // If so we will write the SPS and PPS NAL units to the elementary stream.
+    // If so we will send the SPS and PPS NAL units in front of it.
     //bool isIFrame = !CFDictionaryContainsKey( (CFArrayGetValueAtIndex(CMSampleBufferGetSampleAttachmentsArray(sampleBuffer, true), 0)), kCMSampleAttachmentKey_NotSync);
     BOOL isIFrame = NO;
     CFArrayRef attachmentsArray = CMSampleBufferGetSampleAttachmentsArray(sampleBuffer, true);
@@ -80,57 +220,48 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
         isIFrame = !keyExists || !CFBooleanGetValue(notSync);
     }
     
-    if (isIFrame) {
-        CMFormatDescriptionRef description = CMSampleBufferGetFormatDescription(sampleBuffer);
+    static const int maxParameterSets = 4;
+    const uint8_t *parameterSets[maxParameterSets];
+    int parameterSetSizes[maxParameterSets];
+    int parameterSetCount = 0;
+    int AVCCHeaderLength = 4;
+    
+    CMFormatDescriptionRef description = CMSampleBufferGetFormatDescription(sampleBuffer);
+    size_t count = 0;
+    int headerLength = 0;
+    OSStatus statusCode = CMVideoFormatDescriptionGetH264ParameterSetAtIndex(description, 0, NULL, NULL, &count, &headerLength);
+    if (statusCode == noErr) {
+        AVCCHeaderLength = headerLength;
         
-        // Find out how many parameter sets there are
-        size_t parameterSetCount;
-        OSStatus statusCode = CMVideoFormatDescriptionGetH264ParameterSetAtIndex(description, 0, NULL, NULL, &parameterSetCount, NULL);
-        if (statusCode == noErr) {
-            // Write each parameter set to the elementary stream
-            for (int i = 0; i < parameterSetCount; i++) {
+        if (isIFrame) {
+            // Collect each parameter set, they are packetized along with the frame
+            for (int i = 0; i < count && parameterSetCount < maxParameterSets; i++) {
                 const uint8_t *parameterSetPointer;
                 size_t parameterSetSize;
                 OSStatus statusCode = CMVideoFormatDescriptionGetH264ParameterSetAtIndex(description, i, &parameterSetPointer, &parameterSetSize, NULL, NULL);
                 if (statusCode == noErr) {
-                    // Write the parameter set to the elementary stream
-                    [streamData appendBytes:startCode length:startCodeLength];
-                    [streamData appendBytes:parameterSetPointer length:parameterSetSize];
+                    parameterSets[parameterSetCount] = parameterSetPointer;
+                    parameterSetSizes[parameterSetCount] = (int)parameterSetSize;
+                    parameterSetCount++;
                 }
             }
         }
     }
     
+    // The block buffer holds length-prefixed (AVCC) NAL units, hand them to the
+    // packetizer as they are instead of rewriting them into Annex-B first.
     CMBlockBufferRef dataBuffer = CMSampleBufferGetDataBuffer(sampleBuffer);
     size_t totalLength;
     uint8_t *dataPointer = NULL;
     OSStatus statusCodeRet = CMBlockBufferGetDataPointer(dataBuffer, 0, NULL, &totalLength, (char **)&dataPointer);
-    if (statusCodeRet == noErr) {
-        size_t bufferOffset = 0;
-        static const int AVCCHeaderLength = 4;
-        while (bufferOffset < totalLength - AVCCHeaderLength) {
-            
-            // Read the NAL unit length
-            uint32_t NALUnitLength = 0;
-            memcpy(&NALUnitLength, dataPointer + bufferOffset, AVCCHeaderLength);
-            
-            // Convert the length value from Big-endian to Little-endian
-            NALUnitLength = CFSwapInt32BigToHost(NALUnitLength);
-            
-            // Write start code to the elementary stream
-            [streamData appendBytes:startCode length:startCodeLength];
-            // Write the NAL unit without the AVCC length header to the elementary stream
-            [streamData appendBytes:dataPointer + bufferOffset + AVCCHeaderLength length:NALUnitLength];
-            
-            // Move to the next NAL unit in the block buffer
-            bufferOffset += AVCCHeaderLength + NALUnitLength;
-        }
-    }
-    
-    if (streamData.length > 0) {
+    if (statusCodeRet == noErr && totalLength > 0) {
         CMTime presentationTimeStamp = CMSampleBufferGetPresentationTimeStamp(sampleBuffer);
         uint32_t timestamp = (uint32_t)(presentationTimeStamp.value * 1000 / presentationTimeStamp.timescale);
-        encoder->rtp->streamOut((const uint8_t *)streamData.bytes, (int)streamData.length, timestamp);
+        int result = encoder->rtp->streamOutAvcc(dataPointer, (int)totalLength, AVCCHeaderLength, timestamp,
+                                                 parameterSets, parameterSetSizes, parameterSetCount);
+        if (result != 0) {
+            NSLog(@"H264 encode: malformed AVCC sample buffer, length: %d", (int)totalLength);
+        }
     }
 }
 
@@ -184,16 +315,91 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
             VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_ExpectedFrameRate, (__bridge CFTypeRef)@(fps));
             // 关键帧最大间隔，1为每个都是关键帧，数值越大压缩率越高。此处表示关键帧最大间隔为1s
             VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_MaxKeyFrameInterval, (__bridge CFTypeRef)@(fps));
-            // 设置需要的平均编码率
-            VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_AverageBitRate, (__bridge CFTypeRef)@(width*height*10));
+            // 设置需要的平均编码率，之后跟着带宽估计走
+            int startBitrate = MIN(width*height*10, defaultMaxBitrate);
+            VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_AverageBitRate, (__bridge CFTypeRef)@(startBitrate));
             VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_SourceFrameCount, (__bridge CFTypeRef)@(1));
+            // Only every fourth frame is a reference, the others are temporal
+            // layers a viewer short of bandwidth can do without
+#ifdef __IPHONE_15_0
+            if (@available(iOS 15.0, *)) {
+                OSStatus layerStatus = VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_BaseLayerFrameRateFraction, (__bridge CFTypeRef)@(0.25));
+                if (layerStatus != noErr)
+                    NSLog(@"H264 encode: no temporal layers: %d", (int)layerStatus);
+            }
+#endif
             
             // Tell the encoder to start encoding
             VTCompressionSessionPrepareToEncodeFrames(encodingSession);
             
-            rtp = new CRtpStream(didRtpStreamOut, (__bridge void *)(self));
+            // Spread each frame, keyframes above all, over half a frame interval
+            pacer = new CRtpPacer(didRtpStreamOut, (__bridge void *)(self));
+            pacer->setFrameRate(fps);
+            pacer->setTargetBitrate(startBitrate);
+            
+            // Every packet out carries a transport-wide sequence number. Each
+            // viewer's feedback on what reached it drives an estimate of its
+            // own, the fan-out reports what went to it, and the lowest
+            // estimate sets the bitrate
+            pacer->setTransportSequence(NULL, NULL);
+            @synchronized (viewers) {
+                initialBitrate = startBitrate;
+                for (VideoEncoderViewer *v in viewers) {
+                    if (v->bitrate == 0)
+                        v->bwe->setBitrates(startBitrate, defaultMinBitrate, defaultMaxBitrate);
+                }
+            }
+            
+            // Keep what went out for a second, lost packets are resent on
+            // their own RTX stream ahead of the media queue
+            history = new CRtpPacketHistory();
+            pacer->setHistory(history);
+            retransmitter = new CRtpRetransmitter(history, CRtpPacer::retransmissionIn, pacer);
+            retransmitter->setRtx(defaultRtxPayloadType);
+            pacer->start();
+
+#if REED_SOLOMON_FEC
+            // Repair behind every frame, as much as the loss calls for and
+            // more for keyframes
+            rsEncoder = new CRtpRsEncoder(CRtpPacer::packetsIn, pacer);
+            
+            rtp = new CRtpStream(CRtpRsEncoder::packetsIn, rsEncoder);
+            rsEncoder->setMediaSsrc(rtp->ssrc());
+            // Repair packets, and the transport-wide sequence number the
+            // pacer adds to every packet, within the MTU too
+            rtp->setPacketOverhead(::transportSeqExtLength + ::maxRsOverhead);
+#else
+            // Parity behind every frame, as much as the loss calls for
+            fecEncoder = new CRtpFecEncoder(CRtpPacer::packetsIn, pacer);
+            
+            rtp = new CRtpStream(CRtpFecEncoder::packetsIn, fecEncoder);
+            fecEncoder->setMediaSsrc(rtp->ssrc());
+            // Parity packets and the transport-wide sequence number too
+            rtp->setPacketOverhead(::transportSeqExtLength + ::maxFecOverhead);
+#endif
+            // Frames are tagged with their layer, the fan-out thins the
+            // stream for each viewer by them
+            rtp->setTemporalLayers(::maxTemporalLayers);
+            // Packets as large as the paths to the viewers take, found by
+            // probes the viewers acknowledge. The transport has to send
+            // with DF set for it, CRtpUdpTransport::setDontFragment()
+            rtp->setMtuProbing(true);
+            fanout->setMediaSsrc(rtp->ssrc());
+#if REED_SOLOMON_FEC
+            fanout->setRepairPayloadTypes(defaultRtxPayloadType, -1, defaultRsPayloadType);
+#else
+            fanout->setRepairPayloadTypes(defaultRtxPayloadType, defaultFecPayloadType, -1);
+#endif
+            history->setSsrc(rtp->ssrc());
+            retransmitter->setMediaSsrc(rtp->ssrc());
+            rtcpSession = new CRtcpSession(rtp->ssrc(), didRtcpStreamOut, (__bridge void *)(self));
+            nackedPackets = 0;
+            lossMediaPackets = 0;
+            lossFecPackets = 0;
+            repairOverhead = 0;
+            lossUs = CRtpPacer::nowUs();
         }
-        
+
 #if CROP_IMAGE
         if (renderBuffer == NULL) {
             CVReturn result = CVPixelBufferPoolCreatePixelBuffer(kCFAllocatorDefault, VTCompressionSessionGetPixelBufferPool(encodingSession), &renderBuffer);
@@ -203,16 +409,16 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
                 return;
             }
         }
-
+        
         if (ciContext == NULL) {
             EAGLContext *glCtx = [[EAGLContext alloc] initWithAPI:kEAGLRenderingAPIOpenGLES2];
             ciContext = [CIContext contextWithEAGLContext:glCtx options:@{kCIContextWorkingColorSpace:[NSNull null]}];
         }
-
+        
         // Get the CV Image buffer
         CVPixelBufferRef pixelBuffer = CMSampleBufferGetImageBuffer(sampleBuffer);
         CVPixelBufferLockBaseAddress(pixelBuffer, kCVPixelBufferLock_ReadOnly);
-
+        
         CIImage *ciImage = [CIImage imageWithCVPixelBuffer:pixelBuffer];
         CGFloat bufferWidth = CVPixelBufferGetWidth(pixelBuffer);
         CGFloat bufferHeight = CVPixelBufferGetHeight(pixelBuffer);
@@ -235,18 +441,27 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
             CGAffineTransform transform = CGAffineTransformMakeScale(scaleX, scaleY);
             ciImage = [ciImage imageByApplyingTransform:transform];
         }
-
+        
         CVPixelBufferLockBaseAddress(renderBuffer, 0);
         [ciContext render:ciImage toCVPixelBuffer:renderBuffer bounds:ciImage.extent colorSpace:nil];
         CVPixelBufferUnlockBaseAddress(renderBuffer, 0);
         CVPixelBufferUnlockBaseAddress(pixelBuffer, kCVPixelBufferLock_ReadOnly);
 #endif
-
+        
         // Create properties
         CMTime presentationTimeStamp = CMSampleBufferGetPresentationTimeStamp(sampleBuffer);
         CMTime duration = CMSampleBufferGetDuration(sampleBuffer);
         VTEncodeInfoFlags flags;
         
+        [self updateProtection];
+        rtcpSession->poll(CRtpPacer::nowUs());
+        
+        NSDictionary *frameProperties = nil;
+        if (forceKeyFrame) {
+            frameProperties = @{(__bridge NSString *)kVTEncodeFrameOptionKey_ForceKeyFrame: @YES};
+            forceKeyFrame = NO;
+        }
+        
         // Pass it to the encoder
         OSStatus statusCode = VTCompressionSessionEncodeFrame(encodingSession,
 #if CROP_IMAGE
@@ -256,8 +471,8 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
 #endif
                                                               presentationTimeStamp,
                                                               duration,
-                                                              NULL, NULL, &flags);
-
+                                                              (__bridge CFDictionaryRef)frameProperties, NULL, &flags);
+        
         // Check for error
         if (statusCode != noErr) {
 //            // End the session
@@ -276,7 +491,163 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
     });
 }
 
+- (void)updateProtection
+{
+    int64_t now = CRtpPacer::nowUs();
+    if ((fecEncoder == NULL && rsEncoder == NULL) || now - lossUs < 1000000)
+        return;
+    
+    // NACKs count what the parity could not repair, and a packet may be
+    // asked for more than once. The encoder steps down slowly enough for
+    // that not to matter.
+    uint32_t media = fecEncoder != NULL ? fecEncoder->mediaPackets() : rsEncoder->mediaPackets();
+    uint32_t fec = fecEncoder != NULL ? fecEncoder->fecPackets() : rsEncoder->fecPackets();
+    uint32_t sent = media - lossMediaPackets;
+    if (sent > 0) {
+        float loss = MIN(1.0f, (float)nackedPackets / sent);
+        if (fecEncoder != NULL)
+            fecEncoder->setLossRate(loss, now);
+        else
+            rsEncoder->setLossRate(loss, now);
+        repairOverhead = (float)(fec - lossFecPackets + nackedPackets) / sent;
+    }
+    
+    CRtcpStats stats;
+    if (rtcpSession->stats(rtp->ssrc(), &stats) && stats.rttUs >= 0) {
+        @synchronized (viewers) {
+            for (VideoEncoderViewer *v in viewers)
+                v->bwe->setRtt((int)stats.rttUs);
+        }
+    }
+    
+    nackedPackets = 0;
+    lossMediaPackets = media;
+    lossFecPackets = fec;
+    lossUs = now;
+}
+
+- (void)updateBitrate
+{
+    if (encodingSession == NULL)
+        return;
+    
+    // The slowest viewer sets the bitrate for all, those without an
+    // estimate yet are not counted
+    int bitrate = 0;
+    @synchronized (viewers) {
+        for (VideoEncoderViewer *v in viewers) {
+            if (v->bitrate > 0 && (bitrate == 0 || v->bitrate < bitrate))
+                bitrate = v->bitrate;
+        }
+    }
+    if (bitrate == 0)
+        return;
+    
+    int media = (int)(bitrate / (1 + repairOverhead));
+    VTSessionSetProperty(encodingSession, kVTCompressionPropertyKey_AverageBitRate, (__bridge CFTypeRef)@(media));
+    pacer->setTargetBitrate(bitrate);
+}
+
++ (BOOL)isFeedbackPacket:(NSData *)data
+{
+    // A sender report leads the RTCP of the video coming in, it goes to the
+    // decoder with the video.
+    const uint8_t *bytes = (const uint8_t *)data.bytes;
+    return CRtcpParser::isRtcp(bytes, (int)data.length) && bytes[1] != rtcpSr;
+}
+
+- (void)receiveFeedback:(NSData *)data fromViewer:(id)viewer
+{
+    VideoEncoderViewer *from = nil;
+    @synchronized (viewers) {
+        for (VideoEncoderViewer *v in viewers) {
+            if (v->viewer == viewer)
+                from = v;
+        }
+    }
+    
+    dispatch_async(queue, ^{
+        // Not started, or ended since it was queued
+        if (rtp == NULL)
+            return;
+        
+        if (rtcpParser == NULL) {
+            rtcpParser = new CRtcpParser();
+            rtcpParser->setKeyFrameCallback(didRequestKeyFrame, (__bridge void *)(self));
+            rtcpParser->setNackCallback(didRequestRetransmission, (__bridge void *)(self));
+            rtcpParser->setTransportFeedbackCallback(didTransportFeedback, (__bridge void *)(self));
+            rtcpParser->setProbeAckCallback(didProbeAck, (__bridge void *)(self));
+        }
+        feedbackViewer = from;
+        rtcpParser->parse((const uint8_t *)data.bytes, (int)data.length);
+        feedbackViewer = nil;
+        if (rtcpSession != NULL)
+            rtcpSession->rtcpIn((const uint8_t *)data.bytes, (int)data.length, CRtpPacer::nowUs());
+    });
+}
+
+- (void)addViewer:(id)viewer
+{
+    @synchronized (viewers) {
+        for (VideoEncoderViewer *v in viewers) {
+            if (v->viewer == viewer)
+                return;
+        }
+        
+        VideoEncoderViewer *v = [[VideoEncoderViewer alloc] init];
+        v->encoder = self;
+        v->viewer = viewer;
+        v->bwe = new CRtpBandwidthEstimator(didUpdateBitrate, (__bridge void *)v);
+        v->bwe->setBitrates(initialBitrate, defaultMinBitrate, defaultMaxBitrate);
+        v->probeAcked = -1;
+        v->subscription = fanout->subscribe(didViewerOut, (__bridge void *)v,
+                                            CRtpBandwidthEstimator::packetSentIn, v->bwe);
+        [viewers addObject:v];
+    }
+}
+
+- (void)removeViewer:(id)viewer
+{
+    @synchronized (viewers) {
+        for (VideoEncoderViewer *v in viewers) {
+            if (v->viewer == viewer) {
+                // Joins its thread, the viewer is not called again
+                fanout->unsubscribe(v->subscription);
+                [viewers removeObject:v];
+                break;
+            }
+        }
+    }
+    
+    // It may have been the one holding the bitrate down
+    dispatch_async(queue, ^{
+        [self updateBitrate];
+    });
+}
+
+- (void)removeAllViewers
+{
+    @synchronized (viewers) {
+        for (VideoEncoderViewer *v in viewers)
+            fanout->unsubscribe(v->subscription);
+        [viewers removeAllObjects];
+    }
+}
+
 - (void)end
+{
+    // Feedback blocks queued before use what goes here, it goes after them
+    // on the queue. Those queued after find it gone.
+    if (dispatch_get_specific(queueKey) != NULL) {
+        [self endSession];
+        return;
+    }
+    dispatch_sync(queue, ^{
+        [self endSession];
+    });
+}
+
+- (void)endSession
 {
     if (encodingSession != NULL) {
         // Mark the completion
@@ -287,18 +658,59 @@ void didCompressH264(void *outputCallbackRefCon, void *sourceFrameRefCon, OSStat
         CFRelease(encodingSession);
         encodingSession = NULL;
     }
-    
+
 #if CROP_IMAGE
     if (renderBuffer != NULL) {
         CFRelease(renderBuffer);
         renderBuffer = NULL;
     }
 #endif
-
+    
+    if (rtcpSession) {
+        rtcpSession->bye(CRtpPacer::nowUs());
+    }
+    
     if (rtp) {
         delete rtp;
         rtp = NULL;
     }
+    
+    if (pacer) {
+        delete pacer;
+        pacer = NULL;
+    }
+    
+    if (retransmitter) {
+        delete retransmitter;
+        retransmitter = NULL;
+    }
+    
+    if (fecEncoder) {
+        delete fecEncoder;
+        fecEncoder = NULL;
+    }
+    
+    if (rsEncoder) {
+        delete rsEncoder;
+        rsEncoder = NULL;
+    }
+    
+    if (history) {
+        delete history;
+        history = NULL;
+    }
+    
+    if (rtcpParser) {
+        delete rtcpParser;
+        rtcpParser = NULL;
+    }
+    
+    // Last, the pacer counted its packets into it until it stopped
+    if (rtcpSession) {
+        delete rtcpSession;
+        rtcpSession = NULL;
+    }
+    forceKeyFrame = NO;
 }
 
 @end